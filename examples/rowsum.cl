@@ -0,0 +1,33 @@
+// sums each row of a width x n matrix; rowsum.ptx is what NVIDIA's
+// driver makes of it (clc --analyze examples/rowsum.ptx)
+kernel void rowsum(
+  global float *out,
+  const global float *in,
+  int width)
+{
+    local float tile[256];
+    float part[8];
+    const int row = get_group_id(0);
+    const int lid = get_local_id(0);
+
+    for (int j = 0; j < 8; j++)
+        part[j] = 0.0f;
+    for (int i = 0; i < 16; i++)
+        part[i & 7] += in[row * width + i * 256 + lid];
+
+    float acc = 0.0f;
+    for (int j = 0; j < 8; j++)
+        acc += part[j];
+    tile[lid] = acc;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if (lid == 0) {
+        for (int i = 1; i < 256; i++)
+            acc += tile[i];
+        out[row] = acc;
+    }
+}
+
+kernel void scale(global float *data, float k)
+{
+    data[get_global_id(0)] *= k;
+}
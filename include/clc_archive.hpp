@@ -0,0 +1,396 @@
+// clc_archive.hpp - reads the program archives that clc -F=archive writes
+//
+// Header-only; needs only the OpenCL C API.  Typical use:
+//
+//   clc::Archive ar;
+//   if (ar.open("kernels.clcar")) {
+//       cl_int err;
+//       cl_program prog = ar.createProgram(ctx, dev, kernelSource, &err);
+//       ...
+//   }
+//
+// The archive is memory mapped and the device's entry found by binary
+// search, so startup costs one mmap and O(log n) string compares.
+// Uncompressed binaries go to clCreateProgramWithBinary straight out of
+// the mapping.  If the archive has no binary for the device (or the
+// driver rejects it) createProgram builds the fallback source with the
+// options recorded in the archive, plus those the device's entry adds
+// (e.g. -DCLC_FLOATN=float8 for a template kernel).
+//
+// Format (little-endian; every offset is from the start of the file):
+//   ClcArchiveHeader
+//   ClcArchiveEntry[numEntries]  sorted by (device name, driver version)
+//   string pool                  referenced by ClcArchiveString
+//   payloads                     16-byte aligned; identical binaries are
+//                                stored once and shared by their entries
+#ifndef CLC_ARCHIVE_HPP
+#define CLC_ARCHIVE_HPP
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#ifdef __APPLE__
+#include <OpenCL/cl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define CLC_ARCHIVE_MAGIC "CLCARCH1"
+#define CLC_ARCHIVE_VERSION 2
+// version 1 entries end before extraOptions (48 bytes); they still open
+#define CLC_ARCHIVE_V1_ENTRY_SIZE 48
+
+enum {
+    CLC_ARCHIVE_STORED = 0,
+    CLC_ARCHIVE_LZ4 = 1,    // LZ4 block format
+};
+
+struct ClcArchiveString {
+    uint32_t    offset;     // into the string pool
+    uint32_t    length;     // bytes (no terminator)
+};
+
+struct ClcArchiveHeader {
+    char                magic[8];       // CLC_ARCHIVE_MAGIC
+    uint32_t            version;        // CLC_ARCHIVE_VERSION
+    uint32_t            numEntries;
+    uint64_t            indexOffset;
+    uint64_t            stringsOffset;
+    uint64_t            stringsSize;
+    ClcArchiveString    buildOptions;   // as given to the compiler
+    uint8_t             sourceHash[32]; // SHA-256 of the compiled sources
+};
+
+struct ClcArchiveEntry {
+    ClcArchiveString    device;         // CL_DEVICE_NAME
+    ClcArchiveString    driver;         // CL_DRIVER_VERSION
+    uint64_t            dataOffset;
+    uint64_t            storedSize;     // bytes in the file
+    uint64_t            size;           // bytes once decompressed
+    uint32_t            compression;    // CLC_ARCHIVE_STORED or CLC_ARCHIVE_LZ4
+    uint32_t            reserved;
+    ClcArchiveString    extraOptions;   // added to buildOptions for the device
+};
+
+static_assert(sizeof(ClcArchiveHeader) == 80, "unexpected header layout");
+static_assert(sizeof(ClcArchiveEntry) == 56, "unexpected entry layout");
+
+namespace clc {
+
+// orders index keys; the writer sorts with the same function
+inline int compareArchiveKey(
+    const char *a, size_t aLen, const char *b, size_t bLen)
+{
+    int c = memcmp(a, b, aLen < bLen ? aLen : bLen);
+    if (c != 0)
+        return c;
+    return aLen < bLen ? -1 : aLen > bLen ? 1 : 0;
+}
+
+// decodes an LZ4 block; false if the input is malformed or does not
+// decode to exactly dstLen bytes
+inline bool decompressLz4(
+    const uint8_t *src, size_t srcLen, uint8_t *dst, size_t dstLen)
+{
+    const uint8_t *ip = src, *iend = src + srcLen;
+    uint8_t *op = dst, *oend = dst + dstLen;
+    while (ip < iend) {
+        unsigned token = *ip++;
+        size_t lit = token >> 4;
+        if (lit == 15) {
+            uint8_t b;
+            do {
+                if (ip >= iend)
+                    return false;
+                b = *ip++;
+                lit += b;
+            } while (b == 255);
+        }
+        if ((size_t)(iend - ip) < lit || (size_t)(oend - op) < lit)
+            return false;
+        memcpy(op, ip, lit);
+        ip += lit;
+        op += lit;
+        if (ip == iend)
+            break; // the last sequence has no match
+        if (iend - ip < 2)
+            return false;
+        size_t off = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (off == 0 || off > (size_t)(op - dst))
+            return false;
+        size_t mlen = (token & 15) + 4;
+        if ((token & 15) == 15) {
+            uint8_t b;
+            do {
+                if (ip >= iend)
+                    return false;
+                b = *ip++;
+                mlen += b;
+            } while (b == 255);
+        }
+        if ((size_t)(oend - op) < mlen)
+            return false;
+        const uint8_t *m = op - off;
+        for (size_t i = 0; i < mlen; i++) // may overlap
+            op[i] = m[i];
+        op += mlen;
+    }
+    return op == oend;
+}
+
+class Archive {
+    const uint8_t          *base = nullptr;
+    size_t                  length = 0;
+#ifdef _WIN32
+    HANDLE                  file = INVALID_HANDLE_VALUE;
+    HANDLE                  mapping = nullptr;
+#endif
+
+    const ClcArchiveHeader *header() const {
+        return (const ClcArchiveHeader *)base;
+    }
+    size_t entrySize() const {
+        return header()->version == 1 ? CLC_ARCHIVE_V1_ENTRY_SIZE : sizeof(ClcArchiveEntry);
+    }
+    const ClcArchiveEntry &entryAt(uint32_t i) const {
+        return *(const ClcArchiveEntry *)(base + header()->indexOffset + i * entrySize());
+    }
+    const char *str(const ClcArchiveString &s) const {
+        return (const char *)base + header()->stringsOffset + s.offset;
+    }
+    bool validate() const {
+        if (length < sizeof(ClcArchiveHeader))
+            return false;
+        const auto *h = header();
+        if (memcmp(h->magic, CLC_ARCHIVE_MAGIC, 8) != 0 ||
+            (h->version != 1 && h->version != CLC_ARCHIVE_VERSION))
+        {
+            return false;
+        }
+        if (h->indexOffset > length ||
+            (length - h->indexOffset) / entrySize() < h->numEntries ||
+            h->indexOffset % 8 != 0 ||
+            h->stringsOffset > length || length - h->stringsOffset < h->stringsSize)
+        {
+            return false;
+        }
+        auto strOk = [&](const ClcArchiveString &s) {
+            return s.offset <= h->stringsSize && h->stringsSize - s.offset >= s.length;
+        };
+        if (!strOk(h->buildOptions))
+            return false;
+        for (uint32_t i = 0; i < h->numEntries; i++) {
+            const auto &e = entryAt(i);
+            if (!strOk(e.device) || !strOk(e.driver) ||
+                (h->version > 1 && !strOk(e.extraOptions)) ||
+                e.dataOffset > length || length - e.dataOffset < e.storedSize ||
+                (e.compression == CLC_ARCHIVE_STORED && e.storedSize != e.size) ||
+                e.compression > CLC_ARCHIVE_LZ4)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+public:
+    Archive() { }
+    Archive(const Archive &) = delete;
+    Archive &operator=(const Archive &) = delete;
+    ~Archive() { close(); }
+
+    // maps the archive; false if it is missing or malformed
+    bool open(const char *path) {
+        close();
+#ifdef _WIN32
+        file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr,
+            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+            return false;
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+            close();
+            return false;
+        }
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mapping)
+            base = (const uint8_t *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        length = (size_t)size.QuadPart;
+#else
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void *p = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                base = (const uint8_t *)p;
+                length = (size_t)st.st_size;
+            }
+        }
+        ::close(fd);
+#endif
+        if (!base || !validate()) {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void close() {
+#ifdef _WIN32
+        if (base)
+            UnmapViewOfFile(base);
+        if (mapping)
+            CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE)
+            CloseHandle(file);
+        mapping = nullptr;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (base)
+            munmap((void *)base, length);
+#endif
+        base = nullptr;
+        length = 0;
+    }
+
+    bool isOpen() const { return base != nullptr; }
+    uint32_t size() const { return base ? header()->numEntries : 0; }
+    const ClcArchiveEntry &entry(uint32_t i) const { return entryAt(i); }
+    std::string deviceName(const ClcArchiveEntry &e) const {
+        return std::string(str(e.device), e.device.length);
+    }
+    std::string driverVersion(const ClcArchiveEntry &e) const {
+        return std::string(str(e.driver), e.driver.length);
+    }
+    std::string buildOptions() const {
+        return std::string(str(header()->buildOptions), header()->buildOptions.length);
+    }
+    // the options an entry's binary was built with
+    std::string buildOptions(const ClcArchiveEntry &e) const {
+        std::string opts = buildOptions();
+        if (header()->version == 1 || e.extraOptions.length == 0)
+            return opts;
+        return opts + (opts.empty() ? "" : " ") +
+            std::string(str(e.extraOptions), e.extraOptions.length);
+    }
+    const uint8_t *sourceHash() const { return header()->sourceHash; }
+
+    // the entry for a device and driver version or nullptr
+    const ClcArchiveEntry *find(const std::string &device, const std::string &driver) const {
+        if (!base)
+            return nullptr;
+        uint32_t lo = 0, hi = header()->numEntries;
+        while (lo < hi) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            const auto &e = entryAt(mid);
+            int c = compareArchiveKey(str(e.device), e.device.length,
+                device.data(), device.size());
+            if (c == 0)
+                c = compareArchiveKey(str(e.driver), e.driver.length,
+                    driver.data(), driver.size());
+            if (c == 0)
+                return &e;
+            if (c < 0)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        return nullptr;
+    }
+
+    // the entry's binary: a pointer into the mapping for stored entries;
+    // compressed ones are decoded into scratch
+    bool binary(const ClcArchiveEntry &e,
+        const uint8_t **bits, size_t *len, std::vector<uint8_t> &scratch) const
+    {
+        const uint8_t *p = base + e.dataOffset;
+        if (e.compression == CLC_ARCHIVE_STORED) {
+            *bits = p;
+            *len = (size_t)e.size;
+            return true;
+        }
+        scratch.resize((size_t)e.size);
+        if (!decompressLz4(p, (size_t)e.storedSize, scratch.data(), scratch.size()))
+            return false;
+        *bits = scratch.data();
+        *len = scratch.size();
+        return true;
+    }
+
+    // a built program for dev: from the archive if it has a binary for the
+    // device and driver, otherwise from fallbackSource (if non-null)
+    cl_program createProgram(
+        cl_context ctx, cl_device_id dev, const char *fallbackSource, cl_int *err) const
+    {
+        cl_int e = CL_INVALID_BINARY;
+        const ClcArchiveEntry *ent =
+            find(deviceInfo(dev, CL_DEVICE_NAME), deviceInfo(dev, CL_DRIVER_VERSION));
+        std::vector<uint8_t> scratch;
+        const uint8_t *bits = nullptr;
+        size_t len = 0;
+        if (ent && binary(*ent, &bits, &len, scratch)) {
+            cl_int status = CL_SUCCESS;
+            cl_program prog = clCreateProgramWithBinary(
+                ctx, 1, &dev, &len, &bits, &status, &e);
+            if (prog && e == CL_SUCCESS && status == CL_SUCCESS) {
+                e = clBuildProgram(prog, 1, &dev, nullptr, nullptr, nullptr);
+                if (e == CL_SUCCESS) {
+                    if (err)
+                        *err = e;
+                    return prog;
+                }
+            }
+            if (prog)
+                clReleaseProgram(prog);
+        }
+        if (fallbackSource) {
+            cl_program prog = clCreateProgramWithSource(
+                ctx, 1, &fallbackSource, nullptr, &e);
+            if (prog && e == CL_SUCCESS) {
+                std::string opts = !base ? std::string() :
+                    ent ? buildOptions(*ent) : buildOptions();
+                e = clBuildProgram(prog, 1, &dev, opts.c_str(), nullptr, nullptr);
+                if (e == CL_SUCCESS) {
+                    if (err)
+                        *err = e;
+                    return prog;
+                }
+            }
+            if (prog)
+                clReleaseProgram(prog);
+        }
+        if (err)
+            *err = e;
+        return nullptr;
+    }
+
+    static std::string deviceInfo(cl_device_id dev, cl_device_info param) {
+        size_t n = 0;
+        if (clGetDeviceInfo(dev, param, 0, nullptr, &n) != CL_SUCCESS || n == 0)
+            return std::string();
+        std::vector<char> buf(n);
+        if (clGetDeviceInfo(dev, param, n, buf.data(), nullptr) != CL_SUCCESS)
+            return std::string();
+        return std::string(buf.data(), strnlen(buf.data(), n));
+    }
+};
+
+} // namespace clc
+
+#endif
@@ -0,0 +1,196 @@
+#include "clc.hpp"
+#include "hash.hpp"
+#include "includes.hpp"
+#include "trace.hpp"
+
+#include "clc_archive.hpp"
+
+#include <algorithm>
+#include <map>
+
+static uint32_t read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static void putLength(std::vector<char> &out, size_t n)
+{
+    for (; n >= 255; n -= 255)
+        out.push_back((char)255);
+    out.push_back((char)n);
+}
+
+// a greedy LZ4 block compressor (one hash probe per position); the
+// decoder is in clc_archive.hpp
+static std::vector<char> compressLz4(const uint8_t *src, size_t n)
+{
+    // the format ends a block with at least 5 literals and starts the
+    // last match at least 12 bytes before the end
+    const size_t MIN_MATCH = 4, LAST_LITERALS = 5, MATCH_LIMIT = 12;
+    std::vector<char> out;
+    out.reserve(n / 2 + 16);
+    std::vector<size_t> table(1 << 16, SIZE_MAX);
+
+    auto emit = [&](size_t anchor, size_t lit, size_t off, size_t mlen) {
+        size_t ml = mlen ? mlen - MIN_MATCH : 0;
+        out.push_back((char)((std::min<size_t>(lit, 15) << 4) | std::min<size_t>(ml, 15)));
+        if (lit >= 15)
+            putLength(out, lit - 15);
+        out.insert(out.end(), src + anchor, src + anchor + lit);
+        if (mlen == 0)
+            return;
+        out.push_back((char)(off & 0xFF));
+        out.push_back((char)(off >> 8));
+        if (ml >= 15)
+            putLength(out, ml - 15);
+    };
+
+    size_t anchor = 0, i = 0;
+    if (n > MATCH_LIMIT) {
+        while (i < n - MATCH_LIMIT) {
+            uint32_t seq = read32(src + i);
+            uint32_t h = (seq * 2654435761u) >> 16;
+            size_t cand = table[h];
+            table[h] = i;
+            if (cand == SIZE_MAX || i - cand > 0xFFFF || read32(src + cand) != seq) {
+                i++;
+                continue;
+            }
+            size_t mlen = MIN_MATCH, maxLen = n - LAST_LITERALS - i;
+            while (mlen < maxLen && src[cand + mlen] == src[i + mlen])
+                mlen++;
+            emit(anchor, i - anchor, i - cand, mlen);
+            i += mlen;
+            anchor = i;
+        }
+    }
+    emit(anchor, n - anchor, 0, 0);
+    return out;
+}
+
+struct ArchivePayload {
+    const std::vector<char>    *bits = nullptr;
+    std::vector<char>           packed; // empty if stored as is
+    uint64_t                    offset = 0;
+};
+
+struct ArchiveItem {
+    std::string     device;
+    std::string     driver;
+    std::string     extraOptions; // the device's vector widths
+    size_t          payload = 0;
+};
+
+std::vector<char> archiveImage(
+    const Opts &opts,
+    const std::vector<DeviceBinary> &bins,
+    const std::vector<SourceText> &sourceStrs)
+{
+    TRACE_SCOPE("pack archive");
+    // identical binaries (e.g. the same driver on two platforms) are stored once
+    std::vector<ArchivePayload> payloads;
+    std::map<std::string,size_t> byHash;
+    std::vector<ArchiveItem> items;
+    for (const auto &b : bins) {
+        ArchiveItem it;
+        it.device = b.device.getInfo<CL_DEVICE_NAME>();
+        it.driver = b.device.getInfo<CL_DRIVER_VERSION>();
+        // getInfo strings keep the terminator
+        it.device = it.device.c_str();
+        it.driver = it.driver.c_str();
+        it.extraOptions = vectorWidthOptions(opts, sourceStrs, b.device);
+        auto h = sha256Hex(b.bits.data(), b.bits.size());
+        auto itr = byHash.find(h);
+        if (itr == byHash.end()) {
+            ArchivePayload p;
+            p.bits = &b.bits;
+            itr = byHash.emplace(h, payloads.size()).first;
+            payloads.push_back(p);
+        }
+        it.payload = itr->second;
+        items.push_back(it);
+    }
+    std::stable_sort(items.begin(), items.end(),
+        [](const ArchiveItem &a, const ArchiveItem &b) {
+            int c = clc::compareArchiveKey(a.device.data(), a.device.size(),
+                b.device.data(), b.device.size());
+            if (c == 0)
+                c = clc::compareArchiveKey(a.driver.data(), a.driver.size(),
+                    b.driver.data(), b.driver.size());
+            return c < 0;
+        });
+    // two identical devices map to one key
+    items.erase(std::unique(items.begin(), items.end(),
+        [](const ArchiveItem &a, const ArchiveItem &b) {
+            return a.device == b.device && a.driver == b.driver;
+        }), items.end());
+
+    if (opts.compress) {
+        for (auto &p : payloads) {
+            p.packed = compressLz4((const uint8_t *)p.bits->data(), p.bits->size());
+            if (p.packed.size() >= p.bits->size())
+                p.packed.clear(); // incompressible
+        }
+    }
+
+    std::string strings;
+    auto addString = [&](const std::string &s) {
+        ClcArchiveString as;
+        as.offset = (uint32_t)strings.size();
+        as.length = (uint32_t)s.size();
+        strings += s;
+        return as;
+    };
+
+    ClcArchiveHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, CLC_ARCHIVE_MAGIC, sizeof(hdr.magic));
+    hdr.version = CLC_ARCHIVE_VERSION;
+    hdr.numEntries = (uint32_t)items.size();
+    hdr.indexOffset = sizeof(hdr);
+    hdr.buildOptions = addString(normalizeBuildOptions(opts.buildOpts));
+    Sha256 sh;
+    for (const auto &s : sourceStrs)
+        sh.updateField(s.data(), s.size());
+    sh.digest(hdr.sourceHash);
+
+    std::vector<ClcArchiveEntry> index(items.size());
+    for (size_t i = 0; i < items.size(); i++) {
+        memset(&index[i], 0, sizeof(index[i]));
+        index[i].device = addString(items[i].device);
+        index[i].driver = addString(items[i].driver);
+        index[i].extraOptions = addString(items[i].extraOptions);
+    }
+    hdr.stringsOffset = hdr.indexOffset + index.size() * sizeof(ClcArchiveEntry);
+    hdr.stringsSize = strings.size();
+
+    // payloads are 16-byte aligned for drivers that read them in place
+    auto align = [](uint64_t off) { return (off + 15) & ~(uint64_t)15; };
+    uint64_t end = hdr.stringsOffset + hdr.stringsSize;
+    for (auto &p : payloads) {
+        p.offset = align(end);
+        end = p.offset + (p.packed.empty() ? p.bits->size() : p.packed.size());
+    }
+    for (size_t i = 0; i < items.size(); i++) {
+        const auto &p = payloads[items[i].payload];
+        index[i].dataOffset = p.offset;
+        index[i].size = p.bits->size();
+        index[i].storedSize = p.packed.empty() ? p.bits->size() : p.packed.size();
+        index[i].compression = p.packed.empty() ? CLC_ARCHIVE_STORED : CLC_ARCHIVE_LZ4;
+    }
+
+    std::vector<char> image((size_t)end, 0);
+    memcpy(image.data(), &hdr, sizeof(hdr));
+    if (!index.empty())
+        memcpy(image.data() + hdr.indexOffset, index.data(), index.size() * sizeof(ClcArchiveEntry));
+    memcpy(image.data() + hdr.stringsOffset, strings.data(), strings.size());
+    for (const auto &p : payloads) {
+        const auto &data = p.packed.empty() ? *p.bits : p.packed;
+        memcpy(image.data() + p.offset, data.data(), data.size());
+    }
+    verbose("archive: %d entries, %d distinct binaries, %llu bytes\n",
+        (int)items.size(), (int)payloads.size(), (unsigned long long)image.size());
+    return image;
+}
@@ -0,0 +1,287 @@
+#include "clc.hpp"
+#include "clerrs.h"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <thread>
+
+struct BatchJob {
+    int             line = 0;
+    std::string     text;       // manifest line (for reporting)
+    Opts            opts;
+
+    bool            ok = false;
+    std::string     error;
+    double          seconds = 0.0;
+};
+
+// splits a manifest line into arguments; double quotes group whitespace
+static std::vector<std::string> tokenizeLine(const std::string &ln)
+{
+    std::vector<std::string> tokens;
+    std::string tk;
+    bool inTk = false, inQuote = false;
+    for (char c : ln) {
+        if (c == '"') {
+            inQuote = !inQuote;
+            inTk = true;
+        } else if (!inQuote && (c == ' ' || c == '\t' || c == '\r')) {
+            if (inTk) {
+                tokens.push_back(tk);
+                tk.clear();
+                inTk = false;
+            }
+        } else {
+            tk += c;
+            inTk = true;
+        }
+    }
+    if (inTk)
+        tokens.push_back(tk);
+    return tokens;
+}
+
+static std::vector<BatchJob> parseManifest(const Opts &opts)
+{
+    std::ifstream file(opts.batchFile);
+    if (!file.good()) {
+        fatal("%s: failed to open manifest", opts.batchFile.c_str());
+    }
+
+    std::vector<BatchJob> jobs;
+    std::string ln;
+    int lno = 0;
+    while (std::getline(file, ln)) {
+        lno++;
+        auto tokens = tokenizeLine(ln);
+        if (tokens.empty() || tokens[0][0] == '#')
+            continue;
+
+        std::vector<const char *> argv;
+        for (const auto &tk : tokens)
+            argv.push_back(tk.c_str());
+
+        BatchJob job;
+        job.line = lno;
+        job.text = ln;
+        try {
+            job.opts = parseOpts((int)argv.size(), argv.data(), false);
+        } catch (const FatalError &err) {
+            fatal("%s:%d: %s", opts.batchFile.c_str(), lno, err.what());
+        }
+        const char *envCache = getenv("CLC_CACHE_DIR");
+        if (job.opts.listDevices || !job.opts.batchFile.empty() ||
+            job.opts.cacheStats || job.opts.cacheDir != (envCache ? envCache : "") ||
+            !job.opts.sweeps.empty() || !job.opts.bench.empty() || job.opts.depsOnly ||
+            !job.opts.resources.empty() || !job.opts.stubs.empty() ||
+            !job.opts.analyze.empty() || job.opts.watch || job.opts.time ||
+            !job.opts.traceFile.empty())
+        {
+            fatal("%s:%d: -h=d, -batch, -cache, -sweep, --bench, --resources, --stubs, "
+                "--analyze, --watch, --time, --trace, and -M options are not allowed in a manifest",
+                opts.batchFile.c_str(), lno);
+        }
+        if (job.opts.args.empty()) {
+            fatal("%s:%d: expected input argument", opts.batchFile.c_str(), lno);
+        }
+        for (const auto &a : job.opts.args) {
+            if (a == "-") {
+                fatal("%s:%d: stdin input is not supported in a manifest",
+                    opts.batchFile.c_str(), lno);
+            }
+        }
+        if (job.opts.output == "--") {
+            fatal("%s:%d: stdout output is not supported in a manifest",
+                opts.batchFile.c_str(), lno);
+        }
+
+        // command line -d=, -t=, -vendor=, -m, and -b= act as defaults for every job
+        if (job.opts.device.empty())
+            job.opts.device = opts.device;
+        if (job.opts.deviceType == CL_DEVICE_TYPE_ALL)
+            job.opts.deviceType = opts.deviceType;
+        if (job.opts.vendorId == 0)
+            job.opts.vendorId = opts.vendorId;
+        job.opts.cacheDir = opts.cacheDir;
+        job.opts.refreshDevices = opts.refreshDevices;
+        if (job.opts.maxPrivateBytes == 0)
+            job.opts.maxPrivateBytes = opts.maxPrivateBytes;
+        if (job.opts.maxLocalBytes == 0)
+            job.opts.maxLocalBytes = opts.maxLocalBytes;
+        if (job.opts.minOccupancy <= 0.0)
+            job.opts.minOccupancy = opts.minOccupancy;
+        job.opts.multiDevice |= opts.multiDevice;
+        job.opts.buildOpts.insert(job.opts.buildOpts.begin(),
+            opts.buildOpts.begin(), opts.buildOpts.end());
+        job.opts.verbosity = opts.verbosity;
+
+        jobs.push_back(job);
+    }
+    return jobs;
+}
+
+int runBatch(const Opts &opts, const BinaryCache *cache)
+{
+    auto jobs = parseManifest(opts);
+    if (jobs.empty()) {
+        warning("%s: manifest lists no jobs\n", opts.batchFile.c_str());
+        return 0;
+    }
+
+    int workers = opts.jobs;
+    if (workers <= 0)
+        workers = (int)std::max(1u, std::thread::hardware_concurrency());
+    workers = std::min(workers, (int)jobs.size());
+    verbose("batch: %d jobs on %d workers\n", (int)jobs.size(), workers);
+
+    // device selection and context creation are done once per distinct
+    // -d= and device respectively (-m jobs share a context per platform
+    // with the jobs selecting the same devices); programs are built
+    // concurrently in the shared contexts (clBuildProgram is thread-safe
+    // since CL 1.1)
+    std::mutex mutex;
+    std::map<std::string,cl::Device> devices;
+    std::map<cl_device_id,cl::Context> contexts;
+    std::map<std::string,std::vector<cl::Device>> deviceSets;
+    std::map<std::vector<cl_device_id>,
+        std::map<cl_platform_id,cl::Context>> platformContexts;
+
+    std::atomic<size_t> next(0);
+    std::atomic<int> failed(0);
+    auto t0 = std::chrono::steady_clock::now();
+
+    auto worker = [&]() {
+        for (size_t i = next++; i < jobs.size(); i = next++) {
+            auto &job = jobs[i];
+            auto st = std::chrono::steady_clock::now();
+            TRACE_SCOPE("job", job.text.c_str());
+            try {
+                auto sourceStrs = readSources(job.opts);
+                if (job.opts.format == "spv") {
+                    // the front end needs no device
+                    auto output = intermediatePath(job.opts);
+                    emitSpirv(job.opts, sourceStrs, output);
+                    if (job.opts.depfile)
+                        writeDependencies(job.opts, {output}, sourceStrs);
+                } else {
+                    std::vector<DeviceBinary> bins;
+                    auto selection = job.opts.device + "|" +
+                        std::to_string(job.opts.deviceType) + "|" +
+                        std::to_string(job.opts.vendorId);
+                    if (job.opts.multiDevice) {
+                        std::vector<cl::Device> devs;
+                        std::vector<cl_device_id> ids;
+                        std::map<cl_platform_id,cl::Context> ctxs;
+                        {
+                            std::lock_guard<std::mutex> lock(mutex);
+                            auto itr = deviceSets.find(selection);
+                            if (itr == deviceSets.end())
+                                itr = deviceSets.emplace(selection, findDevices(job.opts)).first;
+                            devs = itr->second;
+                            for (const auto &d : devs)
+                                ids.push_back(d());
+                            ctxs = platformContexts[ids];
+                        }
+                        // a context another job stored meanwhile is kept
+                        bins = buildProgramOnDevices(job.opts, sourceStrs, devs, cache, &ctxs);
+                        std::lock_guard<std::mutex> lock(mutex);
+                        platformContexts[ids].insert(ctxs.begin(), ctxs.end());
+                    } else {
+                        cl::Device dev;
+                        {
+                            std::lock_guard<std::mutex> lock(mutex);
+                            auto itr = devices.find(selection);
+                            if (itr == devices.end())
+                                itr = devices.emplace(selection, findDevice(job.opts)).first;
+                            dev = itr->second;
+                        }
+                        // a cache hit needs no context
+                        DeviceBinary bin;
+                        std::string key;
+                        if (lookupBinary(job.opts, sourceStrs, dev, cache, bin, &key)) {
+                            bins.push_back(std::move(bin));
+                        } else {
+                            cl::Context ctx;
+                            {
+                                std::lock_guard<std::mutex> lock(mutex);
+                                auto citr = contexts.find(dev());
+                                if (citr == contexts.end()) {
+                                    TRACE_SCOPE("create context");
+                                    citr = contexts.emplace(dev(), cl::Context(dev)).first;
+                                }
+                                ctx = citr->second;
+                            }
+                            std::vector<std::string> missed = {key};
+                            bins = buildProgram(job.opts, sourceStrs, {dev}, ctx, cache,
+                                cache ? &missed : nullptr);
+                        }
+                    }
+                    checkResources(job.opts, bins);
+                    saveBinaries(job.opts, bins, sourceStrs);
+                    if (job.opts.depfile) {
+                        std::vector<cl::Device> devs;
+                        for (const auto &b : bins)
+                            devs.push_back(b.device);
+                        writeDependencies(job.opts, outputTargets(job.opts, devs), sourceStrs);
+                    }
+                }
+                job.ok = true;
+            } catch (const FatalError &err) {
+                job.error = err.what();
+            } catch (const cl::Error &err) {
+                std::stringstream ss;
+                ss << err.what() << " (" << clErrStr(err.err()) << ")";
+                job.error = ss.str();
+            }
+            job.seconds = std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - st).count();
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (job.ok) {
+                if (opts.verbosity >= 0)
+                    printf("[%4zu/%zu] %8.1f ms  %s:%d  %s\n",
+                        i + 1, jobs.size(), job.seconds * 1000.0,
+                        opts.batchFile.c_str(), job.line, job.text.c_str());
+            } else {
+                failed++;
+                warning("[%4zu/%zu] %8.1f ms  %s:%d: FAILED: %s\n",
+                    i + 1, jobs.size(), job.seconds * 1000.0,
+                    opts.batchFile.c_str(), job.line, job.error.c_str());
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int i = 1; i < workers; i++)
+        threads.emplace_back(worker);
+    worker();
+    for (auto &t : threads)
+        t.join();
+
+    double wall = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - t0).count();
+    double total = 0.0, slowest = 0.0;
+    for (const auto &job : jobs) {
+        total += job.seconds;
+        slowest = std::max(slowest, job.seconds);
+    }
+
+    if (opts.verbosity >= 0) {
+        printf("batch: %d of %d jobs succeeded\n",
+            (int)jobs.size() - failed.load(), (int)jobs.size());
+        printf("  wall time:       %10.1f ms\n", wall * 1000.0);
+        printf("  sum of job time: %10.1f ms (%.2fx concurrency)\n",
+            total * 1000.0, wall > 0.0 ? total / wall : 0.0);
+        printf("  mean job time:   %10.1f ms\n", total * 1000.0 / jobs.size());
+        printf("  slowest job:     %10.1f ms\n", slowest * 1000.0);
+    }
+    return failed > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
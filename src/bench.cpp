@@ -0,0 +1,305 @@
+#include "clc.hpp"
+#include "clerrs.h"
+#include "includes.hpp"
+#include "launch.hpp"
+#include "system.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <stdio.h>
+
+struct BenchRow {
+    WorkSize    global;
+    WorkSize    local;
+    double      medianNs = 0.0;
+    double      p95Ns = 0.0;
+    size_t      bufferBytes = 0;
+    std::string error;
+    std::string verdict; // vs. the baseline
+    std::vector<cl_ulong> counters; // --instrument: per launch, 2 per region
+};
+
+// Baseline files are tab separated, one line per configuration:
+//   kernel  device  global  local  median-ns  p95-ns
+// Lines starting with # are comments.  A kernel may have entries for
+// several devices; each device is compared only with its own.
+struct BaselineEntry {
+    double      medianNs = 0.0;
+};
+static std::string baselineKey(const std::string &kernel, const std::string &device,
+    const std::string &global, const std::string &local)
+{
+    return kernel + "\t" + device + "\t" + global + "\t" + local;
+}
+
+static std::map<std::string,BaselineEntry> loadBaseline(const std::string &path)
+{
+    std::map<std::string,BaselineEntry> entries;
+    std::ifstream file(path);
+    if (!file.good()) {
+        fatal("%s: failed to open baseline", path.c_str());
+    }
+    std::string ln;
+    int lno = 0;
+    while (std::getline(file, ln)) {
+        lno++;
+        if (ln.empty() || ln[0] == '#')
+            continue;
+        std::vector<std::string> fs;
+        std::stringstream ss(ln);
+        std::string f;
+        while (std::getline(ss, f, '\t'))
+            fs.push_back(f);
+        if (fs.size() < 5) {
+            fatal("%s:%d: malformed baseline entry", path.c_str(), lno);
+        }
+        BaselineEntry e;
+        e.medianNs = atof(fs[4].c_str());
+        entries[baselineKey(fs[0], fs[1], fs[2], fs[3])] = e;
+    }
+    return entries;
+}
+
+static void saveBaseline(
+    const std::string &path,
+    const std::string &kernel,
+    const std::string &devName,
+    const std::vector<BenchRow> &rows)
+{
+    // keep other kernels' (and devices') entries so one file can serve a
+    // whole suite
+    std::stringstream ss;
+    ss << "# clc bench baseline: kernel, device, global, local, median ns, p95 ns\n";
+    std::ifstream old(path);
+    std::string ln;
+    while (std::getline(old, ln)) {
+        if (ln.empty() || ln[0] == '#')
+            continue;
+        std::string prefix = kernel + "\t" + devName + "\t";
+        if (ln.compare(0, prefix.size(), prefix) != 0)
+            ss << ln << "\n";
+    }
+    for (const auto &r : rows) {
+        if (!r.error.empty())
+            continue;
+        ss << kernel << "\t" << devName << "\t" << r.global.str() << "\t" <<
+            r.local.str() << "\t" << (unsigned long long)r.medianNs << "\t" <<
+            (unsigned long long)r.p95Ns << "\n";
+    }
+    auto text = ss.str();
+    if (!writeFileAtomic(path, text.data(), text.size())) {
+        fatal("%s: failed to write baseline", path.c_str());
+    }
+}
+
+// a local size must match the global's dimensions and divide it evenly
+static bool localFits(const WorkSize &global, const WorkSize &local)
+{
+    if (local.dims == 0)
+        return true;
+    if (local.dims != global.dims)
+        return false;
+    for (cl_uint i = 0; i < global.dims; i++)
+        if (global.sizes[i] % local.sizes[i] != 0)
+            return false;
+    return true;
+}
+
+// the --instrument counts of each row: per launch and per work-item; the
+// time column is the work-items' clock ticks summed (ns with %globaltimer)
+static void printRegions(
+    FILE *out, const std::vector<InstrumentRegion> &regions, const std::vector<BenchRow> &rows)
+{
+    if (regions.empty())
+        return;
+    for (const auto &r : rows) {
+        if (!r.error.empty() || r.counters.size() != 2 * regions.size())
+            continue;
+        fprintf(out, "\nregions (global %s, local %s), per launch:\n", r.global.str().c_str(),
+            r.local.str().c_str());
+        fprintf(out, "%-10s %-24s %14s %12s %14s\n", "region", "where", "count",
+            "per item", "item ticks");
+        for (size_t i = 0; i < regions.size(); i++) {
+            cl_ulong count = r.counters[2 * i], ticks = r.counters[2 * i + 1];
+            fprintf(out, "%-10s %-24s %14llu %12.2f %14s\n", regions[i].kind.c_str(),
+                regions[i].where.c_str(), (unsigned long long)count,
+                r.global.items() ? (double)count / r.global.items() : 0.0,
+                ticks ? std::to_string(ticks).c_str() : "-");
+        }
+    }
+}
+
+int runBench(
+    const Opts &opts,
+    const std::vector<SourceText> &sourceStrs,
+    const DeviceBinary &bin)
+{
+    const auto &dev = bin.device;
+    std::string devName = dev.getInfo<CL_DEVICE_NAME>();
+    auto globals = parseWorkSizes(opts.globalSize.empty() ? "1M" : opts.globalSize);
+    auto locals = parseWorkSizes(opts.localSize);
+    for (const auto &g : globals) {
+        if (g.dims == 0) {
+            fatal("-global=auto: the global size must be given");
+        }
+    }
+    std::map<std::string,BaselineEntry> baseline;
+    if (!opts.benchBaseline.empty())
+        baseline = loadBaseline(opts.benchBaseline);
+
+    cl::Context ctx(dev);
+    cl::Program prog(ctx, {dev},
+        {std::make_pair((const void *)bin.bits.data(), bin.bits.size())});
+    prog.build({dev});
+    cl::Kernel kern;
+    try {
+        kern = cl::Kernel(prog, opts.bench.c_str());
+    } catch (const cl::Error &err) {
+        fatal("--bench=%s: no such kernel in the program", opts.bench.c_str());
+    }
+
+    // argument types (if needed) come from a -cl-kernel-arg-info build; the
+    // benchmarked binary is the one we just saved
+    auto spec = parseArgSpec(opts.kernelArgs);
+    // --instrument: the counters are the last argument, after those given
+    std::vector<InstrumentRegion> regions;
+    size_t counterArg = 0, numCounters = 0;
+    if (opts.instrument) {
+        for (const auto &r : instrumentedRegions(sourceStrs)) {
+            numCounters = std::max(numCounters, 4 * (r.index + 1));
+            if (r.kernel == opts.bench)
+                regions.push_back(r);
+        }
+        counterArg = kern.getInfo<CL_KERNEL_NUM_ARGS>() - 1;
+        if (spec.size() > counterArg) {
+            fatal("-args: %s takes %u arguments (and the counters), but %u were given",
+                opts.bench.c_str(), (unsigned)counterArg, (unsigned)spec.size());
+        }
+        spec.resize(counterArg);
+        KernelArg c;
+        c.kind = KernelArg::BUFFER;
+        c.type = "uint";
+        c.count = std::max(numCounters, (size_t)4);
+        spec.push_back(c);
+    }
+    cl::Kernel infoKern;
+    if (!argSpecComplete(spec, kern)) {
+        infoKern = introspectKernel(ctx, dev, sourceStrs,
+            deviceBuildOptions(opts, sourceStrs, dev), opts.bench);
+    }
+
+    cl::CommandQueue queue(ctx, dev, CL_QUEUE_PROFILING_ENABLE);
+    std::vector<BenchRow> rows;
+    for (const auto &global : globals) {
+        auto args = spec;
+        if (infoKern())
+            synthesizeArgs(args, infoKern, dev, global);
+        KernelArgs kargs(ctx, dev, args, global, locals[0]);
+        kargs.bind(kern);
+        for (const auto &local : locals) {
+            if (!localFits(global, local)) {
+                verbose("bench: skipping local %s (does not divide global %s)\n",
+                    local.str().c_str(), global.str().c_str());
+                continue;
+            }
+            BenchRow r;
+            r.global = global;
+            r.local = local;
+            r.bufferBytes = kargs.totalBufferBytes();
+            try {
+                kargs.bindLocals(kern, local);
+                std::vector<cl_uint> counts(opts.instrument ? args[counterArg].count : 0);
+                if (opts.instrument) {
+                    queue.enqueueWriteBuffer(kargs.buffer(counterArg), CL_TRUE, 0,
+                        counts.size() * sizeof(cl_uint), counts.data());
+                }
+                auto ns = timeKernel(queue, kern, global, local,
+                    opts.benchWarmup, opts.iterations);
+                r.medianNs = percentile(ns, 0.5);
+                r.p95Ns = percentile(ns, 0.95);
+                if (opts.instrument) {
+                    queue.enqueueReadBuffer(kargs.buffer(counterArg), CL_TRUE, 0,
+                        counts.size() * sizeof(cl_uint), counts.data());
+                    int launches = opts.benchWarmup + opts.iterations;
+                    for (const auto &reg : regions) {
+                        for (size_t c = 0; c < 2; c++) {
+                            size_t at = 4 * reg.index + 2 * c;
+                            r.counters.push_back((counts[at] |
+                                (cl_ulong)counts[at + 1] << 32) / launches);
+                        }
+                    }
+                }
+            } catch (const cl::Error &err) {
+                r.error = std::string(err.what()) + " (" + clErrStr(err.err()) + ")";
+            }
+            rows.push_back(r);
+        }
+    }
+    if (rows.empty()) {
+        fatal("--bench: no local size fits any global size");
+    }
+
+    int regressions = 0, failures = 0;
+    for (auto &r : rows) {
+        if (!r.error.empty()) {
+            failures++;
+            continue;
+        }
+        auto itr = baseline.find(
+            baselineKey(opts.bench, devName, r.global.str(), r.local.str()));
+        if (opts.benchBaseline.empty()) {
+            continue;
+        } else if (itr == baseline.end() || itr->second.medianNs <= 0.0) {
+            r.verdict = "new";
+            continue;
+        }
+        double delta = (r.medianNs - itr->second.medianNs) / itr->second.medianNs * 100.0;
+        std::stringstream ss;
+        ss << (delta >= 0.0 ? "+" : "") << std::fixed;
+        ss.precision(1);
+        ss << delta << "%";
+        if (delta > opts.benchThreshold) {
+            ss << " REGRESSED";
+            regressions++;
+        }
+        r.verdict = ss.str();
+    }
+
+    FILE *out = opts.output == "--" ? stderr : stdout;
+    if (opts.verbosity >= 0) {
+        fprintf(out, "bench: %s on %s, %d iterations (%d warm-up)\n",
+            opts.bench.c_str(), devName.c_str(), opts.iterations, opts.benchWarmup);
+        fprintf(out, "%14s %10s %12s %12s %10s %9s  %s\n", "global", "local",
+            "median us", "p95 us", "Mitems/s", "GB/s", opts.benchBaseline.empty() ? "" : "vs. baseline");
+        for (const auto &r : rows) {
+            if (!r.error.empty()) {
+                fprintf(out, "%14s %10s  FAILED: %s\n", r.global.str().c_str(),
+                    r.local.str().c_str(), r.error.c_str());
+                continue;
+            }
+            // GB/s counts every buffer once per launch (an upper bound on traffic)
+            double secs = r.medianNs * 1e-9;
+            fprintf(out, "%14s %10s %12.3f %12.3f %10.1f %9.2f  %s\n",
+                r.global.str().c_str(), r.local.str().c_str(),
+                r.medianNs / 1000.0, r.p95Ns / 1000.0,
+                secs > 0.0 ? r.global.items() / secs / 1e6 : 0.0,
+                secs > 0.0 ? r.bufferBytes / secs / 1e9 : 0.0,
+                r.verdict.c_str());
+        }
+        printRegions(out, regions, rows);
+    }
+
+    if (!opts.benchSave.empty())
+        saveBaseline(opts.benchSave, opts.bench, devName, rows);
+
+    if (failures > 0) {
+        warning("--bench=%s: %d configurations failed to run\n", opts.bench.c_str(), failures);
+    }
+    if (regressions > 0) {
+        warning("--bench=%s: %d configurations regressed by more than %g%%\n",
+            opts.bench.c_str(), regressions, opts.benchThreshold);
+    }
+    return failures > 0 || regressions > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,232 @@
+#include "cache.hpp"
+#include "hash.hpp"
+#include "includes.hpp"
+#include "system.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char ENTRY_MAGIC[8] = {'C','L','C','B','I','N','0','1'};
+static const size_t ENTRY_HEADER = sizeof(ENTRY_MAGIC) + 8 + Sha256::DIGEST_SIZE;
+
+BinaryCache::BinaryCache(const std::string &_dir, unsigned long long _maxBytes)
+    : dir(_dir), maxBytes(_maxBytes)
+{
+    if (!makeDirectories(dir)) {
+        fatal("%s: failed to create cache directory", dir.c_str());
+    }
+}
+
+std::string BinaryCache::entryPath(const std::string &key) const
+{
+    return dir + "/" + key.substr(0, 2) + "/" + key + ".bin";
+}
+
+void BinaryCache::count(const char *counter) const
+{
+    // appends are atomic for small writes, so concurrent processes
+    // never lose an update; the counter value is the file size
+    FILE *f = fopen((dir + "/" + counter).c_str(), "ab");
+    if (f) {
+        fputc('.', f);
+        fclose(f);
+    }
+}
+
+bool BinaryCache::lookup(const std::string &key, std::vector<char> &bits) const
+{
+    TRACE_SCOPE("cache lookup");
+    auto path = entryPath(key);
+    MappedFile entry;
+    if (!entry.open(path)) {
+        debug("cache: %s: miss\n", key.c_str());
+        count("misses");
+        return false;
+    }
+
+    uint64_t len = 0;
+    bool ok = entry.size() >= ENTRY_HEADER &&
+        memcmp(entry.data(), ENTRY_MAGIC, sizeof(ENTRY_MAGIC)) == 0;
+    if (ok) {
+        for (int i = 0; i < 8; i++)
+            len |= (uint64_t)(uint8_t)entry.data()[sizeof(ENTRY_MAGIC) + i] << (8*i);
+        ok = len == entry.size() - ENTRY_HEADER;
+    }
+    if (ok) {
+        uint8_t d[Sha256::DIGEST_SIZE];
+        Sha256 h;
+        h.update(entry.data() + ENTRY_HEADER, (size_t)len);
+        h.digest(d);
+        ok = memcmp(d, entry.data() + sizeof(ENTRY_MAGIC) + 8, sizeof(d)) == 0;
+    }
+    if (!ok) {
+        entry.close(); // Windows will not remove a mapped file
+        warning("cache: %s: corrupt entry; removing\n", path.c_str());
+        removeFile(path);
+        count("misses");
+        return false;
+    }
+
+    bits.assign(entry.data() + ENTRY_HEADER, entry.data() + entry.size());
+    entry.close();
+    touchFile(path);
+    debug("cache: %s: hit (%llu B)\n", key.c_str(), (unsigned long long)len);
+    count("hits");
+    return true;
+}
+
+void BinaryCache::store(const std::string &key, const void *bits, size_t bitsLen) const
+{
+    TRACE_SCOPE("cache store");
+    auto path = entryPath(key);
+    if (!makeDirectories(dir + "/" + key.substr(0, 2))) {
+        warning("cache: %s: failed to create directory\n", dir.c_str());
+        return;
+    }
+
+    std::vector<char> entry(ENTRY_HEADER + bitsLen);
+    memcpy(entry.data(), ENTRY_MAGIC, sizeof(ENTRY_MAGIC));
+    for (int i = 0; i < 8; i++)
+        entry[sizeof(ENTRY_MAGIC) + i] = (char)((uint64_t)bitsLen >> (8*i));
+    Sha256 h;
+    h.update(bits, bitsLen);
+    h.digest((uint8_t *)entry.data() + sizeof(ENTRY_MAGIC) + 8);
+    memcpy(entry.data() + ENTRY_HEADER, bits, bitsLen);
+
+    if (!writeFileAtomic(path, entry.data(), entry.size())) {
+        warning("cache: %s: failed to write entry\n", path.c_str());
+        return;
+    }
+    debug("cache: %s: stored (%llu B)\n", key.c_str(), (unsigned long long)bitsLen);
+    evict();
+}
+
+struct CacheEntry {
+    std::string   path;
+    uint64_t      size;
+    int64_t       mtime;
+};
+
+static std::vector<CacheEntry> listEntries(const std::string &dir)
+{
+    std::vector<CacheEntry> es;
+    for (const auto &sub : listDirectory(dir)) {
+        if (sub.size() != 2 || !isDirectory(dir + "/" + sub))
+            continue;
+        for (const auto &f : listDirectory(dir + "/" + sub)) {
+            if (f.size() < 4 || f.compare(f.size() - 4, 4, ".bin") != 0)
+                continue;
+            CacheEntry e;
+            e.path = dir + "/" + sub + "/" + f;
+            if (fileStat(e.path, e.size, e.mtime))
+                es.push_back(e);
+        }
+    }
+    return es;
+}
+
+void BinaryCache::evict() const
+{
+    auto es = listEntries(dir);
+    unsigned long long total = 0;
+    for (const auto &e : es)
+        total += e.size;
+    if (total <= maxBytes)
+        return;
+
+    // trim to 90% so that every store near the limit does not rescan
+    unsigned long long target = maxBytes - maxBytes / 10;
+    std::sort(es.begin(), es.end(),
+        [](const CacheEntry &e1, const CacheEntry &e2) {
+            return e1.mtime < e2.mtime;
+        });
+    for (const auto &e : es) {
+        if (total <= target)
+            break;
+        // a concurrent evictor may have beaten us; that is fine
+        debug("cache: evicting %s\n", e.path.c_str());
+        removeFile(e.path);
+        total -= e.size;
+    }
+}
+
+void BinaryCache::printStats() const
+{
+    uint64_t hits = 0, misses = 0;
+    int64_t mtime;
+    fileStat(dir + "/hits", hits, mtime);
+    fileStat(dir + "/misses", misses, mtime);
+
+    auto es = listEntries(dir);
+    unsigned long long total = 0;
+    for (const auto &e : es)
+        total += e.size;
+
+    std::cout << "cache:   " << dir << "\n";
+    std::cout << "entries: " << es.size() << "\n";
+    std::cout << "size:    " << total << " B (limit " << maxBytes << " B)\n";
+    std::cout << "hits:    " << hits << "\n";
+    std::cout << "misses:  " << misses << "\n";
+    if (hits + misses > 0) {
+        std::cout << "ratio:   " <<
+            (int)(100.0 * hits / (double)(hits + misses)) << "%\n";
+    }
+}
+
+std::string binaryCacheKey(
+    const cl::Device &dev,
+    const std::vector<std::string> &inputPaths,
+    const std::vector<SourceText> &inputTexts,
+    const std::vector<std::string> &buildOpts,
+    const char *kind)
+{
+    Sha256 h;
+    h.updateField(std::string("clc " VERSION_STRING));
+    if (kind)
+        h.updateField(std::string(kind));
+    h.updateField(dev.getInfo<CL_DEVICE_NAME>());
+    h.updateField(dev.getInfo<CL_DRIVER_VERSION>());
+    h.updateField(dev.getInfo<CL_DEVICE_VERSION>());
+
+    h.updateField(normalizeBuildOptions(buildOpts));
+
+    for (const auto &src : inputTexts)
+        h.updateField(src.data(), src.size());
+
+    auto tokens = splitBuildOptions(buildOpts);
+    auto incs = scanIncludes(inputPaths, inputTexts, includeDirectories(tokens));
+    for (const auto &inc : incs) {
+        h.updateField(inc.name);
+        // an unresolved include hashes only by name; the compiler will
+        // fail on it anyway unless it is a driver-provided header
+        if (inc.path.empty()) {
+            h.updateField(std::string());
+        } else {
+            auto text = readSource(inc.path);
+            h.updateField(text.data(), text.size());
+        }
+    }
+    return h.hexDigest();
+}
+
+bool parseByteSize(const char *str, unsigned long long &val)
+{
+    char *end = nullptr;
+    val = strtoull(str, &end, 10);
+    if (end == str)
+        return false;
+    switch (*end) {
+    case 'k': case 'K': val <<= 10; end++; break;
+    case 'm': case 'M': val <<= 20; end++; break;
+    case 'g': case 'G': val <<= 30; end++; break;
+    default: break;
+    }
+    if (*end == 'B' || *end == 'b')
+        end++;
+    return *end == 0;
+}
@@ -0,0 +1,49 @@
+#ifndef CACHE_HPP
+#define CACHE_HPP
+
+#include "clc.hpp"
+
+#include <string>
+#include <vector>
+
+// Content-addressed on-disk cache of program binaries.
+//
+// Layout:  DIR/XX/<sha256>.bin  (XX = first two hex digits)
+//          DIR/hits, DIR/misses (one byte appended per event)
+//
+// Entries are written to a unique temporary file and published with a
+// rename so concurrent clc processes (e.g. make -j) never observe a
+// partial entry.  Each entry also carries a digest of its payload so
+// that a truncated or corrupted file reads as a miss instead of a bad
+// binary.  Eviction is least-recently-used by file mtime; a hit touches
+// the entry.
+class BinaryCache {
+    std::string         dir;
+    unsigned long long  maxBytes;
+
+    std::string entryPath(const std::string &key) const;
+    void count(const char *counter) const;
+    void evict() const;
+public:
+    BinaryCache(const std::string &dir, unsigned long long maxBytes);
+
+    bool lookup(const std::string &key, std::vector<char> &bits) const;
+    void store(const std::string &key, const void *bits, size_t bitsLen) const;
+
+    void printStats() const;
+};
+
+// hashes everything that can change the binary produced for a device;
+// kind separates other artifacts built from the same inputs (e.g. the
+// compiled objects of -incremental builds) from whole-program binaries
+std::string binaryCacheKey(
+    const cl::Device &dev,
+    const std::vector<std::string> &inputPaths,
+    const std::vector<SourceText> &inputTexts,
+    const std::vector<std::string> &buildOpts,
+    const char *kind = nullptr);
+
+// parses sizes such as 512M or 2G
+bool parseByteSize(const char *str, unsigned long long &val);
+
+#endif
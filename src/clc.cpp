@@ -1,586 +1,1450 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <stdarg.h>
-#include <string>
-#include <sstream>
-#include <iostream>
-#include <iomanip>
-#include <fstream>
-#include <vector>
-#include <algorithm>
-#include <iterator>
-#ifdef _WIN32
-#include <Windows.h>
-#include <malloc.h>
-// for _setmode(_fileno())...
-#include <fcntl.h>
-#include <io.h>
-#define VSCPRINTF(PAT,VA) \
-    _vscprintf(PAT,VA)
-#define VSPRINTF(B,BLEN,...) \
-    vsprintf_s(B, BLEN, __VA_ARGS__)
-#define alloca _alloca
-#else
-#define VSCPRINTF(PAT,VA) \
-    vsnprintf(NULL, 0, PAT, VA)
-#define VSPRINTF(B,BLEN,...) \
-    vsprintf(B,__VA_ARGS__)
-#include <alloca.h>
-#endif
-#define __CL_ENABLE_EXCEPTIONS
-#define CL_USE_DEPRECATED_OPENCL_2_0_APIS
-#include <CL/cl.hpp>
-
-#include "clerrs.h"
-
-#define MKBUF(F, PAT) \
-    va_list ap; \
-    va_start(ap, PAT); \
-    size_t _ebuflen = VSCPRINTF(PAT, ap) + 1; \
-    va_end(ap); \
-    \
-    char *_buf = (char *)alloca(_ebuflen); \
-    va_start(ap, pat); \
-    VSPRINTF(_buf, _ebuflen, PAT, ap); \
-    va_end(ap); \
-    _buf[_ebuflen - 1] = 0; \
-    F((std::string)_buf)
-
-static std::string g_exe;
-
-void fatalMessage(const std::string &str) {
-    fputs(g_exe.c_str(), stdout);
-    fputs(": ", stdout);
-    fputs(str.c_str(), stderr);
-    if (str.length() > 0 && str[str.length() - 1] != '\n')
-        fputc('\n', stderr);
-}
-void fatal(const std::string &str) {
-    fatalMessage(str);
-    exit(EXIT_FAILURE);
-}
-void fatal(const char *pat,...) {
-    MKBUF(fatal, pat);
-}
-void warning(const std::string &str) {
-    fputs(str.c_str(), stderr);
-}
-void warning(const char *pat,...) {
-    MKBUF(warning, pat);
-}
-int g_verbosity = 0;
-void verbose(const std::string &str) {
-    if (g_verbosity > 0)
-        fputs(str.c_str(), stderr);
-}
-void verbose(const char *pat,...) {
-    if (g_verbosity > 0) { MKBUF(verbose, pat); }
-}
-void debug(const std::string &str) {
-    if (g_verbosity > 1)
-        fputs(str.c_str(), stderr);
-}
-void debug(const char *pat,...) {
-    if (g_verbosity > 1) { MKBUF(debug, pat); }
-}
-
-
-struct Opts {
-    std::vector<std::string>   args;
-    std::string                device; // substring match
-    std::string                output;
-    std::vector<std::string>   buildOpts;
-    int                        verbosity = 0;
-    bool                       listDevices = false;
-};
-
-
-static void printUsage(FILE *stream) {
-    fprintf(stream,
-        "OpenCL Offline Compiler (" VERSION_STRING ")\n"
-        "usage: %s [OPTS] ARGS\n"
-        "where [OPTS]\n"
-        " -d=DEV          targets device with a substring in it's name\n"
-        " -b=BUILD-OPTS   adds a build option (e.g. -b=-DTILE=32)\n"
-        " -q/-v/-v2       quiet/verbose/debug\n"
-        " -h=d            list devices\n"
-        "[ARGS]           is list of compilation units (.cl files)\n"
-        "\n"
-        "EXAMPLES:\n"
-        " %% clc foo.cl        saves foo.bin as the output for the default device\n"
-        " %% clc -d=Intel ...  selects a device containing \"Intel\" in it's CL_DEVICE_NAME\n"
-        "",
-        g_exe.c_str());
-
-}
-
-static Opts parseOpts(int argc, const char **argv)
-{
-    int ai = 0;
-    auto argpfx = [&](const char *pfx) {
-        return (strncmp(argv[ai], pfx, strlen(pfx)) == 0);
-    };
-    auto argeq = [&](const char *pfx) {
-        return (strcmp(argv[ai], pfx) == 0);
-    };
-    auto badArg = [&](const char *msg) {
-        std::string str = g_exe;
-        str += ": ";
-        str = str + argv[ai] + ": " + msg + "\n";
-        fatalMessage(msg);
-        printUsage(stderr);
-        exit(EXIT_FAILURE);
-    };
-
-    Opts opts;
-    for (; ai < argc;) {
-        if (argeq("--help") || argeq("-h")) {
-            printUsage(stdout);
-            exit(EXIT_SUCCESS);
-
-        } else if (argeq("-h=d")) {
-            opts.listDevices = true;
-            ai++;
-
-        // verbosity
-        } else if (argeq("-q") || argeq("-v-1") || argeq("-v=-1")) {
-            opts.verbosity = -1;
-            ai++;
-        } else if (argeq("-v") || argeq("-v1") || argeq("-v=1")) {
-            opts.verbosity = 1;
-            ai++;
-        } else if (argeq("-v2") || argeq("-v=2")) {
-            opts.verbosity = 2;
-            ai++;
-        } else if (argpfx("-v")) {
-            badArg("unexpected verbosity option");
-
-        // build options
-        } else if (argpfx("-b=")) {
-            opts.buildOpts.emplace_back(argv[ai] + 3);
-            ai++;
-        } else if (argpfx("-b")) {
-            badArg("must be of the form -b=...");
-
-        // -d=device selection
-        } else if (argpfx("-d=")) {
-            const char *str = argv[ai] + 3;
-            if (opts.device.length() > 0) {
-                badArg("argument respecified");
-            }
-            opts.device = str;
-            ai++;
-        } else if (argpfx("-d")) {
-            badArg("must be of the form -d=...");
-
-        } else if (argpfx("-o=")) {
-            if (opts.output.length() > 0) {
-                badArg("argument respecified");
-            }
-            opts.output = argv[ai] + 3;
-            ai++;
-        } else if (argpfx("-o")) {
-            badArg("must be of the form -o=...");
-
-        } else if (!argeq("-") && argpfx("-")) {
-            // - is output
-            badArg("unexpected option");
-        } else {
-            opts.args.emplace_back(argv[ai++]);
-        }
-    }
-    return opts;
-}
-
-
-static cl::Device findDevice(const Opts &opts)
-{
-    debug("selecting matching device %s\n", opts.device.c_str());
-    std::vector<cl::Device> matching;
-    if (opts.device.length() == 0) {
-        matching.emplace_back(cl::Device::getDefault());
-    } else {
-        std::vector<cl::Platform> ps;
-        cl::Platform::get(&ps);
-
-        bool alreadyMatched = false;
-        for (auto &p : ps) {
-            debug("scanning platform %s\n", p.getInfo<CL_PLATFORM_NAME>().c_str());
-            std::vector<cl::Device> ds;
-            p.getDevices(CL_DEVICE_TYPE_ALL, &ds);
-
-            for (auto &d : ds) {
-                std::string dstr = d.getInfo<CL_DEVICE_NAME>();
-                debug("  scanning device %s\n", dstr.c_str());
-
-                if (dstr.find(opts.device) != std::string::npos) {
-                    matching.emplace_back(d);
-                }
-            }
-        }
-    }
-    if (matching.empty()) {
-        fatal("-d=%s: unable to find matching device", opts.device.c_str());
-    } else if (matching.size() > 1) {
-        std::stringstream ss;
-        ss << "-d=" << opts.device << ": matches multiple devices\n";
-        for (auto &d : matching) {
-            auto p = d.getInfo<CL_DEVICE_PLATFORM>();
-            cl::Platform p2(p);
-            ss << "  - " << d.getInfo<CL_DEVICE_NAME>() <<
-                "  (from " << p2.getInfo<CL_PLATFORM_NAME>() << ")\n";
-        }
-        fatal(ss.str());
-    }
-    debug("  => picked device %s\n", matching[0].getInfo<CL_DEVICE_NAME>().c_str());
-    return matching[0];
-}
-
-static void emitProperty(const char *prop)
-{
-    std::cout << "  " << prop << ": ";
-    for (int i = 0, len = 48 - (int)strlen(prop); i < len; i++)
-        std::cout << ' ';
-
-}
-template <typename T>
-static void emitPropertyIntegralUnits(const char *prop, const T &val, const char *units)
-{
-    emitProperty(prop);
-    std::cout << val;
-    if (units && *units)
-        std::cout << " " << units;
-    std::cout << "\n";
-}
-template <typename T>
-static void emitPropertyIntegralBytes(const char *prop, T val)
-{
-    const char *units = "B";
-    if (val % (1024 * 1024) == 0) {
-        val = (val >> 20);
-        units = "MB";
-    } else if (val % 1024 == 0) {
-        val = (val >> 10);
-        units = "KB";
-    }
-    emitPropertyIntegralUnits(prop, val, units);
-}
-static void emitBoolProperty(const char *prop, cl_bool val)
-{
-    emitProperty(prop);
-    std::cout << (val ? "CL_TRUE" : "CL_FALSE") << "\n";
-}
-#define EMIT_DEVICE_PROPERTY_UNITS(SYM,UNITS)  emitPropertyIntegralUnits(#SYM, d.getInfo<SYM>(), UNITS)
-#define EMIT_DEVICE_PROPERTY_MEM(SYM)  emitPropertyIntegralBytes(#SYM, d.getInfo<SYM>())
-#define EMIT_DEVICE_PROPERTY_BOOL(SYM)  emitBoolProperty(#SYM, d.getInfo<SYM>())
-
-
-static void listDevices(const Opts &opts)
-{
-    std::vector<cl::Platform> ps;
-    cl::Platform::get(&ps);
-    for (auto &p : ps) {
-        std::vector<cl::Device> ds;
-        p.getDevices(CL_DEVICE_TYPE_ALL, &ds);
-
-        for (auto &d : ds) {
-            std::cout << "DEVICE: \"" << d.getInfo<CL_DEVICE_NAME>() << "\"";
-            std::cout << "\n";
-            if (opts.verbosity > 0) {
-                EMIT_DEVICE_PROPERTY_UNITS(CL_DEVICE_VERSION,nullptr);
-                EMIT_DEVICE_PROPERTY_UNITS(CL_DEVICE_VENDOR,nullptr);
-                EMIT_DEVICE_PROPERTY_UNITS(CL_DRIVER_VERSION,nullptr);
-                emitProperty("CL_DEVICE_TYPE");
-                switch (d.getInfo<CL_DEVICE_TYPE>()) {
-                case CL_DEVICE_TYPE_CPU: std::cout << "CL_DEVICE_TYPE_CPU"; break;
-                case CL_DEVICE_TYPE_GPU: std::cout << "CL_DEVICE_TYPE_GPU"; break;
-                case CL_DEVICE_TYPE_ACCELERATOR: std::cout << "CL_DEVICE_TYPE_ACCELERATOR"; break;
-                case CL_DEVICE_TYPE_DEFAULT: std::cout << "CL_DEVICE_TYPE_DEFAULT"; break;
-                default: std::cout << d.getInfo<CL_DEVICE_TYPE>() << "?"; break;
-                }
-                std::cout << "\n";
-                std::cout << "  COMPUTE:\n";
-                EMIT_DEVICE_PROPERTY_UNITS(CL_DEVICE_MAX_CLOCK_FREQUENCY,"MHz");
-                EMIT_DEVICE_PROPERTY_UNITS(CL_DEVICE_MAX_COMPUTE_UNITS, nullptr);
-                EMIT_DEVICE_PROPERTY_UNITS(CL_DEVICE_PROFILING_TIMER_RESOLUTION, "ns");
-                EMIT_DEVICE_PROPERTY_BOOL(CL_DEVICE_ENDIAN_LITTLE);
-                // EMIT_DEVICE_PROPERTY_MEM(CL_DEVICE_PRINTF_BUFFER_SIZE); (not supported
-
-                emitProperty("CL_DEVICE_SINGLE_FP_CONFIG"); {
-                    auto fpcfg = d.getInfo<CL_DEVICE_SINGLE_FP_CONFIG>();
-                    const char *sep = ""; // "|";
-                    if ((fpcfg & CL_FP_DENORM)) {
-                        std::cout << sep << "CL_FP_DENORM";
-                        sep = "|";
-                    }
-                    if ((fpcfg & CL_FP_INF_NAN)) {
-                        std::cout << sep << "CL_FP_INF_NAN";
-                        sep = "|";
-                    }
-                    if ((fpcfg & CL_FP_ROUND_TO_NEAREST)) {
-                        std::cout << sep << "CL_FP_ROUND_TO_NEAREST";
-                        sep = "|";
-                    }
-                    if ((fpcfg & CL_FP_ROUND_TO_ZERO)) {
-                        std::cout << sep << "CL_FP_ROUND_TO_ZERO";
-                        sep = "|";
-                    }
-                    if ((fpcfg & CL_FP_ROUND_TO_INF)) {
-                        std::cout << sep << "CL_FP_ROUND_TO_INF";
-                        sep = "|";
-                    }
-                    if ((fpcfg & CL_FP_FMA)) {
-                        std::cout << sep << "CL_FP_FMA";
-                        sep = "|";
-                    }
-                    if ((fpcfg & CL_FP_CORRECTLY_ROUNDED_DIVIDE_SQRT)) {
-                        std::cout << sep << "CL_FP_CORRECTLY_ROUNDED_DIVIDE_SQRT";
-                        sep = "|";
-                    }
-                    if ((fpcfg & CL_FP_SOFT_FLOAT)) {
-                        std::cout << sep << "CL_FP_SOFT_FLOAT";
-                        sep = "|";
-                    }
-                    std::cout << "\n";
-                }
-
-                emitProperty("CL_DEVICE_QUEUE_PROPERTIES"); {
-                    const char *sep = ""; // "|";
-                    auto devq = d.getInfo<CL_DEVICE_QUEUE_PROPERTIES>();
-                    if ((devq & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE)) {
-                        std::cout << sep << "CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE";
-                        sep = "|";
-                    }
-                    if ((devq & CL_QUEUE_PROFILING_ENABLE)) {
-                        std::cout << sep << "CL_QUEUE_PROFILING_ENABLE";
-                        sep = "|";
-                    }
-                    std::cout << "\n";
-                }
-
-                std::cout << "  WORKGROUPS:\n";
-                EMIT_DEVICE_PROPERTY_UNITS(CL_DEVICE_MAX_WORK_GROUP_SIZE,"items");
-                auto dim = d.getInfo<CL_DEVICE_MAX_WORK_ITEM_SIZES>();
-                emitProperty("CL_DEVICE_MAX_WORK_ITEM_SIZES");
-                std::cout << dim[0];
-                for (size_t i = 1; i < dim.size(); i++) {
-                    std::cout << 'x' << dim[i];
-                }
-                std::cout << "\n";
-                EMIT_DEVICE_PROPERTY_UNITS(CL_DEVICE_PREFERRED_VECTOR_WIDTH_CHAR,nullptr);
-                EMIT_DEVICE_PROPERTY_UNITS(CL_DEVICE_PREFERRED_VECTOR_WIDTH_FLOAT,nullptr);
-                std::cout << "  MEMORY:\n";
-                EMIT_DEVICE_PROPERTY_UNITS(CL_DEVICE_ADDRESS_BITS,"b");
-                EMIT_DEVICE_PROPERTY_MEM(CL_DEVICE_MEM_BASE_ADDR_ALIGN);
-                EMIT_DEVICE_PROPERTY_MEM(CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE);
-                EMIT_DEVICE_PROPERTY_MEM(CL_DEVICE_LOCAL_MEM_SIZE);
-                EMIT_DEVICE_PROPERTY_MEM(CL_DEVICE_GLOBAL_MEM_SIZE);
-                emitProperty("CL_DEVICE_GLOBAL_MEM_CACHE_TYPE");
-                switch (d.getInfo<CL_DEVICE_GLOBAL_MEM_CACHE_TYPE>()) {
-                case CL_NONE: std::cout << "CL_NONE"; break;
-                case CL_READ_ONLY_CACHE: std::cout << "CL_READ_ONLY_CACHE"; break;
-                case CL_READ_WRITE_CACHE: std::cout << "CL_READ_WRITE_CACHE"; break;
-                default: std::cout << d.getInfo<CL_DEVICE_GLOBAL_MEM_CACHE_TYPE>() << "?\n"; break;
-                }
-                std::cout << "\n";
-                EMIT_DEVICE_PROPERTY_MEM(CL_DEVICE_GLOBAL_MEM_CACHELINE_SIZE);
-                EMIT_DEVICE_PROPERTY_MEM(CL_DEVICE_GLOBAL_MEM_CACHE_SIZE);
-                std::cout << "  IMAGES:\n";
-                EMIT_DEVICE_PROPERTY_BOOL(CL_DEVICE_IMAGE_SUPPORT);
-                EMIT_DEVICE_PROPERTY_UNITS(CL_DEVICE_IMAGE2D_MAX_HEIGHT,"px");
-                EMIT_DEVICE_PROPERTY_UNITS(CL_DEVICE_IMAGE2D_MAX_WIDTH,"px");
-                // IF NVDA
-                // https://www.khronos.org/registry/cl/extensions/nv/cl_nv_device_attribute_query.txt
-                // e.g. CL_DEVICE_WARP_SIZE_NV
-
-                // EMIT_DEVICE_PROPERTY_UNITS(CL_DEVICE_IMAGE_PITCH_ALIGNMENT,nullptr); // OCL 2.0?
-                std::cout << "  EXTENSIONS:\n";
-                std::istringstream iss(d.getInfo<CL_DEVICE_EXTENSIONS>());
-                std::vector<std::string> tokens;
-                std::copy(std::istream_iterator<std::string>(iss),
-                    std::istream_iterator<std::string>(),
-                    std::back_inserter(tokens));
-                for (auto tk : tokens) {
-                    std::cout << "  " << tk << "\n";
-                }
-            }
-        }
-    }
-}
-
-static std::string readTextStream(
-    const std::string &streamName,
-    std::istream &is)
-{
-    std::string s;
-    is.clear();
-    s.append(std::istreambuf_iterator<char>(is),
-             std::istreambuf_iterator<char>());
-    if (!is.good()) {
-        fatal("%s: error reading", streamName.c_str());
-    }
-    return s;
-}
-
-static std::string readTextFile(
-    const std::string &fileName)
-{
-    std::ifstream file(fileName);
-    if (!file.good()) {
-        fatal("%s: failed to open file", fileName.c_str());
-    }
-    return readTextStream(fileName, file);
-}
-
-static void writeBinary(
-    const std::string &streamName, const void *bits, size_t bitsLen)
-{
-    if (streamName.length() == 0) {
-// have to use stdio here since C++ will not let us output binary
-#ifdef WIN32
-        _setmode(_fileno(stdout), _O_BINARY);
-#else
-        setmode(fileno(stdout), O_BINARY);
-#endif
-        if (fwrite(bits, 1, bitsLen, stdout) < bitsLen) {
-            fatal("failed to write entire output");
-        }
-    } else {
-        std::ofstream os(streamName,std::ios::binary);
-        if (!os.good()) {
-            fatal("%s: failed to open output file", streamName.c_str());
-        }
-        os.clear();
-        os.write((const char *)bits, bitsLen);
-        if (!os.good()) {
-            fatal("%s: error writing", streamName.c_str());
-        }
-    }
-}
-
-int main(int argc, const char **argv)
-{
-    g_exe = argv[0];
-    auto ix = g_exe.rfind('\\');
-    if (ix != std::string::npos)
-        g_exe = g_exe.substr(ix + 1);
-    else if ((ix = g_exe.rfind('/')) != std::string::npos)
-        g_exe = g_exe.substr(ix + 1);
-
-    Opts opts = parseOpts(argc - 1, argv + 1);
-    g_verbosity = opts.verbosity;
-
-    cl::Device dev = findDevice(opts);
-
-    std::stringstream bss;
-    for (size_t i = 0; i < opts.buildOpts.size(); i++) {
-        if (i > 0)
-            bss << " ";
-        bss << opts.buildOpts[i];
-    }
-    std::string buildOpts = bss.str();
-
-    if (opts.listDevices) {
-        listDevices(opts);
-        if (!opts.args.empty()) {
-            fatal("-h=d specified, ignorning arguments");
-        }
-        return 0;
-    }
-
-    // load the source
-    if (opts.args.empty()) {
-        fatal("expected input argument");
-    }
-    cl::Program::Sources sources;
-    std::vector<std::string> sourceStrs;
-    for (auto &f : opts.args) {
-        auto str = f == "-" ?
-            readTextStream("stdin", std::cin) : readTextFile(f);
-        sourceStrs.emplace_back(str);
-        sources.emplace_back(sourceStrs.back().c_str(), str.size());
-    }
-
-    // create the context
-    cl::Context ctx(dev);
-
-    // create the program
-    cl::Program prog(ctx, sources, false); // no autobuild
-    // build it
-    try {
-        // attempt to build the program
-        prog.build(buildOpts.c_str());
-        auto bl = prog.getBuildInfo<CL_PROGRAM_BUILD_LOG>(dev);
-        if (bl.find("warning") != std::string::npos) {
-            warning("warnings during build:\n%s", bl.c_str());
-        } else {
-            verbose("build log:\n%s", bl.c_str());
-        }
-    } catch (const cl::Error &err) {
-        auto bl = prog.getBuildInfo<CL_PROGRAM_BUILD_LOG>(dev);
-        fatal("during build: %s (%s):\n%s",
-            err.what(), clErrStr(err.err()).c_str(), bl.c_str());
-    }
-
-    // save the binary
-    std::vector<size_t> binSizes =
-        prog.getInfo<CL_PROGRAM_BINARY_SIZES>();
-    char *binBuf = (char *)alloca(binSizes[0]);
-    std::vector<char *> binPtrs;
-    binPtrs.push_back(binBuf);
-    try {
-        prog.getInfo(CL_PROGRAM_BINARIES, &binPtrs);
-    } catch (const cl::Error &err) {
-        fatal("clGetProgramInfo(..CL_PROGRAM_BINARIES..): %s (%s)",
-            err.what(), clErrStr(err.err()).c_str());
-    }
-
-    if (opts.output.length() == 0) {
-        std::string filename;
-        if (opts.args[0] == "--") {
-            filename = "stdin";
-        } else {
-            auto arg0 = opts.args[0];
-            auto fslash = arg0.rfind('/');
-            auto bslash = arg0.rfind('\\');
-            if (fslash != std::string::npos) {
-                // foo/bar/baz/foo.cl
-                //            ^
-                filename = arg0.substr(fslash+1);
-            } else if (bslash != std::string::npos) {
-                // foo\\bar\\baz\\foo.cl
-                //              ^^
-                filename = arg0.substr(bslash+1);
-            } else {
-                // foo.cl
-                filename = arg0;
-            }
-            auto ext = filename.rfind(".cl");
-            if (ext != std::string::npos) {
-                filename = filename.substr(0, ext); // foo.cl -> foo
-            }
-        }
-        // foo -> foo.8086.bin
-        std::stringstream ss;
-        ss << filename << ".";
-        if (dev.getInfo<CL_DEVICE_VENDOR_ID>() == 0x10de) {
-            ss << "ptx";
-        } else if (dev.getInfo<CL_DEVICE_VENDOR_ID>() == 0x8086) {
-            ss << "elf";
-        } else {
-            ss << std::hex << std::setfill('0') << std::setw(4) << dev.getInfo<CL_DEVICE_VENDOR_ID>();
-            ss << "bin";
-        }
-        opts.output = ss.str();
-    }
-
-    if (opts.output == "--") {
-        verbose("saving binary to stdout\n");
-        writeBinary("", binPtrs[0], binSizes[0]);
-    } else {
-        verbose("saving binary to %s\n", opts.output.c_str());
-        writeBinary(opts.output, binPtrs[0], binSizes[0]);
-    }
-    return 0;
-}
-
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string>
+#include <sstream>
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <vector>
+#include <algorithm>
+#include <iterator>
+#include <memory>
+#include <thread>
+#ifdef _WIN32
+#include <Windows.h>
+#include <malloc.h>
+// for _setmode(_fileno())...
+#include <fcntl.h>
+#include <io.h>
+#define VSCPRINTF(PAT,VA) \
+    _vscprintf(PAT,VA)
+#define VSPRINTF(B,BLEN,...) \
+    vsprintf_s(B, BLEN, __VA_ARGS__)
+#define alloca _alloca
+#else
+#define VSCPRINTF(PAT,VA) \
+    vsnprintf(NULL, 0, PAT, VA)
+#define VSPRINTF(B,BLEN,...) \
+    vsprintf(B,__VA_ARGS__)
+#include <alloca.h>
+#endif
+#include "clc.hpp"
+#include "clerrs.h"
+#include "clparse.hpp"
+#include "cache.hpp"
+#include "includes.hpp"
+#include "system.hpp"
+#include "trace.hpp"
+
+#define MKBUF(F, PAT) \
+    va_list ap; \
+    va_start(ap, PAT); \
+    size_t _ebuflen = VSCPRINTF(PAT, ap) + 1; \
+    va_end(ap); \
+    \
+    char *_buf = (char *)alloca(_ebuflen); \
+    va_start(ap, pat); \
+    VSPRINTF(_buf, _ebuflen, PAT, ap); \
+    va_end(ap); \
+    _buf[_ebuflen - 1] = 0; \
+    F((std::string)_buf)
+
+std::string g_exe;
+
+void fatalMessage(const std::string &str) {
+    fputs(g_exe.c_str(), stderr);
+    fputs(": ", stderr);
+    fputs(str.c_str(), stderr);
+    if (str.length() > 0 && str[str.length() - 1] != '\n')
+        fputc('\n', stderr);
+}
+void fatal(const std::string &str) {
+    throw FatalError(str);
+}
+void fatal(const char *pat,...) {
+    MKBUF(fatal, pat);
+}
+// the compile server redirects a request's diagnostics to that client
+static thread_local DiagnosticSink *t_sink = nullptr;
+void setDiagnosticSink(DiagnosticSink *sink) {
+    t_sink = sink;
+}
+static void emitDiagnostic(const std::string &str) {
+    if (t_sink)
+        t_sink->text += str;
+    else
+        fputs(str.c_str(), stderr);
+}
+static int verbosity() {
+    return t_sink ? t_sink->verbosity : g_verbosity;
+}
+void warning(const std::string &str) {
+    emitDiagnostic(str);
+}
+void warning(const char *pat,...) {
+    MKBUF(warning, pat);
+}
+int g_verbosity = 0;
+void verbose(const std::string &str) {
+    if (verbosity() > 0)
+        emitDiagnostic(str);
+}
+void verbose(const char *pat,...) {
+    if (verbosity() > 0) { MKBUF(verbose, pat); }
+}
+void debug(const std::string &str) {
+    if (verbosity() > 1)
+        emitDiagnostic(str);
+}
+void debug(const char *pat,...) {
+    if (verbosity() > 1) { MKBUF(debug, pat); }
+}
+
+
+static void printUsage(FILE *stream) {
+    fprintf(stream,
+        "OpenCL Offline Compiler (" VERSION_STRING ")\n"
+        "usage: %s [OPTS] ARGS\n"
+        "where [OPTS]\n"
+        " -d=DEV          targets device with a substring in it's name\n"
+        " -t=TYPE         targets only devices of a type (cpu, gpu, accel, or all)\n"
+        " -vendor=ID      targets only devices of a vendor (nvidia, intel, amd, or a\n"
+        "                 CL_DEVICE_VENDOR_ID such as 0x10de)\n"
+        " -m              compiles for every matching device instead of requiring one\n"
+        "                 (with -o=STEM outputs are STEM.elf, STEM.ptx, ...)\n"
+        " -b=BUILD-OPTS   adds a build option (e.g. -b=-DTILE=32)\n"
+        " -spec=[NAME=]KERNEL:ARG=VALUE,...  also builds a variant of KERNEL with the\n"
+        "                 arguments replaced by constants (see below)\n"
+        " -fuse=NAME:K1>K2  also builds NAME, the elementwise kernels K1, K2, ...\n"
+        "                 fused into one (see below)\n"
+        " -k=KERNEL       builds only KERNEL and what it uses (repeatable; see below)\n"
+        " -F=FORMAT       bin (one binary per device; the default), archive (one\n"
+        "                 indexed file for all devices), cpp (STEM.cpp and STEM.hpp\n"
+        "                 embedding them), or spv (a device-independent SPIR-V\n"
+        "                 module); see below\n"
+        " -compress       LZ4-compresses the binaries in an archive\n"
+        " --time          prints the time spent in each phase and the peak RSS\n"
+        " --trace=FILE    writes the phases as Chrome trace events (chrome://tracing)\n"
+        " -M              prints the make dependencies of the inputs instead of building\n"
+        " -MD             also writes OUTPUT.d with the make dependencies\n"
+        " -MF=FILE        writes the dependencies of -M or -MD to FILE instead\n"
+        " -MP             adds an empty rule per header (so deleted headers are benign)\n"
+        " --resources[=json]  reports each kernel's work-group limits, local and\n"
+        "                 private memory, estimated occupancy, and a local size\n"
+        " -max-private=SIZE   fails the build if a kernel uses more private memory\n"
+        "                 (a sign of register spills)\n"
+        " -max-local=SIZE fails the build if a kernel uses more local memory\n"
+        " -min-occupancy=PCT  fails the build if a kernel's estimated occupancy is lower\n"
+        " --analyze[=json]    reports each kernel's registers, local (spill) and\n"
+        "                 shared memory, instruction mix, and loops from PTX (see below)\n"
+        " --perf-lint[=error]  warns of slow memory access and conversions in the\n"
+        "                 kernels (=error fails the build instead; see below)\n"
+        " --instrument    adds region counters to every kernel (see below)\n"
+        " --analyze-baseline=FILE  compares with an earlier --analyze=json report\n"
+        " --analyze-exact any change from the --analyze-baseline= fails the run\n"
+        " --stubs=FILE    writes a C++ header with a typed launch wrapper per kernel\n"
+        "                 (see below)\n"
+        " -incremental    compiles each input separately and links the objects;\n"
+        "                 with -cache= only changed inputs are recompiled\n"
+        " --watch         rebuilds whenever an input or an included header changes,\n"
+        "                 keeping the devices and contexts between builds\n"
+        " -q/-v/-v2       quiet/verbose/debug\n"
+        " -h=d            list devices\n"
+        " -h=json         prints the device snapshot (every platform and device) as JSON\n"
+        " --refresh-devices  re-queries the devices instead of using the snapshot\n"
+        " -cache=DIR      reuse binaries from an on-disk cache (also $CLC_CACHE_DIR)\n"
+        " -cache-max=SIZE bounds the cache size (e.g. 512M; default 1G)\n"
+        " -cache-stats    print cache hit/miss counts and size\n"
+        " -batch=FILE     compile each job listed in a manifest (see below)\n"
+        " -j=N            number of concurrent batch jobs (default: hardware threads)\n"
+        " --serve[=SOCK]  run as a resident compile server on a local socket\n"
+        " --server=SOCK   socket of the server to use (also $CLC_SERVER)\n"
+        " --no-server     always compile in-process\n"
+        " -sweep=SPEC     builds a variant per value and keeps the fastest (see below)\n"
+        " -kernel=NAME    kernel that -sweep times\n"
+        " -global=SIZE,.. NDRange to time with (e.g. 1M or 1024x1024; default 1M);\n"
+        "                 --bench tries each size in the list\n"
+        " -local=SIZE,..  work-group sizes to try (default: auto)\n"
+        " -args=SPEC      kernel arguments (default: synthesized; see below)\n"
+        " -iters=N        timed launches per variant or configuration (default 10)\n"
+        " -warmup=N       untimed launches before --bench timing (default 3)\n"
+        " --bench=KERNEL  builds as usual and then benchmarks KERNEL (see below)\n"
+        " --baseline=FILE compares --bench results with a saved baseline\n"
+        " --save-baseline=FILE  records --bench results (may be the --baseline file)\n"
+        " --regress=PCT   median slowdown vs. the baseline that fails (default 10)\n"
+        "[ARGS]           is list of compilation units (.cl files) or one SPIR-V\n"
+        "                 module (.spv); with --analyze, PTX files (.ptx)\n"
+        "\n"
+        "EXAMPLES:\n"
+        " %% clc foo.cl        saves foo.bin as the output for the default device\n"
+        " %% clc -d=Intel ...  selects a device containing \"Intel\" in it's CL_DEVICE_NAME\n"
+        " %% clc -m -t=gpu foo.cl  saves foo.ptx, foo.elf, ... one per GPU\n"
+        "\n"
+        "BATCH MANIFESTS:\n"
+        " Each line of a -batch manifest is a clc command line without the program\n"
+        " name (e.g. -d=Intel -b=-DTILE=32 -o=foo32.bin foo.cl); blank lines and\n"
+        " lines starting with # are skipped.  Jobs run concurrently and share one\n"
+        " context per device (-m jobs one per platform for the same devices).\n"
+        " -sweep, --bench, --stubs, --analyze, --watch, --time, and --trace apply to\n"
+        " a single compile and are rejected in a manifest.\n"
+        "\n"
+        "SWEEPS:\n"
+        " -sweep=TILE:8,16,32 -sweep=VW:1,4 builds all six combinations in parallel,\n"
+        " runs -kernel=... on synthetic buffers with a profiling queue, and ranks the\n"
+        " variants by median kernel time.  The fastest binary is saved as usual and its\n"
+        " build options to OUTPUT.opts.  -sweep=-cl-fast-relaxed-math (no values)\n"
+        " tries the build with and without the option.  -args= lists one entry per\n"
+        " kernel argument: _ (synthesize), float[N], float[N]=V, local:float[N], or\n"
+        " int=V; float[] has one element per work-item.\n"
+        "\n"
+        "BENCHMARKS:\n"
+        " clc --bench=blend2 -global=1M,4M -local=auto,64,256 --baseline=perf.txt\n"
+        " times blend2 in every global/local combination (local sizes that do not\n"
+        " divide the global size are skipped) and reports median and p95 kernel time,\n"
+        " work-items/s, and buffer bandwidth.  The exit status is non-zero if any\n"
+        " configuration fails or its median is more than --regress percent slower\n"
+        " than the baseline (entries are per kernel and device).  Arguments use the\n"
+        " -args= syntax above.\n"
+        "\n"
+        "TEMPLATES:\n"
+        " template <typename T = floatN, int W = 1> before a kernel makes it a\n"
+        " template.  -inst=blend<uchar4>,blend<float4,2> adds blend_uchar4 and\n"
+        " blend_float4_2 with the parameters replaced; if every parameter has a\n"
+        " default the kernel also builds as blend, else only its instantiations do.\n"
+        " A type such as floatN or ucharN becomes the device's preferred vector\n"
+        " width (CL_DEVICE_PREFERRED_VECTOR_WIDTH_*): float8 for one device, float4\n"
+        " for another, each built separately.  -b=-DCLC_FLOATN=float2 fixes it.\n"
+        "\n"
+        "SPECIALIZATION:\n"
+        " -spec=blend2:t=0.5 adds a kernel blend2_t_0_5 to the program: a copy of\n"
+        " blend2 without the t argument, which is instead a local initialized to 0.5,\n"
+        " so the compiler can fold it.  -spec=blend2_half=blend2:t=0.5 names the\n"
+        " variant.  Scalar and vector arguments can be specialized (for vectors\n"
+        " give a literal such as (float4)(0,0,0,1)).\n"
+        "\n"
+        "KERNEL FUSION:\n"
+        " -fuse=pc_rot:popcount>rotateK adds a kernel pc_rot(inp, output) that runs\n"
+        " popcount and then rotateK per work-item, passing the value popcount would\n"
+        " write to output through a private variable instead of global memory.\n"
+        " Each stage must write one global buffer at a single index, which the next\n"
+        " stage reads from its one const global buffer (or updates in place) at the\n"
+        " same index (locals are expanded when comparing indexes).  Kernels with\n"
+        " barriers or local memory are refused.  The originals are kept; add -k= to\n"
+        " build only the fused kernel.\n"
+        "\n"
+        "KERNEL SELECTION:\n"
+        " clc -k=blend2 -k=empty lib.cl builds a program with only those kernels.\n"
+        " The inputs and the headers they include are scanned for the functions,\n"
+        " types, globals, and macros the kernels use, transitively, and the rest is\n"
+        " blanked out (line numbers in the build log are unchanged).  Every build\n"
+        " reports a kernel defined twice (outside alternative #if branches) before\n"
+        " calling the compiler.\n"
+        "\n"
+        "ARCHIVES:\n"
+        " clc -m -F=archive -o=kernels.clcar foo.cl packs the binary of every device,\n"
+        " keyed by CL_DEVICE_NAME and CL_DRIVER_VERSION, with the build options and a\n"
+        " hash of the sources.  Identical binaries are stored once.  Applications\n"
+        " load it with include/clc_archive.hpp, which maps the file, finds the\n"
+        " device's binary by binary search, and builds the source on a miss.\n"
+        "\n"
+        " clc -m -F=cpp -o=kernels.cpp foo.cl instead writes kernels.cpp with each\n"
+        " binary as an aligned array and kernels.hpp declaring kernels::find(dev)\n"
+        " and kernels::createProgram(ctx, dev, &err); linked into the application,\n"
+        " the binaries need no file I/O or path lookup at startup.\n"
+        "\n"
+        "LAUNCH STUBS:\n"
+        " clc --stubs=bits_stubs.hpp bits.cl also builds bits.cl with\n"
+        " -cl-kernel-arg-info and writes a class per kernel (bits_stubs::rotate)\n"
+        " that creates its cl_kernel once and whose operator()(queue, dims, global,\n"
+        " local, output, inp, k) takes cl_mem for buffers and images, cl_int,\n"
+        " cl_float4, ... for values, and a byte count for local memory, then sets\n"
+        " each argument by index with a fixed size and enqueues.\n"
+        "\n"
+        "PTX ANALYSIS:\n"
+        " clc --analyze -d=nvidia foo.cl reads the PTX the driver returns and prints\n"
+        " per kernel the virtual registers it declares (in 32-bit units; ptxas\n"
+        " allocates from these), .local bytes (spills and private arrays), .shared\n"
+        " bytes, the instruction mix, and each loop's body and constant trip count,\n"
+        " with an estimate of the instructions a work-item executes.  Given only\n"
+        " .ptx files (clc --analyze foo.ptx) no device is needed.  Save a report with\n"
+        " --analyze=json and pass it to --analyze-baseline= to list what changed;\n"
+        " more registers or local memory than the baseline fails the run\n"
+        " (--analyze-exact fails it on any change, e.g. to test a checked-in report).\n"
+        "\n"
+        "PERFORMANCE LINT:\n"
+        " clc --perf-lint foo.cl reports, per kernel and with the line:\n"
+        "  - global accesses at an index made only of constants, scalar arguments,\n"
+        "    and get_global_size() and the like (every work-item reads or writes\n"
+        "    the same element; macros and calls are not judged), or at\n"
+        "    get_global_id(0) times a stride (neighbours are not coalesced)\n"
+        "  - global pointers that are only read but not const, or not restrict\n"
+        "  - local memory strides that hit the same banks (an even stride of\n"
+        "    get_local_id(0), or a column of a [N][16k] array)\n"
+        "  - conversions: convert_T() and casts in loops, double constants such\n"
+        "    as 0.5 for 0.5f, and integer vectors passed to mix(), sqrt(), ...\n"
+        " Indexes are analyzed with the locals they use expanded.  With\n"
+        " --perf-lint=error any finding fails the build.\n"
+        "\n"
+        "INSTRUMENTATION:\n"
+        " clc --instrument --bench=blend2 blend.cl counts, per launch, how often each\n"
+        " loop body, barrier, and statement after #pragma clc region NAME runs, and\n"
+        " prints the counts after the timings.  Each kernel gets a last argument,\n"
+        " global uint *__clc_counters, with four uints per region (the count and\n"
+        " clock ticks, each as a 64-bit lo, hi pair; the regions are listed as\n"
+        " //@clc-region comments in the generated source).  Work-items count in\n"
+        " private variables and add their totals atomically before returning.  Ticks\n"
+        " come from %%globaltimer on NVIDIA, from -b='-DCLC_READ_CLOCK(t)=...' if\n"
+        " given, and are otherwise 0; the counts work on any device, CPUs included.\n"
+        "\n"
+        "SPIR-V:\n"
+        " clc -F=spv foo.cl runs the OpenCL C front end once and saves foo.spv; it\n"
+        " needs a clang that targets spirv64 (or $CLC_SPIRV_FRONTEND naming one) and\n"
+        " passes it the -b= options.  clc -m foo.spv then builds the module for each\n"
+        " device with clCreateProgramWithIL, so every device and option set skips\n"
+        " the parse.  Devices whose CL_DEVICE_IL_VERSION lacks SPIR-V are refused.\n"
+        "\n"
+        "DEVICE SNAPSHOT:\n"
+        " Device properties are queried once and kept in devices.json in the -cache=\n"
+        " directory (or ~/.cache/clc); -d=, -t=, and -vendor= are matched against it\n"
+        " and only the chosen device's platform is enumerated.  The snapshot is\n"
+        " recaptured when the ICD loader, an ICD registration, or a driver library\n"
+        " changes.\n"
+        "\n"
+        "COMPILE SERVER:\n"
+        " clc --serve keeps platforms, contexts, and recently built binaries warm.\n"
+        " Other clc invocations forward their arguments and sources to it when the\n"
+        " socket (default $XDG_RUNTIME_DIR/clc.sock, else /tmp/clc-$UID/server.sock)\n"
+        " exists and otherwise compile in-process.  A socket or server owned by\n"
+        " another user is refused, and the server only supplies the binaries: the\n"
+        " client names and writes the outputs itself.\n"
+        "",
+        g_exe.c_str());
+
+}
+
+Opts parseOpts(int argc, const char **argv, bool exitOnError)
+{
+    int ai = 0;
+    auto argpfx = [&](const char *pfx) {
+        return (strncmp(argv[ai], pfx, strlen(pfx)) == 0);
+    };
+    auto argeq = [&](const char *pfx) {
+        return (strcmp(argv[ai], pfx) == 0);
+    };
+    auto badArg = [&](const char *msg) {
+        if (!exitOnError) {
+            fatal("%s: %s", argv[ai], msg);
+        }
+        std::string str = argv[ai];
+        str = str + ": " + msg + "\n";
+        fatalMessage(str);
+        printUsage(stderr);
+        exit(EXIT_FAILURE);
+    };
+
+    Opts opts;
+    if (const char *dir = getenv("CLC_CACHE_DIR")) {
+        opts.cacheDir = dir;
+    }
+    if (const char *sock = getenv("CLC_SERVER")) {
+        opts.serverSocket = sock;
+    }
+    for (; ai < argc;) {
+        if (argeq("--help") || argeq("-h")) {
+            if (!exitOnError) {
+                fatal("%s: not supported here", argv[ai]);
+            }
+            printUsage(stdout);
+            exit(EXIT_SUCCESS);
+
+        } else if (argeq("-h=d")) {
+            opts.listDevices = true;
+            ai++;
+        } else if (argeq("-h=json")) {
+            opts.listDevices = true;
+            opts.listJson = true;
+            ai++;
+        } else if (argeq("--refresh-devices")) {
+            opts.refreshDevices = true;
+            ai++;
+
+        // verbosity
+        } else if (argeq("-q") || argeq("-v-1") || argeq("-v=-1")) {
+            opts.verbosity = -1;
+            ai++;
+        } else if (argeq("-v") || argeq("-v1") || argeq("-v=1")) {
+            opts.verbosity = 1;
+            ai++;
+        } else if (argeq("-v2") || argeq("-v=2")) {
+            opts.verbosity = 2;
+            ai++;
+        // -vendor= shares a prefix with -v
+        } else if (argpfx("-vendor=")) {
+            const char *str = argv[ai] + 8;
+            if (strcmp(str, "nvidia") == 0) {
+                opts.vendorId = 0x10de;
+            } else if (strcmp(str, "intel") == 0) {
+                opts.vendorId = 0x8086;
+            } else if (strcmp(str, "amd") == 0) {
+                opts.vendorId = 0x1002;
+            } else {
+                char *end = nullptr;
+                opts.vendorId = (cl_uint)strtoul(str, &end, 0);
+                if (end == str || *end || opts.vendorId == 0) {
+                    badArg("expected nvidia, intel, amd, or a CL_DEVICE_VENDOR_ID (e.g. 0x10de)");
+                }
+            }
+            ai++;
+        } else if (argpfx("-v")) {
+            badArg("unexpected verbosity option");
+
+        // batch mode (-batch shares a prefix with -b)
+        } else if (argpfx("-batch=")) {
+            if (opts.batchFile.length() > 0) {
+                badArg("argument respecified");
+            }
+            opts.batchFile = argv[ai] + 7;
+            ai++;
+        } else if (argpfx("-batch")) {
+            badArg("must be of the form -batch=...");
+        } else if (argpfx("-j=")) {
+            char *end = nullptr;
+            opts.jobs = (int)strtol(argv[ai] + 3, &end, 10);
+            if (*end || opts.jobs <= 0) {
+                badArg("expected positive integer");
+            }
+            ai++;
+        } else if (argpfx("-j")) {
+            badArg("must be of the form -j=...");
+
+        // build options
+        } else if (argpfx("-b=")) {
+            opts.buildOpts.emplace_back(argv[ai] + 3);
+            ai++;
+        } else if (argpfx("-b")) {
+            badArg("must be of the form -b=...");
+        } else if (argpfx("-spec=")) {
+            opts.specs.emplace_back(argv[ai] + 6);
+            ai++;
+        } else if (argpfx("-inst=")) {
+            opts.instantiations.emplace_back(argv[ai] + 6);
+            ai++;
+        } else if (argpfx("-fuse=")) {
+            opts.fusions.emplace_back(argv[ai] + 6);
+            ai++;
+        } else if (argpfx("-k=")) {
+            std::string k = argv[ai] + 3;
+            if (!isIdentifier(k)) {
+                badArg("expected a kernel name");
+            }
+            opts.selectKernels.push_back(k);
+            ai++;
+
+        // -d=device selection
+        } else if (argpfx("-d=")) {
+            const char *str = argv[ai] + 3;
+            if (opts.device.length() > 0) {
+                badArg("argument respecified");
+            }
+            opts.device = str;
+            ai++;
+        } else if (argpfx("-d")) {
+            badArg("must be of the form -d=...");
+        } else if (argpfx("-t=")) {
+            const char *str = argv[ai] + 3;
+            if (strcmp(str, "cpu") == 0) {
+                opts.deviceType = CL_DEVICE_TYPE_CPU;
+            } else if (strcmp(str, "gpu") == 0) {
+                opts.deviceType = CL_DEVICE_TYPE_GPU;
+            } else if (strcmp(str, "accel") == 0) {
+                opts.deviceType = CL_DEVICE_TYPE_ACCELERATOR;
+            } else if (strcmp(str, "all") == 0) {
+                opts.deviceType = CL_DEVICE_TYPE_ALL;
+            } else {
+                badArg("expected cpu, gpu, accel, or all");
+            }
+            ai++;
+        } else if (argpfx("-t")) {
+            badArg("must be of the form -t=...");
+
+        } else if (argeq("-m")) {
+            opts.multiDevice = true;
+            ai++;
+        // phase timing
+        } else if (argeq("--time")) {
+            opts.time = true;
+            ai++;
+        } else if (argpfx("--trace=")) {
+            opts.traceFile = argv[ai] + 8;
+            ai++;
+
+        // -M... dependency output
+        } else if (argeq("-M")) {
+            opts.depsOnly = true;
+            ai++;
+        } else if (argeq("-MD")) {
+            opts.depfile = true;
+            ai++;
+        } else if (argpfx("-MF=")) {
+            opts.depfilePath = argv[ai] + 4;
+            ai++;
+        } else if (argeq("-MP")) {
+            opts.depPhony = true;
+            ai++;
+        } else if (argpfx("-M")) {
+            badArg("expected -M, -MD, -MF=..., or -MP");
+
+        // -F=... output format
+        } else if (argpfx("-F=")) {
+            opts.format = argv[ai] + 3;
+            if (opts.format == "bin") {
+                opts.format.clear();
+            } else if (opts.format != "archive" && opts.format != "cpp" &&
+                opts.format != "spv")
+            {
+                badArg("expected bin, archive, cpp, or spv");
+            }
+            ai++;
+        } else if (argeq("-compress")) {
+            opts.compress = true;
+            ai++;
+
+        // kernel resource report and limits
+        } else if (argeq("--resources")) {
+            opts.resources = "table";
+            ai++;
+        } else if (argeq("--resources=json")) {
+            opts.resources = "json";
+            ai++;
+        } else if (argpfx("--resources")) {
+            badArg("expected --resources or --resources=json");
+        } else if (argeq("--analyze")) {
+            opts.analyze = "table";
+            ai++;
+        } else if (argeq("--analyze=json")) {
+            opts.analyze = "json";
+            ai++;
+        } else if (argpfx("--analyze-baseline=")) {
+            opts.analyzeBaseline = argv[ai] + 19;
+            if (opts.analyzeBaseline.empty()) {
+                badArg("expected a file");
+            }
+            ai++;
+        } else if (argeq("--analyze-exact")) {
+            opts.analyzeExact = true;
+            ai++;
+        } else if (argpfx("--analyze")) {
+            badArg("expected --analyze or --analyze=json");
+        } else if (argeq("--perf-lint")) {
+            opts.perfLint = "warn";
+            ai++;
+        } else if (argeq("--perf-lint=error")) {
+            opts.perfLint = "error";
+            ai++;
+        } else if (argpfx("--perf-lint")) {
+            badArg("expected --perf-lint or --perf-lint=error");
+        } else if (argeq("--instrument")) {
+            opts.instrument = true;
+            ai++;
+        } else if (argpfx("-max-private=")) {
+            if (!parseByteSize(argv[ai] + 13, opts.maxPrivateBytes)) {
+                badArg("malformed size");
+            }
+            ai++;
+        } else if (argpfx("-max-local=")) {
+            if (!parseByteSize(argv[ai] + 11, opts.maxLocalBytes)) {
+                badArg("malformed size");
+            }
+            ai++;
+        } else if (argpfx("-min-occupancy=")) {
+            char *end = nullptr;
+            opts.minOccupancy = strtod(argv[ai] + 15, &end);
+            if (*end == '%')
+                end++;
+            if (*end || opts.minOccupancy < 0.0 || opts.minOccupancy > 100.0) {
+                badArg("expected a percentage (e.g. 50 or 50%)");
+            }
+            ai++;
+
+        } else if (argpfx("--stubs=")) {
+            opts.stubs = argv[ai] + 8;
+            ai++;
+        } else if (argpfx("--stubs")) {
+            badArg("must be of the form --stubs=FILE");
+
+        } else if (argeq("-incremental")) {
+            opts.incremental = true;
+            ai++;
+        } else if (argeq("--watch")) {
+            opts.watch = true;
+            ai++;
+
+        // -cache=... binary cache
+        } else if (argpfx("-cache=")) {
+            opts.cacheDir = argv[ai] + 7;
+            ai++;
+        } else if (argpfx("-cache-max=")) {
+            if (!parseByteSize(argv[ai] + 11, opts.cacheMaxBytes)) {
+                badArg("malformed size");
+            }
+            ai++;
+        } else if (argeq("-cache-stats")) {
+            opts.cacheStats = true;
+            ai++;
+        } else if (argpfx("-cache")) {
+            badArg("must be of the form -cache=..., -cache-max=..., or -cache-stats");
+
+        // -sweep=... autotuning
+        } else if (argpfx("-sweep=")) {
+            opts.sweeps.emplace_back(argv[ai] + 7);
+            ai++;
+        } else if (argpfx("-sweep")) {
+            badArg("must be of the form -sweep=...");
+        } else if (argpfx("-kernel=")) {
+            opts.kernel = argv[ai] + 8;
+            ai++;
+        } else if (argpfx("-global=")) {
+            opts.globalSize = argv[ai] + 8;
+            ai++;
+        } else if (argpfx("-local=")) {
+            opts.localSize = argv[ai] + 7;
+            ai++;
+        } else if (argpfx("-args=")) {
+            opts.kernelArgs = argv[ai] + 6;
+            ai++;
+        } else if (argpfx("-iters=")) {
+            char *end = nullptr;
+            opts.iterations = (int)strtol(argv[ai] + 7, &end, 10);
+            if (*end || opts.iterations <= 0) {
+                badArg("expected positive integer");
+            }
+            ai++;
+        } else if (argpfx("-warmup=")) {
+            char *end = nullptr;
+            opts.benchWarmup = (int)strtol(argv[ai] + 8, &end, 10);
+            if (*end || opts.benchWarmup < 0) {
+                badArg("expected non-negative integer");
+            }
+            ai++;
+
+        // --bench=... kernel benchmarks
+        } else if (argpfx("--bench=")) {
+            opts.bench = argv[ai] + 8;
+            ai++;
+        } else if (argpfx("--baseline=")) {
+            opts.benchBaseline = argv[ai] + 11;
+            ai++;
+        } else if (argpfx("--save-baseline=")) {
+            opts.benchSave = argv[ai] + 16;
+            ai++;
+        } else if (argpfx("--regress=")) {
+            char *end = nullptr;
+            opts.benchThreshold = strtod(argv[ai] + 10, &end);
+            if (*end == '%')
+                end++;
+            if (*end || opts.benchThreshold < 0.0) {
+                badArg("expected a percentage (e.g. 10 or 10%)");
+            }
+            ai++;
+
+        } else if (argpfx("-o=")) {
+            if (opts.output.length() > 0) {
+                badArg("argument respecified");
+            }
+            opts.output = argv[ai] + 3;
+            ai++;
+        } else if (argpfx("-o")) {
+            badArg("must be of the form -o=...");
+
+        // compile server
+        } else if (argeq("--serve")) {
+            opts.serve = true;
+            ai++;
+        } else if (argpfx("--serve=")) {
+            opts.serve = true;
+            opts.serverSocket = argv[ai] + 8;
+            ai++;
+        } else if (argpfx("--server=")) {
+            opts.serverSocket = argv[ai] + 9;
+            ai++;
+        } else if (argeq("--no-server")) {
+            opts.noServer = true;
+            ai++;
+
+        } else if (!argeq("-") && argpfx("-")) {
+            // - is output
+            badArg("unexpected option");
+        } else {
+            opts.args.emplace_back(argv[ai++]);
+        }
+    }
+    return opts;
+}
+
+
+static std::string readTextStream(
+    const std::string &streamName,
+    FILE *f)
+{
+    std::string s;
+    char buf[64 * 1024];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+        s.append(buf, n);
+    if (ferror(f)) {
+        fatal("%s: error reading", streamName.c_str());
+    }
+    return s;
+}
+
+std::string readTextFile(
+    const std::string &fileName)
+{
+    FILE *f = fopen(fileName.c_str(), "rb");
+    if (f == nullptr) {
+        fatal("%s: failed to open file", fileName.c_str());
+    }
+    std::unique_ptr<FILE,int(*)(FILE *)> closer(f, fclose);
+    return readTextStream(fileName, f);
+}
+
+SourceText readSource(
+    const std::string &fileName)
+{
+    if (fileName == "-")
+        return SourceText(readTextStream("stdin", stdin));
+    auto file = std::make_shared<MappedFile>();
+    if (file->open(fileName))
+        return SourceText(std::shared_ptr<const MappedFile>(file));
+    // a pipe (e.g. <(generate-kernels)) or a device
+    return SourceText(readTextFile(fileName));
+}
+
+void writeBinary(
+    const std::string &streamName, const void *bits, size_t bitsLen)
+{
+    TRACE_SCOPE("write output", streamName.c_str());
+    if (streamName.length() == 0) {
+// have to use stdio here since C++ will not let us output binary
+#ifdef _WIN32
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+        if (fwrite(bits, 1, bitsLen, stdout) < bitsLen || fflush(stdout) != 0) {
+            fatal("failed to write entire output");
+        }
+        return;
+    }
+    uint64_t size;
+    int64_t mtime;
+    if (isRegularFile(streamName) || !fileStat(streamName, size, mtime)) {
+        if (!writeFileAtomic(streamName, bits, bitsLen)) {
+            fatal("%s: error writing", streamName.c_str());
+        }
+    } else {
+        // a device such as /dev/null cannot be replaced by a rename
+        FILE *f = fopen(streamName.c_str(), "wb");
+        if (f == nullptr) {
+            fatal("%s: failed to open output file", streamName.c_str());
+        }
+        bool ok = fwrite(bits, 1, bitsLen, f) == bitsLen;
+        if (fclose(f) != 0 || !ok) {
+            fatal("%s: error writing", streamName.c_str());
+        }
+    }
+}
+
+// foo/bar/baz/foo.cl -> foo
+static std::string outputStem(const Opts &opts)
+{
+    std::string filename;
+    if (opts.args[0] == "--") {
+        filename = "stdin";
+    } else {
+        auto arg0 = opts.args[0];
+        auto fslash = arg0.rfind('/');
+        auto bslash = arg0.rfind('\\');
+        if (fslash != std::string::npos) {
+            // foo/bar/baz/foo.cl
+            //            ^
+            filename = arg0.substr(fslash+1);
+        } else if (bslash != std::string::npos) {
+            // foo\\bar\\baz\\foo.cl
+            //              ^^
+            filename = arg0.substr(bslash+1);
+        } else {
+            // foo.cl
+            filename = arg0;
+        }
+        // foo.spv -> foo, so that clc -m foo.spv saves foo.elf, ...
+        if (filename.size() > 4 && filename.compare(filename.size() - 4, 4, ".spv") == 0)
+            filename.resize(filename.size() - 4);
+        auto ext = filename.rfind(".cl");
+        if (ext != std::string::npos) {
+            filename = filename.substr(0, ext); // foo.cl -> foo
+        }
+    }
+    return filename;
+}
+
+// the vendor-specific extension: ptx, elf, or e.g. 1002bin
+static std::string outputExtension(const cl::Device &dev)
+{
+    std::stringstream ss;
+    if (dev.getInfo<CL_DEVICE_VENDOR_ID>() == 0x10de) {
+        ss << "ptx";
+    } else if (dev.getInfo<CL_DEVICE_VENDOR_ID>() == 0x8086) {
+        ss << "elf";
+    } else {
+        ss << std::hex << std::setfill('0') << std::setw(4) << dev.getInfo<CL_DEVICE_VENDOR_ID>();
+        ss << "bin";
+    }
+    return ss.str();
+}
+
+// "Intel(R) HD Graphics 630" -> "Intel_R_HD_Graphics_630"
+static std::string deviceFileTag(const cl::Device &dev)
+{
+    std::string tag;
+    for (char c : dev.getInfo<CL_DEVICE_NAME>()) {
+        if (isalnum((unsigned char)c) || c == '-') {
+            tag += c;
+        } else if (!tag.empty() && tag.back() != '_') {
+            tag += '_';
+        }
+    }
+    while (!tag.empty() && tag.back() == '_')
+        tag.pop_back();
+    return tag.empty() ? "device" : tag;
+}
+
+std::vector<std::string> outputPaths(
+    const Opts &opts, const std::vector<cl::Device> &devs)
+{
+    if (opts.format == "archive") {
+        std::string path = opts.output.length() > 0 ? opts.output : outputStem(opts) + ".clcar";
+        return std::vector<std::string>(devs.size(), path);
+    }
+    if (opts.format == "cpp") {
+        if (opts.output == "--") {
+            fatal("-F=cpp: writes a header and a source file; name them with -o=FILE.cpp");
+        }
+        std::string path = opts.output.length() > 0 ? opts.output : outputStem(opts) + ".cpp";
+        return std::vector<std::string>(devs.size(), path);
+    }
+    if (!opts.multiDevice && opts.output.length() > 0)
+        return std::vector<std::string>(devs.size(), opts.output);
+    if (opts.multiDevice && opts.output == "--") {
+        fatal("-o=--: stdout output cannot hold binaries for multiple devices");
+    }
+
+    // foo -> foo.elf; in multi-device mode -o= names the stem and devices
+    // sharing an extension are told apart by name (foo.Intel_R_HD_630.elf)
+    std::string stem = opts.output.length() > 0 ? opts.output : outputStem(opts);
+    std::vector<std::string> exts;
+    for (const auto &d : devs)
+        exts.push_back(outputExtension(d));
+
+    std::vector<std::string> paths;
+    for (size_t i = 0; i < devs.size(); i++) {
+        bool shared = std::count(exts.begin(), exts.end(), exts[i]) > 1;
+        paths.push_back(shared ?
+            stem + "." + deviceFileTag(devs[i]) + "." + exts[i] :
+            stem + "." + exts[i]);
+    }
+    for (size_t i = 0; i < paths.size(); i++) {
+        for (size_t k = i + 1; k < paths.size(); k++) {
+            if (paths[i] == paths[k]) {
+                // e.g. two identical cards; keep the names unique
+                std::stringstream ss;
+                ss << stem << "." << deviceFileTag(devs[k]) << "." << k << "." << exts[k];
+                paths[k] = ss.str();
+            }
+        }
+    }
+    return paths;
+}
+
+std::string intermediatePath(const Opts &opts)
+{
+    return opts.output.length() > 0 ? opts.output : outputStem(opts) + ".spv";
+}
+
+std::vector<std::string> outputTargets(
+    const Opts &opts, const std::vector<cl::Device> &devs)
+{
+    std::vector<std::string> targets;
+    for (const auto &p : outputPaths(opts, devs)) {
+        if (std::find(targets.begin(), targets.end(), p) == targets.end())
+            targets.push_back(p);
+    }
+    if (opts.format == "cpp" && !targets.empty())
+        targets.push_back(embedHeaderPath(targets[0]));
+    return targets;
+}
+
+std::vector<SourceText> readSources(const Opts &opts, bool mapFiles)
+{
+    TRACE_SCOPE("read sources");
+    if (opts.args.empty()) {
+        fatal("expected input argument");
+    }
+    std::vector<SourceText> sourceStrs;
+    for (auto &f : opts.args) {
+        if (mapFiles || f == "-")
+            sourceStrs.push_back(readSource(f));
+        else
+            sourceStrs.push_back(SourceText(readTextFile(f)));
+        bool il = isSpirv(sourceStrs.back());
+        if (!il && f.size() > 4 && f.compare(f.size() - 4, 4, ".spv") == 0) {
+            fatal("%s: not a SPIR-V module", f.c_str());
+        }
+        if (il && opts.args.size() > 1) {
+            fatal("%s: a SPIR-V module must be the only input (link modules first)",
+                f.c_str());
+        }
+        if (il && !opts.specs.empty()) {
+            fatal("%s: -spec= rewrites OpenCL C and cannot apply to SPIR-V", f.c_str());
+        }
+    }
+    // here so that every mode (batch, sweep, --watch, the server's
+    // client) builds the variants
+    applyTemplates(opts, sourceStrs);
+    applySpecializations(opts, sourceStrs);
+    applyFusions(opts, sourceStrs);
+    pruneToKernels(opts, sourceStrs);
+    checkDuplicateKernels(opts, sourceStrs);
+    perfLint(opts, sourceStrs);
+    applyInstrumentation(opts, sourceStrs);
+    return sourceStrs;
+}
+
+void reportBuildLog(const cl::Program &prog, const cl::Device &dev, size_t numDevs)
+{
+    auto bl = prog.getBuildInfo<CL_PROGRAM_BUILD_LOG>(dev);
+    std::string who = numDevs > 1 ? " for " + dev.getInfo<CL_DEVICE_NAME>() : "";
+    if (bl.find("warning") != std::string::npos) {
+        warning("warnings during build%s:\n%s", who.c_str(), bl.c_str());
+    } else {
+        verbose("build log%s:\n%s", who.c_str(), bl.c_str());
+    }
+}
+
+std::vector<std::vector<char>> programBinaries(
+    const cl::Program &prog, const std::vector<cl::Device> &devs)
+{
+    TRACE_SCOPE("fetch binaries");
+    // the program spans every device in the context (in CL_PROGRAM_DEVICES
+    // order), so devices it was not built for report size 0
+    std::vector<cl::Device> progDevs = prog.getInfo<CL_PROGRAM_DEVICES>();
+    std::vector<size_t> binSizes =
+        prog.getInfo<CL_PROGRAM_BINARY_SIZES>();
+    std::vector<std::vector<char>> binBufs(binSizes.size());
+    std::vector<char *> binPtrs;
+    for (size_t i = 0; i < binSizes.size(); i++) {
+        binBufs[i].resize(binSizes[i]);
+        binPtrs.push_back(binSizes[i] ? binBufs[i].data() : nullptr);
+    }
+    try {
+        prog.getInfo(CL_PROGRAM_BINARIES, &binPtrs);
+    } catch (const cl::Error &err) {
+        fatal("clGetProgramInfo(..CL_PROGRAM_BINARIES..): %s (%s)",
+            err.what(), clErrStr(err.err()).c_str());
+    }
+
+    std::vector<std::vector<char>> bits(devs.size());
+    for (size_t i = 0; i < devs.size(); i++) {
+        for (size_t k = 0; k < progDevs.size(); k++) {
+            if (progDevs[k]() == devs[i]())
+                bits[i].swap(binBufs[k]);
+        }
+        if (bits[i].empty()) {
+            fatal("%s: driver returned an empty binary",
+                devs[i].getInfo<CL_DEVICE_NAME>().c_str());
+        }
+    }
+    return bits;
+}
+
+// the key of dev's binary; the vector widths buildProgram adds are part
+// of it (and already in opts.buildOpts once buildProgram has added them)
+static std::string deviceCacheKey(
+    const Opts &opts, const std::vector<SourceText> &sourceStrs, const cl::Device &dev)
+{
+    std::vector<std::string> buildOpts = opts.buildOpts;
+    auto widths = vectorWidthOptions(opts, sourceStrs, dev);
+    if (!widths.empty())
+        buildOpts.push_back(widths);
+    bool incremental = opts.incremental && !isSpirvProgram(sourceStrs);
+    return binaryCacheKey(dev, opts.args, sourceStrs, buildOpts,
+        incremental ? "linked" : nullptr);
+}
+
+bool lookupBinary(
+    const Opts &opts,
+    const std::vector<SourceText> &sourceStrs,
+    const cl::Device &dev,
+    const BinaryCache *cache,
+    DeviceBinary &bin,
+    std::string *keyOut)
+{
+    if (!cache)
+        return false;
+    auto key = deviceCacheKey(opts, sourceStrs, dev);
+    if (keyOut)
+        *keyOut = key;
+    if (!cache->lookup(key, bin.bits))
+        return false;
+    verbose("cache hit %s\n", key.c_str());
+    bin.device = dev;
+    return true;
+}
+
+std::vector<DeviceBinary> buildProgram(
+    const Opts &opts,
+    const std::vector<SourceText> &sourceStrs,
+    const std::vector<cl::Device> &devs,
+    const cl::Context &ctx,
+    const BinaryCache *cache,
+    const std::vector<std::string> *missedKeys)
+{
+    // devices that prefer different vector widths build the templates'
+    // CLC_*N types separately (the -D is then in the options and the key)
+    std::vector<std::string> widths;
+    std::vector<std::vector<cl::Device>> byWidth;
+    std::vector<std::vector<std::string>> keysByWidth;
+    for (size_t i = 0; i < devs.size(); i++) {
+        auto w = vectorWidthOptions(opts, sourceStrs, devs[i]);
+        auto itr = std::find(widths.begin(), widths.end(), w);
+        size_t g = itr - widths.begin();
+        if (itr == widths.end()) {
+            widths.push_back(w);
+            byWidth.emplace_back();
+            keysByWidth.emplace_back();
+        }
+        byWidth[g].push_back(devs[i]);
+        if (missedKeys)
+            keysByWidth[g].push_back((*missedKeys)[i]);
+    }
+    if (!widths.empty() && !(widths.size() == 1 && widths[0].empty())) {
+        std::vector<DeviceBinary> bins;
+        for (size_t g = 0; g < widths.size(); g++) {
+            Opts wopts = opts;
+            if (!widths[g].empty()) {
+                verbose("%s: %s\n", byWidth[g][0].getInfo<CL_DEVICE_NAME>().c_str(),
+                    widths[g].c_str());
+                wopts.buildOpts.push_back(widths[g]);
+            }
+            for (auto &b : buildProgram(wopts, sourceStrs, byWidth[g], ctx, cache,
+                    missedKeys ? &keysByWidth[g] : nullptr))
+            {
+                bins.push_back(std::move(b));
+            }
+        }
+        // in devs order
+        std::vector<DeviceBinary> ordered;
+        for (const auto &d : devs) {
+            for (auto &b : bins) {
+                if (b.device() == d())
+                    ordered.push_back(std::move(b));
+            }
+        }
+        return ordered;
+    }
+
+    std::string buildOpts = normalizeBuildOptions(opts.buildOpts);
+
+    std::vector<DeviceBinary> bins(devs.size());
+    std::vector<std::string> cacheKeys(devs.size());
+    // a module is a single unit; there is nothing to compile separately
+    bool incremental = opts.incremental && !isSpirvProgram(sourceStrs);
+
+    // a cache hit skips the build for that device entirely
+    std::vector<cl::Device> buildDevs;
+    std::vector<size_t> buildIxs;
+    for (size_t i = 0; i < devs.size(); i++) {
+        bins[i].device = devs[i];
+        if (cache && missedKeys) {
+            cacheKeys[i] = (*missedKeys)[i];
+        } else if (cache) {
+            cacheKeys[i] = deviceCacheKey(opts, sourceStrs, devs[i]);
+            if (cache->lookup(cacheKeys[i], bins[i].bits)) {
+                verbose("cache hit %s\n", cacheKeys[i].c_str());
+                continue;
+            }
+        }
+        buildDevs.push_back(devs[i]);
+        buildIxs.push_back(i);
+    }
+    if (buildDevs.empty())
+        return bins;
+
+    std::vector<std::vector<char>> built;
+    if (incremental) {
+        built = compileAndLink(opts, sourceStrs, buildDevs, ctx, cache);
+    } else {
+        // create the program
+        cl::Program prog = createProgram(ctx, sourceStrs, buildDevs);
+        // build it
+        try {
+            // attempt to build the program
+            TRACE_SCOPE("build");
+            prog.build(buildDevs, buildOpts.c_str());
+            for (auto &d : buildDevs)
+                reportBuildLog(prog, d, buildDevs.size());
+        } catch (const cl::Error &err) {
+            std::stringstream ss;
+            for (auto &d : buildDevs) {
+                if (buildDevs.size() > 1)
+                    ss << d.getInfo<CL_DEVICE_NAME>() << ":\n";
+                ss << prog.getBuildInfo<CL_PROGRAM_BUILD_LOG>(d);
+            }
+            fatal("during build: %s (%s):\n%s",
+                err.what(), clErrStr(err.err()).c_str(), ss.str().c_str());
+        }
+        built = programBinaries(prog, buildDevs);
+    }
+
+    for (size_t k = 0; k < buildIxs.size(); k++) {
+        size_t i = buildIxs[k];
+        bins[i].bits.swap(built[k]);
+        if (cache) {
+            cache->store(cacheKeys[i], bins[i].bits.data(), bins[i].bits.size());
+        }
+    }
+    return bins;
+}
+
+std::vector<DeviceBinary> buildProgramOnDevices(
+    const Opts &opts,
+    const std::vector<SourceText> &sourceStrs,
+    const std::vector<cl::Device> &devs,
+    const BinaryCache *cache,
+    std::map<cl_platform_id,cl::Context> *contexts)
+{
+    // a program (and its context) cannot span platforms; build one per
+    // platform and run those builds concurrently
+    std::vector<cl_platform_id> platforms;
+    std::vector<std::vector<cl::Device>> groups;
+    for (const auto &d : devs) {
+        auto p = d.getInfo<CL_DEVICE_PLATFORM>();
+        auto itr = std::find(platforms.begin(), platforms.end(), p);
+        if (itr == platforms.end()) {
+            platforms.push_back(p);
+            groups.emplace_back();
+            groups.back().push_back(d);
+        } else {
+            groups[itr - platforms.begin()].push_back(d);
+        }
+    }
+
+    std::vector<cl::Context> ctxs(groups.size());
+    if (contexts) {
+        for (size_t i = 0; i < groups.size(); i++) {
+            auto itr = contexts->find(platforms[i]);
+            if (itr != contexts->end())
+                ctxs[i] = itr->second;
+        }
+    }
+    std::vector<std::vector<DeviceBinary>> results(groups.size());
+    std::vector<std::string> errors(groups.size());
+    auto buildGroup = [&](size_t i) {
+        try {
+            // a platform whose devices all hit the cache needs no context
+            std::vector<cl::Device> misses;
+            std::vector<std::string> missedKeys;
+            for (const auto &d : groups[i]) {
+                DeviceBinary bin;
+                std::string key;
+                if (lookupBinary(opts, sourceStrs, d, cache, bin, &key)) {
+                    results[i].push_back(std::move(bin));
+                } else {
+                    misses.push_back(d);
+                    missedKeys.push_back(key);
+                }
+            }
+            if (misses.empty())
+                return;
+            if (ctxs[i]() == nullptr) {
+                TRACE_SCOPE("create context");
+                ctxs[i] = cl::Context(groups[i]);
+            }
+            for (auto &b : buildProgram(opts, sourceStrs, misses, ctxs[i], cache,
+                    cache ? &missedKeys : nullptr))
+                results[i].push_back(std::move(b));
+        } catch (const FatalError &err) {
+            errors[i] = err.what();
+        } catch (const cl::Error &err) {
+            errors[i] = std::string(err.what()) + " (" + clErrStr(err.err()) + ")";
+        }
+    };
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < groups.size(); i++)
+        threads.emplace_back(buildGroup, i);
+    buildGroup(0);
+    for (auto &t : threads)
+        t.join();
+    if (contexts) {
+        for (size_t i = 0; i < groups.size(); i++) {
+            if (ctxs[i]() != nullptr)
+                (*contexts)[platforms[i]] = ctxs[i];
+        }
+    }
+
+    std::string allErrors;
+    for (const auto &e : errors) {
+        if (!e.empty())
+            allErrors += (allErrors.empty() ? "" : "\n") + e;
+    }
+    if (!allErrors.empty())
+        fatal(allErrors);
+
+    // restore the caller's device order
+    std::vector<DeviceBinary> bins;
+    for (const auto &d : devs) {
+        for (auto &r : results) {
+            for (auto &b : r) {
+                if (b.device() == d())
+                    bins.push_back(b);
+            }
+        }
+    }
+    return bins;
+}
+
+void saveBinaries(
+    const Opts &opts,
+    const std::vector<DeviceBinary> &bins,
+    const std::vector<SourceText> &sourceStrs)
+{
+    std::vector<cl::Device> devs;
+    for (const auto &b : bins)
+        devs.push_back(b.device);
+    auto outputs = outputPaths(opts, devs);
+    if (opts.format == "archive") {
+        auto image = archiveImage(opts, bins, sourceStrs);
+        verbose("saving archive to %s\n", outputs[0] == "--" ? "stdout" : outputs[0].c_str());
+        writeBinary(outputs[0] == "--" ? "" : outputs[0], image.data(), image.size());
+        return;
+    }
+    if (opts.format == "cpp") {
+        for (const auto &f : embeddedSources(opts, bins, outputs[0])) {
+            verbose("saving %s\n", f.first.c_str());
+            writeBinary(f.first, f.second.data(), f.second.size());
+        }
+        return;
+    }
+    for (size_t i = 0; i < bins.size(); i++) {
+        if (outputs[i] == "--") {
+            verbose("saving binary to stdout\n");
+            writeBinary("", bins[i].bits.data(), bins[i].bits.size());
+        } else {
+            verbose("saving binary to %s\n", outputs[i].c_str());
+            writeBinary(outputs[i], bins[i].bits.data(), bins[i].bits.size());
+        }
+    }
+}
+
+void writeDependencies(
+    const Opts &opts,
+    const std::vector<std::string> &targets,
+    const std::vector<SourceText> &sourceStrs)
+{
+    TRACE_SCOPE("write dependencies");
+    auto tokens = splitBuildOptions(opts.buildOpts);
+    auto incs = scanIncludes(opts.args, sourceStrs, includeDirectories(tokens));
+
+    std::vector<std::string> deps;
+    for (const auto &a : opts.args) {
+        if (a != "-")
+            deps.push_back(a);
+    }
+    size_t numInputs = deps.size();
+    for (const auto &inc : incs) {
+        // unresolved includes are usually driver-provided headers
+        if (!inc.path.empty())
+            deps.push_back(inc.path);
+    }
+    auto text = formatDepfile(targets, deps, numInputs, opts.depPhony);
+
+    if (opts.depsOnly && opts.depfilePath.empty()) {
+        fputs(text.c_str(), stdout);
+        return;
+    }
+    std::string path = opts.depfilePath;
+    if (path.empty()) {
+        if (targets[0] == "--") {
+            fatal("-MD: output is stdout; name the dependency file with -MF=...");
+        }
+        path = targets[0] + ".d";
+    }
+    verbose("saving dependencies to %s\n", path.c_str());
+    if (!writeFileAtomic(path, text.data(), text.size())) {
+        fatal("%s: failed to write dependencies", path.c_str());
+    }
+}
+
+static int runMain(const Opts &opts, int argc, const char **argv)
+{
+    if (opts.serve) {
+        return runServer(opts);
+    }
+    int exitCode = 0;
+    if (runClient(opts, argc, argv, exitCode)) {
+        return exitCode;
+    }
+
+    if (opts.listDevices) {
+        listDevices(opts);
+        if (!opts.args.empty()) {
+            fatal("-h=d specified, ignorning arguments");
+        }
+        return 0;
+    }
+
+    std::unique_ptr<BinaryCache> cache;
+    if (!opts.cacheDir.empty()) {
+        cache.reset(new BinaryCache(opts.cacheDir, opts.cacheMaxBytes));
+    }
+    if (opts.cacheStats) {
+        if (!cache) {
+            fatal("-cache-stats: no cache directory given (-cache=... or CLC_CACHE_DIR)");
+        }
+        cache->printStats();
+        if (opts.args.empty() && opts.batchFile.empty())
+            return 0;
+    }
+
+    if (!opts.analyze.empty() && !opts.args.empty() &&
+        std::all_of(opts.args.begin(), opts.args.end(), isPtxPath))
+    {
+        // saved PTX is analyzed offline
+        return runAnalyze(opts);
+    }
+    if (!opts.analyzeBaseline.empty() && opts.analyze.empty()) {
+        fatal("--analyze-baseline: requires --analyze or --analyze=json");
+    }
+    if (opts.analyzeExact && opts.analyzeBaseline.empty()) {
+        fatal("--analyze-exact: requires --analyze-baseline=");
+    }
+
+    if (opts.format == "spv" && (opts.watch || !opts.sweeps.empty() || !opts.bench.empty())) {
+        fatal("-F=spv: cannot be combined with --watch, -sweep, or --bench");
+    }
+    if (opts.watch) {
+        if (!opts.batchFile.empty() || !opts.sweeps.empty() || !opts.bench.empty() ||
+            opts.depsOnly)
+        {
+            fatal("--watch: cannot be combined with -batch, -sweep, --bench, or -M");
+        }
+        return runWatch(opts, cache.get());
+    }
+
+    if (!opts.sweeps.empty()) {
+        if (!opts.batchFile.empty() || !opts.bench.empty()) {
+            fatal("-sweep: cannot be combined with -batch or --bench");
+        }
+        return runSweep(opts, cache.get());
+    }
+
+    if (!opts.batchFile.empty()) {
+        if (!opts.args.empty()) {
+            fatal("-batch=%s: unexpected arguments (compilation units go in the manifest)",
+                opts.batchFile.c_str());
+        }
+        return runBatch(opts, cache.get());
+    }
+
+    // load the source
+    auto sourceStrs = readSources(opts);
+
+    if (opts.format == "spv") {
+        // the module is device-independent; no OpenCL runtime is involved
+        auto output = intermediatePath(opts);
+        if (!opts.depsOnly)
+            emitSpirv(opts, sourceStrs, output);
+        if (opts.depsOnly || opts.depfile)
+            writeDependencies(opts, {output}, sourceStrs);
+        return 0;
+    }
+
+    if (opts.depsOnly && (!opts.multiDevice || opts.format == "archive" ||
+        opts.format == "cpp") && opts.output.length() > 0)
+    {
+        // the target is known without touching the OpenCL runtime
+        std::vector<std::string> targets = {opts.output};
+        if (opts.format == "cpp")
+            targets.push_back(embedHeaderPath(opts.output));
+        writeDependencies(opts, targets, sourceStrs);
+        return 0;
+    }
+
+    std::vector<cl::Device> devs;
+    if (opts.multiDevice) {
+        devs = findDevices(opts);
+    } else {
+        devs.push_back(findDevice(opts));
+    }
+
+    if (opts.depsOnly) {
+        // output names depend on the device vendor
+        writeDependencies(opts, outputTargets(opts, devs), sourceStrs);
+        return 0;
+    }
+    if (!opts.bench.empty() && opts.multiDevice) {
+        fatal("--bench: benchmarks a single device (drop -m)");
+    }
+
+    auto bins = buildProgramOnDevices(opts, sourceStrs, devs, cache.get());
+    checkResources(opts, bins);
+    analyzeBinaries(opts, bins);
+    saveBinaries(opts, bins, sourceStrs);
+    if (!opts.stubs.empty()) {
+        writeLaunchStubs(opts, sourceStrs, devs[0]);
+    }
+    if (opts.depfile) {
+        writeDependencies(opts, outputTargets(opts, devs), sourceStrs);
+    }
+    if (!opts.bench.empty()) {
+        return runBench(opts, sourceStrs, bins[0]);
+    }
+    return 0;
+}
+
+int main(int argc, const char **argv)
+{
+    g_exe = argv[0];
+    auto ix = g_exe.rfind('\\');
+    if (ix != std::string::npos)
+        g_exe = g_exe.substr(ix + 1);
+    else if ((ix = g_exe.rfind('/')) != std::string::npos)
+        g_exe = g_exe.substr(ix + 1);
+
+    Opts opts = parseOpts(argc - 1, argv + 1);
+    g_verbosity = opts.verbosity;
+    g_tracing = opts.time || !opts.traceFile.empty();
+
+    int exitCode = EXIT_FAILURE;
+    try {
+        TRACE_SCOPE("clc");
+        exitCode = runMain(opts, argc - 1, argv + 1);
+    } catch (const FatalError &err) {
+        fatalMessage(err.what());
+    } catch (const cl::Error &err) {
+        fatalMessage(std::string(err.what()) + ": " + clErrStr(err.err()));
+    }
+
+    // failed runs are reported too; they are often the slow ones
+    if (opts.time) {
+        printTimeReport(stderr);
+    }
+    if (!opts.traceFile.empty()) {
+        try {
+            writeTrace(opts.traceFile);
+        } catch (const FatalError &err) {
+            fatalMessage(err.what());
+            exitCode = EXIT_FAILURE;
+        }
+    }
+    return exitCode;
+}
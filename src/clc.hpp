@@ -0,0 +1,326 @@
+#ifndef CLC_HPP
+#define CLC_HPP
+
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#define __CL_ENABLE_EXCEPTIONS
+#define CL_USE_DEPRECATED_OPENCL_2_0_APIS
+#include <CL/cl.hpp>
+
+#include "system.hpp"
+
+struct Opts {
+    std::vector<std::string>   args;
+    std::string                device; // substring match
+    cl_device_type             deviceType = CL_DEVICE_TYPE_ALL; // -t=...
+    cl_uint                    vendorId = 0; // -vendor=...; 0 matches any
+    bool                       multiDevice = false; // -m
+    std::string                output;
+    std::vector<std::string>   buildOpts;
+    int                        verbosity = 0;
+    bool                       listDevices = false;
+    bool                       listJson = false; // -h=json
+    bool                       refreshDevices = false; // --refresh-devices
+    std::string                cacheDir; // -cache=... or $CLC_CACHE_DIR
+    unsigned long long         cacheMaxBytes = 1024ull * 1024ull * 1024ull;
+    bool                       cacheStats = false;
+    std::string                batchFile; // -batch=... manifest
+    int                        jobs = 0; // -j=...; 0 means one per hardware thread
+    bool                       serve = false; // --serve
+    std::string                serverSocket; // --serve=... or --server=... or $CLC_SERVER
+    bool                       noServer = false; // --no-server
+    std::vector<std::string>   sweeps; // -sweep=NAME:V1,V2,...
+    std::string                kernel; // -kernel=... (the kernel -sweep times)
+    std::string                globalSize; // -global=...
+    std::string                localSize; // -local=...
+    std::string                kernelArgs; // -args=...
+    int                        iterations = 10; // -iters=...
+    std::string                bench; // --bench=KERNEL
+    std::string                benchBaseline; // --baseline=...
+    std::string                benchSave; // --save-baseline=...
+    double                     benchThreshold = 10.0; // --regress=... (percent)
+    int                        benchWarmup = 3; // -warmup=...
+    bool                       incremental = false; // -incremental
+    bool                       depsOnly = false; // -M
+    bool                       depfile = false; // -MD
+    std::string                depfilePath; // -MF=...
+    bool                       depPhony = false; // -MP
+    bool                       time = false; // --time
+    std::string                traceFile; // --trace=...
+    std::string                format; // -F=...; "" is loose binaries, or archive, cpp, or spv
+    bool                       compress = false; // -compress (-F=archive)
+    std::string                resources; // --resources ("table") or --resources=json
+    unsigned long long         maxPrivateBytes = 0; // -max-private=...; 0 is no limit
+    unsigned long long         maxLocalBytes = 0; // -max-local=...
+    double                     minOccupancy = 0.0; // -min-occupancy=... (percent)
+    bool                       watch = false; // --watch
+    std::vector<std::string>   specs; // -spec=[NAME=]KERNEL:ARG=VALUE,...
+    std::vector<std::string>   fusions; // -fuse=NAME:K1>K2>...
+    std::vector<std::string>   instantiations; // -inst=KERNEL<ARG,...>,...
+    std::vector<std::string>   selectKernels; // -k=... (prune to these kernels)
+    std::string                perfLint; // --perf-lint ("warn") or --perf-lint=error
+    bool                       instrument = false; // --instrument (region counters)
+    std::string                stubs; // --stubs=FILE (C++ launch wrappers)
+    std::string                analyze; // --analyze ("table") or --analyze=json (PTX)
+    std::string                analyzeBaseline; // --analyze-baseline=...
+    bool                       analyzeExact = false; // --analyze-exact
+};
+
+// fatal() throws this; main() and the batch workers report it
+struct FatalError : std::runtime_error {
+    FatalError(const std::string &msg) : std::runtime_error(msg) { }
+};
+
+extern std::string g_exe;
+extern int g_verbosity;
+
+// when set (per thread), warning/verbose/debug output accumulates here
+// instead of going to stderr
+struct DiagnosticSink {
+    std::string   text;
+    int           verbosity = 0;
+};
+void setDiagnosticSink(DiagnosticSink *sink);
+
+void fatalMessage(const std::string &str);
+void fatal(const std::string &str);
+void fatal(const char *pat,...);
+void warning(const std::string &str);
+void warning(const char *pat,...);
+void verbose(const std::string &str);
+void verbose(const char *pat,...);
+void debug(const std::string &str);
+void debug(const char *pat,...);
+
+// The text of an input.  Regular files are mapped rather than read, and
+// copies share the mapping, so even a generated source of tens of MB
+// reaches clCreateProgramWithSource without being copied; stdin, pipes,
+// and texts sent to the server are held in a string.  The text is not
+// NUL-terminated.
+class SourceText {
+    std::shared_ptr<const MappedFile>   file;
+    std::string                         text;
+public:
+    SourceText() { }
+    explicit SourceText(std::string str) : text(std::move(str)) { }
+    explicit SourceText(std::shared_ptr<const MappedFile> f) : file(std::move(f)) { }
+
+    const char *data() const { return file ? file->data() : text.data(); }
+    size_t size() const { return file ? file->size() : text.size(); }
+    std::string str() const { return std::string(data(), size()); }
+};
+
+std::string readTextFile(const std::string &fileName);
+// maps the file (or, if it cannot be mapped, reads it); - is stdin
+SourceText readSource(const std::string &fileName);
+// an empty stream name is stdout; files are replaced atomically (via a
+// temporary and rename) so a failed or interrupted write never leaves a
+// truncated binary behind for make to consider up to date
+void writeBinary(
+    const std::string &streamName, const void *bits, size_t bitsLen);
+
+class BinaryCache;
+
+// exits on a bad option (after the usage) unless exitOnError is false,
+// as for a manifest line or a server request, where it throws FatalError
+Opts parseOpts(int argc, const char **argv, bool exitOnError = true);
+// devices.cpp; all devices matching -d=, -t=, and -vendor=
+std::vector<cl::Device> findDevices(const Opts &opts);
+// the single device matching -d=, -t=, and -vendor= (fatal if ambiguous)
+cl::Device findDevice(const Opts &opts);
+// -h=d and -h=json
+void listDevices(const Opts &opts);
+
+struct DeviceBinary {
+    cl::Device          device;
+    std::vector<char>   bits;
+};
+
+// reads the compilation units in opts.args (- is stdin) with the -spec=
+// variants added; with mapFiles false they are read into memory instead
+// (a mapped file that is truncated in place faults)
+std::vector<SourceText> readSources(const Opts &opts, bool mapFiles = true);
+// templates.cpp; replaces each template kernel by its -inst=
+// instantiations (and by itself if every parameter has a default)
+void applyTemplates(const Opts &opts, std::vector<SourceText> &sourceStrs);
+// the -DCLC_FLOATN=float4 ... that fit dev for the CLC_*N macros the
+// sources use (and -b= does not define)
+std::string vectorWidthOptions(
+    const Opts &opts, const std::vector<SourceText> &sourceStrs, const cl::Device &dev);
+// the options buildProgram hands dev's compiler: -b= and the vector widths;
+// any other build of the same sources for dev must use these too
+std::string deviceBuildOptions(
+    const Opts &opts, const std::vector<SourceText> &sourceStrs, const cl::Device &dev);
+// spec.cpp; adds a copy of each -spec= kernel with the given arguments
+// replaced by constants right after the kernel
+void applySpecializations(const Opts &opts, std::vector<SourceText> &sourceStrs);
+// fuse.cpp; adds each -fuse= kernel: the chained elementwise kernels as
+// one, with the intermediates in private variables
+void applyFusions(const Opts &opts, std::vector<SourceText> &sourceStrs);
+// prune.cpp; with -k=, inlines the quoted #includes and blanks the
+// definitions the selected kernels do not reach
+void pruneToKernels(const Opts &opts, std::vector<SourceText> &sourceStrs);
+// fatal if a kernel is defined twice (a warning if #if may exclude one)
+void checkDuplicateKernels(const Opts &opts, const std::vector<SourceText> &sourceStrs);
+// lint.cpp; with --perf-lint, warns of (or with =error fails on)
+// uncoalesced, bank-conflicting, and converting code in the kernels
+void perfLint(const Opts &opts, const std::vector<SourceText> &sourceStrs);
+// instrument.cpp; with --instrument, gives each kernel a last argument
+// global uint *__clc_counters and counts (and where a clock is available,
+// times) its loops, barriers, and #pragma clc region statements into it
+void applyInstrumentation(const Opts &opts, std::vector<SourceText> &sourceStrs);
+
+// a region of an instrumented kernel; its counters are the uints at
+// 4 * index: the count and the clock ticks, each as (lo, hi)
+struct InstrumentRegion {
+    size_t          index = 0;
+    std::string     kernel;
+    std::string     kind; // loop, barrier, or the #pragma clc region name
+    std::string     where; // FILE:LINE
+};
+// the regions applyInstrumentation added to the sources
+std::vector<InstrumentRegion> instrumentedRegions(const std::vector<SourceText> &sourceStrs);
+// il.cpp; true if the text is a SPIR-V module (by its magic number)
+bool isSpirv(const SourceText &text);
+// true if the program is a single SPIR-V module rather than OpenCL C
+bool isSpirvProgram(const std::vector<SourceText> &sourceStrs);
+// the program for the sources: from OpenCL C, or from the module via
+// clCreateProgramWithIL (fatal unless every one of devs takes SPIR-V)
+cl::Program createProgram(
+    const cl::Context &ctx,
+    const std::vector<SourceText> &sourceStrs,
+    const std::vector<cl::Device> &devs);
+// -F=spv: compiles the sources to a SPIR-V module with the external front
+// end ($CLC_SPIRV_FRONTEND or clang) and saves it to output (-- is stdout)
+void emitSpirv(
+    const Opts &opts,
+    const std::vector<SourceText> &sourceStrs,
+    const std::string &output);
+// warns about (or, with -v, prints) a device's build log
+void reportBuildLog(const cl::Program &prog, const cl::Device &dev, size_t numDevs);
+// the binary for each of devs (in devs order) from a built program
+std::vector<std::vector<char>> programBinaries(
+    const cl::Program &prog, const std::vector<cl::Device> &devs);
+// fetches dev's binary from the cache, keyed as buildProgram keys it (the
+// key is returned in *key either way); lets callers skip creating a
+// context when every device hits
+bool lookupBinary(
+    const Opts &opts,
+    const std::vector<SourceText> &sourceStrs,
+    const cl::Device &dev,
+    const BinaryCache *cache,
+    DeviceBinary &bin,
+    std::string *key = nullptr);
+// builds the sources for devices in ctx (or fetches them from the cache);
+// the result is in devs order.  Given missedKeys (in devs order), the
+// caller has looked devs up with lookupBinary and missed, so the cache is
+// only stored to
+std::vector<DeviceBinary> buildProgram(
+    const Opts &opts,
+    const std::vector<SourceText> &sourceStrs,
+    const std::vector<cl::Device> &devs,
+    const cl::Context &ctx,
+    const BinaryCache *cache,
+    const std::vector<std::string> *missedKeys = nullptr);
+// as above, but creates a context per platform and builds concurrently;
+// given contexts, the contexts are kept there for later calls to reuse
+std::vector<DeviceBinary> buildProgramOnDevices(
+    const Opts &opts,
+    const std::vector<SourceText> &sourceStrs,
+    const std::vector<cl::Device> &devs,
+    const BinaryCache *cache,
+    std::map<cl_platform_id,cl::Context> *contexts = nullptr);
+// link.cpp; the -incremental form of the build in buildProgram: each
+// input is compiled on its own (or fetched from the object cache) and
+// the objects linked; the result is in devs order
+std::vector<std::vector<char>> compileAndLink(
+    const Opts &opts,
+    const std::vector<SourceText> &sourceStrs,
+    const std::vector<cl::Device> &devs,
+    const cl::Context &ctx,
+    const BinaryCache *cache);
+// output file name for each device (see -o=, -m, and -F=); with
+// -F=archive or -F=cpp every device maps to the one archive or source
+std::vector<std::string> outputPaths(
+    const Opts &opts, const std::vector<cl::Device> &devs);
+// the -F=spv output: -o= or STEM.spv
+std::string intermediatePath(const Opts &opts);
+// the distinct files among outputPaths (the make targets)
+std::vector<std::string> outputTargets(
+    const Opts &opts, const std::vector<cl::Device> &devs);
+void saveBinaries(
+    const Opts &opts,
+    const std::vector<DeviceBinary> &bins,
+    const std::vector<SourceText> &sourceStrs);
+// archive.cpp; the -F=archive file holding bins (include/clc_archive.hpp)
+std::vector<char> archiveImage(
+    const Opts &opts,
+    const std::vector<DeviceBinary> &bins,
+    const std::vector<SourceText> &sourceStrs);
+// -M/-MD: writes the rule for the given outputs (to -MF=..., OUTPUT.d, or
+// for -M alone stdout)
+void writeDependencies(
+    const Opts &opts,
+    const std::vector<std::string> &targets,
+    const std::vector<SourceText> &sourceStrs);
+
+// resources.cpp; the --resources report of every kernel's work-group
+// limits, memory use, and estimated occupancy; fatal if a kernel exceeds
+// -max-private=, -max-local=, or -min-occupancy=
+void checkResources(const Opts &opts, const std::vector<DeviceBinary> &bins);
+
+// ptx.cpp; the --analyze report of the PTX among bins (NVIDIA's binaries):
+// each kernel's registers, local and shared memory, instruction mix, and
+// loops; fatal if registers or local memory grew since --analyze-baseline=
+void analyzeBinaries(const Opts &opts, const std::vector<DeviceBinary> &bins);
+// true for FILE.ptx
+bool isPtxPath(const std::string &path);
+// --analyze of PTX files given as the inputs; needs no OpenCL device
+int runAnalyze(const Opts &opts);
+
+// embed.cpp; the -F=cpp files as (path, text): a header declaring a
+// lookup by device name and driver version, and sourcePath defining the
+// binaries as aligned arrays
+std::vector<std::pair<std::string,std::string>> embeddedSources(
+    const Opts &opts,
+    const std::vector<DeviceBinary> &bins,
+    const std::string &sourcePath);
+// foo.cpp -> foo.hpp
+std::string embedHeaderPath(const std::string &sourcePath);
+
+// stubs.cpp; foo-bar.hpp -> foo_bar (the namespace of a generated file)
+std::string identifierFrom(const std::string &path);
+// writes the --stubs header: a C++ launch wrapper per kernel,
+// typed from the argument info of a -cl-kernel-arg-info build on dev
+void writeLaunchStubs(
+    const Opts &opts,
+    const std::vector<SourceText> &sourceStrs,
+    const cl::Device &dev);
+
+// watch.cpp; rebuilds whenever an input or a header it includes changes
+// (--watch); returns only on a fatal setup error
+int runWatch(const Opts &opts, const BinaryCache *cache);
+
+// batch.cpp
+int runBatch(const Opts &opts, const BinaryCache *cache);
+
+// sweep.cpp
+int runSweep(const Opts &opts, const BinaryCache *cache);
+
+// bench.cpp; times a kernel of a freshly built binary (--bench=...)
+int runBench(
+    const Opts &opts,
+    const std::vector<SourceText> &sourceStrs,
+    const DeviceBinary &bin);
+
+// server.cpp
+int runServer(const Opts &opts);
+// forwards the invocation to a running server; false if there is none
+// (or the invocation is not a plain compile) and we should build in-process
+bool runClient(const Opts &opts, int argc, const char **argv, int &exitCode);
+
+#endif
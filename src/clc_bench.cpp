@@ -0,0 +1,571 @@
+// clc_bench: measures clc itself.  Every input of a corpus (the examples
+// plus generated large and many-kernel sources) is compiled N times per
+// mode by running the clc executable, so each sample is the whole
+// pipeline a build system pays for: process start, device discovery,
+// the build, binary extraction, and the write.
+//
+//   cold    no device snapshot and no binary cache (first run after a
+//           driver update)
+//   warm    a device snapshot but no binary cache (an edit-compile loop)
+//   cached  a device snapshot and a binary cache hit (a no-op rebuild)
+//
+// The drivers' own kernel caches (pocl's, which otherwise lives under
+// $XDG_CACHE_HOME with the snapshot, NVIDIA's, and Intel's) are turned off
+// for every run, so a cold or warm sample always pays for the build.
+//
+// Each input is first built once untimed; one that fails there (e.g. an
+// example that does not compile for the device) is reported and left out.
+// The latency distribution and peak RSS of each (input, mode) go out as
+// CSV or JSON; with -baseline= a previous JSON report gates regressions.
+#include "json.hpp"
+#include "system.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#ifdef _WIN32
+#include <Windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#ifndef CLC_EXE_NAME
+#define CLC_EXE_NAME "clc"
+#endif
+#ifndef CLC_EXAMPLES_DIR
+#define CLC_EXAMPLES_DIR "examples"
+#endif
+
+static const char *MODES[] = {"cold", "warm", "cached"};
+
+struct BenchOpts {
+    std::string                 clc; // -clc=...
+    std::string                 examples = CLC_EXAMPLES_DIR; // -examples=...
+    std::string                 work; // -work=...
+    std::vector<std::string>    clcOpts; // after --
+    int                         runs = 5; // -n=...
+    double                      scale = 1.0; // -scale=...
+    std::string                 format = "csv"; // -format=...
+    std::string                 output; // -o=...
+    std::string                 baseline; // -baseline=...
+    double                      threshold = 20.0; // -regress=... (percent)
+};
+
+struct BenchInput {
+    std::string     name;
+    std::string     path;
+    uint64_t        bytes = 0;
+};
+
+struct BenchResult {
+    std::string             input;
+    uint64_t                bytes = 0;
+    std::string             mode;
+    std::vector<double>     ms;
+    std::vector<uint64_t>   peakRss;
+};
+
+static void fatal(const char *pat, ...)
+{
+    va_list ap;
+    va_start(ap, pat);
+    fputs("clc_bench: ", stderr);
+    vfprintf(stderr, pat, ap);
+    fputc('\n', stderr);
+    va_end(ap);
+    exit(EXIT_FAILURE);
+}
+
+static void printUsage()
+{
+    printf(
+        "usage: clc_bench [OPTS] [-- CLC-OPTS]\n"
+        "where [OPTS]\n"
+        " -clc=PATH       the clc to measure (default: " CLC_EXE_NAME " next to clc_bench)\n"
+        " -n=N            timed runs per input and mode (default 5)\n"
+        " -examples=DIR   the .cl files to include in the corpus\n"
+        "                 (default " CLC_EXAMPLES_DIR ")\n"
+        " -scale=F        scales the generated sources (default 1: about 1 MB and\n"
+        "                 2000 kernels)\n"
+        " -work=DIR       scratch directory (default: clc_bench.work)\n"
+        " -format=FMT     csv or json (default csv)\n"
+        " -o=FILE         writes the report to FILE instead of stdout\n"
+        " -baseline=FILE  a previous -format=json report; fails if a median is slower\n"
+        " -regress=PCT    slowdown vs. the baseline that fails (default 20)\n"
+        "[CLC-OPTS]       select the device and build options (default -t=cpu)\n");
+}
+
+static void setEnv(const char *name, const std::string &value)
+{
+#ifdef _WIN32
+    _putenv_s(name, value.c_str());
+#else
+    if (value.empty())
+        unsetenv(name);
+    else
+        setenv(name, value.c_str(), 1);
+#endif
+}
+
+// where clc keeps its device snapshot when there is no -cache=
+static void setSnapshotDirectory(const std::string &dir)
+{
+#ifdef _WIN32
+    setEnv("LOCALAPPDATA", dir);
+#else
+    setEnv("XDG_CACHE_HOME", dir);
+#endif
+}
+
+// a driver that caches built kernels would turn cold and warm samples
+// into its own cache hits
+static void disableDriverCaches()
+{
+    setEnv("POCL_KERNEL_CACHE", "0");
+    setEnv("CUDA_CACHE_DISABLE", "1");
+    setEnv("NEO_CACHE_PERSISTENT", "0");
+}
+
+static std::string absolute(const std::string &path)
+{
+#ifdef _WIN32
+    char buf[MAX_PATH];
+    DWORD n = GetFullPathNameA(path.c_str(), sizeof(buf), buf, nullptr);
+    return n > 0 && n < sizeof(buf) ? std::string(buf) : path;
+#else
+    if (!path.empty() && path[0] == '/')
+        return path;
+    char buf[4096];
+    return getcwd(buf, sizeof(buf)) ? std::string(buf) + "/" + path : path;
+#endif
+}
+
+static std::string defaultClc(const char *argv0)
+{
+    std::string self = argv0;
+    auto ix = self.find_last_of("/\\");
+    std::string dir = ix == std::string::npos ? "." : self.substr(0, ix);
+#ifdef _WIN32
+    return dir + "\\" CLC_EXE_NAME ".exe";
+#else
+    return dir + "/" CLC_EXE_NAME;
+#endif
+}
+
+struct ProcessResult {
+    int         status = -1;
+    double      ms = 0.0;
+    uint64_t    peakRss = 0;
+};
+
+static ProcessResult runProcess(const std::vector<std::string> &args)
+{
+    ProcessResult r;
+    auto t0 = std::chrono::steady_clock::now();
+#ifdef _WIN32
+    std::string cmd;
+    for (const auto &a : args) {
+        if (!cmd.empty())
+            cmd += ' ';
+        cmd += '"';
+        for (char c : a)
+            cmd += c == '"' ? std::string("\\\"") : std::string(1, c);
+        cmd += '"';
+    }
+    STARTUPINFOA si;
+    PROCESS_INFORMATION pi;
+    memset(&si, 0, sizeof(si));
+    si.cb = sizeof(si);
+    if (!CreateProcessA(nullptr, &cmd[0], nullptr, nullptr, FALSE, 0, nullptr,
+        nullptr, &si, &pi))
+    {
+        fatal("%s: failed to start", args[0].c_str());
+    }
+    WaitForSingleObject(pi.hProcess, INFINITE);
+    DWORD code = 1;
+    GetExitCodeProcess(pi.hProcess, &code);
+    r.status = (int)code;
+    PROCESS_MEMORY_COUNTERS pmc;
+    if (GetProcessMemoryInfo(pi.hProcess, &pmc, sizeof(pmc)))
+        r.peakRss = pmc.PeakWorkingSetSize;
+    CloseHandle(pi.hThread);
+    CloseHandle(pi.hProcess);
+#else
+    std::vector<char *> argv;
+    for (const auto &a : args)
+        argv.push_back((char *)a.c_str());
+    argv.push_back(nullptr);
+    pid_t pid = fork();
+    if (pid < 0) {
+        fatal("fork failed");
+    } else if (pid == 0) {
+        execv(argv[0], argv.data());
+        _exit(127);
+    }
+    int status = 0;
+    struct rusage ru;
+    memset(&ru, 0, sizeof(ru));
+    if (wait4(pid, &status, 0, &ru) < 0) {
+        fatal("%s: wait failed", args[0].c_str());
+    }
+    r.status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+#ifdef __APPLE__
+    r.peakRss = (uint64_t)ru.ru_maxrss; // bytes
+#else
+    r.peakRss = (uint64_t)ru.ru_maxrss * 1024; // kilobytes
+#endif
+#endif
+    r.ms = std::chrono::duration<double,std::milli>(
+        std::chrono::steady_clock::now() - t0).count();
+    return r;
+}
+
+static void writeText(const std::string &path, const std::string &text)
+{
+    if (!writeFileAtomic(path, text.data(), text.size())) {
+        fatal("%s: failed to write", path.c_str());
+    }
+}
+
+// one kernel with a long dependent body: front-end and optimizer cost
+static std::string largeSource(int statements)
+{
+    std::stringstream ss;
+    ss << "kernel void large(global float *a, const global float *b)\n{\n"
+        "    size_t i = get_global_id(0);\n"
+        "    float x = b[i];\n";
+    char buf[96];
+    for (int k = 0; k < statements; k++) {
+        snprintf(buf, sizeof(buf), "    x = x * 1.%06df + b[(i + %d) & 1023u];\n", k % 97, k);
+        ss << buf;
+    }
+    ss << "    a[i] = x;\n}\n";
+    return ss.str();
+}
+
+// many small kernels: per-kernel overhead in the compiler and the binary
+static std::string manySource(int kernels)
+{
+    std::stringstream ss;
+    for (int k = 0; k < kernels; k++) {
+        ss << "kernel void k" << k << "(global float *a)\n{\n"
+            "    size_t i = get_global_id(0);\n"
+            "    a[i] = a[i] * " << (k % 13 + 1) << ".0f + " << k << ".0f;\n}\n";
+    }
+    return ss.str();
+}
+
+static std::vector<BenchInput> buildCorpus(const BenchOpts &opts)
+{
+    std::vector<BenchInput> corpus;
+    auto names = listDirectory(opts.examples);
+    std::sort(names.begin(), names.end());
+    for (const auto &n : names) {
+        if (n.size() < 3 || n.compare(n.size() - 3, 3, ".cl") != 0)
+            continue;
+        BenchInput in;
+        in.name = n;
+        in.path = absolute(opts.examples + "/" + n);
+        corpus.push_back(in);
+    }
+    if (corpus.empty()) {
+        fprintf(stderr, "clc_bench: %s: no .cl files; benchmarking generated sources only\n",
+            opts.examples.c_str());
+    }
+
+    BenchInput large;
+    large.name = "generated_large.cl";
+    large.path = absolute(opts.work + "/" + large.name);
+    writeText(large.path, largeSource((int)(20000 * opts.scale)));
+    corpus.push_back(large);
+
+    BenchInput many;
+    many.name = "generated_many.cl";
+    many.path = absolute(opts.work + "/" + many.name);
+    writeText(many.path, manySource((int)(2000 * opts.scale)));
+    corpus.push_back(many);
+
+    for (auto &in : corpus) {
+        int64_t mtime;
+        fileStat(in.path, in.bytes, mtime);
+    }
+    return corpus;
+}
+
+static double percentile(std::vector<double> v, double p)
+{
+    if (v.empty())
+        return 0.0;
+    std::sort(v.begin(), v.end());
+    size_t ix = (size_t)(p / 100.0 * (double)(v.size() - 1) + 0.5);
+    return v[std::min(ix, v.size() - 1)];
+}
+
+static uint64_t medianBytes(std::vector<uint64_t> v)
+{
+    if (v.empty())
+        return 0;
+    std::sort(v.begin(), v.end());
+    return v[v.size() / 2];
+}
+
+static std::string formatCsv(const std::vector<BenchResult> &results)
+{
+    std::stringstream ss;
+    ss << "input,bytes,mode,runs,min_ms,median_ms,p95_ms,max_ms,"
+        "median_peak_rss_kb,max_peak_rss_kb\n";
+    char buf[256];
+    for (const auto &r : results) {
+        snprintf(buf, sizeof(buf), "%s,%llu,%s,%d,%.3f,%.3f,%.3f,%.3f,%llu,%llu\n",
+            r.input.c_str(), (unsigned long long)r.bytes, r.mode.c_str(),
+            (int)r.ms.size(), percentile(r.ms, 0), percentile(r.ms, 50),
+            percentile(r.ms, 95), percentile(r.ms, 100),
+            (unsigned long long)(medianBytes(r.peakRss) / 1024),
+            (unsigned long long)(*std::max_element(r.peakRss.begin(), r.peakRss.end()) / 1024));
+        ss << buf;
+    }
+    return ss.str();
+}
+
+static std::string formatJson(const BenchOpts &opts, const std::vector<BenchResult> &results)
+{
+    std::stringstream ss;
+    JsonWriter w(ss);
+    w.beginObject();
+    w.member("clc", opts.clc);
+    w.key("clc_options").beginArray();
+    for (const auto &o : opts.clcOpts)
+        w.value(o);
+    w.endArray();
+    w.key("results").beginArray();
+    for (const auto &r : results) {
+        w.beginObject();
+        w.member("input", r.input);
+        w.member("bytes", r.bytes);
+        w.member("mode", r.mode);
+        w.member("runs", r.ms.size());
+        w.member("min_ms", percentile(r.ms, 0));
+        w.member("median_ms", percentile(r.ms, 50));
+        w.member("p95_ms", percentile(r.ms, 95));
+        w.member("max_ms", percentile(r.ms, 100));
+        w.member("median_peak_rss", medianBytes(r.peakRss));
+        w.member("max_peak_rss", *std::max_element(r.peakRss.begin(), r.peakRss.end()));
+        w.key("samples_ms").beginArray();
+        for (auto ms : r.ms)
+            w.value(ms);
+        w.endArray();
+        w.endObject();
+    }
+    w.endArray();
+    w.endObject();
+    ss << "\n";
+    return ss.str();
+}
+
+// the number of (input, mode) medians slower than the baseline's by more
+// than the threshold; entries missing on either side are skipped
+static int compareBaseline(const BenchOpts &opts, const std::vector<BenchResult> &results)
+{
+    std::ifstream file(opts.baseline);
+    if (!file.good()) {
+        fatal("%s: failed to open baseline", opts.baseline.c_str());
+    }
+    std::stringstream text;
+    text << file.rdbuf();
+    JsonValue doc;
+    std::string err;
+    if (!parseJson(text.str(), doc, err)) {
+        fatal("%s: %s", opts.baseline.c_str(), err.c_str());
+    }
+    const auto &base = doc["results"];
+    int regressions = 0;
+    for (const auto &r : results) {
+        for (size_t i = 0; i < base.size(); i++) {
+            const auto &b = base[i];
+            if (b["input"].str() != r.input || b["mode"].str() != r.mode)
+                continue;
+            double was = b["median_ms"].number(), now = percentile(r.ms, 50);
+            double pct = was > 0.0 ? (now - was) / was * 100.0 : 0.0;
+            bool regressed = pct > opts.threshold;
+            fprintf(stderr, "%-24s %-6s %10.3f ms -> %10.3f ms  %+6.1f%%%s\n",
+                r.input.c_str(), r.mode.c_str(), was, now, pct,
+                regressed ? "  REGRESSION" : "");
+            regressions += regressed ? 1 : 0;
+        }
+    }
+    return regressions;
+}
+
+// the clc command line that compiles in with the mode's cache
+static std::vector<std::string> clcArgs(const BenchOpts &opts, const std::string &root,
+    const BenchInput &in, const std::string &mode)
+{
+    std::vector<std::string> args = {opts.clc, "--no-server", "-q"};
+    args.insert(args.end(), opts.clcOpts.begin(), opts.clcOpts.end());
+    args.push_back("-b=-I \"" + root + "\"");
+    args.push_back("-o=" + opts.work + "/out/" + in.name + ".bin");
+    if (mode == "cached")
+        args.push_back("-cache=" + opts.work + "/" + mode + "/cache");
+    args.push_back(in.path);
+    return args;
+}
+
+// an empty directory, whatever an earlier run left in it
+static void resetDirectory(const std::string &dir)
+{
+    if (isDirectory(dir) && !removeDirectory(dir)) {
+        fatal("%s: failed to remove directory", dir.c_str());
+    }
+    if (!makeDirectories(dir)) {
+        fatal("%s: failed to create directory", dir.c_str());
+    }
+}
+
+static BenchOpts parseOpts(int argc, const char **argv)
+{
+    BenchOpts opts;
+    opts.clc = defaultClc(argv[0]);
+    int ai = 1;
+    auto argpfx = [&](const char *pfx) {
+        return strncmp(argv[ai], pfx, strlen(pfx)) == 0;
+    };
+    for (; ai < argc; ai++) {
+        const char *arg = argv[ai];
+        if (strcmp(arg, "--") == 0) {
+            for (ai++; ai < argc; ai++)
+                opts.clcOpts.push_back(argv[ai]);
+        } else if (strcmp(arg, "-h") == 0 || strcmp(arg, "--help") == 0) {
+            printUsage();
+            exit(EXIT_SUCCESS);
+        } else if (argpfx("-clc=")) {
+            opts.clc = arg + 5;
+        } else if (argpfx("-examples=")) {
+            opts.examples = arg + 10;
+        } else if (argpfx("-work=")) {
+            opts.work = arg + 6;
+        } else if (argpfx("-n=")) {
+            opts.runs = atoi(arg + 3);
+            if (opts.runs <= 0)
+                fatal("%s: expected a positive integer", arg);
+        } else if (argpfx("-scale=")) {
+            opts.scale = atof(arg + 7);
+            if (opts.scale <= 0.0)
+                fatal("%s: expected a positive number", arg);
+        } else if (argpfx("-format=")) {
+            opts.format = arg + 8;
+            if (opts.format != "csv" && opts.format != "json")
+                fatal("%s: expected csv or json", arg);
+        } else if (argpfx("-o=")) {
+            opts.output = arg + 3;
+        } else if (argpfx("-baseline=")) {
+            opts.baseline = arg + 10;
+        } else if (argpfx("-regress=")) {
+            opts.threshold = atof(arg + 9);
+        } else {
+            fatal("%s: unexpected option (try -h)", arg);
+        }
+    }
+    if (opts.clcOpts.empty())
+        opts.clcOpts.push_back("-t=cpu");
+    if (opts.work.empty())
+        opts.work = "clc_bench.work";
+    opts.work = absolute(opts.work);
+    return opts;
+}
+
+int main(int argc, const char **argv)
+{
+    BenchOpts opts = parseOpts(argc, argv);
+    if (!makeDirectories(opts.work + "/out")) {
+        fatal("%s: failed to create directory", opts.work.c_str());
+    }
+    auto corpus = buildCorpus(opts);
+
+    // a stray $CLC_CACHE_DIR would make every run a cached one
+    setEnv("CLC_CACHE_DIR", "");
+    disableDriverCaches();
+    // examples include one another relative to the repository root
+    std::string root = absolute(opts.examples + "/..");
+
+    // an input that does not build says nothing about clc's speed; only a
+    // failure after a good probe counts against the run
+    std::vector<BenchInput> builds;
+    setSnapshotDirectory(opts.work + "/probe");
+    for (const auto &in : corpus) {
+        auto pr = runProcess(clcArgs(opts, root, in, "warm"));
+        if (pr.status != 0) {
+            fprintf(stderr, "clc_bench: %s: skipped (clc exited with %d)\n",
+                in.name.c_str(), pr.status);
+            continue;
+        }
+        builds.push_back(in);
+    }
+    if (builds.empty()) {
+        fatal("no input builds with %s", opts.clc.c_str());
+    }
+
+    std::vector<BenchResult> results;
+    int failures = 0;
+    for (const auto &in : builds) {
+        for (const char *mode : MODES) {
+            BenchResult r;
+            r.input = in.name;
+            r.bytes = in.bytes;
+            r.mode = mode;
+
+            std::string modeDir = opts.work + "/" + mode;
+            auto args = clcArgs(opts, root, in, r.mode);
+
+            // warm and cached runs start from the state one untimed run left
+            if (r.mode != "cold") {
+                setSnapshotDirectory(modeDir);
+                runProcess(args);
+            }
+            for (int i = 0; i < opts.runs; i++) {
+                // a snapshot from an earlier sample (or invocation) would
+                // make this a warm start
+                if (r.mode == "cold") {
+                    std::stringstream dir;
+                    dir << modeDir << "/" << in.name << "." << i;
+                    resetDirectory(dir.str());
+                    setSnapshotDirectory(dir.str());
+                }
+                auto pr = runProcess(args);
+                if (pr.status != 0) {
+                    fprintf(stderr, "clc_bench: %s (%s): clc exited with %d\n",
+                        in.name.c_str(), mode, pr.status);
+                    failures++;
+                    break;
+                }
+                r.ms.push_back(pr.ms);
+                r.peakRss.push_back(pr.peakRss);
+            }
+            if (!r.ms.empty()) {
+                fprintf(stderr, "%-24s %-6s median %10.3f ms\n",
+                    r.input.c_str(), mode, percentile(r.ms, 50));
+                results.push_back(r);
+            }
+        }
+    }
+
+    auto report = opts.format == "json" ? formatJson(opts, results) : formatCsv(results);
+    if (opts.output.empty()) {
+        fputs(report.c_str(), stdout);
+    } else {
+        writeText(opts.output, report);
+    }
+    int regressions = opts.baseline.empty() ? 0 : compareBaseline(opts, results);
+    return failures == 0 && regressions == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
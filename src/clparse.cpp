@@ -0,0 +1,677 @@
+#include "clparse.hpp"
+
+#include <algorithm>
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+static bool isIdentChar(char c)
+{
+    return isalnum((unsigned char)c) || c == '_';
+}
+
+bool isIdentifier(const std::string &s)
+{
+    if (s.empty() || isdigit((unsigned char)s[0]))
+        return false;
+    for (char c : s) {
+        if (!isIdentChar(c))
+            return false;
+    }
+    return true;
+}
+
+size_t lineOf(const char *src, size_t offset)
+{
+    size_t line = 1;
+    for (size_t i = 0; i < offset; i++) {
+        if (src[i] == '\n')
+            line++;
+    }
+    return line;
+}
+
+std::string lineDirective(size_t line, const std::string &path)
+{
+    std::string d = "#line " + std::to_string(line);
+    if (path != "-") {
+        d += " \"";
+        for (char ch : path) {
+            if (ch == '\\' || ch == '"')
+                d += '\\';
+            d += ch;
+        }
+        d += "\"";
+    }
+    return d + "\n";
+}
+
+std::pair<std::string,size_t> sourceLocation(
+    const char *src, size_t offset, const std::string &path)
+{
+    std::string file = path == "-" ? "stdin" : path;
+    size_t line = 1;
+    for (size_t b = 0; b < offset; ) {
+        const char *nl = (const char *)memchr(src + b, '\n', offset - b);
+        if (!nl)
+            break;
+        size_t e = nl - src;
+        line++;
+        if (e - b > 6 && strncmp(src + b, "#line ", 6) == 0) {
+            // #line N "FILE": the next line is N
+            std::string ln(src + b + 6, e - b - 6);
+            size_t l = strtoul(ln.c_str(), nullptr, 10);
+            auto q = ln.find('"');
+            auto qe = q == std::string::npos ? q : ln.find('"', q + 1);
+            if (l > 0)
+                line = l;
+            if (qe != std::string::npos)
+                file = ln.substr(q + 1, qe - q - 1);
+        }
+        b = e + 1;
+    }
+    return std::make_pair(file, line);
+}
+
+// true if only whitespace precedes i on its line
+static bool atLineStart(const char *s, size_t i)
+{
+    while (i > 0 && (s[i - 1] == ' ' || s[i - 1] == '\t'))
+        i--;
+    return i == 0 || s[i - 1] == '\n';
+}
+
+// the offset past a "..." or '...' literal starting at i
+static size_t skipLiteral(const char *s, size_t n, size_t i)
+{
+    char q = s[i++];
+    while (i < n && s[i] != q && s[i] != '\n') {
+        if (s[i] == '\\')
+            i++;
+        i++;
+    }
+    return i < n ? i + 1 : n;
+}
+
+// the next offset from i that is not whitespace, a comment, or part of
+// a preprocessor line (with its continuations)
+static size_t skipSpace(const char *s, size_t n, size_t i)
+{
+    while (i < n) {
+        if (isspace((unsigned char)s[i])) {
+            i++;
+        } else if (s[i] == '/' && i + 1 < n && s[i + 1] == '/') {
+            while (i < n && s[i] != '\n')
+                i++;
+        } else if (s[i] == '/' && i + 1 < n && s[i + 1] == '*') {
+            i += 2;
+            while (i + 1 < n && !(s[i] == '*' && s[i + 1] == '/'))
+                i++;
+            i = i + 2 < n ? i + 2 : n;
+        } else if (s[i] == '#' && atLineStart(s, i)) {
+            while (i < n && s[i] != '\n') {
+                if (s[i] == '\\' && i + 1 < n && s[i + 1] == '\n')
+                    i++;
+                i++;
+            }
+        } else {
+            break;
+        }
+    }
+    return i;
+}
+
+// the offset of the bracket closing the one at i (n if unbalanced)
+static size_t matchClose(const char *s, size_t n, size_t i)
+{
+    char open = s[i], close = open == '(' ? ')' : open == '{' ? '}' : ']';
+    int depth = 0;
+    while (i < n) {
+        i = skipSpace(s, n, i);
+        if (i >= n)
+            break;
+        if (s[i] == '"' || s[i] == '\'') {
+            i = skipLiteral(s, n, i);
+            continue;
+        }
+        if (s[i] == open) {
+            depth++;
+        } else if (s[i] == close && --depth == 0) {
+            return i;
+        }
+        i++;
+    }
+    return n;
+}
+
+static size_t skipIdentifier(const char *s, size_t n, size_t i)
+{
+    while (i < n && isIdentChar(s[i]))
+        i++;
+    return i;
+}
+
+size_t closingBracket(const char *s, size_t end, size_t open)
+{
+    return matchClose(s, end, open);
+}
+
+std::vector<size_t> identifierUses(
+    const char *s, size_t begin, size_t end, const std::string &name)
+{
+    std::vector<size_t> uses;
+    for (size_t i = begin; i < end; ) {
+        i = skipSpace(s, end, i);
+        if (i >= end)
+            break;
+        if (s[i] == '"' || s[i] == '\'') {
+            i = skipLiteral(s, end, i);
+        } else if (isIdentChar(s[i])) {
+            size_t e = skipIdentifier(s, end, i);
+            if (e - i == name.size() && name.compare(0, name.size(), s + i, e - i) == 0)
+                uses.push_back(i);
+            i = e;
+        } else {
+            i++;
+        }
+    }
+    return uses;
+}
+
+std::vector<CodeToken> codeTokens(const char *s, size_t begin, size_t end)
+{
+    static const char *ops[] = {
+        "<<=", ">>=", "...", "->", "++", "--", "<<", ">>", "<=", ">=", "==", "!=",
+        "&&", "||", "+=", "-=", "*=", "/=", "%=", "&=", "|=", "^=",
+    };
+    std::vector<CodeToken> ts;
+    for (size_t i = begin; i < end; ) {
+        i = skipSpace(s, end, i);
+        if (i >= end)
+            break;
+        CodeToken t;
+        t.begin = i;
+        if (s[i] == '"' || s[i] == '\'') {
+            i = skipLiteral(s, end, i);
+            continue;
+        } else if (isdigit((unsigned char)s[i]) ||
+            (s[i] == '.' && i + 1 < end && isdigit((unsigned char)s[i + 1])))
+        {
+            t.kind = CodeToken::NUMBER;
+            while (i < end && (isIdentChar(s[i]) || s[i] == '.' ||
+                ((s[i] == '+' || s[i] == '-') && (s[i - 1] == 'e' || s[i - 1] == 'E' ||
+                    s[i - 1] == 'p' || s[i - 1] == 'P'))))
+            {
+                i++;
+            }
+        } else if (isIdentChar(s[i])) {
+            t.kind = CodeToken::IDENT;
+            i = skipIdentifier(s, end, i);
+        } else {
+            i++;
+            for (const char *op : ops) {
+                size_t n = strlen(op);
+                if (t.begin + n <= end && strncmp(s + t.begin, op, n) == 0) {
+                    i = t.begin + n;
+                    break;
+                }
+            }
+        }
+        t.end = i;
+        t.text.assign(s + t.begin, t.end - t.begin);
+        ts.push_back(t);
+    }
+    return ts;
+}
+
+// the text between b and e without comments and with runs of whitespace
+// collapsed to one space
+static std::string cleanText(const char *s, size_t b, size_t e)
+{
+    std::string out;
+    for (size_t i = b; i < e; ) {
+        size_t j = skipSpace(s, e, i);
+        if (j != i) {
+            if (!out.empty())
+                out += ' ';
+            i = j;
+            continue;
+        }
+        out += s[i++];
+    }
+    while (!out.empty() && out.back() == ' ')
+        out.pop_back();
+    return out;
+}
+
+static KernelParam parseParam(const std::string &text)
+{
+    KernelParam p;
+    p.text = text;
+    // the name is the last identifier outside any trailing [N]
+    size_t e = text.size();
+    while (e > 0 && text[e - 1] == ']') {
+        auto ob = text.rfind('[', e - 1);
+        if (ob == std::string::npos)
+            break;
+        e = ob;
+        while (e > 0 && text[e - 1] == ' ')
+            e--;
+    }
+    size_t b = e;
+    while (b > 0 && isIdentChar(text[b - 1]))
+        b--;
+    p.name = text.substr(b, e - b);
+    std::string type = text.substr(0, b) + text.substr(e);
+    while (!type.empty() && type.back() == ' ')
+        type.pop_back();
+    p.type = type;
+    return p;
+}
+
+static std::vector<KernelParam> parseParams(const char *s, size_t b, size_t e)
+{
+    std::vector<KernelParam> params;
+    size_t start = b;
+    int depth = 0;
+    for (size_t i = b; i <= e; ) {
+        if (i < e) {
+            size_t j = skipSpace(s, e, i);
+            if (j != i) {
+                i = j;
+                continue;
+            }
+        }
+        char c = i < e ? s[i] : ',';
+        if (c == '(' || c == '[') {
+            depth++;
+        } else if (c == ')' || c == ']') {
+            depth--;
+        } else if (c == ',' && depth == 0) {
+            auto text = cleanText(s, start, i);
+            if (!text.empty() && text != "void")
+                params.push_back(parseParam(text));
+            start = i + 1;
+        }
+        i++;
+    }
+    return params;
+}
+
+// parses the declaration whose kernel keyword starts at begin; false for
+// prototypes and anything unrecognized
+static bool parseKernelAt(const char *s, size_t n, size_t begin, size_t keywordEnd,
+    KernelDecl &k)
+{
+    size_t i = keywordEnd, lastIdent = n, lastIdentEnd = n;
+    for (;;) {
+        i = skipSpace(s, n, i);
+        if (i >= n)
+            return false;
+        if (isIdentChar(s[i])) {
+            size_t e = skipIdentifier(s, n, i);
+            if (e - i == 13 && strncmp(s + i, "__attribute__", 13) == 0) {
+                i = skipSpace(s, n, e);
+                if (i >= n || s[i] != '(')
+                    return false;
+                i = matchClose(s, n, i) + 1;
+                continue;
+            }
+            lastIdent = i;
+            lastIdentEnd = e;
+            i = e;
+        } else if (s[i] == '(') {
+            break;
+        } else if (s[i] == '*') {
+            i++;
+        } else {
+            return false;
+        }
+    }
+    if (lastIdent == n)
+        return false;
+    size_t close = matchClose(s, n, i);
+    if (close >= n)
+        return false;
+
+    size_t j = close + 1;
+    for (;;) {
+        j = skipSpace(s, n, j);
+        if (j + 13 <= n && strncmp(s + j, "__attribute__", 13) == 0) {
+            j = skipSpace(s, n, j + 13);
+            if (j >= n || s[j] != '(')
+                return false;
+            j = matchClose(s, n, j) + 1;
+            continue;
+        }
+        break;
+    }
+    if (j >= n || s[j] != '{')
+        return false;
+    size_t bodyClose = matchClose(s, n, j);
+    if (bodyClose >= n)
+        return false;
+
+    k.name.assign(s + lastIdent, lastIdentEnd - lastIdent);
+    k.begin = begin;
+    k.nameBegin = lastIdent;
+    k.nameEnd = lastIdentEnd;
+    k.paramsBegin = i + 1;
+    k.paramsEnd = close;
+    k.bodyBegin = j;
+    k.bodyEnd = bodyClose + 1;
+    k.params = parseParams(s, k.paramsBegin, k.paramsEnd);
+    return true;
+}
+
+std::vector<KernelDecl> parseKernels(const char *s, size_t n)
+{
+    std::vector<KernelDecl> kernels;
+    int depth = 0;
+    for (size_t i = 0; i < n; ) {
+        i = skipSpace(s, n, i);
+        if (i >= n)
+            break;
+        char c = s[i];
+        if (c == '"' || c == '\'') {
+            i = skipLiteral(s, n, i);
+        } else if (isIdentChar(c)) {
+            size_t e = skipIdentifier(s, n, i);
+            std::string word(s + i, e - i);
+            KernelDecl k;
+            if (depth == 0 && (word == "kernel" || word == "__kernel") &&
+                parseKernelAt(s, n, i, e, k))
+            {
+                kernels.push_back(k);
+                e = k.bodyEnd;
+            }
+            i = e;
+        } else {
+            if (c == '{')
+                depth++;
+            else if (c == '}' && depth > 0)
+                depth--;
+            i++;
+        }
+    }
+    return kernels;
+}
+
+bool isReservedWord(const std::string &s)
+{
+    static const char *words[] = {
+        "__attribute__", "__constant", "__generic", "__global", "__kernel", "__local",
+        "__private", "__read_only", "__read_write", "__write_only", "auto", "bool",
+        "break", "case", "char", "const", "constant", "continue", "default", "defined",
+        "do", "double", "else", "enum", "event_t", "extern", "float", "for", "generic",
+        "global", "goto", "half", "if", "image1d_array_t", "image1d_buffer_t",
+        "image1d_t", "image2d_array_t", "image2d_t", "image3d_t", "inline", "int",
+        "intptr_t", "kernel", "local", "long", "pipe", "private", "ptrdiff_t",
+        "read_only", "read_write", "register", "restrict", "return", "sampler_t",
+        "short", "signed", "size_t", "sizeof", "static", "struct", "switch", "typedef",
+        "uchar", "uint", "uintptr_t", "ulong", "union", "unsigned", "ushort", "void",
+        "volatile", "while", "write_only",
+    };
+    for (const char *w : words) {
+        if (s == w)
+            return true;
+    }
+    // vector types (float4, uchar16, ...)
+    size_t d = s.size();
+    while (d > 0 && isdigit((unsigned char)s[d - 1]))
+        d--;
+    if (d == s.size() || d == 0)
+        return false;
+    std::string base = s.substr(0, d), width = s.substr(d);
+    static const char *scalars[] = {
+        "char", "uchar", "short", "ushort", "int", "uint", "long", "ulong", "float",
+        "double", "half",
+    };
+    bool scalar = false;
+    for (const char *t : scalars)
+        scalar |= base == t;
+    return scalar && (width == "2" || width == "3" || width == "4" || width == "8" ||
+        width == "16");
+}
+
+struct ItemToken {
+    std::string     text; // an identifier or a single punctuator
+    int             depth; // of (, [, and { enclosing it
+    bool            ident;
+};
+
+static void addUnique(std::vector<std::string> &names, const std::string &name)
+{
+    if (std::find(names.begin(), names.end(), name) == names.end())
+        names.push_back(name);
+}
+
+// the names a declaration introduces (see TopLevelItem::defines)
+static std::vector<std::string> declaredNames(const std::vector<ItemToken> &ts)
+{
+    std::vector<std::string> names;
+    bool inInit = false;
+    for (size_t i = 0; i < ts.size(); i++) {
+        const auto &t = ts[i];
+        const ItemToken *next = i + 1 < ts.size() ? &ts[i + 1] : nullptr;
+        if (t.ident && (t.text == "struct" || t.text == "union" || t.text == "enum")) {
+            // a tag is defined only by its body (struct s {...}) or alone (struct s;)
+            if (next && next->ident && i + 2 < ts.size() &&
+                (ts[i + 2].text == "{" || (ts[i + 2].text == ";" && i == 0)))
+            {
+                addUnique(names, next->text);
+            }
+            if (t.text == "enum") {
+                // the constants: identifiers after the { or a , inside it
+                size_t j = i + 1;
+                while (j < ts.size() && ts[j].text != "{")
+                    j++;
+                int d = j < ts.size() ? ts[j].depth + 1 : 0;
+                for (size_t k = j + 1; k < ts.size() && ts[k].depth >= d; k++) {
+                    if (ts[k].ident && ts[k].depth == d &&
+                        (ts[k - 1].text == "{" || ts[k - 1].text == ","))
+                    {
+                        addUnique(names, ts[k].text);
+                    }
+                }
+            }
+            continue;
+        }
+        if (t.depth != 0)
+            continue;
+        if (t.text == "=") {
+            inInit = true;
+        } else if (t.text == ",") {
+            inInit = false;
+        } else if (t.ident && !inInit && next && next->depth == 0 &&
+            (next->text == "=" || next->text == ";" || next->text == "[" ||
+             next->text == "," || next->text == "(") &&
+            !isReservedWord(t.text))
+        {
+            addUnique(names, t.text);
+        }
+    }
+    return names;
+}
+
+// as skipSpace, but stops at preprocessor lines
+static size_t skipComments(const char *s, size_t n, size_t i)
+{
+    while (i < n) {
+        if (isspace((unsigned char)s[i])) {
+            i++;
+        } else if (s[i] == '/' && i + 1 < n && s[i + 1] == '/') {
+            while (i < n && s[i] != '\n')
+                i++;
+        } else if (s[i] == '/' && i + 1 < n && s[i + 1] == '*') {
+            i += 2;
+            while (i + 1 < n && !(s[i] == '*' && s[i + 1] == '/'))
+                i++;
+            i = i + 2 < n ? i + 2 : n;
+        } else {
+            break;
+        }
+    }
+    return i;
+}
+
+std::vector<TopLevelItem> parseTopLevel(const char *s, size_t n)
+{
+    std::vector<TopLevelItem> items;
+    size_t i = 0;
+    while (i < n) {
+        i = skipComments(s, n, i);
+        if (i >= n)
+            break;
+
+        TopLevelItem item;
+        item.begin = i;
+        if (s[i] == '#' && atLineStart(s, i)) {
+            size_t e = i;
+            while (e < n && s[e] != '\n') {
+                if (s[e] == '\\' && e + 1 < n && s[e + 1] == '\n')
+                    e++;
+                e++;
+            }
+            item.kind = TopLevelItem::DIRECTIVE;
+            item.end = e;
+            size_t w = i + 1;
+            while (w < e && (s[w] == ' ' || s[w] == '\t'))
+                w++;
+            size_t we = skipIdentifier(s, e, w);
+            item.directive.assign(s + w, we - w);
+            bool first = true;
+            for (size_t j = we; j < e; ) {
+                if (s[j] == '"' || s[j] == '\'' || (s[j] == '<' && item.directive == "include")) {
+                    j = s[j] == '<' ? e : skipLiteral(s, e, j);
+                } else if (isIdentChar(s[j]) && !isdigit((unsigned char)s[j])) {
+                    size_t je = skipIdentifier(s, e, j);
+                    std::string word(s + j, je - j);
+                    if (first && item.directive == "define")
+                        item.defines.push_back(word);
+                    else if (!isReservedWord(word))
+                        addUnique(item.refs, word);
+                    first = false;
+                    j = je;
+                } else if (isIdentChar(s[j])) {
+                    j = skipIdentifier(s, e, j); // a number (1e5f, 0x10u)
+                } else {
+                    j++;
+                }
+            }
+            items.push_back(item);
+            i = e;
+            continue;
+        }
+
+        // a definition or declaration: through the ; at depth 0, or the
+        // } of a function body (a { at depth 0 right after a ')')
+        std::vector<ItemToken> ts;
+        int depth = 0;
+        size_t j = i;
+        item.end = n;
+        while (j < n) {
+            j = skipSpace(s, n, j);
+            if (j >= n)
+                break;
+            char c = s[j];
+            if (c == '"' || c == '\'') {
+                j = skipLiteral(s, n, j);
+                continue;
+            }
+            if (isIdentChar(c)) {
+                size_t e = skipIdentifier(s, n, j);
+                if (!isdigit((unsigned char)c))
+                    ts.push_back({std::string(s + j, e - j), depth, true});
+                j = e;
+                continue;
+            }
+            if (c == '{' && depth == 0 && !ts.empty() && ts.back().text == ")") {
+                size_t close = matchClose(s, n, j);
+                item.kind = TopLevelItem::FUNCTION;
+                item.end = close < n ? close + 1 : n;
+                // the body's identifiers are references, except members
+                // (after . or ->)
+                char last = 0;
+                for (size_t k = j + 1; k < item.end; ) {
+                    k = skipSpace(s, item.end, k);
+                    if (k >= item.end)
+                        break;
+                    if (s[k] == '"' || s[k] == '\'') {
+                        k = skipLiteral(s, item.end, k);
+                        last = '"';
+                    } else if (isIdentChar(s[k])) {
+                        size_t e = skipIdentifier(s, item.end, k);
+                        if (!isdigit((unsigned char)s[k]) && last != '.' && last != '>')
+                            ts.push_back({std::string(s + k, e - k), 1, true});
+                        k = e;
+                        last = 'a';
+                    } else {
+                        last = s[k] == '>' && k > 0 && s[k - 1] != '-' ? '<' : s[k];
+                        k++;
+                    }
+                }
+                break;
+            }
+            if (c == '(' || c == '[' || c == '{') {
+                ts.push_back({std::string(1, c), depth, false});
+                depth++;
+            } else if (c == ')' || c == ']' || c == '}') {
+                if (depth > 0)
+                    depth--;
+                ts.push_back({std::string(1, c), depth, false});
+            } else {
+                ts.push_back({std::string(1, c), depth, false});
+                if (c == ';' && depth == 0) {
+                    item.end = j + 1;
+                    break;
+                }
+            }
+            j++;
+        }
+        std::vector<std::string> params;
+        if (item.kind == TopLevelItem::FUNCTION) {
+            // the name precedes the first ( at depth 0 that is not an
+            // attribute's
+            for (size_t k = 0; k < ts.size(); k++) {
+                if (ts[k].text == "__attribute__") {
+                    while (k + 1 < ts.size() && !(ts[k + 1].text == ")" && ts[k + 1].depth == 0))
+                        k++;
+                    k++;
+                    continue;
+                }
+                if (ts[k].text == "(" && ts[k].depth == 0) {
+                    if (k > 0 && ts[k - 1].ident)
+                        item.defines.push_back(ts[k - 1].text);
+                    // the parameters: the identifier before each , ) or [
+                    for (size_t m = k + 1; m < ts.size(); m++) {
+                        const auto &t = ts[m];
+                        bool end = t.text == ")" && t.depth == 0;
+                        if ((end || (t.depth == 1 && (t.text == "," || t.text == "["))) &&
+                            ts[m - 1].ident)
+                        {
+                            params.push_back(ts[m - 1].text);
+                        }
+                        if (end)
+                            break;
+                    }
+                    break;
+                }
+            }
+        } else {
+            item.defines = declaredNames(ts);
+        }
+        for (const auto &t : ts) {
+            if (t.ident && !isReservedWord(t.text) &&
+                std::find(item.defines.begin(), item.defines.end(), t.text) ==
+                    item.defines.end() &&
+                std::find(params.begin(), params.end(), t.text) == params.end())
+            {
+                addUnique(item.refs, t.text);
+            }
+        }
+        items.push_back(item);
+        i = item.end > i ? item.end : i + 1;
+    }
+    return items;
+}
@@ -0,0 +1,86 @@
+#ifndef CLPARSE_HPP
+#define CLPARSE_HPP
+
+#include <string>
+#include <utility>
+#include <vector>
+
+// A lightweight scanner for the kernels of an OpenCL C translation unit;
+// enough to find each kernel's name, parameters, and body for the
+// source-to-source features (-spec=, ...).  It does not preprocess:
+// comments, string literals, and preprocessor lines are skipped, so the
+// kernels of every #if branch are reported, and kernels produced by
+// macros are not.
+
+struct KernelParam {
+    std::string     text; // comments removed and whitespace collapsed
+    std::string     type; // text without the name (e.g. "const global float *")
+    std::string     name;
+
+    bool isPointer() const { return type.find('*') != std::string::npos; }
+};
+
+struct KernelDecl {
+    std::string                 name;
+    size_t                      begin = 0; // the kernel (or __kernel) keyword
+    size_t                      nameBegin = 0, nameEnd = 0;
+    size_t                      paramsBegin = 0, paramsEnd = 0; // inside the parentheses
+    size_t                      bodyBegin = 0, bodyEnd = 0; // '{' through '}'
+    std::vector<KernelParam>    params;
+};
+
+// A top-level construct: a preprocessor line, a function definition, or
+// a declaration through its ';' (types, globals, prototypes)
+struct TopLevelItem {
+    enum Kind {DIRECTIVE, FUNCTION, DECLARATION};
+
+    Kind                        kind = DECLARATION;
+    size_t                      begin = 0, end = 0;
+    std::string                 directive; // "define", "if", ... for DIRECTIVE
+    // the names it introduces (a function, macro, type, struct tag, enum
+    // constant, or variable); empty if none could be told (e.g. a typedef
+    // of a function pointer)
+    std::vector<std::string>    defines;
+    // the other identifiers it mentions, keywords and built-in types
+    // excluded (member names and parameters are included, so this is a
+    // superset of what it depends on)
+    std::vector<std::string>    refs;
+};
+
+// the top-level items in source order; text between them is whitespace
+// and comments
+std::vector<TopLevelItem> parseTopLevel(const char *src, size_t n);
+// true for OpenCL C keywords, qualifiers, and built-in type names
+bool isReservedWord(const std::string &s);
+
+// the kernel definitions (not prototypes) in source order
+std::vector<KernelDecl> parseKernels(const char *src, size_t n);
+// the 1-based line number of an offset
+size_t lineOf(const char *src, size_t offset);
+// the offsets of the identifier in [begin, end), outside comments and
+// literals
+std::vector<size_t> identifierUses(
+    const char *src, size_t begin, size_t end, const std::string &name);
+// A token of code: comments, literals, and preprocessor lines are not
+// tokens; a number includes its suffix, exponent, and fraction
+struct CodeToken {
+    enum Kind {IDENT, NUMBER, PUNCT};
+
+    Kind            kind = PUNCT;
+    size_t          begin = 0, end = 0;
+    std::string     text; // an operator is one token (+=, ->, <<=, ...)
+};
+
+// the tokens in [begin, end)
+std::vector<CodeToken> codeTokens(const char *src, size_t begin, size_t end);
+// the offset of the bracket closing the (, [, or { at open (end if none)
+size_t closingBracket(const char *src, size_t end, size_t open);
+// "#line LINE "PATH"\n" (without the path for stdin, -)
+std::string lineDirective(size_t line, const std::string &path);
+// the path and line an offset of a (possibly #line-directed) text came from
+std::pair<std::string,size_t> sourceLocation(
+    const char *src, size_t offset, const std::string &path);
+// true for [A-Za-z_][A-Za-z0-9_]*
+bool isIdentifier(const std::string &s);
+
+#endif
@@ -0,0 +1,552 @@
+#include "devices.hpp"
+#include "hash.hpp"
+#include "json.hpp"
+#include "system.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <dlfcn.h>
+#endif
+
+static const int SNAPSHOT_FORMAT = 1;
+
+static const char *deviceTypeName(cl_device_type t)
+{
+    switch (t) {
+    case CL_DEVICE_TYPE_CPU: return "CL_DEVICE_TYPE_CPU";
+    case CL_DEVICE_TYPE_GPU: return "CL_DEVICE_TYPE_GPU";
+    case CL_DEVICE_TYPE_ACCELERATOR: return "CL_DEVICE_TYPE_ACCELERATOR";
+    case CL_DEVICE_TYPE_DEFAULT: return "CL_DEVICE_TYPE_DEFAULT";
+    default: return nullptr;
+    }
+}
+
+// getInfo strings include the terminator
+static std::string infoString(const std::string &s)
+{
+    return s.c_str();
+}
+
+// the vendor ICD registrations; adding or removing a driver changes these
+static std::vector<std::string> icdRegistrations()
+{
+    std::vector<std::string> icds;
+#ifdef _WIN32
+    HKEY key;
+    if (RegOpenKeyExA(HKEY_LOCAL_MACHINE, "SOFTWARE\\Khronos\\OpenCL\\Vendors",
+        0, KEY_READ, &key) == ERROR_SUCCESS)
+    {
+        char name[MAX_PATH];
+        for (DWORD i = 0;; i++) {
+            DWORD len = sizeof(name);
+            if (RegEnumValueA(key, i, name, &len,
+                nullptr, nullptr, nullptr, nullptr) != ERROR_SUCCESS)
+            {
+                break;
+            }
+            icds.push_back(name);
+        }
+        RegCloseKey(key);
+    }
+#else
+    std::string dir = "/etc/OpenCL/vendors";
+    if (const char *env = getenv("OCL_ICD_VENDORS")) {
+        if (isDirectory(env))
+            dir = env;
+        else
+            icds.push_back(env);
+    }
+    for (const auto &f : listDirectory(dir)) {
+        if (f.size() > 4 && f.compare(f.size() - 4, 4, ".icd") == 0)
+            icds.push_back(dir + "/" + f);
+    }
+    if (const char *env = getenv("OCL_ICD_FILENAMES"))
+        icds.push_back(env);
+#endif
+    std::sort(icds.begin(), icds.end());
+    return icds;
+}
+
+// the ICD loader (or OpenCL library) clc runs against
+static std::string openclLibrary()
+{
+#ifdef _WIN32
+    char path[MAX_PATH];
+    HMODULE mod = GetModuleHandleA("OpenCL.dll");
+    if (mod && GetModuleFileNameA(mod, path, sizeof(path)))
+        return path;
+#else
+    Dl_info info;
+    if (dladdr((void *)&clGetPlatformIDs, &info) && info.dli_fname)
+        return info.dli_fname;
+#endif
+    return std::string();
+}
+
+// a driver update replaces some of these files, changing a size or mtime
+static std::string runtimeFingerprint(const std::vector<std::string> &files)
+{
+    Sha256 h;
+    h.updateField(std::string("clc " VERSION_STRING));
+    auto addFile = [&](const std::string &path) {
+        uint64_t size = 0;
+        int64_t mtime = 0;
+        h.updateField(path);
+        h.updateField(fileStat(path, size, mtime) ?
+            std::to_string(size) + "@" + std::to_string(mtime) : std::string("-"));
+    };
+    for (const auto &icd : icdRegistrations())
+        addFile(icd);
+    for (const auto &f : files)
+        addFile(f);
+    return h.hexDigest();
+}
+
+static DeviceSnapshot captureSnapshot()
+{
+    TRACE_SCOPE("capture devices");
+    auto before = loadedLibraries();
+    std::sort(before.begin(), before.end());
+
+    DeviceSnapshot snap;
+    snap.captured = true;
+    std::vector<cl::Platform> ps;
+    cl::Platform::get(&ps);
+    for (size_t pi = 0; pi < ps.size(); pi++) {
+        PlatformInfo pinfo;
+        pinfo.name = infoString(ps[pi].getInfo<CL_PLATFORM_NAME>());
+        pinfo.vendor = infoString(ps[pi].getInfo<CL_PLATFORM_VENDOR>());
+        pinfo.version = infoString(ps[pi].getInfo<CL_PLATFORM_VERSION>());
+        snap.platforms.push_back(pinfo);
+        debug("scanning platform %s\n", pinfo.name.c_str());
+
+        std::vector<cl::Device> ds;
+        try {
+            ps[pi].getDevices(CL_DEVICE_TYPE_ALL, &ds);
+        } catch (const cl::Error &) {
+            // CL_DEVICE_NOT_FOUND: a platform with no devices
+        }
+        for (size_t di = 0; di < ds.size(); di++) {
+            const auto &d = ds[di];
+            DeviceInfo info;
+            info.platform = pi;
+            info.index = di;
+#define CAPTURE_STRING(SYM, T, F) info.F = infoString(d.getInfo<SYM>());
+#define CAPTURE_INTEGER(SYM, T, F) info.F = d.getInfo<SYM>();
+            DEVICE_STRING_PROPERTIES(CAPTURE_STRING)
+            DEVICE_INTEGER_PROPERTIES(CAPTURE_INTEGER)
+#undef CAPTURE_STRING
+#undef CAPTURE_INTEGER
+            info.maxWorkItemSizes = d.getInfo<CL_DEVICE_MAX_WORK_ITEM_SIZES>();
+            debug("  scanning device %s\n", info.name.c_str());
+            snap.devices.push_back(info);
+        }
+    }
+
+    // the drivers the loader just brought in (and what they depend on)
+    // identify the installed runtime better than their registrations do
+    auto lib = openclLibrary();
+    if (!lib.empty())
+        snap.runtimeFiles.push_back(lib);
+    for (const auto &f : loadedLibraries()) {
+        if (!std::binary_search(before.begin(), before.end(), f))
+            snap.runtimeFiles.push_back(f);
+    }
+    snap.fingerprint = runtimeFingerprint(snap.runtimeFiles);
+    return snap;
+}
+
+void writeDeviceSnapshot(std::ostream &os, const DeviceSnapshot &snap)
+{
+    JsonWriter w(os);
+    w.beginObject();
+    w.member("format", SNAPSHOT_FORMAT);
+    w.member("clc", VERSION_STRING);
+    w.member("fingerprint", snap.fingerprint);
+    w.key("runtime_files").beginArray();
+    for (const auto &f : snap.runtimeFiles)
+        w.value(f);
+    w.endArray();
+    w.key("platforms").beginArray();
+    for (size_t pi = 0; pi < snap.platforms.size(); pi++) {
+        const auto &p = snap.platforms[pi];
+        w.beginObject();
+        w.member("CL_PLATFORM_NAME", p.name);
+        w.member("CL_PLATFORM_VENDOR", p.vendor);
+        w.member("CL_PLATFORM_VERSION", p.version);
+        w.key("devices").beginArray();
+        for (const auto &d : snap.devices) {
+            if (d.platform != pi)
+                continue;
+            w.beginObject();
+#define WRITE_PROPERTY(SYM, T, F) w.member(#SYM, d.F);
+            DEVICE_STRING_PROPERTIES(WRITE_PROPERTY)
+            DEVICE_INTEGER_PROPERTIES(WRITE_PROPERTY)
+#undef WRITE_PROPERTY
+            w.key("CL_DEVICE_MAX_WORK_ITEM_SIZES").beginArray();
+            for (auto s : d.maxWorkItemSizes)
+                w.value(s);
+            w.endArray();
+            w.endObject();
+        }
+        w.endArray();
+        w.endObject();
+    }
+    w.endArray();
+    w.endObject();
+}
+
+static bool readSnapshot(const std::string &path, DeviceSnapshot &snap)
+{
+    uint64_t size;
+    int64_t mtime;
+    if (path.empty() || !fileStat(path, size, mtime))
+        return false;
+    TRACE_SCOPE("load devices");
+    std::string text, err;
+    JsonValue doc;
+    try {
+        text = readTextFile(path);
+    } catch (const FatalError &) {
+        return false;
+    }
+    if (!parseJson(text, doc, err)) {
+        warning("%s: %s; recapturing the device snapshot\n", path.c_str(), err.c_str());
+        return false;
+    }
+    if (doc["format"].uint64() != SNAPSHOT_FORMAT || doc["clc"].str() != VERSION_STRING)
+        return false;
+    snap.fingerprint = doc["fingerprint"].str();
+    for (size_t i = 0; i < doc["runtime_files"].size(); i++)
+        snap.runtimeFiles.push_back(doc["runtime_files"][i].str());
+    if (snap.fingerprint != runtimeFingerprint(snap.runtimeFiles)) {
+        verbose("%s: the OpenCL runtime changed; recapturing the device snapshot\n",
+            path.c_str());
+        return false;
+    }
+    const auto &ps = doc["platforms"];
+    for (size_t pi = 0; pi < ps.size(); pi++) {
+        PlatformInfo p;
+        p.name = ps[pi]["CL_PLATFORM_NAME"].str();
+        p.vendor = ps[pi]["CL_PLATFORM_VENDOR"].str();
+        p.version = ps[pi]["CL_PLATFORM_VERSION"].str();
+        snap.platforms.push_back(p);
+        const auto &ds = ps[pi]["devices"];
+        for (size_t di = 0; di < ds.size(); di++) {
+            const auto &d = ds[di];
+            DeviceInfo info;
+            info.platform = pi;
+            info.index = di;
+#define READ_STRING(SYM, T, F) info.F = d[#SYM].str();
+#define READ_INTEGER(SYM, T, F) info.F = (T)d[#SYM].uint64();
+            DEVICE_STRING_PROPERTIES(READ_STRING)
+            DEVICE_INTEGER_PROPERTIES(READ_INTEGER)
+#undef READ_STRING
+#undef READ_INTEGER
+            const auto &wis = d["CL_DEVICE_MAX_WORK_ITEM_SIZES"];
+            for (size_t i = 0; i < wis.size(); i++)
+                info.maxWorkItemSizes.push_back((size_t)wis[i].uint64());
+            snap.devices.push_back(info);
+        }
+    }
+    debug("%s: %d devices on %d platforms\n", path.c_str(),
+        (int)snap.devices.size(), (int)snap.platforms.size());
+    return true;
+}
+
+static std::string snapshotPath(const Opts &opts)
+{
+    std::string dir = opts.cacheDir.empty() ? userCacheDirectory() : opts.cacheDir;
+    return dir.empty() ? dir : dir + "/devices.json";
+}
+
+DeviceSnapshot deviceSnapshot(const Opts &opts, bool refresh)
+{
+    // one per process; the batch workers and the server share it
+    static std::mutex mutex;
+    static std::unique_ptr<DeviceSnapshot> current;
+    std::lock_guard<std::mutex> lock(mutex);
+    if (opts.refreshDevices && !(current && current->captured))
+        refresh = true;
+    if (current && !refresh)
+        return *current;
+
+    auto path = snapshotPath(opts);
+    DeviceSnapshot snap;
+    if (refresh || !readSnapshot(path, snap)) {
+        snap = captureSnapshot();
+        if (!path.empty()) {
+            std::stringstream ss;
+            writeDeviceSnapshot(ss, snap);
+            auto text = ss.str();
+            auto dir = path.substr(0, path.find_last_of("/\\"));
+            if (makeDirectories(dir) && writeFileAtomic(path, text.data(), text.size())) {
+                verbose("saved the device snapshot to %s\n", path.c_str());
+            } else {
+                warning("%s: failed to save the device snapshot\n", path.c_str());
+            }
+        }
+    }
+    current.reset(new DeviceSnapshot(snap));
+    return snap;
+}
+
+bool deviceMatches(const Opts &opts, const DeviceInfo &dev)
+{
+    return (dev.type & opts.deviceType) != 0 &&
+        (opts.vendorId == 0 || dev.vendorId == opts.vendorId) &&
+        dev.name.find(opts.device) != std::string::npos;
+}
+
+std::vector<cl::Device> findDevices(const Opts &opts)
+{
+    TRACE_SCOPE("device discovery");
+    debug("selecting matching device %s\n", opts.device.c_str());
+    std::vector<cl::Device> matching;
+    if (opts.device.length() == 0 && opts.vendorId == 0 &&
+        opts.deviceType == CL_DEVICE_TYPE_ALL && !opts.multiDevice)
+    {
+        matching.emplace_back(cl::Device::getDefault());
+    } else {
+        for (bool refresh = false;; refresh = true) {
+            auto snap = deviceSnapshot(opts, refresh);
+            // only the platforms with a match are enumerated
+            std::vector<cl::Platform> ps;
+            std::map<size_t,std::vector<cl::Device>> platformDevices;
+            bool stale = false;
+            matching.clear();
+            for (const auto &d : snap.devices) {
+                if (!deviceMatches(opts, d))
+                    continue;
+                if (ps.empty())
+                    cl::Platform::get(&ps);
+                if (d.platform >= ps.size()) {
+                    stale = true;
+                    break;
+                }
+                auto itr = platformDevices.find(d.platform);
+                if (itr == platformDevices.end()) {
+                    std::vector<cl::Device> ds;
+                    try {
+                        ps[d.platform].getDevices(CL_DEVICE_TYPE_ALL, &ds);
+                    } catch (const cl::Error &) {
+                    }
+                    itr = platformDevices.emplace(d.platform, ds).first;
+                }
+                if (d.index >= itr->second.size() ||
+                    infoString(itr->second[d.index].getInfo<CL_DEVICE_NAME>()) != d.name)
+                {
+                    stale = true;
+                    break;
+                }
+                matching.push_back(itr->second[d.index]);
+            }
+            // a device added since the snapshot would not match either
+            if (snap.captured || (!stale && !matching.empty()))
+                break;
+            verbose("the device snapshot is out of date; recapturing\n");
+        }
+    }
+    if (matching.empty()) {
+        fatal("-d=%s: unable to find matching device", opts.device.c_str());
+    }
+    for (auto &d : matching)
+        debug("  => picked device %s\n", d.getInfo<CL_DEVICE_NAME>().c_str());
+    return matching;
+}
+
+cl::Device findDevice(const Opts &opts)
+{
+    auto matching = findDevices(opts);
+    if (matching.size() > 1) {
+        std::stringstream ss;
+        ss << "-d=" << opts.device << ": matches multiple devices"
+            " (use -m to compile for all of them)\n";
+        for (auto &d : matching) {
+            auto p = d.getInfo<CL_DEVICE_PLATFORM>();
+            cl::Platform p2(p);
+            ss << "  - " << d.getInfo<CL_DEVICE_NAME>() <<
+                "  (from " << p2.getInfo<CL_PLATFORM_NAME>() << ")\n";
+        }
+        fatal(ss.str());
+    }
+    return matching[0];
+}
+
+static void emitProperty(const char *prop)
+{
+    std::cout << "  " << prop << ": ";
+    for (int i = 0, len = 48 - (int)strlen(prop); i < len; i++)
+        std::cout << ' ';
+
+}
+template <typename T>
+static void emitPropertyIntegralUnits(const char *prop, const T &val, const char *units)
+{
+    emitProperty(prop);
+    std::cout << val;
+    if (units && *units)
+        std::cout << " " << units;
+    std::cout << "\n";
+}
+template <typename T>
+static void emitPropertyIntegralBytes(const char *prop, T val)
+{
+    const char *units = "B";
+    if (val % (1024 * 1024) == 0) {
+        val = (val >> 20);
+        units = "MB";
+    } else if (val % 1024 == 0) {
+        val = (val >> 10);
+        units = "KB";
+    }
+    emitPropertyIntegralUnits(prop, val, units);
+}
+static void emitBoolProperty(const char *prop, cl_bool val)
+{
+    emitProperty(prop);
+    std::cout << (val ? "CL_TRUE" : "CL_FALSE") << "\n";
+}
+#define EMIT_DEVICE_PROPERTY_UNITS(SYM,F,UNITS)  emitPropertyIntegralUnits(#SYM, d.F, UNITS)
+#define EMIT_DEVICE_PROPERTY_MEM(SYM,F)  emitPropertyIntegralBytes(#SYM, d.F)
+#define EMIT_DEVICE_PROPERTY_BOOL(SYM,F)  emitBoolProperty(#SYM, d.F)
+
+void listDevices(const Opts &opts)
+{
+    TRACE_SCOPE("list devices");
+    auto snap = deviceSnapshot(opts);
+    if (opts.listJson) {
+        writeDeviceSnapshot(std::cout, snap);
+        return;
+    }
+    for (const auto &d : snap.devices) {
+        std::cout << "DEVICE: \"" << d.name << "\"";
+        std::cout << "\n";
+        if (opts.verbosity > 0) {
+            EMIT_DEVICE_PROPERTY_UNITS(CL_DEVICE_VERSION,version,nullptr);
+            EMIT_DEVICE_PROPERTY_UNITS(CL_DEVICE_VENDOR,vendor,nullptr);
+            EMIT_DEVICE_PROPERTY_UNITS(CL_DRIVER_VERSION,driverVersion,nullptr);
+            emitProperty("CL_DEVICE_TYPE");
+            if (const char *tnm = deviceTypeName(d.type)) {
+                std::cout << tnm;
+            } else {
+                std::cout << d.type << "?";
+            }
+            std::cout << "\n";
+            std::cout << "  COMPUTE:\n";
+            EMIT_DEVICE_PROPERTY_UNITS(CL_DEVICE_MAX_CLOCK_FREQUENCY,maxClockFrequency,"MHz");
+            EMIT_DEVICE_PROPERTY_UNITS(CL_DEVICE_MAX_COMPUTE_UNITS,maxComputeUnits,nullptr);
+            EMIT_DEVICE_PROPERTY_UNITS(CL_DEVICE_PROFILING_TIMER_RESOLUTION,profilingTimerResolution,"ns");
+            EMIT_DEVICE_PROPERTY_BOOL(CL_DEVICE_ENDIAN_LITTLE,endianLittle);
+            // EMIT_DEVICE_PROPERTY_MEM(CL_DEVICE_PRINTF_BUFFER_SIZE); (not supported
+
+            emitProperty("CL_DEVICE_SINGLE_FP_CONFIG"); {
+                auto fpcfg = d.singleFpConfig;
+                const char *sep = ""; // "|";
+                if ((fpcfg & CL_FP_DENORM)) {
+                    std::cout << sep << "CL_FP_DENORM";
+                    sep = "|";
+                }
+                if ((fpcfg & CL_FP_INF_NAN)) {
+                    std::cout << sep << "CL_FP_INF_NAN";
+                    sep = "|";
+                }
+                if ((fpcfg & CL_FP_ROUND_TO_NEAREST)) {
+                    std::cout << sep << "CL_FP_ROUND_TO_NEAREST";
+                    sep = "|";
+                }
+                if ((fpcfg & CL_FP_ROUND_TO_ZERO)) {
+                    std::cout << sep << "CL_FP_ROUND_TO_ZERO";
+                    sep = "|";
+                }
+                if ((fpcfg & CL_FP_ROUND_TO_INF)) {
+                    std::cout << sep << "CL_FP_ROUND_TO_INF";
+                    sep = "|";
+                }
+                if ((fpcfg & CL_FP_FMA)) {
+                    std::cout << sep << "CL_FP_FMA";
+                    sep = "|";
+                }
+                if ((fpcfg & CL_FP_CORRECTLY_ROUNDED_DIVIDE_SQRT)) {
+                    std::cout << sep << "CL_FP_CORRECTLY_ROUNDED_DIVIDE_SQRT";
+                    sep = "|";
+                }
+                if ((fpcfg & CL_FP_SOFT_FLOAT)) {
+                    std::cout << sep << "CL_FP_SOFT_FLOAT";
+                    sep = "|";
+                }
+                std::cout << "\n";
+            }
+
+            emitProperty("CL_DEVICE_QUEUE_PROPERTIES"); {
+                const char *sep = ""; // "|";
+                auto devq = d.queueProperties;
+                if ((devq & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE)) {
+                    std::cout << sep << "CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE";
+                    sep = "|";
+                }
+                if ((devq & CL_QUEUE_PROFILING_ENABLE)) {
+                    std::cout << sep << "CL_QUEUE_PROFILING_ENABLE";
+                    sep = "|";
+                }
+                std::cout << "\n";
+            }
+
+            std::cout << "  WORKGROUPS:\n";
+            EMIT_DEVICE_PROPERTY_UNITS(CL_DEVICE_MAX_WORK_GROUP_SIZE,maxWorkGroupSize,"items");
+            const auto &dim = d.maxWorkItemSizes;
+            emitProperty("CL_DEVICE_MAX_WORK_ITEM_SIZES");
+            for (size_t i = 0; i < dim.size(); i++) {
+                std::cout << (i > 0 ? "x" : "") << dim[i];
+            }
+            std::cout << "\n";
+            EMIT_DEVICE_PROPERTY_UNITS(CL_DEVICE_PREFERRED_VECTOR_WIDTH_CHAR,preferredVectorWidthChar,nullptr);
+            EMIT_DEVICE_PROPERTY_UNITS(CL_DEVICE_PREFERRED_VECTOR_WIDTH_FLOAT,preferredVectorWidthFloat,nullptr);
+            std::cout << "  MEMORY:\n";
+            EMIT_DEVICE_PROPERTY_UNITS(CL_DEVICE_ADDRESS_BITS,addressBits,"b");
+            EMIT_DEVICE_PROPERTY_MEM(CL_DEVICE_MEM_BASE_ADDR_ALIGN,memBaseAddrAlign);
+            EMIT_DEVICE_PROPERTY_MEM(CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE,maxConstantBufferSize);
+            EMIT_DEVICE_PROPERTY_MEM(CL_DEVICE_LOCAL_MEM_SIZE,localMemSize);
+            EMIT_DEVICE_PROPERTY_MEM(CL_DEVICE_GLOBAL_MEM_SIZE,globalMemSize);
+            emitProperty("CL_DEVICE_GLOBAL_MEM_CACHE_TYPE");
+            switch (d.globalMemCacheType) {
+            case CL_NONE: std::cout << "CL_NONE"; break;
+            case CL_READ_ONLY_CACHE: std::cout << "CL_READ_ONLY_CACHE"; break;
+            case CL_READ_WRITE_CACHE: std::cout << "CL_READ_WRITE_CACHE"; break;
+            default: std::cout << d.globalMemCacheType << "?\n"; break;
+            }
+            std::cout << "\n";
+            EMIT_DEVICE_PROPERTY_MEM(CL_DEVICE_GLOBAL_MEM_CACHELINE_SIZE,globalMemCachelineSize);
+            EMIT_DEVICE_PROPERTY_MEM(CL_DEVICE_GLOBAL_MEM_CACHE_SIZE,globalMemCacheSize);
+            std::cout << "  IMAGES:\n";
+            EMIT_DEVICE_PROPERTY_BOOL(CL_DEVICE_IMAGE_SUPPORT,imageSupport);
+            EMIT_DEVICE_PROPERTY_UNITS(CL_DEVICE_IMAGE2D_MAX_HEIGHT,image2dMaxHeight,"px");
+            EMIT_DEVICE_PROPERTY_UNITS(CL_DEVICE_IMAGE2D_MAX_WIDTH,image2dMaxWidth,"px");
+            // IF NVDA
+            // https://www.khronos.org/registry/cl/extensions/nv/cl_nv_device_attribute_query.txt
+            // e.g. CL_DEVICE_WARP_SIZE_NV
+
+            // EMIT_DEVICE_PROPERTY_UNITS(CL_DEVICE_IMAGE_PITCH_ALIGNMENT,nullptr); // OCL 2.0?
+            std::cout << "  EXTENSIONS:\n";
+            std::istringstream iss(d.extensions);
+            std::vector<std::string> tokens;
+            std::copy(std::istream_iterator<std::string>(iss),
+                std::istream_iterator<std::string>(),
+                std::back_inserter(tokens));
+            for (auto tk : tokens) {
+                std::cout << "  " << tk << "\n";
+            }
+        }
+    }
+}
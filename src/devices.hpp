@@ -0,0 +1,89 @@
+#ifndef DEVICES_HPP
+#define DEVICES_HPP
+
+#include "clc.hpp"
+
+#include <ostream>
+#include <string>
+#include <vector>
+
+// A snapshot of every platform and device with the properties that
+// -h=d -v prints and device selection needs.
+//
+// Walking every platform and querying each device costs dozens of calls
+// per device (some drivers wake the GPU to answer them), so clc records
+// the answers once as JSON (devices.json in the -cache= directory, or in
+// the user's cache directory) and selects devices from the record; only
+// the selected device's platform is then enumerated.  The snapshot is
+// recaptured when its fingerprint of the OpenCL runtime (the ICD loader,
+// the vendor ICD registrations, and the driver libraries they loaded)
+// no longer matches, when a selected device does not match its record,
+// or with --refresh-devices.
+
+// X(SYMBOL, TYPE, FIELD)
+#define DEVICE_STRING_PROPERTIES(X) \
+    X(CL_DEVICE_NAME, std::string, name) \
+    X(CL_DEVICE_VENDOR, std::string, vendor) \
+    X(CL_DEVICE_VERSION, std::string, version) \
+    X(CL_DRIVER_VERSION, std::string, driverVersion) \
+    X(CL_DEVICE_EXTENSIONS, std::string, extensions)
+#define DEVICE_INTEGER_PROPERTIES(X) \
+    X(CL_DEVICE_VENDOR_ID, cl_uint, vendorId) \
+    X(CL_DEVICE_TYPE, cl_device_type, type) \
+    X(CL_DEVICE_MAX_CLOCK_FREQUENCY, cl_uint, maxClockFrequency) \
+    X(CL_DEVICE_MAX_COMPUTE_UNITS, cl_uint, maxComputeUnits) \
+    X(CL_DEVICE_PROFILING_TIMER_RESOLUTION, size_t, profilingTimerResolution) \
+    X(CL_DEVICE_ENDIAN_LITTLE, cl_bool, endianLittle) \
+    X(CL_DEVICE_SINGLE_FP_CONFIG, cl_device_fp_config, singleFpConfig) \
+    X(CL_DEVICE_QUEUE_PROPERTIES, cl_command_queue_properties, queueProperties) \
+    X(CL_DEVICE_MAX_WORK_GROUP_SIZE, size_t, maxWorkGroupSize) \
+    X(CL_DEVICE_PREFERRED_VECTOR_WIDTH_CHAR, cl_uint, preferredVectorWidthChar) \
+    X(CL_DEVICE_PREFERRED_VECTOR_WIDTH_SHORT, cl_uint, preferredVectorWidthShort) \
+    X(CL_DEVICE_PREFERRED_VECTOR_WIDTH_INT, cl_uint, preferredVectorWidthInt) \
+    X(CL_DEVICE_PREFERRED_VECTOR_WIDTH_LONG, cl_uint, preferredVectorWidthLong) \
+    X(CL_DEVICE_PREFERRED_VECTOR_WIDTH_FLOAT, cl_uint, preferredVectorWidthFloat) \
+    X(CL_DEVICE_PREFERRED_VECTOR_WIDTH_DOUBLE, cl_uint, preferredVectorWidthDouble) \
+    X(CL_DEVICE_ADDRESS_BITS, cl_uint, addressBits) \
+    X(CL_DEVICE_MEM_BASE_ADDR_ALIGN, cl_uint, memBaseAddrAlign) \
+    X(CL_DEVICE_MAX_MEM_ALLOC_SIZE, cl_ulong, maxMemAllocSize) \
+    X(CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE, cl_ulong, maxConstantBufferSize) \
+    X(CL_DEVICE_LOCAL_MEM_SIZE, cl_ulong, localMemSize) \
+    X(CL_DEVICE_GLOBAL_MEM_SIZE, cl_ulong, globalMemSize) \
+    X(CL_DEVICE_GLOBAL_MEM_CACHE_TYPE, cl_device_mem_cache_type, globalMemCacheType) \
+    X(CL_DEVICE_GLOBAL_MEM_CACHELINE_SIZE, cl_uint, globalMemCachelineSize) \
+    X(CL_DEVICE_GLOBAL_MEM_CACHE_SIZE, cl_ulong, globalMemCacheSize) \
+    X(CL_DEVICE_IMAGE_SUPPORT, cl_bool, imageSupport) \
+    X(CL_DEVICE_IMAGE2D_MAX_HEIGHT, size_t, image2dMaxHeight) \
+    X(CL_DEVICE_IMAGE2D_MAX_WIDTH, size_t, image2dMaxWidth)
+
+struct DeviceInfo {
+    size_t                  platform = 0; // index in clGetPlatformIDs order
+    size_t                  index = 0; // in the platform's CL_DEVICE_TYPE_ALL list
+#define DEVICE_FIELD(SYM, T, F) T F = T();
+    DEVICE_STRING_PROPERTIES(DEVICE_FIELD)
+    DEVICE_INTEGER_PROPERTIES(DEVICE_FIELD)
+#undef DEVICE_FIELD
+    std::vector<size_t>     maxWorkItemSizes;
+};
+
+struct PlatformInfo {
+    std::string             name;
+    std::string             vendor;
+    std::string             version;
+};
+
+struct DeviceSnapshot {
+    std::string                 fingerprint;
+    std::vector<std::string>    runtimeFiles; // loader and driver libraries
+    std::vector<PlatformInfo>   platforms;
+    std::vector<DeviceInfo>     devices; // platform by platform
+    bool                        captured = false; // queried by this process
+};
+
+// the current snapshot (read from disk unless it is stale or refresh is set)
+DeviceSnapshot deviceSnapshot(const Opts &opts, bool refresh = false);
+void writeDeviceSnapshot(std::ostream &os, const DeviceSnapshot &snap);
+// the -d=, -t=, and -vendor= filters
+bool deviceMatches(const Opts &opts, const DeviceInfo &dev);
+
+#endif
@@ -0,0 +1,227 @@
+#include "clc.hpp"
+#include "hash.hpp"
+#include "includes.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <ctype.h>
+#include <map>
+#include <stdio.h>
+
+// foo.cpp -> foo.hpp
+std::string embedHeaderPath(const std::string &sourcePath)
+{
+    auto slash = sourcePath.find_last_of("/\\");
+    auto dot = sourcePath.rfind('.');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+        return sourcePath + ".hpp";
+    return sourcePath.substr(0, dot) + ".hpp";
+}
+
+// a C string literal; ? is escaped against trigraphs
+static std::string quoted(const std::string &s)
+{
+    std::string q = "\"";
+    for (char c : s) {
+        unsigned char u = (unsigned char)c;
+        if (c == '"' || c == '\\' || c == '?') {
+            q += '\\';
+            q += c;
+        } else if (u < 0x20 || u >= 0x7f) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\%03o", u);
+            q += buf;
+        } else {
+            q += c;
+        }
+    }
+    return q + "\"";
+}
+
+// the array initializer, 16 bytes per line; several MB of binary make
+// tens of MB of text, so this avoids a printf per byte
+static void appendBytes(std::string &out, const std::vector<char> &bits)
+{
+    static const char hex[] = "0123456789abcdef";
+    out.reserve(out.size() + bits.size() * 6 + bits.size() / 16 * 5 + 16);
+    for (size_t i = 0; i < bits.size(); i++) {
+        if (i % 16 == 0)
+            out += "    ";
+        unsigned char u = (unsigned char)bits[i];
+        char b[6] = {'0', 'x', hex[u >> 4], hex[u & 15], ',', '\0'};
+        out += b;
+        out += i % 16 == 15 || i + 1 == bits.size() ? "\n" : " ";
+    }
+}
+
+struct EmbedItem {
+    std::string     device;
+    std::string     driver;
+    size_t          payload; // index of the array
+};
+
+std::vector<std::pair<std::string,std::string>> embeddedSources(
+    const Opts &opts,
+    const std::vector<DeviceBinary> &bins,
+    const std::string &sourcePath)
+{
+    TRACE_SCOPE("generate C++");
+    std::string headerPath = embedHeaderPath(sourcePath);
+    std::string ns = identifierFrom(sourcePath);
+    std::string guard = ns;
+    for (auto &c : guard)
+        c = (char)toupper((unsigned char)c);
+    std::string inputs;
+    for (const auto &a : opts.args)
+        inputs += (inputs.empty() ? "" : " ") + (a == "-" ? std::string("stdin") : a);
+
+    // as in an archive, identical binaries are emitted once and the table
+    // is sorted for a binary search
+    std::vector<const std::vector<char> *> payloads;
+    std::map<std::string,size_t> byHash;
+    std::vector<EmbedItem> items;
+    for (const auto &b : bins) {
+        EmbedItem it;
+        it.device = b.device.getInfo<CL_DEVICE_NAME>().c_str();
+        it.driver = b.device.getInfo<CL_DRIVER_VERSION>().c_str();
+        auto h = sha256Hex(b.bits.data(), b.bits.size());
+        auto itr = byHash.find(h);
+        if (itr == byHash.end()) {
+            itr = byHash.emplace(h, payloads.size()).first;
+            payloads.push_back(&b.bits);
+        }
+        it.payload = itr->second;
+        items.push_back(it);
+    }
+    std::stable_sort(items.begin(), items.end(), [](const EmbedItem &a, const EmbedItem &b) {
+        return a.device != b.device ? a.device < b.device : a.driver < b.driver;
+    });
+    items.erase(std::unique(items.begin(), items.end(),
+        [](const EmbedItem &a, const EmbedItem &b) {
+            return a.device == b.device && a.driver == b.driver;
+        }), items.end());
+
+    std::string hdr;
+    hdr += "// generated by clc -F=cpp from " + inputs + "; do not edit\n";
+    hdr += "//\n";
+    hdr += "// The binaries are compiled into the program (see the .cpp file), so\n";
+    hdr += "// loading them needs no file I/O, and clCreateProgramWithBinary reads\n";
+    hdr += "// them where they are:\n";
+    hdr += "//\n";
+    hdr += "//   cl_int err;\n";
+    hdr += "//   cl_program prog = " + ns + "::createProgram(ctx, dev, &err);\n";
+    hdr += "#ifndef " + guard + "_HPP\n";
+    hdr += "#define " + guard + "_HPP\n\n";
+    hdr += "#include <stddef.h>\n\n";
+    hdr += "#ifdef __APPLE__\n#include <OpenCL/cl.h>\n#else\n#include <CL/cl.h>\n#endif\n\n";
+    hdr += "namespace " + ns + " {\n\n";
+    hdr += "struct Binary {\n";
+    hdr += "    const char          *device;    // CL_DEVICE_NAME\n";
+    hdr += "    const char          *driver;    // CL_DRIVER_VERSION\n";
+    hdr += "    const unsigned char *bits;      // 16-byte aligned\n";
+    hdr += "    size_t              size;\n";
+    hdr += "};\n\n";
+    hdr += "// sorted by device and then driver (strcmp order)\n";
+    hdr += "extern const Binary binaries[];\n";
+    hdr += "extern const size_t numBinaries;\n";
+    hdr += "// the build options the binaries were compiled with\n";
+    hdr += "extern const char buildOptions[];\n\n";
+    hdr += "// the binary for a device and driver version or nullptr\n";
+    hdr += "const Binary *find(const char *device, const char *driver);\n";
+    hdr += "// the binary for dev's CL_DEVICE_NAME and CL_DRIVER_VERSION or nullptr\n";
+    hdr += "const Binary *find(cl_device_id dev);\n";
+    hdr += "// a built program for dev from its binary; nullptr if there is none\n";
+    hdr += "// (CL_INVALID_BINARY) or the driver rejects it (its error)\n";
+    hdr += "cl_program createProgram(cl_context ctx, cl_device_id dev, cl_int *err);\n\n";
+    hdr += "} // namespace " + ns + "\n\n";
+    hdr += "#endif\n";
+
+    std::string inc = headerPath.substr(headerPath.find_last_of("/\\") + 1);
+    std::string src;
+    src += "// generated by clc -F=cpp from " + inputs + "; do not edit\n";
+    src += "#include " + quoted(inc) + "\n\n";
+    src += "#include <string.h>\n";
+    src += "#include <vector>\n\n";
+    src += "namespace " + ns + " {\n\n";
+    for (size_t p = 0; p < payloads.size(); p++) {
+        src += "//";
+        for (const auto &it : items) {
+            if (it.payload == p)
+                src += " " + it.device + " (" + it.driver + ");";
+        }
+        src.back() = '\n';
+        src += "alignas(16) static const unsigned char bits" + std::to_string(p) +
+            "[" + std::to_string(payloads[p]->size()) + "] = {\n";
+        appendBytes(src, *payloads[p]);
+        src += "};\n\n";
+    }
+    src += "const Binary binaries[] = {\n";
+    for (const auto &it : items) {
+        std::string arr = "bits" + std::to_string(it.payload);
+        src += "    {" + quoted(it.device) + ", " + quoted(it.driver) + ", " + arr +
+            ", sizeof(" + arr + ")},\n";
+    }
+    if (items.empty())
+        src += "    {nullptr, nullptr, nullptr, 0},\n"; // no zero-length arrays
+    src += "};\n";
+    src += "const size_t numBinaries = " + std::to_string(items.size()) + ";\n";
+    src += "const char buildOptions[] = " +
+        quoted(normalizeBuildOptions(opts.buildOpts)) + ";\n\n";
+    src +=
+        "const Binary *find(const char *device, const char *driver)\n"
+        "{\n"
+        "    size_t lo = 0, hi = numBinaries;\n"
+        "    while (lo < hi) {\n"
+        "        size_t mid = lo + (hi - lo) / 2;\n"
+        "        int c = strcmp(binaries[mid].device, device);\n"
+        "        if (c == 0)\n"
+        "            c = strcmp(binaries[mid].driver, driver);\n"
+        "        if (c == 0)\n"
+        "            return &binaries[mid];\n"
+        "        if (c < 0)\n"
+        "            lo = mid + 1;\n"
+        "        else\n"
+        "            hi = mid;\n"
+        "    }\n"
+        "    return nullptr;\n"
+        "}\n\n"
+        "static std::vector<char> deviceInfo(cl_device_id dev, cl_device_info what)\n"
+        "{\n"
+        "    size_t n = 0;\n"
+        "    if (clGetDeviceInfo(dev, what, 0, nullptr, &n) != CL_SUCCESS || n == 0)\n"
+        "        return std::vector<char>(1, '\\0');\n"
+        "    std::vector<char> s(n + 1, '\\0');\n"
+        "    if (clGetDeviceInfo(dev, what, n, s.data(), nullptr) != CL_SUCCESS)\n"
+        "        s[0] = '\\0';\n"
+        "    return s;\n"
+        "}\n\n"
+        "const Binary *find(cl_device_id dev)\n"
+        "{\n"
+        "    return find(deviceInfo(dev, CL_DEVICE_NAME).data(),\n"
+        "        deviceInfo(dev, CL_DRIVER_VERSION).data());\n"
+        "}\n\n"
+        "cl_program createProgram(cl_context ctx, cl_device_id dev, cl_int *err)\n"
+        "{\n"
+        "    cl_int e = CL_INVALID_BINARY, status = CL_SUCCESS;\n"
+        "    cl_program prog = nullptr;\n"
+        "    if (const Binary *b = find(dev)) {\n"
+        "        const unsigned char *bits = b->bits;\n"
+        "        prog = clCreateProgramWithBinary(ctx, 1, &dev, &b->size, &bits, &status, &e);\n"
+        "        if (prog && e == CL_SUCCESS)\n"
+        "            e = status;\n"
+        "        if (prog && e == CL_SUCCESS)\n"
+        "            e = clBuildProgram(prog, 1, &dev, nullptr, nullptr, nullptr);\n"
+        "        if (prog && e != CL_SUCCESS) {\n"
+        "            clReleaseProgram(prog);\n"
+        "            prog = nullptr;\n"
+        "        }\n"
+        "    }\n"
+        "    if (err)\n"
+        "        *err = e;\n"
+        "    return prog;\n"
+        "}\n\n";
+    src += "} // namespace " + ns + "\n";
+
+    verbose("C++: %d entries, %d distinct binaries\n", (int)items.size(), (int)payloads.size());
+    return {std::make_pair(headerPath, hdr), std::make_pair(sourcePath, src)};
+}
@@ -0,0 +1,451 @@
+#include "clc.hpp"
+#include "clparse.hpp"
+
+#include <algorithm>
+#include <sstream>
+#include <string.h>
+
+// Elementwise kernels chained through global buffers (-fuse=) are fused
+// into one kernel: each stage becomes a function whose buffer to or from
+// the neighboring stage is a pointer to a private variable, so the
+// intermediate values stay in registers once the calls are inlined.
+
+struct FuseRequest {
+    std::string                 text; // as given (for messages)
+    std::string                 name; // the fused kernel's
+    std::vector<std::string>    stages;
+};
+
+struct FuseStage {
+    KernelDecl      k;
+    int             input = -1;  // the parameter fed by the previous stage
+    int             output = -1; // the parameter feeding the next stage
+    std::string     attrs;       // reqd_work_group_size(...) or ""
+};
+
+// NAME:K1>K2[>K3...]
+static FuseRequest parseFuse(const std::string &text)
+{
+    FuseRequest r;
+    r.text = text;
+    auto colon = text.find(':');
+    if (colon == std::string::npos) {
+        fatal("-fuse=%s: expected NAME:KERNEL>KERNEL...", text.c_str());
+    }
+    r.name = text.substr(0, colon);
+    std::string rest = text.substr(colon + 1);
+    for (size_t b = 0; ; ) {
+        auto e = rest.find('>', b);
+        r.stages.push_back(rest.substr(b, e == std::string::npos ? e : e - b));
+        if (e == std::string::npos)
+            break;
+        b = e + 1;
+    }
+    if (!isIdentifier(r.name)) {
+        fatal("-fuse=%s: malformed kernel name %s", text.c_str(), r.name.c_str());
+    }
+    for (const auto &s : r.stages) {
+        if (!isIdentifier(s)) {
+            fatal("-fuse=%s: malformed kernel name %s", text.c_str(), s.c_str());
+        }
+    }
+    if (r.stages.size() < 2) {
+        fatal("-fuse=%s: expected at least two kernels (NAME:K1>K2)", text.c_str());
+    }
+    return r;
+}
+
+static std::vector<std::string> words(const std::string &s)
+{
+    std::vector<std::string> ws;
+    std::string w;
+    for (char c : s) {
+        if (isalnum((unsigned char)c) || c == '_') {
+            w += c;
+        } else {
+            if (!w.empty())
+                ws.push_back(w);
+            w.clear();
+        }
+    }
+    if (!w.empty())
+        ws.push_back(w);
+    return ws;
+}
+
+static bool hasWord(const std::string &s, const char *word)
+{
+    for (const auto &w : words(s)) {
+        if (w == word)
+            return true;
+    }
+    return false;
+}
+
+static bool isGlobalPointer(const KernelParam &p)
+{
+    return p.isPointer() && (hasWord(p.type, "global") || hasWord(p.type, "__global"));
+}
+
+// const global float * -> float
+static std::string elementType(const KernelParam &p)
+{
+    std::string t;
+    for (const auto &w : words(p.type)) {
+        if (w == "global" || w == "__global" || w == "const" || w == "restrict" ||
+            w == "volatile")
+        {
+            continue;
+        }
+        t += (t.empty() ? "" : " ") + w;
+    }
+    return t;
+}
+
+static std::string withoutSpaces(const std::string &s)
+{
+    std::string out;
+    for (char c : s) {
+        if (!isspace((unsigned char)c))
+            out += c;
+    }
+    return out;
+}
+
+// the initializer of a local declared in the body as "TYPE NAME = INIT;"
+static bool localInitializer(const char *src, const KernelDecl &k, const std::string &name,
+    std::string &init)
+{
+    for (size_t at : identifierUses(src, k.bodyBegin, k.bodyEnd, name)) {
+        size_t b = at;
+        while (b > k.bodyBegin && isspace((unsigned char)src[b - 1]))
+            b--;
+        size_t e = at + name.size();
+        while (e < k.bodyEnd && isspace((unsigned char)src[e]))
+            e++;
+        bool declared = b > k.bodyBegin && (isalnum((unsigned char)src[b - 1]) ||
+            src[b - 1] == '_');
+        if (!declared || src[e] != '=' || src[e + 1] == '=')
+            continue;
+        size_t semi = e + 1;
+        int depth = 0;
+        while (semi < k.bodyEnd && !(src[semi] == ';' && depth == 0) &&
+            !(src[semi] == ',' && depth == 0))
+        {
+            if (src[semi] == '(')
+                depth++;
+            else if (src[semi] == ')')
+                depth--;
+            semi++;
+        }
+        init.assign(src + e + 1, semi - e - 1);
+        return true;
+    }
+    return false;
+}
+
+// the index expression with the locals it uses replaced by their
+// initializers (so off and x + y*get_global_size(0) compare equal)
+static std::string resolveIndex(const char *src, const KernelDecl &k,
+    const std::string &expr, int depth = 0)
+{
+    std::string out, word;
+    auto flush = [&]() {
+        std::string init;
+        if (!word.empty() && depth < 4 && !isdigit((unsigned char)word[0]) &&
+            localInitializer(src, k, word, init))
+        {
+            out += "(" + resolveIndex(src, k, init, depth + 1) + ")";
+        } else {
+            out += word;
+        }
+        word.clear();
+    };
+    for (char c : expr) {
+        if (isalnum((unsigned char)c) || c == '_') {
+            word += c;
+        } else {
+            flush();
+            out += c;
+        }
+    }
+    flush();
+    return withoutSpaces(out);
+}
+
+// the body with every P[INDEX] of the parameters replaced by (*P); the
+// resolved indexes of each go to indexes (fatal if P is used otherwise)
+static std::string rewriteAccesses(const FuseRequest &r, const char *src,
+    const KernelDecl &k, const std::vector<std::string> &params,
+    std::vector<std::vector<std::string>> &indexes)
+{
+    std::vector<std::pair<size_t,size_t>> uses; // (offset, parameter)
+    for (size_t p = 0; p < params.size(); p++) {
+        for (size_t at : identifierUses(src, k.bodyBegin, k.bodyEnd, params[p]))
+            uses.emplace_back(at, p);
+    }
+    std::sort(uses.begin(), uses.end());
+    indexes.assign(params.size(), std::vector<std::string>());
+
+    std::string out;
+    size_t copied = k.bodyBegin;
+    for (const auto &u : uses) {
+        const auto &param = params[u.second];
+        size_t ob = u.first + param.size();
+        while (ob < k.bodyEnd && isspace((unsigned char)src[ob]))
+            ob++;
+        size_t cb = ob < k.bodyEnd && src[ob] == '[' ? closingBracket(src, k.bodyEnd, ob) :
+            k.bodyEnd;
+        if (cb >= k.bodyEnd) {
+            fatal("-fuse=%s: %s line %d: %s is used other than as %s[INDEX], so %s is "
+                "not elementwise", r.text.c_str(), k.name.c_str(),
+                (int)sourceLocation(src, u.first, "").second, param.c_str(), param.c_str(),
+                k.name.c_str());
+        }
+        indexes[u.second].push_back(
+            resolveIndex(src, k, std::string(src + ob + 1, cb - ob - 1)));
+        out.append(src + copied, u.first - copied);
+        out += "(*" + param + ")";
+        copied = cb + 1;
+    }
+    out.append(src + copied, k.bodyEnd - copied);
+    return out;
+}
+
+// the fused kernel (and a function per stage) for the request
+static std::string fusedKernel(const FuseRequest &r, const char *src,
+    const std::vector<FuseStage> &stages, const std::string &path)
+{
+    std::stringstream ss;
+    ss << "\n// -fuse=" << r.text << "\n";
+
+    std::string attrs;
+    for (const auto &s : stages) {
+        if (!s.attrs.empty() && !attrs.empty() && s.attrs != attrs) {
+            fatal("-fuse=%s: the kernels require different work-group sizes (%s, %s)",
+                r.text.c_str(), attrs.c_str(), s.attrs.c_str());
+        }
+        if (!s.attrs.empty())
+            attrs = s.attrs;
+    }
+
+    // the index each intermediate is written at must be the one it is
+    // read at, or the fused work-item would read another's value
+    std::vector<std::string> bodies;
+    std::string written; // the index the previous stage writes at
+    for (size_t i = 0; i < stages.size(); i++) {
+        const auto &s = stages[i];
+        std::vector<std::string> ps;
+        if (s.input >= 0)
+            ps.push_back(s.k.params[s.input].name);
+        if (s.output >= 0 && s.output != s.input)
+            ps.push_back(s.k.params[s.output].name);
+        std::vector<std::vector<std::string>> indexes;
+        auto body = rewriteAccesses(r, src, s.k, ps, indexes);
+        if (s.input >= 0) {
+            for (const auto &x : indexes[0]) {
+                if (x != written) {
+                    fatal("-fuse=%s: %s writes %s[%s] but %s reads %s[%s]; the index "
+                        "spaces differ", r.text.c_str(), stages[i - 1].k.name.c_str(),
+                        stages[i - 1].k.params[stages[i - 1].output].name.c_str(),
+                        written.c_str(), s.k.name.c_str(), ps[0].c_str(), x.c_str());
+                }
+            }
+        }
+        if (s.output >= 0 && s.output != s.input) {
+            const auto &writes = indexes.back();
+            if (writes.empty()) {
+                fatal("-fuse=%s: %s never writes %s", r.text.c_str(), s.k.name.c_str(),
+                    ps.back().c_str());
+            }
+            for (const auto &x : writes) {
+                if (x != writes[0]) {
+                    fatal("-fuse=%s: %s writes %s at different indexes (%s, %s)",
+                        r.text.c_str(), s.k.name.c_str(), ps.back().c_str(),
+                        writes[0].c_str(), x.c_str());
+                }
+            }
+            written = writes[0];
+        }
+        bodies.push_back(body);
+    }
+
+    // a function per stage
+    for (size_t i = 0; i < stages.size(); i++) {
+        const auto &s = stages[i];
+        ss << "void " << r.name << "_" << s.k.name << "(";
+        for (size_t p = 0; p < s.k.params.size(); p++) {
+            const auto &kp = s.k.params[p];
+            ss << (p == 0 ? "\n    " : ",\n    ");
+            if ((int)p == s.input && (int)p != s.output) {
+                ss << "const private " << elementType(kp) << " *" << kp.name;
+            } else if ((int)p == s.input || (int)p == s.output) {
+                ss << "private " << elementType(kp) << " *" << kp.name;
+            } else {
+                ss << kp.text;
+            }
+        }
+        ss << ")\n";
+        auto where = sourceLocation(src, s.k.bodyBegin, path);
+        ss << lineDirective(where.second, where.first);
+        ss << bodies[i] << "\n";
+    }
+
+    // the kernel: the parameters of every stage except the intermediates
+    // (a name used by two stages is prefixed with the later kernel's), a
+    // private variable per intermediate, and a call per stage
+    std::vector<std::string> names;
+    std::string params, decls, calls, current;
+    for (size_t i = 0; i < stages.size(); i++) {
+        const auto &s = stages[i];
+        std::string args;
+        for (size_t p = 0; p < s.k.params.size(); p++) {
+            const auto &kp = s.k.params[p];
+            std::string arg;
+            if ((int)p == s.input) {
+                arg = current; // in place, the variable carries on
+            } else if ((int)p == s.output) {
+                std::string t = "t" + std::to_string(i);
+                decls += "    " + elementType(kp) + " " + t + ";\n";
+                arg = current = "&" + t;
+            } else {
+                arg = kp.name;
+                if (std::find(names.begin(), names.end(), arg) != names.end())
+                    arg = s.k.name + "_" + arg;
+                names.push_back(arg);
+                auto at = kp.text.rfind(kp.name);
+                params += (params.empty() ? "\n    " : ",\n    ") +
+                    kp.text.substr(0, at) + arg + kp.text.substr(at + kp.name.size());
+            }
+            args += (args.empty() ? "" : ", ") + arg;
+        }
+        calls += "    " + r.name + "_" + s.k.name + "(" + args + ");\n";
+    }
+    if (!attrs.empty())
+        ss << "__attribute__((" << attrs << ")) ";
+    ss << "kernel void " << r.name << "(" << params << ")\n{\n" << decls << calls << "}\n";
+    return ss.str();
+}
+
+// the stage's input (from the previous stage) and output parameters
+static FuseStage classifyStage(const FuseRequest &r, const char *src, const KernelDecl &k,
+    bool first, bool last)
+{
+    FuseStage s;
+    s.k = k;
+    std::vector<int> writable, readable;
+    for (size_t p = 0; p < k.params.size(); p++) {
+        const auto &kp = k.params[p];
+        if (hasWord(kp.type, "local") || hasWord(kp.type, "__local")) {
+            fatal("-fuse=%s: %s takes local memory (%s), so it is not elementwise",
+                r.text.c_str(), k.name.c_str(), kp.text.c_str());
+        }
+        if (isGlobalPointer(kp))
+            (hasWord(kp.type, "const") ? readable : writable).push_back((int)p);
+    }
+    for (const char *sync : {"barrier", "work_group_barrier", "mem_fence"}) {
+        if (!identifierUses(src, k.bodyBegin, k.bodyEnd, sync).empty()) {
+            fatal("-fuse=%s: %s synchronizes work-items (%s), so it is not elementwise",
+                r.text.c_str(), k.name.c_str(), sync);
+        }
+    }
+    if (writable.size() != 1) {
+        fatal("-fuse=%s: %s writes %d global buffers; a stage needs exactly one output",
+            r.text.c_str(), k.name.c_str(), (int)writable.size());
+    }
+    s.output = writable[0];
+    if (!first) {
+        if (readable.size() == 1) {
+            s.input = readable[0];
+        } else if (readable.empty()) {
+            s.input = s.output; // in place (e.g. data[i] *= k)
+        } else {
+            fatal("-fuse=%s: %s reads %d const global buffers; it is ambiguous which "
+                "one the previous stage feeds", r.text.c_str(), k.name.c_str(),
+                (int)readable.size());
+        }
+    }
+    if (last) {
+        if (s.input == s.output) {
+            fatal("-fuse=%s: %s updates its buffer in place; the last stage must write "
+                "a separate output", r.text.c_str(), k.name.c_str());
+        }
+        s.output = -1; // its output stays a global buffer
+    }
+    std::string prefix = withoutSpaces(std::string(src + k.begin, k.nameBegin - k.begin));
+    auto rq = prefix.find("reqd_work_group_size(");
+    if (rq != std::string::npos)
+        s.attrs = prefix.substr(rq, prefix.find(')', rq) + 1 - rq);
+    return s;
+}
+
+void applyFusions(const Opts &opts, std::vector<SourceText> &sourceStrs)
+{
+    for (const auto &text : opts.fusions) {
+        auto r = parseFuse(text);
+        // every stage must be in one unit (the functions are copies)
+        size_t unit = sourceStrs.size();
+        std::vector<KernelDecl> kernels;
+        for (size_t u = 0; u < sourceStrs.size() && unit == sourceStrs.size(); u++) {
+            if (isSpirv(sourceStrs[u]))
+                continue;
+            auto ks = parseKernels(sourceStrs[u].data(), sourceStrs[u].size());
+            for (const auto &k : ks) {
+                if (k.name == r.stages[0]) {
+                    unit = u;
+                    kernels = ks;
+                }
+            }
+        }
+        if (unit == sourceStrs.size()) {
+            fatal("-fuse=%s: no kernel %s in the inputs", text.c_str(), r.stages[0].c_str());
+        }
+        const char *src = sourceStrs[unit].data();
+        size_t n = sourceStrs[unit].size();
+        std::vector<FuseStage> stages;
+        size_t after = 0;
+        for (size_t i = 0; i < r.stages.size(); i++) {
+            const KernelDecl *k = nullptr;
+            for (const auto &kd : kernels) {
+                if (kd.name == r.stages[i] && k == nullptr)
+                    k = &kd;
+            }
+            if (k == nullptr) {
+                fatal("-fuse=%s: no kernel %s in %s (the kernels must be in one input)",
+                    text.c_str(), r.stages[i].c_str(), opts.args[unit].c_str());
+            }
+            stages.push_back(classifyStage(r, src, *k, i == 0, i + 1 == r.stages.size()));
+            after = std::max(after, k->bodyEnd);
+            if (i > 0) {
+                const auto &prev = stages[i - 1].k.params[stages[i - 1].output];
+                const auto &in = k->params[stages[i].input];
+                if (elementType(prev) != elementType(in)) {
+                    fatal("-fuse=%s: %s writes %s but %s reads %s", text.c_str(),
+                        r.stages[i - 1].c_str(), elementType(prev).c_str(),
+                        r.stages[i].c_str(), elementType(in).c_str());
+                }
+            }
+        }
+        for (const auto &k : kernels) {
+            if (k.name == r.name) {
+                fatal("-fuse=%s: kernel %s already exists", text.c_str(), r.name.c_str());
+            }
+        }
+        for (const auto &s : r.stages) {
+            if (!identifierUses(src, 0, n, r.name + "_" + s).empty()) {
+                fatal("-fuse=%s: %s_%s already exists", text.c_str(), r.name.c_str(),
+                    s.c_str());
+            }
+        }
+
+        // after the last stage, as -spec= does, with the numbering restored
+        std::string out(src, after);
+        out += fusedKernel(r, src, stages, opts.args[unit]);
+        auto where = sourceLocation(src, after, opts.args[unit]);
+        out += lineDirective(where.second, where.first);
+        out.append(src + after, n - after);
+        sourceStrs[unit] = SourceText(std::move(out));
+        verbose("%s: fused %s as %s\n", opts.args[unit].c_str(),
+            text.substr(text.find(':') + 1).c_str(), r.name.c_str());
+    }
+}
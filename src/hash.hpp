@@ -0,0 +1,38 @@
+#ifndef HASH_HPP
+#define HASH_HPP
+
+#include <stdint.h>
+#include <string>
+
+// FIPS 180-4 SHA-256; used to content-address cache entries
+class Sha256 {
+    uint32_t    state[8];
+    uint8_t     block[64];
+    size_t      blockLen = 0;
+    uint64_t    totalLen = 0;
+
+    void compress(const uint8_t *blk);
+public:
+    static const size_t DIGEST_SIZE = 32;
+
+    Sha256();
+
+    void update(const void *bits, size_t bitsLen);
+    void update(const std::string &str) {update(str.data(), str.size());}
+    // feeds a length prefix before the bytes so that adjacent fields
+    // can never alias (e.g. "ab"+"c" vs "a"+"bc")
+    void updateField(const void *bits, size_t bitsLen);
+    void updateField(const std::string &str) {updateField(str.data(), str.size());}
+
+    void digest(uint8_t out[DIGEST_SIZE]);
+    std::string hexDigest();
+};
+
+static inline std::string sha256Hex(const void *bits, size_t bitsLen)
+{
+    Sha256 h;
+    h.update(bits, bitsLen);
+    return h.hexDigest();
+}
+
+#endif
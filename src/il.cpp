@@ -0,0 +1,179 @@
+#include "clc.hpp"
+#include "clerrs.h"
+#include "clparse.hpp"
+#include "includes.hpp"
+#include "system.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <string.h>
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <dlfcn.h>
+#endif
+
+// OpenCL 2.1 (and cl_khr_il_program, as CL_DEVICE_IL_VERSION_KHR)
+#ifndef CL_DEVICE_IL_VERSION
+#define CL_DEVICE_IL_VERSION 0x105B
+#endif
+
+static const uint32_t SPIRV_MAGIC = 0x07230203;
+
+bool isSpirv(const SourceText &text)
+{
+    // a module starts with a five word header
+    if (text.size() < 20 || text.size() % 4 != 0)
+        return false;
+    uint32_t w;
+    memcpy(&w, text.data(), sizeof(w));
+    uint32_t swapped = (w >> 24) | ((w >> 8) & 0xff00) | ((w << 8) & 0xff0000) | (w << 24);
+    return w == SPIRV_MAGIC || swapped == SPIRV_MAGIC;
+}
+
+bool isSpirvProgram(const std::vector<SourceText> &sourceStrs)
+{
+    return sourceStrs.size() == 1 && isSpirv(sourceStrs[0]);
+}
+
+// "" if the device takes no IL
+static std::string deviceIlVersion(const cl::Device &dev)
+{
+    size_t n = 0;
+    if (clGetDeviceInfo(dev(), CL_DEVICE_IL_VERSION, 0, nullptr, &n) != CL_SUCCESS || n == 0)
+        return "";
+    std::string s(n, '\0');
+    if (clGetDeviceInfo(dev(), CL_DEVICE_IL_VERSION, n, &s[0], nullptr) != CL_SUCCESS)
+        return "";
+    return s.c_str();
+}
+
+typedef cl_program (CL_API_CALL *CreateProgramWithIL)(
+    cl_context, const void *, size_t, cl_int *);
+
+// clc builds against the 1.2 headers and may run on an ICD loader that
+// predates 2.1, so the entry point is looked up at run time: the
+// extension's for drivers that only have cl_khr_il_program, otherwise the
+// loader's core one
+static CreateProgramWithIL findCreateProgramWithIL(const cl::Device &dev)
+{
+    auto exts = dev.getInfo<CL_DEVICE_EXTENSIONS>();
+    if (exts.find("cl_khr_il_program") != std::string::npos) {
+        void *fn = clGetExtensionFunctionAddressForPlatform(
+            dev.getInfo<CL_DEVICE_PLATFORM>(), "clCreateProgramWithILKHR");
+        if (fn)
+            return (CreateProgramWithIL)fn;
+    }
+#ifdef _WIN32
+    HMODULE lib = GetModuleHandleA("OpenCL.dll");
+    return lib ? (CreateProgramWithIL)GetProcAddress(lib, "clCreateProgramWithIL") : nullptr;
+#else
+    return (CreateProgramWithIL)dlsym(RTLD_DEFAULT, "clCreateProgramWithIL");
+#endif
+}
+
+cl::Program createProgram(
+    const cl::Context &ctx,
+    const std::vector<SourceText> &sourceStrs,
+    const std::vector<cl::Device> &devs)
+{
+    if (!isSpirvProgram(sourceStrs)) {
+        cl::Program::Sources sources;
+        for (auto &str : sourceStrs)
+            sources.emplace_back(str.data(), str.size());
+        return cl::Program(ctx, sources); // no autobuild
+    }
+
+    for (const auto &d : devs) {
+        auto il = deviceIlVersion(d);
+        if (il.find("SPIR-V") == std::string::npos) {
+            fatal("%s: the device does not accept SPIR-V (CL_DEVICE_IL_VERSION is \"%s\"); "
+                "build it from the OpenCL C source", d.getInfo<CL_DEVICE_NAME>().c_str(),
+                il.c_str());
+        }
+        debug("%s: takes %s\n", d.getInfo<CL_DEVICE_NAME>().c_str(), il.c_str());
+    }
+    auto create = findCreateProgramWithIL(devs[0]);
+    if (create == nullptr) {
+        fatal("clCreateProgramWithIL: not provided by the OpenCL runtime");
+    }
+    TRACE_SCOPE("create program from IL");
+    cl_int err = CL_SUCCESS;
+    cl_program prog = create(ctx(), sourceStrs[0].data(), sourceStrs[0].size(), &err);
+    if (prog == nullptr || err != CL_SUCCESS) {
+        fatal("clCreateProgramWithIL: %s", clErrStr(err).c_str());
+    }
+    return cl::Program(prog);
+}
+
+void emitSpirv(
+    const Opts &opts,
+    const std::vector<SourceText> &sourceStrs,
+    const std::string &output)
+{
+    if (isSpirvProgram(sourceStrs)) {
+        fatal("-F=spv: %s is already a SPIR-V module", opts.args[0].c_str());
+    }
+    const char *env = getenv("CLC_SPIRV_FRONTEND");
+    std::string frontEnd = env && *env ? env : "clang";
+
+    // the front end takes one file: the units (as specialized) joined, with
+    // #line keeping its diagnostics on the original files; the inputs'
+    // directories are searched first as the driver would for each input
+    std::string base = output == "--" ? "clc-spv" : output;
+    std::string srcPath = uniqueTempPath(base) + ".cl";
+    std::string binPath = uniqueTempPath(base);
+    std::string text;
+    for (size_t i = 0; i < sourceStrs.size(); i++) {
+        text += lineDirective(1, opts.args[i]);
+        text.append(sourceStrs[i].data(), sourceStrs[i].size());
+        text += "\n";
+    }
+    if (!writeFileAtomic(srcPath, text.data(), text.size())) {
+        fatal("%s: error writing", srcPath.c_str());
+    }
+
+    std::vector<std::string> cmd = {frontEnd, "-c", "-x", "cl", "--target=spirv64"};
+    for (const auto &a : opts.args) {
+        if (a == "-")
+            continue;
+        auto ix = a.find_last_of("/\\");
+        std::string dir = ix == std::string::npos ? "." : a.substr(0, ix + 1);
+        if (std::find(cmd.begin(), cmd.end(), "-I" + dir) == cmd.end())
+            cmd.push_back("-I" + dir);
+    }
+    for (const auto &t : splitBuildOptions(opts.buildOpts))
+        cmd.push_back(t);
+    cmd.push_back("-o");
+    cmd.push_back(binPath);
+    cmd.push_back(srcPath);
+
+    std::string line;
+    for (const auto &c : cmd)
+        line += (line.empty() ? "" : " ") + c;
+    verbose("%s\n", line.c_str());
+
+    int status;
+    {
+        TRACE_SCOPE("front end", frontEnd.c_str());
+        status = runCommand(cmd);
+    }
+    removeFile(srcPath);
+    if (status != 0) {
+        removeFile(binPath);
+        if (status < 0) {
+            fatal("-F=spv: cannot run %s (set CLC_SPIRV_FRONTEND to a clang with "
+                "SPIR-V support)", frontEnd.c_str());
+        }
+        fatal("-F=spv: %s failed (exit status %d)", frontEnd.c_str(), status);
+    }
+
+    // copied, not mapped: Windows cannot delete a mapped file
+    SourceText module(readTextFile(binPath));
+    removeFile(binPath);
+    if (!isSpirv(module)) {
+        fatal("-F=spv: %s did not produce a SPIR-V module", frontEnd.c_str());
+    }
+    verbose("saving SPIR-V to %s\n", output == "--" ? "stdout" : output.c_str());
+    writeBinary(output == "--" ? "" : output, module.data(), module.size());
+}
@@ -0,0 +1,277 @@
+#include "includes.hpp"
+#include "clc.hpp"
+
+#include <fstream>
+#include <set>
+#include <sstream>
+
+std::vector<std::string> splitBuildOptions(
+    const std::vector<std::string> &buildOpts)
+{
+    std::vector<std::string> tokens;
+    for (const auto &opt : buildOpts) {
+        std::string tk;
+        bool inTk = false, inQuote = false;
+        for (char c : opt) {
+            if (c == '"') {
+                // quotes are kept so that -DSTR="..." means the same thing
+                // to the compiler after we rejoin the tokens
+                inQuote = !inQuote;
+                tk += c;
+                inTk = true;
+            } else if (!inQuote && (c == ' ' || c == '\t' || c == '\n' || c == '\r')) {
+                if (inTk) {
+                    tokens.push_back(tk);
+                    tk.clear();
+                    inTk = false;
+                }
+            } else {
+                tk += c;
+                inTk = true;
+            }
+        }
+        if (inTk)
+            tokens.push_back(tk);
+    }
+    return tokens;
+}
+
+std::string normalizeBuildOptions(
+    const std::vector<std::string> &buildOpts)
+{
+    std::stringstream ss;
+    auto tokens = splitBuildOptions(buildOpts);
+    for (size_t i = 0; i < tokens.size(); i++) {
+        if (i > 0)
+            ss << " ";
+        ss << tokens[i];
+    }
+    return ss.str();
+}
+
+static std::string unquote(const std::string &str)
+{
+    std::string s;
+    for (char c : str)
+        if (c != '"')
+            s += c;
+    return s;
+}
+
+std::vector<std::string> includeDirectories(
+    const std::vector<std::string> &tokens)
+{
+    std::vector<std::string> dirs;
+    for (size_t i = 0; i < tokens.size(); i++) {
+        if (tokens[i] == "-I") {
+            if (i + 1 < tokens.size())
+                dirs.push_back(unquote(tokens[++i]));
+        } else if (tokens[i].size() > 2 && tokens[i].compare(0, 2, "-I") == 0) {
+            dirs.push_back(unquote(tokens[i].substr(2)));
+        }
+    }
+    return dirs;
+}
+
+static std::string directoryOf(const std::string &path)
+{
+    auto ix = path.find_last_of("/\\");
+    if (ix == std::string::npos)
+        return "";
+    return path.substr(0, ix + 1);
+}
+
+static bool fileExists(const std::string &path)
+{
+    std::ifstream f(path);
+    return f.good();
+}
+
+// strips comments (but not string literals) so that commented-out
+// directives do not register
+static std::string stripComments(const char *src, size_t n)
+{
+    auto at = [&](size_t i, const char *two) {
+        return i + 1 < n && src[i] == two[0] && src[i + 1] == two[1];
+    };
+    std::string out;
+    out.reserve(n);
+    for (size_t i = 0; i < n; i++) {
+        if (src[i] == '"') {
+            size_t e = i + 1;
+            while (e < n && src[e] != '"' && src[e] != '\n') {
+                if (src[e] == '\\')
+                    e++;
+                e++;
+            }
+            if (e >= n)
+                e = n - 1;
+            out.append(src + i, e - i + 1);
+            i = e;
+        } else if (at(i, "//")) {
+            while (i < n && src[i] != '\n')
+                i++;
+            if (i < n)
+                out += '\n';
+        } else if (at(i, "/*")) {
+            i += 2;
+            while (i < n && !at(i, "*/")) {
+                if (src[i] == '\n')
+                    out += '\n';
+                i++;
+            }
+            i++;
+            out += ' ';
+        } else {
+            out += src[i];
+        }
+    }
+    return out;
+}
+
+// returns (name, isQuoted) for each #include in the text
+static std::vector<std::pair<std::string,bool>> findDirectives(
+    const SourceText &text)
+{
+    std::vector<std::pair<std::string,bool>> names;
+    std::string src = stripComments(text.data(), text.size());
+    for (size_t b = 0; b < src.size(); ) {
+        size_t e = src.find('\n', b);
+        if (e == std::string::npos)
+            e = src.size();
+        std::string ln;
+        size_t i = src.find_first_not_of(" \t", b);
+        if (i < e && src[i] == '#')
+            ln.assign(src, b, e - b);
+        b = e + 1;
+        if (ln.empty())
+            continue;
+
+        i = ln.find_first_not_of(" \t");
+        i = ln.find_first_not_of(" \t", i + 1);
+        if (i == std::string::npos || ln.compare(i, 7, "include") != 0)
+            continue;
+        i = ln.find_first_not_of(" \t", i + 7);
+        if (i == std::string::npos)
+            continue;
+        char close = ln[i] == '"' ? '"' : ln[i] == '<' ? '>' : 0;
+        if (close == 0)
+            continue; // macro-expanded include; cannot resolve statically
+        auto q = ln.find(close, i + 1);
+        if (q == std::string::npos)
+            continue;
+        names.emplace_back(ln.substr(i + 1, q - i - 1), close == '"');
+    }
+    return names;
+}
+
+std::string resolveInclude(
+    const std::string &name,
+    bool quoted,
+    const std::string &includer,
+    const std::vector<std::string> &incDirs)
+{
+    std::vector<std::string> candidates;
+    if (quoted) {
+        if (includer != "-")
+            candidates.push_back(directoryOf(includer) + name);
+        candidates.push_back(name);
+    }
+    for (const auto &dir : incDirs) {
+        std::string sep =
+            dir.empty() || dir.back() == '/' || dir.back() == '\\' ? "" : "/";
+        candidates.push_back(dir + sep + name);
+    }
+    for (const auto &c : candidates) {
+        if (fileExists(c))
+            return c;
+    }
+    return "";
+}
+
+std::vector<IncludeFile> scanIncludes(
+    const std::vector<std::string> &inputPaths,
+    const std::vector<SourceText> &inputTexts,
+    const std::vector<std::string> &incDirs)
+{
+    std::vector<IncludeFile> incs;
+    std::set<std::string> seen;
+
+    // worklist of (path, text)
+    std::vector<std::pair<std::string,SourceText>> work;
+    for (size_t i = inputPaths.size(); i > 0; i--)
+        work.emplace_back(inputPaths[i - 1], inputTexts[i - 1]);
+
+    while (!work.empty()) {
+        auto w = work.back();
+        work.pop_back();
+        if (isSpirv(w.second))
+            continue; // a module has no directives left
+        auto ds = findDirectives(w.second);
+        // push in reverse so that discovery order matches the source
+        std::vector<std::pair<std::string,SourceText>> nested;
+        for (const auto &d : ds) {
+            IncludeFile inc;
+            inc.name = d.first;
+            inc.includer = w.first;
+            inc.path = resolveInclude(d.first, d.second, w.first, incDirs);
+            std::string id = inc.path.empty() ? "<" + inc.name + ">" : inc.path;
+            if (!seen.insert(id).second)
+                continue;
+            debug("  %s: includes %s => %s\n", w.first.c_str(), inc.name.c_str(),
+                inc.path.empty() ? "(unresolved)" : inc.path.c_str());
+            incs.push_back(inc);
+            if (!inc.path.empty())
+                nested.emplace_back(inc.path, readSource(inc.path));
+        }
+        for (size_t i = nested.size(); i > 0; i--)
+            work.push_back(nested[i - 1]);
+    }
+    return incs;
+}
+
+// spaces and # are backslash escaped and $ doubled, as gcc does
+static std::string escapeMakePath(const std::string &path)
+{
+    std::string s;
+    for (char c : path) {
+        if (c == ' ' || c == '#')
+            s += '\\';
+        else if (c == '$')
+            s += '$';
+        s += c;
+    }
+    return s;
+}
+
+std::string formatDepfile(
+    const std::vector<std::string> &targets,
+    const std::vector<std::string> &deps,
+    size_t numInputs,
+    bool phony)
+{
+    std::stringstream ss;
+    size_t col = 0;
+    for (size_t i = 0; i < targets.size(); i++) {
+        auto t = escapeMakePath(targets[i]);
+        ss << (i > 0 ? " " : "") << t;
+        col += t.size() + (i > 0 ? 1 : 0);
+    }
+    ss << ":";
+    col++;
+    for (const auto &d : deps) {
+        auto e = escapeMakePath(d);
+        if (col + 1 + e.size() > 78) {
+            ss << " \\\n ";
+            col = 1;
+        }
+        ss << " " << e;
+        col += 1 + e.size();
+    }
+    ss << "\n";
+    if (phony) {
+        for (size_t i = numInputs; i < deps.size(); i++)
+            ss << "\n" << escapeMakePath(deps[i]) << ":\n";
+    }
+    return ss.str();
+}
@@ -0,0 +1,56 @@
+#ifndef INCLUDES_HPP
+#define INCLUDES_HPP
+
+#include "clc.hpp"
+
+#include <string>
+#include <vector>
+
+// splits the -b=... options into individual tokens
+// (e.g. {"-I inc -DX", "-DY"} -> {"-I","inc","-DX","-DY"});
+// double quotes group whitespace and are kept in the token
+std::vector<std::string> splitBuildOptions(
+    const std::vector<std::string> &buildOpts);
+// tokens rejoined with single spaces (the form we hand to clBuildProgram)
+std::string normalizeBuildOptions(
+    const std::vector<std::string> &buildOpts);
+// extracts the -I directories from split build options
+std::vector<std::string> includeDirectories(
+    const std::vector<std::string> &tokens);
+
+struct IncludeFile {
+    std::string     name;     // as written in the directive
+    std::string     path;     // resolved path (empty if unresolved)
+    std::string     includer; // path of the file containing the directive
+};
+
+// The OpenCL front end resolves quoted includes relative to the process
+// working directory, so we try (in order): the includer's directory,
+// the working directory, and then each -I directory (only the last for
+// <...>).  The path found or "" if there is none.
+std::string resolveInclude(
+    const std::string &name,
+    bool quoted,
+    const std::string &includer,
+    const std::vector<std::string> &incDirs);
+
+// Transitively scans #include directives starting from the given inputs.
+// Each is resolved as in resolveInclude.
+// Conditional compilation is ignored; the result is a conservative
+// superset of what the compiler reads.  Each file appears once.
+std::vector<IncludeFile> scanIncludes(
+    const std::vector<std::string> &inputPaths,
+    const std::vector<SourceText> &inputTexts,
+    const std::vector<std::string> &incDirs);
+
+// A make rule "targets: deps" in the form gcc -MD writes (paths escaped,
+// long lines continued); with phony each dependency after the first
+// numInputs also gets an empty rule so that make does not fail once a
+// header is deleted (gcc -MP).
+std::string formatDepfile(
+    const std::vector<std::string> &targets,
+    const std::vector<std::string> &deps,
+    size_t numInputs,
+    bool phony);
+
+#endif
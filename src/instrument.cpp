@@ -0,0 +1,328 @@
+#include "clc.hpp"
+#include "clparse.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <sstream>
+#include <string.h>
+
+// --instrument: each kernel gets a last argument
+//
+//   global uint *__clc_counters
+//
+// with four uints per region: the number of times it ran and the clock
+// ticks spent in it, as 64-bit sums of (lo, hi) halves.  The regions are
+// each loop (counting iterations), each barrier, and each statement after
+// a "#pragma clc region NAME".  Work-items count in private variables and
+// add them to the buffer with 32-bit atomics once, before returning.  The
+// clock is NVIDIA's %globaltimer (ns) where inline PTX is available,
+// -DCLC_READ_CLOCK(t)=... elsewhere, or absent (0): the counts alone are
+// portable (e.g. to CPU devices).
+//
+// The generated code keeps the line numbers: what a region adds is put on
+// its lines, and a comment per region ("//@clc-region N KERNEL KIND
+// WHERE") before each kernel, which instrumentedRegions() reads, is
+// followed by #line.
+
+static const char *const prelude =
+    "#ifndef CLC_READ_CLOCK\n"
+    "#ifdef cl_nv_pragma_unroll\n"
+    "#define CLC_READ_CLOCK(t) asm volatile(\"mov.u64 %0, %%globaltimer;\" : \"=l\"(t))\n"
+    "#else\n"
+    "#define CLC_READ_CLOCK(t) ((t) = 0)\n"
+    "#endif\n"
+    "#endif\n"
+    "#ifndef CLC_ADD64\n"
+    "#define CLC_ADD64(p, v) \\\n"
+    "    if ((v) != 0) { \\\n"
+    "        uint clc_lo = (uint)(v), clc_old = atomic_add((p), clc_lo); \\\n"
+    "        atomic_add((p) + 1, (uint)((v) >> 32) + (clc_old + clc_lo < clc_old)); \\\n"
+    "    }\n"
+    "#endif\n";
+
+struct Insertion {
+    size_t          at;
+    std::string     text;
+    bool            close; // ends a region's code (before opens at the same offset)
+    size_t          span; // of the region: outer opens first, inner closes first
+};
+
+struct InstrumentedKernel {
+    const char                      *src;
+    const KernelDecl                *k;
+    std::vector<CodeToken>          ts;
+    std::vector<size_t>             match;
+    std::vector<Insertion>          edits;
+    std::vector<std::string>        regions; // "KIND WHERE" by local number
+};
+
+// the end (a token index, exclusive) of the statement starting at token i
+static size_t statementEnd(const InstrumentedKernel &ik, size_t i)
+{
+    const auto &ts = ik.ts;
+    if (i >= ts.size())
+        return i;
+    if (ts[i].text == "{")
+        return std::min(ik.match[i], ts.size() - 1) + 1;
+    if (ts[i].text == "do") {
+        size_t e = statementEnd(ik, i + 1);
+        // while (...);
+        if (e + 1 < ts.size() && ts[e].text == "while" && ik.match[e + 1] != SIZE_MAX)
+            e = ik.match[e + 1] + 1;
+        return std::min(e + 1, ts.size());
+    }
+    if ((ts[i].text == "for" || ts[i].text == "while" || ts[i].text == "if" ||
+        ts[i].text == "switch") && i + 1 < ts.size() && ik.match[i + 1] != SIZE_MAX)
+    {
+        size_t e = statementEnd(ik, ik.match[i + 1] + 1);
+        if (ts[i].text == "if" && e < ts.size() && ts[e].text == "else")
+            e = statementEnd(ik, e + 1);
+        return e;
+    }
+    for (; i < ts.size(); i++) {
+        if (ts[i].text == ";")
+            return i + 1;
+        if (ik.match[i] != SIZE_MAX && ik.match[i] > i)
+            i = ik.match[i];
+    }
+    return i;
+}
+
+static size_t endOffset(const InstrumentedKernel &ik, size_t tokEnd)
+{
+    return ik.ts[tokEnd - 1].end;
+}
+
+// a new region of the statement (tokens b..e): counted on entry (or per
+// iteration, at the start of a loop's body) and timed throughout
+static void addRegion(InstrumentedKernel &ik, const std::string &kind, size_t b, size_t e,
+    const std::string &path)
+{
+    const auto &ts = ik.ts;
+    std::string n = std::to_string(ik.regions.size());
+    auto where = sourceLocation(ik.src, ts[b].begin, path);
+    ik.regions.push_back(kind + " " + where.first + ":" + std::to_string(where.second));
+    size_t begin = ts[b].begin, end = endOffset(ik, e);
+    size_t span = end - begin;
+    ik.edits.push_back({begin, "{ ulong clc_s" + n + "; CLC_READ_CLOCK(clc_s" + n + "); ",
+        false, span});
+    ik.edits.push_back({end, " { ulong clc_e" + n + "; CLC_READ_CLOCK(clc_e" + n +
+        "); clc_t" + n + " += clc_e" + n + " - clc_s" + n + "; } }", true, span});
+
+    std::string count = "clc_n" + n + "++; ";
+    if (kind != "loop") {
+        ik.edits.push_back({begin, count, false, span - 1});
+        return;
+    }
+    // the loop's body
+    size_t body;
+    if (ts[b].text == "do") {
+        body = b + 1;
+    } else {
+        body = ik.match[b + 1] + 1;
+    }
+    size_t bodyEnd = statementEnd(ik, body);
+    if (body >= e || bodyEnd > e)
+        return;
+    if (ts[body].text == "{") {
+        ik.edits.push_back({ts[body].end, " " + count, false, 0});
+    } else {
+        size_t bb = ts[body].begin, be = endOffset(ik, bodyEnd);
+        ik.edits.push_back({bb, "{ " + count, false, be - bb});
+        ik.edits.push_back({be, " }", true, be - bb});
+    }
+}
+
+// the kernel's regions and the flushes of their counts
+static void instrumentKernel(InstrumentedKernel &ik, size_t base, const std::string &path)
+{
+    const auto &k = *ik.k;
+    auto &ts = ik.ts;
+    ts = codeTokens(ik.src, k.bodyBegin, k.bodyEnd);
+    ik.match.assign(ts.size(), SIZE_MAX);
+    std::vector<size_t> open;
+    for (size_t i = 0; i < ts.size(); i++) {
+        const auto &t = ts[i].text;
+        if (t == "(" || t == "[" || t == "{") {
+            open.push_back(i);
+        } else if ((t == ")" || t == "]" || t == "}") && !open.empty()) {
+            ik.match[i] = open.back();
+            ik.match[open.back()] = i;
+            open.pop_back();
+        }
+    }
+
+    // #pragma clc region NAME: the next statement (the pragma lines are
+    // not tokens, so this finds them in the text)
+    std::vector<std::pair<size_t,std::string>> marks; // (offset, name)
+    for (size_t i = k.bodyBegin; i < k.bodyEnd; ) {
+        const char *nl = (const char *)memchr(ik.src + i, '\n', k.bodyEnd - i);
+        size_t e = nl ? (size_t)(nl - ik.src) : k.bodyEnd;
+        std::string ln(ik.src + i, e - i);
+        size_t h = ln.find_first_not_of(" \t");
+        if (h != std::string::npos && ln[h] == '#') {
+            std::stringstream ws(ln.substr(h + 1));
+            std::string pragma, clc, region, name, extra;
+            ws >> pragma >> clc >> region >> name >> extra;
+            if (pragma == "pragma" && clc == "clc") {
+                if (region != "region" || !isIdentifier(name) || !extra.empty()) {
+                    auto where = sourceLocation(ik.src, i + h, path);
+                    fatal("%s:%d: expected #pragma clc region NAME",
+                        where.first.c_str(), (int)where.second);
+                }
+                marks.emplace_back(e, name);
+                // (a pragma the compiler does not know may warn)
+                ik.edits.push_back({i + h, "//", false, 0});
+            }
+        }
+        i = e + 1;
+    }
+
+    size_t next = 0;
+    std::vector<size_t> doWhiles; // the while of each do ... while
+    for (size_t i = 1; i + 1 < ts.size(); i++) {
+        const auto &w = ts[i].text;
+        const auto &prev = ts[i - 1].text;
+        bool statementStart = prev == ";" || prev == "{" || prev == "}" || prev == ")" ||
+            prev == ":" || prev == "else" || prev == "do";
+        while (next < marks.size() && marks[next].first < ts[i].begin) {
+            addRegion(ik, marks[next].second, i, statementEnd(ik, i), path);
+            next++;
+        }
+        if (ts[i].kind != CodeToken::IDENT)
+            continue;
+        if ((w == "for" || w == "while") && ts[i + 1].text == "(" &&
+            ik.match[i + 1] != SIZE_MAX &&
+            std::find(doWhiles.begin(), doWhiles.end(), i) == doWhiles.end())
+        {
+            addRegion(ik, "loop", i, statementEnd(ik, i), path);
+        } else if (w == "do") {
+            doWhiles.push_back(statementEnd(ik, i + 1));
+            addRegion(ik, "loop", i, statementEnd(ik, i), path);
+        } else if ((w == "barrier" || w == "work_group_barrier") && statementStart &&
+            ts[i + 1].text == "(")
+        {
+            addRegion(ik, "barrier", i, statementEnd(ik, i), path);
+        }
+    }
+
+    // the private counts, and their flush before each return and at the end
+    std::string decls, flush;
+    for (size_t r = 0; r < ik.regions.size(); r++) {
+        std::string n = std::to_string(r), g = std::to_string(4 * (base + r));
+        decls += "ulong clc_n" + n + " = 0, clc_t" + n + " = 0; ";
+        flush += "CLC_ADD64(__clc_counters + " + g + ", clc_n" + n + ") ";
+        flush += "CLC_ADD64(__clc_counters + " + g + " + 2, clc_t" + n + ") ";
+    }
+    if (ik.regions.empty())
+        return;
+    ik.edits.push_back({k.bodyBegin + 1, " " + decls, false, SIZE_MAX});
+    for (size_t i = 0; i + 1 < ts.size(); i++) {
+        if (ts[i].text == "return" && ts[i].kind == CodeToken::IDENT) {
+            size_t e = statementEnd(ik, i);
+            ik.edits.push_back({ts[i].begin, "{ " + flush, false, 0});
+            ik.edits.push_back({endOffset(ik, e), " }", true, 0});
+        }
+    }
+    ik.edits.push_back({k.bodyEnd - 1, flush, false, 0});
+}
+
+void applyInstrumentation(const Opts &opts, std::vector<SourceText> &sourceStrs)
+{
+    if (!opts.instrument)
+        return;
+    TRACE_SCOPE("instrument");
+    size_t base = 0;
+    for (size_t u = 0; u < sourceStrs.size(); u++) {
+        if (isSpirv(sourceStrs[u])) {
+            fatal("%s: --instrument rewrites OpenCL C, not SPIR-V", opts.args[u].c_str());
+        }
+        const char *src = sourceStrs[u].data();
+        size_t n = sourceStrs[u].size();
+        const auto &path = opts.args[u];
+        auto kernels = parseKernels(src, n);
+        if (kernels.empty())
+            continue;
+
+        std::vector<Insertion> edits;
+        edits.push_back({0, prelude + lineDirective(1, path), false, SIZE_MAX});
+        for (const auto &k : kernels) {
+            InstrumentedKernel ik;
+            ik.src = src;
+            ik.k = &k;
+            instrumentKernel(ik, base, path);
+
+            std::string header;
+            for (size_t r = 0; r < ik.regions.size(); r++) {
+                header += "//@clc-region " + std::to_string(base + r) + " " + k.name + " " +
+                    ik.regions[r] + "\n";
+            }
+            // the header needs lines of its own: an attribute may precede
+            // the kernel keyword on its line
+            size_t bol = k.begin;
+            while (bol > 0 && src[bol - 1] != '\n')
+                bol--;
+            bool midLine = std::find_if(src + bol, src + k.begin, [](char c) {
+                return !isspace((unsigned char)c);
+            }) != src + k.begin;
+            auto where = sourceLocation(src, k.begin, path);
+            edits.push_back({k.begin, (midLine ? "\n" : "") + header +
+                lineDirective(where.second, where.first), false, SIZE_MAX});
+            // the counters are the last argument
+            std::string params(src + k.paramsBegin, k.paramsEnd - k.paramsBegin);
+            auto p = params.find_first_not_of(" \t\r\n");
+            bool none = p == std::string::npos || params.compare(p, 4, "void") == 0;
+            if (none) {
+                edits.push_back({k.paramsBegin, "global uint *__clc_counters", false, 0});
+                if (p != std::string::npos) {
+                    // replace the void
+                    edits.push_back({k.paramsBegin + p, "/*", false, 0});
+                    edits.push_back({k.paramsBegin + p + 4, "*/", true, 0});
+                }
+            } else {
+                edits.push_back({k.paramsEnd, ", global uint *__clc_counters", false, 0});
+            }
+            edits.insert(edits.end(), ik.edits.begin(), ik.edits.end());
+            verbose("%s: instrumented %s: %d regions\n", path.c_str(), k.name.c_str(),
+                (int)ik.regions.size());
+            base += ik.regions.size();
+        }
+
+        std::stable_sort(edits.begin(), edits.end(), [](const Insertion &a, const Insertion &b) {
+            if (a.at != b.at)
+                return a.at < b.at;
+            if (a.close != b.close)
+                return a.close;
+            return a.close ? a.span < b.span : a.span > b.span;
+        });
+        std::string out;
+        out.reserve(n + n / 2);
+        size_t copied = 0;
+        for (const auto &e : edits) {
+            out.append(src + copied, e.at - copied);
+            out += e.text;
+            copied = e.at;
+        }
+        out.append(src + copied, n - copied);
+        sourceStrs[u] = SourceText(std::move(out));
+    }
+}
+
+std::vector<InstrumentRegion> instrumentedRegions(const std::vector<SourceText> &sourceStrs)
+{
+    std::vector<InstrumentRegion> regions;
+    for (const auto &s : sourceStrs) {
+        std::stringstream ss(s.str());
+        std::string ln;
+        while (std::getline(ss, ln)) {
+            if (ln.compare(0, 14, "//@clc-region ") != 0)
+                continue;
+            // N KERNEL KIND WHERE
+            std::stringstream ls(ln.substr(14));
+            InstrumentRegion r;
+            if (ls >> r.index >> r.kernel >> r.kind && std::getline(ls >> std::ws, r.where))
+                regions.push_back(r);
+        }
+    }
+    return regions;
+}
@@ -0,0 +1,401 @@
+#include "json.hpp"
+
+#include <ctype.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+std::string jsonQuote(const std::string &s)
+{
+    std::string q = "\"";
+    for (char c : s) {
+        switch (c) {
+        case '"': q += "\\\""; break;
+        case '\\': q += "\\\\"; break;
+        case '\n': q += "\\n"; break;
+        case '\r': q += "\\r"; break;
+        case '\t': q += "\\t"; break;
+        default:
+            if ((unsigned char)c < 0x20) {
+                char buf[8];
+                snprintf(buf, sizeof(buf), "\\u%04x", (unsigned char)c);
+                q += buf;
+            } else {
+                q += c;
+            }
+        }
+    }
+    return q + "\"";
+}
+
+void JsonWriter::beginValue()
+{
+    if (afterKey) {
+        afterKey = false;
+        return;
+    }
+    if (!hasMembers.empty()) {
+        os << (hasMembers.back() ? ",\n" : "\n");
+        os << std::string(2 * hasMembers.size(), ' ');
+        hasMembers.back() = true;
+    }
+}
+
+JsonWriter &JsonWriter::raw(const std::string &text)
+{
+    beginValue();
+    os << text;
+    return *this;
+}
+
+JsonWriter &JsonWriter::beginObject()
+{
+    beginValue();
+    os << "{";
+    hasMembers.push_back(false);
+    return *this;
+}
+
+JsonWriter &JsonWriter::endObject()
+{
+    bool any = hasMembers.back();
+    hasMembers.pop_back();
+    if (any)
+        os << "\n" << std::string(2 * hasMembers.size(), ' ');
+    os << "}";
+    if (hasMembers.empty())
+        os << "\n";
+    return *this;
+}
+
+JsonWriter &JsonWriter::beginArray()
+{
+    beginValue();
+    os << "[";
+    hasMembers.push_back(false);
+    return *this;
+}
+
+JsonWriter &JsonWriter::endArray()
+{
+    bool any = hasMembers.back();
+    hasMembers.pop_back();
+    if (any)
+        os << "\n" << std::string(2 * hasMembers.size(), ' ');
+    os << "]";
+    if (hasMembers.empty())
+        os << "\n";
+    return *this;
+}
+
+JsonWriter &JsonWriter::key(const std::string &k)
+{
+    beginValue();
+    os << jsonQuote(k) << ": ";
+    afterKey = true;
+    return *this;
+}
+
+JsonWriter &JsonWriter::value(const std::string &v)
+{
+    return raw(jsonQuote(v));
+}
+
+JsonWriter &JsonWriter::value(double v)
+{
+    if (!isfinite(v))
+        return null();
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.15g", v);
+    return raw(buf);
+}
+
+static const JsonValue s_null;
+
+const JsonValue &JsonValue::operator[](size_t i) const
+{
+    return type == ARRAY && i < items.size() ? items[i] : s_null;
+}
+
+const JsonValue &JsonValue::operator[](const std::string &key) const
+{
+    if (type == OBJECT) {
+        for (size_t i = 0; i < keys.size(); i++) {
+            if (keys[i] == key)
+                return items[i];
+        }
+    }
+    return s_null;
+}
+
+double JsonValue::number(double def) const
+{
+    return type == NUMBER ? strtod(text.c_str(), nullptr) : def;
+}
+
+unsigned long long JsonValue::uint64(unsigned long long def) const
+{
+    if (type != NUMBER)
+        return def;
+    if (text.find_first_of("-.eE") == std::string::npos)
+        return strtoull(text.c_str(), nullptr, 10);
+    double d = number();
+    return d >= 0.0 ? (unsigned long long)d : def;
+}
+
+// a recursive-descent parser for RFC 8259 JSON
+class JsonParser {
+    const std::string  &s;
+    size_t              pos = 0;
+    int                 depth = 0;
+    std::string         error;
+
+    bool fail(const char *msg) {
+        if (error.empty())
+            error = msg;
+        return false;
+    }
+    void skipSpace() {
+        while (pos < s.size() &&
+            (s[pos] == ' ' || s[pos] == '\t' || s[pos] == '\r' || s[pos] == '\n'))
+        {
+            pos++;
+        }
+    }
+    bool literal(const char *lit) {
+        size_t n = strlen(lit);
+        if (s.compare(pos, n, lit) != 0)
+            return fail("unexpected token");
+        pos += n;
+        return true;
+    }
+    bool hex4(unsigned &cp) {
+        if (pos + 4 > s.size())
+            return fail("truncated \\u escape");
+        cp = 0;
+        for (int i = 0; i < 4; i++) {
+            char c = s[pos++];
+            cp <<= 4;
+            if (c >= '0' && c <= '9') cp |= c - '0';
+            else if (c >= 'a' && c <= 'f') cp |= c - 'a' + 10;
+            else if (c >= 'A' && c <= 'F') cp |= c - 'A' + 10;
+            else return fail("malformed \\u escape");
+        }
+        return true;
+    }
+    static void appendUtf8(std::string &out, unsigned cp) {
+        if (cp < 0x80) {
+            out += (char)cp;
+        } else if (cp < 0x800) {
+            out += (char)(0xC0 | (cp >> 6));
+            out += (char)(0x80 | (cp & 0x3F));
+        } else if (cp < 0x10000) {
+            out += (char)(0xE0 | (cp >> 12));
+            out += (char)(0x80 | ((cp >> 6) & 0x3F));
+            out += (char)(0x80 | (cp & 0x3F));
+        } else {
+            out += (char)(0xF0 | (cp >> 18));
+            out += (char)(0x80 | ((cp >> 12) & 0x3F));
+            out += (char)(0x80 | ((cp >> 6) & 0x3F));
+            out += (char)(0x80 | (cp & 0x3F));
+        }
+    }
+    bool string(std::string &out) {
+        pos++; // "
+        while (pos < s.size() && s[pos] != '"') {
+            char c = s[pos++];
+            if ((unsigned char)c < 0x20)
+                return fail("control character in string");
+            if (c != '\\') {
+                out += c;
+                continue;
+            }
+            if (pos >= s.size())
+                break;
+            switch (s[pos++]) {
+            case '"': out += '"'; break;
+            case '\\': out += '\\'; break;
+            case '/': out += '/'; break;
+            case 'b': out += '\b'; break;
+            case 'f': out += '\f'; break;
+            case 'n': out += '\n'; break;
+            case 'r': out += '\r'; break;
+            case 't': out += '\t'; break;
+            case 'u': {
+                unsigned cp;
+                if (!hex4(cp))
+                    return false;
+                if (cp >= 0xD800 && cp < 0xDC00) {
+                    unsigned lo;
+                    if (s.compare(pos, 2, "\\u") != 0)
+                        return fail("unpaired surrogate");
+                    pos += 2;
+                    if (!hex4(lo))
+                        return false;
+                    if (lo < 0xDC00 || lo >= 0xE000)
+                        return fail("unpaired surrogate");
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                }
+                appendUtf8(out, cp);
+                break;
+            }
+            default:
+                return fail("unknown escape");
+            }
+        }
+        if (pos >= s.size())
+            return fail("unterminated string");
+        pos++; // "
+        return true;
+    }
+    bool number(std::string &out) {
+        size_t start = pos;
+        if (s[pos] == '-')
+            pos++;
+        auto digits = [&]() {
+            size_t d = pos;
+            while (pos < s.size() && isdigit((unsigned char)s[pos]))
+                pos++;
+            return pos > d;
+        };
+        if (!digits())
+            return fail("malformed number");
+        if (pos < s.size() && s[pos] == '.') {
+            pos++;
+            if (!digits())
+                return fail("malformed number");
+        }
+        if (pos < s.size() && (s[pos] == 'e' || s[pos] == 'E')) {
+            pos++;
+            if (pos < s.size() && (s[pos] == '+' || s[pos] == '-'))
+                pos++;
+            if (!digits())
+                return fail("malformed number");
+        }
+        out = s.substr(start, pos - start);
+        return true;
+    }
+public:
+    explicit JsonParser(const std::string &_s) : s(_s) { }
+
+    bool value(JsonValue &v) {
+        skipSpace();
+        if (pos >= s.size())
+            return fail("unexpected end of input");
+        if (++depth > 256)
+            return fail("nested too deeply");
+        bool ok = true;
+        switch (s[pos]) {
+        case '{':
+            v.type = JsonValue::OBJECT;
+            pos++;
+            skipSpace();
+            if (pos < s.size() && s[pos] == '}') {
+                pos++;
+                break;
+            }
+            for (;;) {
+                skipSpace();
+                if (pos >= s.size() || s[pos] != '"') {
+                    ok = fail("expected a member name");
+                    break;
+                }
+                std::string key;
+                if (!(ok = string(key)))
+                    break;
+                skipSpace();
+                if (pos >= s.size() || s[pos] != ':') {
+                    ok = fail("expected :");
+                    break;
+                }
+                pos++;
+                v.keys.push_back(key);
+                v.items.emplace_back();
+                if (!(ok = value(v.items.back())))
+                    break;
+                skipSpace();
+                if (pos < s.size() && s[pos] == ',') {
+                    pos++;
+                } else if (pos < s.size() && s[pos] == '}') {
+                    pos++;
+                    break;
+                } else {
+                    ok = fail("expected , or }");
+                    break;
+                }
+            }
+            break;
+        case '[':
+            v.type = JsonValue::ARRAY;
+            pos++;
+            skipSpace();
+            if (pos < s.size() && s[pos] == ']') {
+                pos++;
+                break;
+            }
+            for (;;) {
+                v.items.emplace_back();
+                if (!(ok = value(v.items.back())))
+                    break;
+                skipSpace();
+                if (pos < s.size() && s[pos] == ',') {
+                    pos++;
+                } else if (pos < s.size() && s[pos] == ']') {
+                    pos++;
+                    break;
+                } else {
+                    ok = fail("expected , or ]");
+                    break;
+                }
+            }
+            break;
+        case '"':
+            v.type = JsonValue::STRING;
+            ok = string(v.text);
+            break;
+        case 't':
+            v.type = JsonValue::BOOLEAN;
+            v.boolean = true;
+            ok = literal("true");
+            break;
+        case 'f':
+            v.type = JsonValue::BOOLEAN;
+            ok = literal("false");
+            break;
+        case 'n':
+            ok = literal("null");
+            break;
+        default:
+            if (s[pos] != '-' && !isdigit((unsigned char)s[pos])) {
+                ok = fail("unexpected character");
+                break;
+            }
+            v.type = JsonValue::NUMBER;
+            ok = number(v.text);
+            break;
+        }
+        depth--;
+        return ok;
+    }
+
+    bool document(JsonValue &v, std::string &err) {
+        bool ok = value(v);
+        skipSpace();
+        if (ok && pos < s.size())
+            ok = fail("trailing characters");
+        if (!ok) {
+            int line = 1;
+            for (size_t i = 0; i < pos && i < s.size(); i++)
+                line += s[i] == '\n';
+            err = "line " + std::to_string(line) + ": " + error;
+        }
+        return ok;
+    }
+};
+
+bool parseJson(const std::string &text, JsonValue &value, std::string &err)
+{
+    value = JsonValue();
+    return JsonParser(text).document(value, err);
+}
@@ -0,0 +1,71 @@
+#ifndef JSON_HPP
+#define JSON_HPP
+
+#include <ostream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+// a streaming writer for the JSON that clc emits (--trace, ...);
+// containers are pretty-printed one member per line
+class JsonWriter {
+    std::ostream       &os;
+    std::vector<bool>   hasMembers; // per open container
+    bool                afterKey = false;
+
+    void beginValue();
+    JsonWriter &raw(const std::string &text);
+public:
+    explicit JsonWriter(std::ostream &os) : os(os) { }
+
+    JsonWriter &beginObject();
+    JsonWriter &endObject();
+    JsonWriter &beginArray();
+    JsonWriter &endArray();
+    JsonWriter &key(const std::string &k);
+
+    JsonWriter &value(const std::string &v);
+    JsonWriter &value(const char *v) { return value(std::string(v)); }
+    JsonWriter &value(bool v) { return raw(v ? "true" : "false"); }
+    JsonWriter &value(double v);
+    template <typename T>
+    typename std::enable_if<std::is_integral<T>::value, JsonWriter&>::type
+    value(T v) { return raw(std::to_string(v)); }
+    JsonWriter &null() { return raw("null"); }
+
+    // key(k).value(v)
+    template <typename T>
+    JsonWriter &member(const std::string &k, const T &v) { return key(k).value(v); }
+};
+
+// "..." with JSON escapes
+std::string jsonQuote(const std::string &s);
+
+// a parsed JSON document; lookups of missing members or elements (or of
+// the wrong type) yield a null value so readers can chain them
+struct JsonValue {
+    enum Type {NUL, BOOLEAN, NUMBER, STRING, ARRAY, OBJECT};
+
+    Type                        type = NUL;
+    bool                        boolean = false;
+    std::string                 text; // a string, or a number as written
+    std::vector<std::string>    keys; // objects: one per item
+    std::vector<JsonValue>      items;
+
+    bool isNull() const { return type == NUL; }
+    size_t size() const { return items.size(); }
+    const JsonValue &operator[](size_t i) const;
+    const JsonValue &operator[](const std::string &key) const;
+
+    std::string str(const std::string &def = std::string()) const {
+        return type == STRING ? text : def;
+    }
+    double number(double def = 0.0) const;
+    // numbers written as integers keep all 64 bits
+    unsigned long long uint64(unsigned long long def = 0) const;
+};
+
+// false (and a message with the offending line in err) if text is not JSON
+bool parseJson(const std::string &text, JsonValue &value, std::string &err);
+
+#endif
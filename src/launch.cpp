@@ -0,0 +1,465 @@
+#include "launch.hpp"
+#include "cache.hpp"
+#include "clerrs.h"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <math.h>
+#include <sstream>
+#include <stdlib.h>
+#include <string.h>
+
+cl::NDRange WorkSize::range() const
+{
+    switch (dims) {
+    case 1: return cl::NDRange(sizes[0]);
+    case 2: return cl::NDRange(sizes[0], sizes[1]);
+    case 3: return cl::NDRange(sizes[0], sizes[1], sizes[2]);
+    default: return cl::NullRange;
+    }
+}
+
+std::string WorkSize::str() const
+{
+    if (dims == 0)
+        return "auto";
+    std::stringstream ss;
+    for (cl_uint i = 0; i < dims; i++)
+        ss << (i > 0 ? "x" : "") << sizes[i];
+    return ss.str();
+}
+
+static bool parseWorkSize(const std::string &str, WorkSize &ws)
+{
+    ws = WorkSize();
+    if (str == "auto")
+        return true;
+    size_t st = 0;
+    while (st <= str.size()) {
+        size_t x = str.find('x', st);
+        if (x == std::string::npos)
+            x = str.size();
+        unsigned long long n = 0;
+        if (ws.dims == 3 || !parseByteSize(str.substr(st, x - st).c_str(), n) || n == 0)
+            return false;
+        ws.sizes[ws.dims++] = (size_t)n;
+        st = x + 1;
+    }
+    return ws.dims > 0;
+}
+
+std::vector<WorkSize> parseWorkSizes(const std::string &str)
+{
+    std::vector<WorkSize> wss;
+    std::stringstream ss(str);
+    std::string tk;
+    while (std::getline(ss, tk, ',')) {
+        WorkSize ws;
+        if (!parseWorkSize(tk, ws)) {
+            fatal("%s: malformed work size (expected e.g. 1024, 512x512, or auto)",
+                tk.c_str());
+        }
+        wss.push_back(ws);
+    }
+    if (wss.empty())
+        wss.emplace_back();
+    return wss;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// OpenCL C scalar and vector types
+struct TypeInfo {
+    size_t    scalarBytes = 0;
+    int       lanes = 1;
+    bool      isFloat = false;
+    bool      isSigned = false;
+
+    // 3-component vectors occupy the space of 4
+    size_t bytes() const { return scalarBytes * (lanes == 3 ? 4 : lanes); }
+};
+
+static bool parseTypeName(
+    std::string name, const cl::Device &dev, TypeInfo &ti)
+{
+    if (name.compare(0, 9, "unsigned ") == 0)
+        name = "u" + name.substr(9);
+    size_t e = name.size();
+    while (e > 0 && isdigit((unsigned char)name[e - 1]))
+        e--;
+    if (e < name.size()) {
+        ti.lanes = atoi(name.c_str() + e);
+        if (ti.lanes != 2 && ti.lanes != 3 && ti.lanes != 4 &&
+            ti.lanes != 8 && ti.lanes != 16)
+        {
+            return false;
+        }
+        name = name.substr(0, e);
+    }
+
+    static const struct {
+        const char *name;
+        size_t      bytes; // 0 for pointer-sized
+        bool        isFloat, isSigned;
+    } types[] = {
+        {"char", 1, false, true},   {"uchar", 1, false, false},
+        {"short", 2, false, true},  {"ushort", 2, false, false},
+        {"int", 4, false, true},    {"uint", 4, false, false},
+        {"long", 8, false, true},   {"ulong", 8, false, false},
+        {"half", 2, true, true},    {"float", 4, true, true},
+        {"double", 8, true, true},
+        {"size_t", 0, false, false}, {"uintptr_t", 0, false, false},
+        {"ptrdiff_t", 0, false, true}, {"intptr_t", 0, false, true},
+    };
+    for (const auto &t : types) {
+        if (name == t.name) {
+            ti.scalarBytes = t.bytes ? t.bytes :
+                dev.getInfo<CL_DEVICE_ADDRESS_BITS>() / 8;
+            ti.isFloat = t.isFloat;
+            ti.isSigned = t.isSigned;
+            return true;
+        }
+    }
+    return false;
+}
+
+static TypeInfo typeInfo(const std::string &name, const cl::Device &dev)
+{
+    TypeInfo ti;
+    if (!parseTypeName(name, dev, ti)) {
+        fatal("%s: unsupported argument type (give a plain element type, e.g. uchar[8192])",
+            name.c_str());
+    }
+    return ti;
+}
+
+static uint16_t floatToHalf(float f)
+{
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    uint16_t sign = (uint16_t)((x >> 16) & 0x8000);
+    int exp = (int)((x >> 23) & 0xff) - 127 + 15;
+    uint32_t mant = x & 0x7fffff;
+    if (((x >> 23) & 0xff) == 0xff)
+        return sign | 0x7c00 | (mant ? 0x200 : 0); // inf/nan
+    if (exp >= 31)
+        return sign | 0x7c00;
+    if (exp <= 0) {
+        if (exp < -10)
+            return sign;
+        mant |= 0x800000;
+        return sign | (uint16_t)(mant >> (14 - exp));
+    }
+    return sign | (uint16_t)(exp << 10) | (uint16_t)(mant >> 13);
+}
+
+// one element of the type with every lane set to the value
+static std::vector<char> encodeValue(
+    const TypeInfo &ti, const std::string &text)
+{
+    std::vector<char> lane(ti.scalarBytes);
+    if (!text.empty()) {
+        char *end = nullptr;
+        if (ti.isFloat) {
+            double d = strtod(text.c_str(), &end);
+            if (ti.scalarBytes == 2) {
+                uint16_t h = floatToHalf((float)d);
+                memcpy(lane.data(), &h, 2);
+            } else if (ti.scalarBytes == 4) {
+                float f = (float)d;
+                memcpy(lane.data(), &f, 4);
+            } else {
+                memcpy(lane.data(), &d, 8);
+            }
+        } else {
+            // little-endian truncation of a 64-bit value
+            unsigned long long u = ti.isSigned ?
+                (unsigned long long)strtoll(text.c_str(), &end, 0) :
+                strtoull(text.c_str(), &end, 0);
+            for (size_t i = 0; i < ti.scalarBytes; i++)
+                lane[i] = (char)(u >> (8 * i));
+        }
+        if (*end) {
+            fatal("%s: malformed value", text.c_str());
+        }
+    }
+    std::vector<char> elem(ti.bytes());
+    for (int i = 0; i < ti.lanes; i++)
+        memcpy(elem.data() + i * ti.scalarBytes, lane.data(), ti.scalarBytes);
+    return elem;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// argument specs
+std::string KernelArg::str() const
+{
+    std::stringstream ss;
+    switch (kind) {
+    case UNSPECIFIED:
+        return "_";
+    case LOCAL:
+        ss << "local:";
+        // fallthrough
+    case BUFFER:
+        ss << type << "[";
+        if (count)
+            ss << count;
+        ss << "]";
+        break;
+    case SCALAR:
+        break;
+    }
+    if (kind == SCALAR)
+        ss << type;
+    if (!value.empty())
+        ss << "=" << value;
+    return ss.str();
+}
+
+static KernelArg parseArg(const std::string &str)
+{
+    KernelArg a;
+    if (str == "_")
+        return a;
+
+    std::string s = str;
+    auto eq = s.find('=');
+    if (eq != std::string::npos) {
+        a.value = s.substr(eq + 1);
+        s = s.substr(0, eq);
+    }
+    bool isLocal = s.compare(0, 6, "local:") == 0;
+    if (isLocal)
+        s = s.substr(6);
+    auto lb = s.find('[');
+    if (lb == std::string::npos) {
+        if (isLocal || a.value.empty())
+            fatal("-args: %s: expected TYPE[N], local:TYPE[N], or TYPE=VALUE", str.c_str());
+        a.kind = KernelArg::SCALAR;
+        a.type = s;
+        return a;
+    }
+    if (s.back() != ']')
+        fatal("-args: %s: expected ] after element count", str.c_str());
+    a.kind = isLocal ? KernelArg::LOCAL : KernelArg::BUFFER;
+    a.type = s.substr(0, lb);
+    auto n = s.substr(lb + 1, s.size() - lb - 2);
+    unsigned long long count = 0;
+    if (!n.empty() && (!parseByteSize(n.c_str(), count) || count == 0))
+        fatal("-args: %s: malformed element count", str.c_str());
+    a.count = (size_t)count;
+    if (isLocal && !a.value.empty())
+        fatal("-args: %s: local memory cannot be initialized", str.c_str());
+    return a;
+}
+
+std::vector<KernelArg> parseArgSpec(const std::string &spec)
+{
+    std::vector<KernelArg> args;
+    if (spec.empty())
+        return args;
+    std::stringstream ss(spec);
+    std::string tk;
+    while (std::getline(ss, tk, ','))
+        args.push_back(parseArg(tk));
+    return args;
+}
+
+bool argSpecComplete(const std::vector<KernelArg> &args, const cl::Kernel &kern)
+{
+    cl_uint numArgs = kern.getInfo<CL_KERNEL_NUM_ARGS>();
+    if (args.size() > numArgs) {
+        fatal("-args: %s takes %u arguments, but %u were given",
+            kern.getInfo<CL_KERNEL_FUNCTION_NAME>().c_str(),
+            numArgs, (unsigned)args.size());
+    }
+    if (args.size() < numArgs)
+        return false;
+    for (const auto &a : args)
+        if (a.kind == KernelArg::UNSPECIFIED)
+            return false;
+    return true;
+}
+
+void synthesizeArgs(
+    std::vector<KernelArg> &args,
+    const cl::Kernel &kern,
+    const cl::Device &dev,
+    const WorkSize &global)
+{
+    cl_uint numArgs = kern.getInfo<CL_KERNEL_NUM_ARGS>();
+    args.resize(numArgs);
+    for (cl_uint i = 0; i < numArgs; i++) {
+        auto &a = args[i];
+        if (a.kind != KernelArg::UNSPECIFIED)
+            continue;
+
+        cl_kernel_arg_address_qualifier aq = CL_KERNEL_ARG_ADDRESS_PRIVATE;
+        std::string type, name;
+        try {
+            aq = kern.getArgInfo<CL_KERNEL_ARG_ADDRESS_QUALIFIER>(i);
+            type = kern.getArgInfo<CL_KERNEL_ARG_TYPE_NAME>(i);
+            name = kern.getArgInfo<CL_KERNEL_ARG_NAME>(i);
+        } catch (const cl::Error &err) {
+            fatal("argument %u: argument info unavailable (%s); give it in -args=...",
+                i, clErrStr(err.err()).c_str());
+        }
+        bool isPointer = !type.empty() && type.back() == '*';
+        if (isPointer)
+            type.pop_back();
+        TypeInfo ti;
+        if (!parseTypeName(type, dev, ti)) {
+            fatal("argument %u (%s %s): cannot synthesize a value for this type;"
+                " give it in -args=...", i, type.c_str(), name.c_str());
+        }
+
+        a.type = type;
+        if (aq == CL_KERNEL_ARG_ADDRESS_LOCAL) {
+            a.kind = KernelArg::LOCAL;
+            a.count = 0; // sized per launch by bindLocals
+        } else if (isPointer) {
+            a.kind = KernelArg::BUFFER;
+        } else {
+            a.kind = KernelArg::SCALAR;
+            a.value = ti.isFloat ? "1" : std::to_string(global.items());
+        }
+        debug("  arg %u (%s): %s\n", i, name.c_str(), a.str().c_str());
+    }
+}
+
+cl::Kernel introspectKernel(
+    const cl::Context &ctx,
+    const cl::Device &dev,
+    const std::vector<SourceText> &sourceStrs,
+    const std::string &buildOpts,
+    const std::string &kernelName)
+{
+    cl::Program prog = createProgram(ctx, sourceStrs, {dev});
+    std::string withInfo = buildOpts + (buildOpts.empty() ? "" : " ") + "-cl-kernel-arg-info";
+    try {
+        prog.build({dev}, withInfo.c_str());
+    } catch (const cl::Error &err) {
+        fatal("during build: %s (%s):\n%s", err.what(), clErrStr(err.err()).c_str(),
+            prog.getBuildInfo<CL_PROGRAM_BUILD_LOG>(dev).c_str());
+    }
+    try {
+        return cl::Kernel(prog, kernelName.c_str());
+    } catch (const cl::Error &err) {
+        fatal("%s: no such kernel in the program (%s)",
+            kernelName.c_str(), clErrStr(err.err()).c_str());
+    }
+    return cl::Kernel();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// argument storage
+KernelArgs::KernelArgs(
+    const cl::Context &ctx,
+    const cl::Device &dev,
+    const std::vector<KernelArg> &argList,
+    const WorkSize &global,
+    const WorkSize &local)
+    : args(argList), buffers(argList.size()), bytes(argList.size()),
+      scalars(argList.size()), elemBytes(argList.size()),
+      maxGroupItems(dev.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>())
+{
+    for (size_t i = 0; i < args.size(); i++) {
+        const auto &a = args[i];
+        if (a.kind == KernelArg::UNSPECIFIED) {
+            fatal("argument %u: unspecified (give it in -args=...)", (unsigned)i);
+        }
+        auto ti = typeInfo(a.type, dev);
+        auto elem = encodeValue(ti, a.value);
+        elemBytes[i] = elem.size();
+        if (a.kind == KernelArg::SCALAR) {
+            bytes[i] = elem.size();
+            scalars[i].swap(elem);
+            continue;
+        }
+
+        size_t count = a.count;
+        if (count == 0) {
+            count = a.kind == KernelArg::BUFFER ? global.items() :
+                local.dims ? local.items() : maxGroupItems;
+        }
+        bytes[i] = count * elem.size();
+        if (a.kind == KernelArg::BUFFER) {
+            std::vector<char> host(bytes[i]);
+            if (!a.value.empty()) {
+                for (size_t k = 0; k < count; k++)
+                    memcpy(host.data() + k * elem.size(), elem.data(), elem.size());
+            }
+            buffers[i] = cl::Buffer(ctx, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                bytes[i], host.data());
+        }
+    }
+}
+
+void KernelArgs::bind(cl::Kernel &kern) const
+{
+    for (size_t i = 0; i < args.size(); i++) {
+        const auto &a = args[i];
+        if (a.kind == KernelArg::BUFFER) {
+            kern.setArg((cl_uint)i, buffers[i]);
+        } else if (a.kind == KernelArg::LOCAL) {
+            kern.setArg((cl_uint)i, cl::Local(bytes[i]));
+        } else {
+            kern.setArg((cl_uint)i, scalars[i].size(), scalars[i].data());
+        }
+    }
+}
+
+void KernelArgs::bindLocals(cl::Kernel &kern, const WorkSize &local) const
+{
+    for (size_t i = 0; i < args.size(); i++) {
+        if (args[i].kind == KernelArg::LOCAL && args[i].count == 0) {
+            size_t items = local.dims ? local.items() : maxGroupItems;
+            kern.setArg((cl_uint)i, cl::Local(items * elemBytes[i]));
+        }
+    }
+}
+
+size_t KernelArgs::totalBufferBytes() const
+{
+    size_t total = 0;
+    for (size_t i = 0; i < args.size(); i++)
+        if (args[i].kind == KernelArg::BUFFER)
+            total += bytes[i];
+    return total;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// timing
+std::vector<double> timeKernel(
+    const cl::CommandQueue &queue,
+    const cl::Kernel &kern,
+    const WorkSize &global,
+    const WorkSize &local,
+    int warmup,
+    int iterations)
+{
+    TRACE_SCOPE("time kernel");
+    for (int i = 0; i < warmup; i++)
+        queue.enqueueNDRangeKernel(kern, cl::NullRange, global.range(), local.range());
+    queue.finish();
+
+    std::vector<double> ns;
+    for (int i = 0; i < iterations; i++) {
+        cl::Event ev;
+        queue.enqueueNDRangeKernel(
+            kern, cl::NullRange, global.range(), local.range(), nullptr, &ev);
+        ev.wait();
+        cl_ulong st = ev.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+        cl_ulong en = ev.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+        ns.push_back((double)(en - st));
+    }
+    return ns;
+}
+
+double percentile(std::vector<double> samples, double p)
+{
+    if (samples.empty())
+        return 0.0;
+    std::sort(samples.begin(), samples.end());
+    size_t rank = (size_t)ceil(p * samples.size());
+    return samples[rank > 0 ? rank - 1 : 0];
+}
@@ -0,0 +1,103 @@
+#ifndef LAUNCH_HPP
+#define LAUNCH_HPP
+
+#include "clc.hpp"
+
+#include <string>
+#include <vector>
+
+// Running a kernel on synthetic data (used by -sweep).
+
+// an NDRange such as 1024, 512x512, or 64x64x4 (K and M scale by 1024);
+// dims == 0 is "let the runtime choose" (cl::NullRange)
+struct WorkSize {
+    cl_uint   dims = 0;
+    size_t    sizes[3] = {1, 1, 1};
+
+    size_t items() const { return sizes[0] * sizes[1] * sizes[2]; }
+    cl::NDRange range() const;
+    std::string str() const;
+};
+// a comma-separated list of work sizes; "auto" is dims == 0
+std::vector<WorkSize> parseWorkSizes(const std::string &str);
+
+// One kernel argument.  The -args=... spec has one comma-separated
+// entry per argument (trailing arguments may be omitted):
+//   _               synthesized from the argument's declared type
+//   float[N]        global buffer of N elements (float[] = one per work-item)
+//   float[N]=V      ... filled with V
+//   local:float[N]  N elements of local memory
+//   int=V           scalar value (vectors broadcast V, e.g. float4=0.5)
+struct KernelArg {
+    enum Kind { UNSPECIFIED, BUFFER, LOCAL, SCALAR };
+    Kind                kind = UNSPECIFIED;
+    std::string         type;   // element type (e.g. float4)
+    size_t              count = 0; // elements; 0 means one per work-item
+    std::string         value;  // scalar value or buffer fill ("" is zero)
+
+    std::string str() const;
+};
+std::vector<KernelArg> parseArgSpec(const std::string &spec);
+
+// true if the spec covers every argument of the kernel
+bool argSpecComplete(const std::vector<KernelArg> &args, const cl::Kernel &kern);
+// fills in unspecified arguments from the kernel's argument info (so kern
+// must come from a -cl-kernel-arg-info build): pointers become zero-filled
+// buffers with one element per work-item, local pointers one element per
+// work-item of the group, integer scalars the work-item count (a common
+// loop bound), and float scalars 1
+void synthesizeArgs(
+    std::vector<KernelArg> &args,
+    const cl::Kernel &kern,
+    const cl::Device &dev,
+    const WorkSize &global);
+// builds the sources once more with -cl-kernel-arg-info for synthesizeArgs
+cl::Kernel introspectKernel(
+    const cl::Context &ctx,
+    const cl::Device &dev,
+    const std::vector<SourceText> &sourceStrs,
+    const std::string &buildOpts,
+    const std::string &kernelName);
+
+// device storage for a set of arguments; buffers are shared by every
+// kernel bound to them
+class KernelArgs {
+    std::vector<KernelArg>      args;
+    std::vector<cl::Buffer>     buffers;
+    std::vector<size_t>         bytes;
+    std::vector<std::vector<char>> scalars;
+    std::vector<size_t>         elemBytes;
+    size_t                      maxGroupItems = 0;
+public:
+    KernelArgs(
+        const cl::Context &ctx,
+        const cl::Device &dev,
+        const std::vector<KernelArg> &args,
+        const WorkSize &global,
+        const WorkSize &local);
+
+    void bind(cl::Kernel &kern) const;
+    // resizes the local memory given per work-item (local:T[]) for another
+    // work-group size than the one the arguments were made for
+    void bindLocals(cl::Kernel &kern, const WorkSize &local) const;
+    const std::vector<KernelArg> &list() const { return args; }
+    const cl::Buffer &buffer(size_t i) const { return buffers[i]; }
+    size_t bufferBytes(size_t i) const { return bytes[i]; }
+    // total global memory read or written per launch (upper bound)
+    size_t totalBufferBytes() const;
+};
+
+// enqueues `warmup` untimed launches and then `iterations` timed ones on a
+// profiling queue; returns each timed launch's device time in nanoseconds
+std::vector<double> timeKernel(
+    const cl::CommandQueue &queue,
+    const cl::Kernel &kern,
+    const WorkSize &global,
+    const WorkSize &local,
+    int warmup,
+    int iterations);
+
+// p in [0,1] (nearest rank); samples need not be sorted
+double percentile(std::vector<double> samples, double p);
+
+#endif
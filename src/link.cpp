@@ -0,0 +1,233 @@
+#include "clc.hpp"
+#include "cache.hpp"
+#include "clerrs.h"
+#include "includes.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <sstream>
+#include <thread>
+
+// options that clLinkProgram accepts; everything else is for the compiler
+static std::string linkOptions(const std::vector<std::string> &tokens)
+{
+    static const char *linkOpts[] = {
+        "-create-library",
+        "-enable-link-options",
+        "-cl-denorms-are-zero",
+        "-cl-no-signed-zeros",
+        "-cl-unsafe-math-optimizations",
+        "-cl-finite-math-only",
+        "-cl-fast-relaxed-math",
+        "-cl-no-subgroup-ifp",
+    };
+    std::string s;
+    for (const auto &tk : tokens) {
+        for (const char *lo : linkOpts) {
+            if (tk == lo) {
+                s += (s.empty() ? "" : " ") + tk;
+                break;
+            }
+        }
+    }
+    return s;
+}
+
+// the options for clCompileProgram: all but the link-only ones, which it
+// rejects as invalid
+static std::string compileOptions(const std::vector<std::string> &tokens)
+{
+    std::vector<std::string> compile;
+    for (const auto &tk : tokens) {
+        if (tk != "-create-library" && tk != "-enable-link-options")
+            compile.push_back(tk);
+    }
+    return normalizeBuildOptions(compile);
+}
+
+struct CompileUnit {
+    std::string                     path;
+    const SourceText               *text = nullptr;
+    std::vector<std::string>        keys;       // object cache key per device
+    std::vector<std::vector<char>>  objects;    // per device (empty if missing)
+    std::vector<cl::Device>         missing;    // devices to compile for
+    std::vector<bool>               fresh;      // per device: compiled now
+    std::string                     error;
+};
+
+// compiles one input with its (transitively) included headers embedded so
+// that the object depends on exactly the headers this unit reads
+static void compileUnit(
+    CompileUnit &u,
+    const cl::Context &ctx,
+    const std::string &compileOpts,
+    const std::vector<std::string> &incDirs)
+{
+    TRACE_SCOPE("compile", u.path.c_str());
+    std::vector<cl::Program> headers;
+    std::vector<std::string> headerNames;
+    for (const auto &inc : scanIncludes({u.path}, {*u.text}, incDirs)) {
+        if (inc.path.empty() ||
+            std::find(headerNames.begin(), headerNames.end(), inc.name) != headerNames.end())
+        {
+            continue;
+        }
+        auto text = readTextFile(inc.path);
+        headers.emplace_back(ctx, cl::Program::Sources{std::make_pair(text.c_str(), text.size())});
+        headerNames.push_back(inc.name);
+    }
+    std::vector<cl_program> headerIds;
+    std::vector<const char *> headerNamePtrs;
+    for (size_t i = 0; i < headers.size(); i++) {
+        headerIds.push_back(headers[i]());
+        headerNamePtrs.push_back(headerNames[i].c_str());
+    }
+
+    cl::Program prog(ctx,
+        cl::Program::Sources{std::make_pair(u.text->data(), u.text->size())});
+    std::vector<cl_device_id> ids;
+    for (const auto &d : u.missing)
+        ids.push_back(d());
+    verbose("compiling %s (%d embedded headers)\n", u.path.c_str(), (int)headers.size());
+    cl_int err = clCompileProgram(prog(), (cl_uint)ids.size(), ids.data(),
+        compileOpts.c_str(), (cl_uint)headerIds.size(),
+        headerIds.empty() ? nullptr : headerIds.data(),
+        headerNamePtrs.empty() ? nullptr : headerNamePtrs.data(),
+        nullptr, nullptr);
+    if (err != CL_SUCCESS) {
+        std::stringstream ss;
+        for (auto &d : u.missing) {
+            if (u.missing.size() > 1)
+                ss << d.getInfo<CL_DEVICE_NAME>() << ":\n";
+            ss << prog.getBuildInfo<CL_PROGRAM_BUILD_LOG>(d);
+        }
+        fatal("%s: during compile: clCompileProgram (%s):\n%s",
+            u.path.c_str(), clErrStr(err).c_str(), ss.str().c_str());
+    }
+    for (auto &d : u.missing)
+        reportBuildLog(prog, d, u.missing.size());
+
+    auto objs = programBinaries(prog, u.missing);
+    size_t k = 0;
+    for (size_t i = 0; i < u.objects.size(); i++) {
+        if (u.objects[i].empty())
+            u.objects[i].swap(objs[k++]);
+    }
+}
+
+std::vector<std::vector<char>> compileAndLink(
+    const Opts &opts,
+    const std::vector<SourceText> &sourceStrs,
+    const std::vector<cl::Device> &devs,
+    const cl::Context &ctx,
+    const BinaryCache *cache)
+{
+    auto tokens = splitBuildOptions(opts.buildOpts);
+    std::string compileOpts = compileOptions(tokens);
+    std::string linkOpts = linkOptions(tokens);
+    auto incDirs = includeDirectories(tokens);
+
+    // an object is keyed by its own text, its headers, the options, and the
+    // device, so editing one input (or a header only it includes)
+    // recompiles just that input
+    std::vector<CompileUnit> units(sourceStrs.size());
+    std::vector<size_t> toCompile;
+    for (size_t i = 0; i < units.size(); i++) {
+        auto &u = units[i];
+        u.path = opts.args[i];
+        u.text = &sourceStrs[i];
+        u.keys.resize(devs.size());
+        u.objects.resize(devs.size());
+        u.fresh.resize(devs.size());
+        for (size_t k = 0; k < devs.size(); k++) {
+            if (cache) {
+                u.keys[k] = binaryCacheKey(devs[k], {u.path}, {*u.text},
+                    opts.buildOpts, "object");
+                if (cache->lookup(u.keys[k], u.objects[k])) {
+                    verbose("object cache hit for %s\n", u.path.c_str());
+                    continue;
+                }
+            }
+            u.missing.push_back(devs[k]);
+            u.fresh[k] = true;
+        }
+        if (!u.missing.empty())
+            toCompile.push_back(i);
+    }
+
+    int workers = opts.jobs;
+    if (workers <= 0)
+        workers = (int)std::max(1u, std::thread::hardware_concurrency());
+    workers = std::min(workers, (int)toCompile.size());
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+        for (size_t i = next++; i < toCompile.size(); i = next++) {
+            auto &u = units[toCompile[i]];
+            try {
+                compileUnit(u, ctx, compileOpts, incDirs);
+                if (cache) {
+                    for (size_t k = 0; k < devs.size(); k++) {
+                        if (u.fresh[k])
+                            cache->store(u.keys[k], u.objects[k].data(), u.objects[k].size());
+                    }
+                }
+            } catch (const FatalError &err) {
+                u.error = err.what();
+            } catch (const cl::Error &err) {
+                u.error = std::string(err.what()) + " (" + clErrStr(err.err()) + ")";
+            }
+        }
+    };
+    std::vector<std::thread> threads;
+    for (int i = 1; i < workers; i++)
+        threads.emplace_back(worker);
+    if (workers > 0)
+        worker();
+    for (auto &t : threads)
+        t.join();
+
+    std::string errors;
+    for (const auto &u : units)
+        errors += u.error;
+    if (!errors.empty())
+        fatal(errors);
+
+    // link the objects (compiled or cached) for every device at once
+    std::vector<cl::Program> objects;
+    std::vector<cl_program> objectIds;
+    for (const auto &u : units) {
+        cl::Program::Binaries bins;
+        for (const auto &o : u.objects)
+            bins.emplace_back(o.data(), o.size());
+        objects.emplace_back(ctx, devs, bins);
+        objectIds.push_back(objects.back()());
+    }
+    std::vector<cl_device_id> ids;
+    for (const auto &d : devs)
+        ids.push_back(d());
+    verbose("linking %d objects%s%s\n", (int)objectIds.size(),
+        linkOpts.empty() ? "" : " with ", linkOpts.c_str());
+    cl_int err = CL_SUCCESS;
+    TRACE_SCOPE("link");
+    cl_program linked = clLinkProgram(ctx(), (cl_uint)ids.size(), ids.data(),
+        linkOpts.c_str(), (cl_uint)objectIds.size(), objectIds.data(),
+        nullptr, nullptr, &err);
+    if (err != CL_SUCCESS) {
+        std::stringstream ss;
+        if (linked) {
+            cl::Program prog(linked);
+            for (auto &d : devs) {
+                if (devs.size() > 1)
+                    ss << d.getInfo<CL_DEVICE_NAME>() << ":\n";
+                ss << prog.getBuildInfo<CL_PROGRAM_BUILD_LOG>(d);
+            }
+        }
+        fatal("during link: clLinkProgram (%s):\n%s",
+            clErrStr(err).c_str(), ss.str().c_str());
+    }
+    cl::Program prog(linked);
+    for (auto &d : devs)
+        reportBuildLog(prog, d, devs.size());
+    return programBinaries(prog, devs);
+}
@@ -0,0 +1,645 @@
+#include "clc.hpp"
+#include "clparse.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <map>
+#include <set>
+#include <stdlib.h>
+#include <string.h>
+
+// --perf-lint: a look at each kernel body for access and conversion
+// patterns that are slow on GPUs.  It is textual: the locals an index is
+// computed from are expanded into it (unless they are reassigned), and
+// get_global_id(0)/get_local_id(0) are taken as the dimension in which
+// neighbouring work-items run together.
+
+struct LintLocal {
+    std::string                 type; // the token before the name
+    bool                        localMemory = false; // local or __local
+    std::vector<std::string>    dims; // of an array
+    size_t                      initBegin = 0, initEnd = 0; // tokens; 0 if none
+    bool                        reassigned = false;
+};
+
+struct LintKernel {
+    const char                          *src;
+    const KernelDecl                    *k;
+    std::vector<CodeToken>              ts;
+    std::vector<size_t>                 match; // of each bracket (or SIZE_MAX)
+    std::map<std::string,LintLocal>     locals;
+    std::vector<std::pair<size_t,size_t>>   loops; // token ranges
+    std::vector<std::pair<size_t,size_t>>   idIfs; // if bodies conditional on an id
+    std::vector<std::pair<size_t,std::string>> findings; // (offset, message)
+};
+
+static const char *const idFunctions[] = {
+    "get_global_id", "get_local_id", "get_group_id", "get_global_linear_id",
+    "get_local_linear_id", "get_sub_group_id", "get_sub_group_local_id",
+};
+
+// built-ins defined for floating-point arguments only
+static const char *const floatFunctions[] = {
+    "mix", "smoothstep", "step", "sqrt", "rsqrt", "cbrt", "exp", "exp2", "exp10",
+    "log", "log2", "log10", "pow", "pown", "powr", "sin", "cos", "tan", "floor",
+    "ceil", "round", "trunc", "fma", "mad", "fmin", "fmax", "fabs", "native_sqrt",
+    "native_exp", "native_log", "native_sin", "native_cos", "native_powr",
+};
+
+static bool isAssignment(const std::string &op)
+{
+    static const char *const ops[] = {
+        "=", "+=", "-=", "*=", "/=", "%=", "&=", "|=", "^=", "<<=", ">>=", "++", "--",
+    };
+    for (const char *o : ops) {
+        if (op == o)
+            return true;
+    }
+    return false;
+}
+
+// the scalar of a built-in arithmetic type (uchar4 -> uchar), or ""
+static std::string scalarOf(const std::string &type)
+{
+    static const char *const scalars[] = {
+        "char", "uchar", "short", "ushort", "int", "uint", "long", "ulong", "float",
+        "double", "half", "size_t",
+    };
+    size_t d = type.size();
+    while (d > 0 && isdigit((unsigned char)type[d - 1]))
+        d--;
+    std::string base = type.substr(0, d);
+    for (const char *s : scalars) {
+        if (base == s && (d == type.size() || isReservedWord(type)))
+            return base;
+    }
+    return "";
+}
+
+static bool isIntegerType(const std::string &type)
+{
+    auto s = scalarOf(type);
+    return !s.empty() && s != "float" && s != "double" && s != "half";
+}
+
+// the arithmetic type in a parameter's type text ("const global float *" -> float)
+static std::string typeWord(const std::string &text)
+{
+    std::string word, found;
+    for (size_t i = 0; i <= text.size(); i++) {
+        if (i < text.size() && (isalnum((unsigned char)text[i]) || text[i] == '_')) {
+            word += text[i];
+        } else if (!word.empty()) {
+            if (!scalarOf(word).empty())
+                found = word;
+            word.clear();
+        }
+    }
+    return found;
+}
+
+static bool hasWord(const std::string &text, const char *word)
+{
+    size_t n = strlen(word);
+    for (size_t i = text.find(word); i != std::string::npos; i = text.find(word, i + 1)) {
+        bool before = i == 0 || !(isalnum((unsigned char)text[i - 1]) || text[i - 1] == '_');
+        bool after = i + n == text.size() ||
+            !(isalnum((unsigned char)text[i + n]) || text[i + n] == '_');
+        if (before && after)
+            return true;
+    }
+    return false;
+}
+
+static bool mentionsId(const std::string &expr)
+{
+    for (const char *f : idFunctions) {
+        if (hasWord(expr, f))
+            return true;
+    }
+    return false;
+}
+
+static std::string tokenText(const LintKernel &lk, size_t b, size_t e)
+{
+    std::string out;
+    for (size_t i = b; i < e; i++) {
+        const auto &t = lk.ts[i];
+        if (!out.empty() && t.kind != CodeToken::PUNCT &&
+            (isalnum((unsigned char)out.back()) || out.back() == '_'))
+        {
+            out += ' ';
+        }
+        out += t.text;
+    }
+    return out;
+}
+
+// the tokens b..e with the locals that are assigned once replaced by
+// their initializers
+static std::string expand(const LintKernel &lk, size_t b, size_t e, int depth)
+{
+    std::string out;
+    for (size_t i = b; i < e; i++) {
+        const auto &t = lk.ts[i];
+        std::string text = t.text;
+        auto itr = lk.locals.find(t.text);
+        if (t.kind == CodeToken::IDENT && itr != lk.locals.end() && depth < 8 &&
+            !itr->second.reassigned && itr->second.initBegin > 0 &&
+            (i < itr->second.initBegin || i >= itr->second.initEnd))
+        {
+            text = "(" + expand(lk, itr->second.initBegin, itr->second.initEnd, depth + 1) +
+                ")";
+        }
+        if (!out.empty() && t.kind != CodeToken::PUNCT &&
+            (isalnum((unsigned char)out.back()) || out.back() == '_'))
+        {
+            out += ' ';
+        }
+        out += text;
+    }
+    return out;
+}
+
+// true if the expression is provably the same for every work-item: its
+// identifiers are all scalar kernel parameters, uniform built-ins, or type
+// names (casts); a macro, a call, or an unknown name makes it unknown
+static bool isUniform(const LintKernel &lk, const std::string &expr)
+{
+    static const std::set<std::string> uniformBuiltins = {
+        "get_global_size", "get_local_size", "get_enqueued_local_size", "get_num_groups",
+        "get_work_dim", "get_global_offset",
+    };
+    for (const auto &t : codeTokens(expr.data(), 0, expr.size())) {
+        if (t.kind != CodeToken::IDENT)
+            continue;
+        bool param = false;
+        for (const auto &p : lk.k->params)
+            param |= p.name == t.text && !p.isPointer();
+        if (!param && uniformBuiltins.count(t.text) == 0 && scalarOf(t.text).empty())
+            return false;
+    }
+    return true;
+}
+
+// the distance in elements between neighbouring work-items' indexes: the
+// factor get_global_id(0) or get_local_id(0) is multiplied by ("" if
+// none, "1" if it is not)
+static std::string dim0Stride(const std::string &expr)
+{
+    for (const char *f : {"get_global_id", "get_local_id"}) {
+        std::string id = std::string(f) + "(0)";
+        size_t b = expr.find(id);
+        if (b == std::string::npos)
+            continue;
+        size_t e = b + id.size();
+        while (b > 0 && e < expr.size() && expr[b - 1] == '(' && expr[e] == ')') {
+            b--;
+            e++;
+        }
+        if (e < expr.size() && expr[e] == '*') {
+            size_t s = e + 1, t = s;
+            if (t < expr.size() && expr[t] == '(') {
+                int depth = 0;
+                do {
+                    depth += expr[t] == '(' ? 1 : expr[t] == ')' ? -1 : 0;
+                    t++;
+                } while (t < expr.size() && depth > 0);
+            } else {
+                while (t < expr.size() && (isalnum((unsigned char)expr[t]) ||
+                    expr[t] == '_' || expr[t] == '.'))
+                {
+                    t++;
+                }
+            }
+            return expr.substr(s, t - s);
+        }
+        if (b > 0 && expr[b - 1] == '*') {
+            size_t t = b - 1, s = t;
+            if (s > 0 && expr[s - 1] == ')') {
+                int depth = 0;
+                do {
+                    s--;
+                    depth += expr[s] == ')' ? 1 : expr[s] == '(' ? -1 : 0;
+                } while (s > 0 && depth > 0);
+            } else {
+                while (s > 0 && (isalnum((unsigned char)expr[s - 1]) ||
+                    expr[s - 1] == '_' || expr[s - 1] == '.'))
+                {
+                    s--;
+                }
+            }
+            return expr.substr(s, t - s);
+        }
+        if (expr.compare(e, 2, "<<") == 0) {
+            size_t t = e + 2;
+            while (t < expr.size() && isdigit((unsigned char)expr[t]))
+                t++;
+            unsigned long shift = strtoul(expr.c_str() + e + 2, nullptr, 10);
+            return t > e + 2 && shift < 32 ? std::to_string(1UL << shift) : "a power of 2";
+        }
+        return "1";
+    }
+    return "";
+}
+
+static std::string withoutParens(const std::string &s)
+{
+    if (s.size() > 2 && s[0] == '(' && s.back() == ')')
+        return s.substr(1, s.size() - 2);
+    return s;
+}
+
+// the end (exclusive) of the statement starting at token i
+static size_t statementEnd(const LintKernel &lk, size_t i)
+{
+    if (i >= lk.ts.size())
+        return i;
+    if (lk.ts[i].text == "{")
+        return std::min(lk.match[i], lk.ts.size() - 1) + 1;
+    for (; i < lk.ts.size(); i++) {
+        if (lk.ts[i].text == ";")
+            return i + 1;
+        if (lk.match[i] != SIZE_MAX && lk.match[i] > i)
+            i = lk.match[i];
+    }
+    return i;
+}
+
+static bool within(const std::vector<std::pair<size_t,size_t>> &ranges, size_t i)
+{
+    for (const auto &r : ranges) {
+        if (i >= r.first && i < r.second)
+            return true;
+    }
+    return false;
+}
+
+static void scanKernel(LintKernel &lk)
+{
+    auto &ts = lk.ts;
+    ts = codeTokens(lk.src, lk.k->bodyBegin, lk.k->bodyEnd);
+    lk.match.assign(ts.size(), SIZE_MAX);
+    std::vector<size_t> open;
+    for (size_t i = 0; i < ts.size(); i++) {
+        const auto &t = ts[i].text;
+        if (t == "(" || t == "[" || t == "{") {
+            open.push_back(i);
+        } else if ((t == ")" || t == "]" || t == "}") && !open.empty()) {
+            lk.match[i] = open.back();
+            lk.match[open.back()] = i;
+            open.pop_back();
+        }
+    }
+
+    // declarations: TYPE NAME or TYPE *NAME followed by = ; , [ or )
+    static const std::set<std::string> notTypes = {
+        "return", "case", "else", "do", "goto", "sizeof", "break", "continue",
+    };
+    for (size_t i = 1; i + 1 < ts.size(); i++) {
+        const auto &t = ts[i];
+        const auto &next = ts[i + 1].text;
+        if (t.kind != CodeToken::IDENT || isReservedWord(t.text) ||
+            !(next == "=" || next == ";" || next == "," || next == "[" || next == ")"))
+        {
+            continue;
+        }
+        const auto &prev = ts[i - 1];
+        bool decl = prev.kind == CodeToken::IDENT && notTypes.count(prev.text) == 0;
+        bool pointer = prev.text == "*" && i >= 2 && isReservedWord(ts[i - 2].text);
+        if (!decl && !pointer)
+            continue;
+        if (lk.locals.count(t.text) > 0) {
+            lk.locals[t.text].reassigned = true; // shadowed: either may be meant
+            continue;
+        }
+        LintLocal l;
+        l.type = pointer ? ts[i - 2].text + "*" : prev.text;
+        for (size_t b = i; b > 0; b--) {
+            const auto &w = ts[b - 1].text;
+            if (w == ";" || w == "{" || w == "}" || w == "(")
+                break;
+            l.localMemory |= w == "local" || w == "__local";
+        }
+        size_t j = i + 1;
+        while (j < ts.size() && ts[j].text == "[" && lk.match[j] != SIZE_MAX) {
+            l.dims.push_back(tokenText(lk, j + 1, lk.match[j]));
+            j = lk.match[j] + 1;
+        }
+        if (j < ts.size() && ts[j].text == "=") {
+            l.initBegin = j + 1;
+            for (j++; j < ts.size() && ts[j].text != ";" && ts[j].text != ","; j++) {
+                if (lk.match[j] != SIZE_MAX && lk.match[j] > j)
+                    j = lk.match[j];
+            }
+            l.initEnd = j;
+        }
+        lk.locals[t.text] = l;
+        ts[i].kind = CodeToken::Kind(-1); // (marks the declaration for below)
+    }
+    for (size_t i = 0; i < ts.size(); i++) {
+        auto itr = lk.locals.find(ts[i].text);
+        if (ts[i].kind == CodeToken::IDENT && itr != lk.locals.end()) {
+            bool assigned = i + 1 < ts.size() && isAssignment(ts[i + 1].text);
+            bool incremented = i > 0 && (ts[i - 1].text == "++" || ts[i - 1].text == "--");
+            bool addressed = i > 0 && ts[i - 1].text == "&" &&
+                (i < 2 || ts[i - 2].kind == CodeToken::PUNCT);
+            itr->second.reassigned |= assigned || incremented || addressed;
+        }
+    }
+    for (auto &t : ts) {
+        if (t.kind == CodeToken::Kind(-1))
+            t.kind = CodeToken::IDENT;
+    }
+
+    for (size_t i = 0; i + 1 < ts.size(); i++) {
+        const auto &w = ts[i].text;
+        if (ts[i].kind != CodeToken::IDENT)
+            continue;
+        if (w == "do") {
+            lk.loops.emplace_back(i, statementEnd(lk, i + 1));
+        } else if ((w == "for" || w == "while" || w == "if") && ts[i + 1].text == "(" &&
+            lk.match[i + 1] != SIZE_MAX)
+        {
+            size_t close = lk.match[i + 1];
+            std::pair<size_t,size_t> r(i, statementEnd(lk, close + 1));
+            if (w != "if")
+                lk.loops.push_back(r);
+            else if (mentionsId(expand(lk, i + 2, close, 0)))
+                lk.idIfs.push_back(r);
+        }
+    }
+}
+
+static void addFinding(LintKernel &lk, size_t tok, const std::string &msg)
+{
+    lk.findings.emplace_back(lk.ts[tok].begin, msg);
+}
+
+// uniform and strided global accesses; strides that conflict in local memory
+static void lintIndexes(LintKernel &lk)
+{
+    const auto &ts = lk.ts;
+    std::set<std::string> seen;
+    for (size_t i = 0; i + 1 < ts.size(); i++) {
+        if (ts[i].kind != CodeToken::IDENT || ts[i + 1].text != "[" ||
+            lk.match[i + 1] == SIZE_MAX || (i > 0 && (ts[i - 1].text == "." ||
+            ts[i - 1].text == "->")))
+        {
+            continue;
+        }
+        const auto &name = ts[i].text;
+        size_t close = lk.match[i + 1];
+        std::string index = tokenText(lk, i + 2, close);
+        std::string expr = expand(lk, i + 2, close, 0);
+        bool write = close + 1 < ts.size() && isAssignment(ts[close + 1].text);
+        std::string access = name + "[" + index + "]";
+
+        const KernelParam *param = nullptr;
+        for (const auto &p : lk.k->params) {
+            if (p.name == name)
+                param = &p;
+        }
+        auto loc = lk.locals.find(name);
+        bool global = param && param->isPointer() &&
+            (hasWord(param->type, "global") || hasWord(param->type, "__global"));
+        bool localMemory = (param && param->isPointer() &&
+            (hasWord(param->type, "local") || hasWord(param->type, "__local"))) ||
+            (loc != lk.locals.end() && loc->second.localMemory);
+
+        if (global) {
+            if (isUniform(lk, expr) && !within(lk.idIfs, i) &&
+                seen.insert("u" + access).second)
+            {
+                addFinding(lk, i, access + ": every work-item " +
+                    (write ? "writes the same element" :
+                    "reads the same element; read it once or pass it by value"));
+            }
+            auto stride = withoutParens(dim0Stride(expr));
+            if (!stride.empty() && stride != "1" && seen.insert("s" + access).second) {
+                addFinding(lk, i, access + ": neighbouring work-items are " + stride +
+                    " elements apart, so the accesses are not coalesced");
+            }
+        } else if (localMemory) {
+            auto stride = withoutParens(dim0Stride(expr));
+            unsigned long s = strtoul(stride.c_str(), nullptr, 10);
+            if (s > 1 && s % 2 == 0 && stride.find_first_not_of("0123456789") ==
+                std::string::npos && seen.insert("b" + access).second)
+            {
+                addFinding(lk, i, access + ": a stride of " + stride + " puts " +
+                    "neighbouring work-items in the same local memory banks");
+            }
+            // tile[lid][...] with rows of 16, 32, ... elements
+            size_t open2 = close + 1;
+            if (loc != lk.locals.end() && loc->second.dims.size() == 2 &&
+                open2 < ts.size() && ts[open2].text == "[" && lk.match[open2] != SIZE_MAX)
+            {
+                auto inner = expand(lk, open2 + 1, lk.match[open2], 0);
+                unsigned long row = strtoul(loc->second.dims[1].c_str(), nullptr, 10);
+                if (!dim0Stride(expr).empty() && dim0Stride(inner).empty() &&
+                    row >= 16 && row % 16 == 0 && seen.insert("r" + access).second)
+                {
+                    addFinding(lk, i, access + "[" + tokenText(lk, open2 + 1,
+                        lk.match[open2]) + "]: rows of " + loc->second.dims[1] +
+                        " elements put a column in one local memory bank; declare " +
+                        name + "[" + loc->second.dims[0] + "][" +
+                        std::to_string(row + 1) + "]");
+                }
+            }
+        }
+    }
+}
+
+// global pointers that are only read but not const (or restrict)
+static void lintQualifiers(LintKernel &lk)
+{
+    const auto &ts = lk.ts;
+    const auto &k = *lk.k;
+    size_t globals = 0;
+    for (const auto &p : k.params) {
+        globals += p.isPointer() &&
+            (hasWord(p.type, "global") || hasWord(p.type, "__global"));
+    }
+    for (const auto &p : k.params) {
+        if (!p.isPointer() || !(hasWord(p.type, "global") || hasWord(p.type, "__global")))
+            continue;
+        bool read = false, written = false, escapes = false;
+        for (size_t i = 0; i < ts.size(); i++) {
+            if (ts[i].kind != CodeToken::IDENT || ts[i].text != p.name)
+                continue;
+            bool incremented = i > 0 && (ts[i - 1].text == "++" || ts[i - 1].text == "--");
+            if (i + 1 < ts.size() && ts[i + 1].text == "[" && lk.match[i + 1] != SIZE_MAX) {
+                size_t close = lk.match[i + 1];
+                bool addressed = i > 0 && ts[i - 1].text == "&" &&
+                    (i < 2 || ts[i - 2].kind == CodeToken::PUNCT);
+                if (addressed)
+                    escapes = true;
+                else if (incremented || (close + 1 < ts.size() &&
+                    isAssignment(ts[close + 1].text)))
+                    written = true;
+                else
+                    read = true;
+                continue;
+            }
+            // the function it is passed to: vloadN reads
+            size_t b = i;
+            int depth = 0;
+            while (b > 0 && !(ts[b - 1].text == "(" && depth == 0)) {
+                b--;
+                if (ts[b].text == ")")
+                    depth++;
+                else if (ts[b].text == "(" )
+                    depth--;
+            }
+            if (b >= 2 && ts[b - 2].text.compare(0, 5, "vload") == 0)
+                read = true;
+            else
+                escapes = true;
+        }
+        if (!read || written || escapes)
+            continue;
+        auto uses = identifierUses(lk.src, k.paramsBegin, k.paramsEnd, p.name);
+        size_t at = uses.empty() ? k.paramsBegin : uses.back();
+        if (!hasWord(p.type, "const")) {
+            lk.findings.emplace_back(at, p.name + " is only read; declare it const (and " +
+                "restrict if it cannot alias another buffer)");
+        } else if (!hasWord(p.type, "restrict") && globals > 1) {
+            lk.findings.emplace_back(at, p.name + " is only read; declare it restrict so " +
+                "its loads need not be ordered against the other buffers' stores");
+        }
+    }
+}
+
+// conversions: in loops, and from double constants and integer vectors
+// passed to floating-point built-ins anywhere
+static void lintConversions(LintKernel &lk)
+{
+    const auto &ts = lk.ts;
+    const auto &k = *lk.k;
+    bool usesDouble = false;
+    for (const auto &p : k.params)
+        usesDouble |= scalarOf(typeWord(p.type)) == "double";
+    for (const auto &t : ts)
+        usesDouble |= t.text == "double" || scalarOf(t.text) == "double";
+
+    std::set<std::string> seen;
+    for (size_t i = 0; i < ts.size(); i++) {
+        const auto &t = ts[i];
+        bool inLoop = within(lk.loops, i);
+        if (t.kind == CodeToken::NUMBER && !usesDouble) {
+            bool hex = t.text.size() > 1 && (t.text[1] == 'x' || t.text[1] == 'X');
+            bool real = !hex && t.text.find_first_of(".eE") != std::string::npos;
+            char last = (char)tolower((unsigned char)t.text.back());
+            if (real && last != 'f' && last != 'h' && seen.insert("d" + t.text).second) {
+                addFinding(lk, i, t.text + " is a double constant, so the expression " +
+                    "is converted to double; write " + t.text + "f");
+            }
+        }
+        if (t.kind != CodeToken::IDENT || i + 1 >= ts.size())
+            continue;
+        if (inLoop && t.text.compare(0, 8, "convert_") == 0 && ts[i + 1].text == "(") {
+            addFinding(lk, i, t.text + " in a loop converts on every iteration; " +
+                "convert once outside it or keep the data in one type");
+        }
+        // (TYPE)expr in a loop, unless expr is a constant
+        if (inLoop && i > 0 && ts[i - 1].text == "(" && ts[i + 1].text == ")" &&
+            !scalarOf(t.text).empty() && i + 2 < ts.size())
+        {
+            size_t n = i + 2;
+            bool constant = ts[n].kind == CodeToken::NUMBER;
+            if (ts[n].text == "(" && lk.match[n] != SIZE_MAX) {
+                constant = true;
+                for (size_t c = n + 1; c < lk.match[n]; c++) {
+                    constant &= ts[c].kind == CodeToken::NUMBER || ts[c].text == "," ||
+                        ts[c].text == "-";
+                }
+            }
+            if (!constant) {
+                addFinding(lk, i, "(" + t.text + ") in a loop converts on every " +
+                    "iteration; convert once outside it or keep the data in one type");
+            }
+        }
+        // mix(in1, in2, t) with integer in1
+        bool floatOnly = false;
+        for (const char *f : floatFunctions)
+            floatOnly |= t.text == f;
+        if (!floatOnly || ts[i + 1].text != "(" || lk.match[i + 1] == SIZE_MAX)
+            continue;
+        size_t close = lk.match[i + 1];
+        for (size_t a = i + 2; a < close; a++) {
+            if (lk.match[a] != SIZE_MAX && lk.match[a] > a) {
+                a = lk.match[a];
+                continue;
+            }
+            if (ts[a].kind != CodeToken::IDENT ||
+                !(ts[a - 1].text == "(" || ts[a - 1].text == ",") ||
+                !(ts[a + 1].text == ")" || ts[a + 1].text == ","))
+            {
+                continue;
+            }
+            std::string type;
+            auto loc = lk.locals.find(ts[a].text);
+            if (loc != lk.locals.end())
+                type = loc->second.type;
+            for (const auto &p : k.params) {
+                if (p.name == ts[a].text && !p.isPointer())
+                    type = typeWord(p.type);
+            }
+            if (isIntegerType(type)) {
+                std::string f = "float";
+                if (type.size() > scalarOf(type).size())
+                    f += type.substr(scalarOf(type).size());
+                addFinding(lk, a, t.text + "() converts " + type + " " + ts[a].text +
+                    " to " + f + (inLoop ? " on every iteration" : "") +
+                    "; use integer arithmetic or keep the data as " + f);
+            }
+        }
+    }
+}
+
+void perfLint(const Opts &opts, const std::vector<SourceText> &sourceStrs)
+{
+    if (opts.perfLint.empty())
+        return;
+    TRACE_SCOPE("perf lint");
+    std::vector<std::string> reports;
+    std::set<std::string> seen;
+    int kernels = 0;
+    for (size_t u = 0; u < sourceStrs.size(); u++) {
+        if (isSpirv(sourceStrs[u]))
+            continue;
+        const char *src = sourceStrs[u].data();
+        for (const auto &k : parseKernels(src, sourceStrs[u].size())) {
+            LintKernel lk;
+            lk.src = src;
+            lk.k = &k;
+            scanKernel(lk);
+            lintIndexes(lk);
+            lintQualifiers(lk);
+            lintConversions(lk);
+            kernels++;
+            std::stable_sort(lk.findings.begin(), lk.findings.end(),
+                [](const std::pair<size_t,std::string> &a,
+                    const std::pair<size_t,std::string> &b) {
+                    return a.first < b.first;
+                });
+            for (const auto &f : lk.findings) {
+                auto where = sourceLocation(src, f.first, opts.args[u]);
+                std::string r = where.first + ":" + std::to_string(where.second) +
+                    ": " + k.name + ": " + f.second;
+                // (instantiations and -spec= copies repeat their original)
+                if (seen.insert(r).second)
+                    reports.push_back(r);
+            }
+        }
+    }
+    verbose("perf-lint: %d findings in %d kernels\n", (int)reports.size(), kernels);
+    if (opts.perfLint == "error" && !reports.empty()) {
+        std::string errors;
+        for (const auto &r : reports)
+            errors += (errors.empty() ? "" : "\n") + r;
+        fatal(errors);
+    }
+    for (const auto &r : reports)
+        warning("%s\n", r.c_str());
+}
@@ -0,0 +1,323 @@
+#include "clc.hpp"
+#include "clparse.hpp"
+#include "includes.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <map>
+#include <set>
+#include <string.h>
+
+// the conditional branches enclosing each kernel: one (#if number, branch
+// number) per open #if; directives inside definitions are not considered
+typedef std::vector<std::pair<int,int>> Branches;
+
+static std::vector<Branches> kernelBranches(
+    const char *src, size_t n, const std::vector<KernelDecl> &kernels)
+{
+    std::vector<Branches> result;
+    auto items = parseTopLevel(src, n);
+    Branches open;
+    int ifs = 0;
+    size_t it = 0;
+    for (const auto &k : kernels) {
+        for (; it < items.size() && items[it].begin < k.begin; it++) {
+            const auto &d = items[it].directive;
+            if (items[it].kind != TopLevelItem::DIRECTIVE)
+                continue;
+            if (d == "if" || d == "ifdef" || d == "ifndef") {
+                open.emplace_back(ifs++, 0);
+            } else if ((d == "elif" || d == "else") && !open.empty()) {
+                open.back().second++;
+            } else if (d == "endif" && !open.empty()) {
+                open.pop_back();
+            }
+        }
+        result.push_back(open);
+    }
+    return result;
+}
+
+// true if no build can contain both (different branches of one #if)
+static bool exclusive(const Branches &a, const Branches &b)
+{
+    for (size_t i = 0; i < a.size() && i < b.size(); i++) {
+        if (a[i].first != b[i].first)
+            return false;
+        if (a[i].second != b[i].second)
+            return true;
+    }
+    return false;
+}
+
+void checkDuplicateKernels(const Opts &opts, const std::vector<SourceText> &sourceStrs)
+{
+    TRACE_SCOPE("check kernels");
+    struct Seen {
+        size_t      unit;
+        size_t      offset;
+        Branches    branches;
+    };
+    std::map<std::string,std::vector<Seen>> byName;
+    for (size_t u = 0; u < sourceStrs.size(); u++) {
+        if (isSpirv(sourceStrs[u]))
+            continue;
+        const char *src = sourceStrs[u].data();
+        size_t n = sourceStrs[u].size();
+        auto kernels = parseKernels(src, n);
+        auto branches = kernelBranches(src, n, kernels);
+        for (size_t i = 0; i < kernels.size(); i++)
+            byName[kernels[i].name].push_back({u, kernels[i].begin, branches[i]});
+    }
+
+    std::string errors;
+    for (const auto &e : byName) {
+        const auto &defs = e.second;
+        for (size_t i = 1; i < defs.size(); i++) {
+            for (size_t j = 0; j < i; j++) {
+                const auto &a = defs[j], &b = defs[i];
+                bool sameUnit = a.unit == b.unit;
+                if (sameUnit && exclusive(a.branches, b.branches))
+                    continue;
+                auto la = sourceLocation(sourceStrs[a.unit].data(), a.offset,
+                    opts.args[a.unit]);
+                auto lb = sourceLocation(sourceStrs[b.unit].data(), b.offset,
+                    opts.args[b.unit]);
+                std::string msg = lb.first + ":" + std::to_string(lb.second) +
+                    ": kernel " + e.first + " is already defined at " + la.first + ":" +
+                    std::to_string(la.second);
+                if (sameUnit ? a.branches == b.branches :
+                    a.branches.empty() && b.branches.empty())
+                {
+                    errors += (errors.empty() ? "" : "\n") + msg;
+                } else {
+                    warning("%s (unless #if excludes one)\n", msg.c_str());
+                }
+                break;
+            }
+        }
+    }
+    if (!errors.empty()) {
+        fatal(errors);
+    }
+}
+
+// the text with each #include "..." that resolves replaced by the file
+// (recursively), so that -k= can prune helpers defined in headers too.
+// The directive stays behind an #if 0 for scanIncludes (-MD, --watch), and
+// #line keeps the build log's file names and line numbers.
+static std::string inlineIncludes(
+    const std::string &path,
+    const char *src,
+    size_t n,
+    const std::vector<std::string> &incDirs,
+    std::set<std::string> &once,
+    int depth)
+{
+    if (depth > 64) {
+        fatal("%s: #include nested too deeply (a header that includes itself?)",
+            path.c_str());
+    }
+    std::string out;
+    out.reserve(n);
+    bool inComment = false;
+    size_t line = 0;
+    for (size_t b = 0; b < n; ) {
+        const char *nl = (const char *)memchr(src + b, '\n', n - b);
+        size_t e = nl ? (size_t)(nl - src) : n;
+        line++;
+        std::string ln(src + b, e - b);
+        size_t next = e < n ? e + 1 : n;
+
+        // the directive: # include "name" outside a comment
+        std::string name;
+        bool quoted = false;
+        size_t i = ln.find_first_not_of(" \t");
+        if (!inComment && i != std::string::npos && ln[i] == '#') {
+            i = ln.find_first_not_of(" \t", i + 1);
+            if (i != std::string::npos && ln.compare(i, 7, "include") == 0) {
+                i = ln.find_first_not_of(" \t", i + 7);
+                char close = i == std::string::npos ? 0 :
+                    ln[i] == '"' ? '"' : ln[i] == '<' ? '>' : 0;
+                auto q = close ? ln.find(close, i + 1) : std::string::npos;
+                if (q != std::string::npos) {
+                    name = ln.substr(i + 1, q - i - 1);
+                    quoted = close == '"';
+                }
+            }
+        }
+        // (block comments only matter for where directives can start)
+        for (size_t c = 0; c + 1 < ln.size(); c++) {
+            if (!inComment && ln[c] == '/' && ln[c + 1] == '/')
+                break;
+            if (!inComment && ln[c] == '/' && ln[c + 1] == '*') {
+                inComment = true;
+                c++;
+            } else if (inComment && ln[c] == '*' && ln[c + 1] == '/') {
+                inComment = false;
+                c++;
+            }
+        }
+
+        std::string inc = name.empty() ? "" :
+            resolveInclude(name, quoted, path, incDirs);
+        if (inc.empty()) {
+            out.append(src + b, next - b);
+            if (next == n && e == n)
+                out += '\n';
+            b = next;
+            continue;
+        }
+        out += "#if 0 // inlined below for -k=\n";
+        out += ln + "\n";
+        out += "#endif\n";
+        auto text = readSource(inc);
+        if (once.count(inc) == 0) {
+            if (text.str().find("#pragma once") != std::string::npos)
+                once.insert(inc);
+            out += lineDirective(1, inc);
+            out += inlineIncludes(inc, text.data(), text.size(), incDirs, once, depth + 1);
+        }
+        out += lineDirective(line + 1, path);
+        b = next;
+    }
+    return out;
+}
+
+// the text with the items not in keep blanked (newlines and the
+// preprocessor lines inside them stay, so #if nesting and line numbers
+// are unchanged)
+static std::string blankItems(
+    const char *src, size_t n,
+    const std::vector<TopLevelItem> &items,
+    const std::vector<bool> &keep)
+{
+    std::string out;
+    out.reserve(n);
+    size_t copied = 0;
+    for (size_t i = 0; i < items.size(); i++) {
+        if (keep[i])
+            continue;
+        const auto &it = items[i];
+        out.append(src + copied, it.begin - copied);
+        bool lineStart = false;
+        for (size_t c = it.begin; c < it.end; c++) {
+            if (src[c] == '\n') {
+                out += '\n';
+                lineStart = true;
+            } else if (lineStart && src[c] == '#') {
+                // a directive (with its continuations) inside the item
+                while (c < it.end && src[c] != '\n') {
+                    if (src[c] == '\\' && c + 1 < it.end && src[c + 1] == '\n')
+                        out += src[c++];
+                    out += src[c++];
+                }
+                c--;
+                lineStart = false;
+            } else if (src[c] != ' ' && src[c] != '\t') {
+                lineStart = false;
+            }
+        }
+        copied = it.end;
+    }
+    out.append(src + copied, n - copied);
+    return out;
+}
+
+void pruneToKernels(const Opts &opts, std::vector<SourceText> &sourceStrs)
+{
+    if (opts.selectKernels.empty())
+        return;
+    TRACE_SCOPE("prune kernels");
+    auto incDirs = includeDirectories(splitBuildOptions(opts.buildOpts));
+
+    struct Unit {
+        std::string                 text;
+        std::vector<TopLevelItem>   items;
+        std::vector<bool>           keep;
+    };
+    std::vector<Unit> units(sourceStrs.size());
+    // name -> (unit, item) of every definition or declaration of it
+    std::map<std::string,std::vector<std::pair<size_t,size_t>>> defs;
+    std::set<std::string> kernels, macros;
+    for (size_t u = 0; u < units.size(); u++) {
+        if (isSpirv(sourceStrs[u])) {
+            fatal("%s: -k= selects kernels from OpenCL C, not SPIR-V", opts.args[u].c_str());
+        }
+        std::set<std::string> once;
+        auto &un = units[u];
+        un.text = inlineIncludes(opts.args[u], sourceStrs[u].data(), sourceStrs[u].size(),
+            incDirs, once, 0);
+        un.items = parseTopLevel(un.text.data(), un.text.size());
+        un.keep.assign(un.items.size(), false);
+        for (const auto &k : parseKernels(un.text.data(), un.text.size()))
+            kernels.insert(k.name);
+        for (size_t i = 0; i < un.items.size(); i++) {
+            const auto &it = un.items[i];
+            for (const auto &d : it.defines)
+                defs[d].emplace_back(u, i);
+            if (it.kind == TopLevelItem::DIRECTIVE && it.directive == "define")
+                macros.insert(it.defines.begin(), it.defines.end());
+        }
+    }
+    for (const auto &k : opts.selectKernels) {
+        if (kernels.count(k) == 0) {
+            fatal("-k=%s: no kernel %s in the inputs", k.c_str(), k.c_str());
+        }
+    }
+
+    // the roots: the selected kernels, what other directives (#if ...)
+    // mention, and items we cannot attribute (no name, or a name that is
+    // a macro: an invocation that expands to definitions)
+    std::vector<std::string> work(opts.selectKernels.begin(), opts.selectKernels.end());
+    auto mark = [&](size_t u, size_t i) {
+        auto &un = units[u];
+        if (un.keep[i])
+            return;
+        un.keep[i] = true;
+        work.insert(work.end(), un.items[i].refs.begin(), un.items[i].refs.end());
+    };
+    for (size_t u = 0; u < units.size(); u++) {
+        for (size_t i = 0; i < units[u].items.size(); i++) {
+            const auto &it = units[u].items[i];
+            bool invocation = false;
+            for (const auto &d : it.defines)
+                invocation |= it.kind != TopLevelItem::DIRECTIVE && macros.count(d) > 0;
+            if ((it.kind == TopLevelItem::DIRECTIVE && it.directive != "define") ||
+                it.defines.empty() || invocation)
+            {
+                mark(u, i);
+            }
+        }
+    }
+    std::set<std::string> reached;
+    while (!work.empty()) {
+        auto name = work.back();
+        work.pop_back();
+        if (!reached.insert(name).second)
+            continue;
+        auto itr = defs.find(name);
+        if (itr == defs.end())
+            continue; // a built-in, a member, a parameter, ...
+        for (const auto &d : itr->second)
+            mark(d.first, d.second);
+    }
+
+    std::set<std::string> kept;
+    size_t items = 0, keptItems = 0;
+    for (size_t u = 0; u < units.size(); u++) {
+        auto &un = units[u];
+        auto text = blankItems(un.text.data(), un.text.size(), un.items, un.keep);
+        for (const auto &k : parseKernels(text.data(), text.size()))
+            kept.insert(k.name);
+        for (size_t i = 0; i < un.items.size(); i++) {
+            if (un.items[i].kind != TopLevelItem::DIRECTIVE) {
+                items++;
+                keptItems += un.keep[i];
+            }
+        }
+        sourceStrs[u] = SourceText(std::move(text));
+    }
+    verbose("-k: kept %d of %d kernels and %d of %d definitions\n", (int)kept.size(),
+        (int)kernels.size(), (int)keptItems, (int)items);
+}
@@ -0,0 +1,671 @@
+#include "clc.hpp"
+#include "json.hpp"
+
+#include <algorithm>
+#include <map>
+#include <sstream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Static analysis of PTX (the "binary" NVIDIA's OpenCL driver returns).
+// PTX is assembly for a virtual machine: registers are not allocated yet
+// (ptxas does that when the program is loaded), so the register counts
+// are the virtual registers each kernel declares.  They track register
+// pressure closely enough to catch regressions between builds.
+
+struct PtxLoop {
+    int         line = 0;     // of the loop head label
+    int         body = 0;     // instructions from the label to the branch
+    int         memory = 0;   // ... of which loads and stores
+    long long   trips = -1;   // -1 if no constant bound was found
+    int         depth = 1;
+    size_t      begin = 0, end = 0; // instruction indexes
+    long long   extra = 0;    // dynamic instructions beyond one pass
+};
+
+struct PtxKernel {
+    std::string             name;
+    int                     line = 0;
+    int                     regs[5] = {0, 0, 0, 0, 0}; // pred, 16, 32, 64, 128 bits
+    unsigned long long      localBytes = 0;
+    unsigned long long      sharedBytes = 0;
+    bool                    dynamicShared = false; // .extern .shared
+    int                     instructions = 0;
+    std::map<std::string,int> memory; // by state space (global, shared, ...)
+    int                     alu = 0;
+    int                     control = 0;
+    std::vector<PtxLoop>    loops;
+    long long               estimate = 0; // dynamic instructions per work-item
+    bool                    bounded = true; // every loop's trip count known
+
+    // the registers in 32-bit units, as ptxas allocates them
+    int regs32() const { return regs[1] + regs[2] + 2 * regs[3] + 4 * regs[4]; }
+    int memoryOps() const {
+        int n = 0;
+        for (const auto &m : memory)
+            n += m.second;
+        return n;
+    }
+};
+
+struct PtxUnit {
+    std::string             name; // device or file
+    std::vector<PtxKernel>  kernels;
+};
+
+bool isPtx(const char *text, size_t n)
+{
+    size_t head = std::min(n, (size_t)4096);
+    std::string s(text, head);
+    return s.find(".version") != std::string::npos && s.find(".target") != std::string::npos;
+}
+
+static std::string trim(const std::string &s)
+{
+    size_t b = s.find_first_not_of(" \t\r");
+    if (b == std::string::npos)
+        return "";
+    size_t e = s.find_last_not_of(" \t\r");
+    return s.substr(b, e - b + 1);
+}
+
+static std::vector<std::string> tokens(const std::string &s)
+{
+    std::vector<std::string> ts;
+    std::string t;
+    for (char c : s) {
+        if (c == ' ' || c == '\t' || c == ',' || c == ';') {
+            if (!t.empty())
+                ts.push_back(t);
+            t.clear();
+        } else {
+            t += c;
+        }
+    }
+    if (!t.empty())
+        ts.push_back(t);
+    return ts;
+}
+
+// .b32 -> 4, .f64 -> 8, .pred -> 0
+static int typeBytes(const std::string &type)
+{
+    if (type == ".pred")
+        return 0;
+    size_t i = 0;
+    while (i < type.size() && !isdigit((unsigned char)type[i]))
+        i++;
+    int bits = atoi(type.c_str() + i);
+    if (type.find("x2") != std::string::npos)
+        return 4; // .f16x2
+    return bits / 8;
+}
+
+// the bytes of a .local or .shared declaration such as
+// .shared .align 4 .b8 tile[1024];
+static unsigned long long declBytes(const std::vector<std::string> &ts, std::string *name)
+{
+    int elem = 1;
+    for (size_t i = 1; i < ts.size(); i++) {
+        const auto &t = ts[i];
+        if (t == ".align" || t == ".extern" || t == ".visible" || t == ".local" ||
+            t == ".shared" || (i > 0 && ts[i - 1] == ".align"))
+        {
+            continue;
+        }
+        if (t[0] == '.') {
+            elem = std::max(1, typeBytes(t));
+            continue;
+        }
+        auto lb = t.find('[');
+        if (name)
+            *name = t.substr(0, lb);
+        unsigned long long n = 1;
+        while (lb != std::string::npos) {
+            n *= strtoull(t.c_str() + lb + 1, nullptr, 10);
+            lb = t.find('[', lb + 1);
+        }
+        return n * elem;
+    }
+    return 0;
+}
+
+static void countRegisters(const std::vector<std::string> &ts, PtxKernel &k)
+{
+    // .reg .b32 %r<10>;  or  .reg .f32 %f1, %f2;
+    if (ts.size() < 3)
+        return;
+    int bytes = typeBytes(ts[1]);
+    int slot = ts[1] == ".pred" ? 0 : bytes <= 2 ? 1 : bytes == 4 ? 2 : bytes == 8 ? 3 : 4;
+    for (size_t i = 2; i < ts.size(); i++) {
+        auto lt = ts[i].find('<');
+        k.regs[slot] += lt == std::string::npos ? 1 : atoi(ts[i].c_str() + lt + 1);
+    }
+}
+
+// ld.global.f32 -> global; the state space of a memory instruction
+static std::string stateSpace(const std::string &op)
+{
+    static const char *spaces[] = {"global", "shared", "local", "param", "const", "tex"};
+    for (const char *s : spaces) {
+        if (op.find(std::string(".") + s) != std::string::npos)
+            return s;
+    }
+    if (op.compare(0, 3, "tex") == 0 || op.compare(0, 3, "tld") == 0 ||
+        op.compare(0, 2, "su") == 0)
+    {
+        return "tex";
+    }
+    return "generic";
+}
+
+static bool isMemoryOp(const std::string &base)
+{
+    static const char *ops[] = {
+        "ld", "ldu", "st", "atom", "red", "tex", "tld4", "suld", "sust", "sured",
+        "prefetch", "prefetchu", "cp", "isspacep", "cvta",
+    };
+    for (const char *o : ops) {
+        if (base == o)
+            return strcmp(o, "isspacep") != 0 && strcmp(o, "cvta") != 0;
+    }
+    return false;
+}
+
+static bool isControlOp(const std::string &base)
+{
+    static const char *ops[] = {"bra", "brx", "call", "ret", "exit", "bar", "barrier", "trap"};
+    for (const char *o : ops) {
+        if (base == o)
+            return true;
+    }
+    return false;
+}
+
+// for a bra predicated on p, the constant operand of the setp (in the
+// loop body) that computes p: the bound of the usual counted loop
+static long long constantBound(const std::vector<std::vector<std::string>> &insns,
+    size_t begin, size_t end, const std::string &pred)
+{
+    for (size_t i = end; i-- > begin; ) {
+        const auto &ts = insns[i];
+        if (ts.size() < 4 || ts[0].compare(0, 4, "setp") != 0)
+            continue;
+        // setp.lt.s32 %p1, %r5, 16;  (or %p1|%p2)
+        if (ts[1] != pred && ts[1].compare(0, pred.size() + 1, pred + "|") != 0)
+            continue;
+        for (size_t j = 2; j < ts.size(); j++) {
+            const auto &o = ts[j];
+            char *e = nullptr;
+            long long v = strtoll(o.c_str(), &e, 0);
+            if (!o.empty() && *e == 0 && o[0] != '%')
+                return v < 0 ? -v : v;
+        }
+        return -1;
+    }
+    return -1;
+}
+
+std::vector<PtxKernel> parsePtx(const char *text, size_t n)
+{
+    std::vector<PtxKernel> kernels;
+    std::map<std::string,unsigned long long> moduleShared; // module-scope .shared
+    std::vector<std::string> moduleDynamic; // ... and .extern .shared
+
+    PtxKernel k;
+    int state = 0; // 0: module, 1: entry header, 2: body
+    int depth = 0;
+    std::vector<std::vector<std::string>> insns; // of the current kernel
+    std::vector<int> insnLines;
+    std::map<std::string,size_t> labels; // label -> instruction index
+    std::map<std::string,int> labelLines;
+    std::string bodyText;
+    bool inComment = false;
+
+    int lineNo = 0;
+    size_t pos = 0;
+    while (pos < n) {
+        const char *nl = (const char *)memchr(text + pos, '\n', n - pos);
+        size_t e = nl ? (size_t)(nl - text) : n;
+        std::string line(text + pos, e - pos);
+        pos = e + 1;
+        lineNo++;
+
+        // comments
+        if (inComment) {
+            auto c = line.find("*/");
+            if (c == std::string::npos)
+                continue;
+            line = line.substr(c + 2);
+            inComment = false;
+        }
+        auto bc = line.find("/*");
+        if (bc != std::string::npos) {
+            auto c = line.find("*/", bc + 2);
+            if (c == std::string::npos) {
+                inComment = true;
+                line = line.substr(0, bc);
+            } else {
+                line = line.substr(0, bc) + " " + line.substr(c + 2);
+            }
+        }
+        auto lc = line.find("//");
+        if (lc != std::string::npos)
+            line = line.substr(0, lc);
+        line = trim(line);
+        if (line.empty())
+            continue;
+
+        if (state == 0) {
+            auto ts = tokens(line);
+            auto ent = std::find(ts.begin(), ts.end(), ".entry");
+            if (ent != ts.end() && ent + 1 != ts.end()) {
+                k = PtxKernel();
+                k.name = ent[1].substr(0, ent[1].find('('));
+                k.line = lineNo;
+                insns.clear();
+                insnLines.clear();
+                labels.clear();
+                labelLines.clear();
+                bodyText.clear();
+                state = 1;
+            } else if (!ts.empty() && (ts[0] == ".shared" ||
+                (ts.size() > 1 && ts[1] == ".shared")))
+            {
+                std::string name;
+                auto bytes = declBytes(ts, &name);
+                if (ts[0] == ".extern")
+                    moduleDynamic.push_back(name);
+                else
+                    moduleShared[name] = bytes;
+            }
+            if (state == 0)
+                continue;
+        }
+        if (state == 1) {
+            auto ob = line.find('{');
+            if (ob == std::string::npos)
+                continue;
+            state = 2;
+            depth = 0;
+        }
+
+        // body: track the braces of nested scopes
+        for (char c : line) {
+            if (c == '{')
+                depth++;
+            else if (c == '}')
+                depth--;
+        }
+        bodyText += line + "\n";
+        std::string stmt = trim(line.substr(0, line.find_first_of("{}") == 0 ?
+            0 : line.size()));
+        if (stmt.empty() || stmt == "{" || stmt == "}") {
+            // nothing
+        } else if (stmt.back() == ':') {
+            auto label = stmt.substr(0, stmt.size() - 1);
+            labels[label] = insns.size();
+            labelLines[label] = lineNo;
+        } else if (stmt[0] == '.') {
+            auto ts = tokens(stmt);
+            if (ts[0] == ".reg") {
+                countRegisters(ts, k);
+            } else if (ts[0] == ".local") {
+                k.localBytes += declBytes(ts, nullptr);
+            } else if (ts[0] == ".shared") {
+                k.sharedBytes += declBytes(ts, nullptr);
+            } else if (ts[0] == ".extern" && ts.size() > 1 && ts[1] == ".shared") {
+                k.dynamicShared = true;
+            }
+        } else {
+            auto ts = tokens(stmt);
+            std::string pred;
+            if (!ts.empty() && ts[0][0] == '@') {
+                pred = ts[0].substr(ts[0][1] == '!' ? 2 : 1);
+                ts.erase(ts.begin());
+            }
+            if (!ts.empty()) {
+                const auto &op = ts[0];
+                std::string base = op.substr(0, op.find('.'));
+                k.instructions++;
+                if (isMemoryOp(base)) {
+                    k.memory[stateSpace(op)]++;
+                } else if (isControlOp(base)) {
+                    k.control++;
+                } else {
+                    k.alu++;
+                }
+                insns.push_back(ts);
+                insnLines.push_back(lineNo);
+
+                // a branch back to an earlier label closes a loop
+                if (base == "bra" && ts.size() > 1) {
+                    auto itr = labels.find(ts.back());
+                    if (itr != labels.end()) {
+                        PtxLoop l;
+                        l.line = labelLines[ts.back()];
+                        l.begin = itr->second;
+                        l.end = insns.size();
+                        l.body = (int)(l.end - l.begin);
+                        for (size_t i = l.begin; i < l.end; i++) {
+                            if (isMemoryOp(insns[i][0].substr(0, insns[i][0].find('.'))))
+                                l.memory++;
+                        }
+                        if (!pred.empty())
+                            l.trips = constantBound(insns, l.begin, l.end, pred);
+                        k.loops.push_back(l);
+                    }
+                }
+            }
+        }
+
+        if (depth <= 0) {
+            for (const auto &s : moduleShared) {
+                if (!s.first.empty() && bodyText.find(s.first) != std::string::npos)
+                    k.sharedBytes += s.second;
+            }
+            for (const auto &d : moduleDynamic) {
+                if (!d.empty() && bodyText.find(d) != std::string::npos)
+                    k.dynamicShared = true;
+            }
+            kernels.push_back(k);
+            state = 0;
+        }
+    }
+
+    // loop nesting and the estimated dynamic instruction count: a loop
+    // runs its body and its inner loops' extra trips times, one pass of
+    // the body being in the static count (an unknown count is taken as 1)
+    for (auto &kern : kernels) {
+        auto &ls = kern.loops;
+        std::sort(ls.begin(), ls.end(), [](const PtxLoop &a, const PtxLoop &b) {
+            return a.end - a.begin < b.end - b.begin;
+        });
+        for (size_t i = 0; i < ls.size(); i++) {
+            long long inner = 0;
+            for (size_t j = 0; j < i; j++) {
+                bool inside = ls[j].begin >= ls[i].begin && ls[j].end <= ls[i].end;
+                if (inside) {
+                    ls[j].depth++;
+                    // only direct children; deeper ones are in their extra
+                    bool direct = true;
+                    for (size_t m = j + 1; m < i; m++) {
+                        if (ls[j].begin >= ls[m].begin && ls[j].end <= ls[m].end &&
+                            ls[m].begin >= ls[i].begin && ls[m].end <= ls[i].end)
+                        {
+                            direct = false;
+                        }
+                    }
+                    if (direct)
+                        inner += ls[j].extra;
+                }
+            }
+            long long trips = ls[i].trips > 0 ? ls[i].trips : 1;
+            if (ls[i].trips < 0)
+                kern.bounded = false;
+            ls[i].extra = trips * (ls[i].body + inner) - ls[i].body;
+        }
+        kern.estimate = kern.instructions;
+        for (size_t i = 0; i < ls.size(); i++) {
+            bool top = true;
+            for (size_t j = i + 1; j < ls.size(); j++) {
+                if (ls[i].begin >= ls[j].begin && ls[i].end <= ls[j].end)
+                    top = false;
+            }
+            if (top)
+                kern.estimate += ls[i].extra;
+        }
+        std::sort(ls.begin(), ls.end(), [](const PtxLoop &a, const PtxLoop &b) {
+            return a.line < b.line;
+        });
+    }
+    std::sort(kernels.begin(), kernels.end(), [](const PtxKernel &a, const PtxKernel &b) {
+        return a.name < b.name;
+    });
+    return kernels;
+}
+
+static void printTable(FILE *out, const std::vector<PtxUnit> &units)
+{
+    for (const auto &u : units) {
+        fprintf(out, "PTX analysis of %s:\n", u.name.c_str());
+        fprintf(out, "%-24s %5s %5s %8s %9s %7s %6s %6s %5s %5s  %s\n", "kernel", "regs",
+            "preds", "local B", "shared B", "instrs", "memory", "alu", "ctrl", "loops",
+            "est. instrs");
+        for (const auto &k : u.kernels) {
+            char shared[32];
+            snprintf(shared, sizeof(shared), "%llu%s", k.sharedBytes,
+                k.dynamicShared ? "+" : "");
+            fprintf(out, "%-24s %5d %5d %8llu %9s %7d %6d %6d %5d %5d  %s%lld\n",
+                k.name.c_str(), k.regs32(), k.regs[0], k.localBytes, shared,
+                k.instructions, k.memoryOps(), k.alu, k.control, (int)k.loops.size(),
+                k.bounded ? "" : ">=", k.estimate);
+            for (const auto &l : k.loops) {
+                std::string trips = l.trips < 0 ? "?" : std::to_string(l.trips);
+                fprintf(out, "  loop at line %d (depth %d): %s trips x %d instructions "
+                    "(%d memory)\n", l.line, l.depth, trips.c_str(), l.body, l.memory);
+            }
+        }
+    }
+}
+
+static void printJson(std::ostream &os, const std::vector<PtxUnit> &units)
+{
+    JsonWriter w(os);
+    w.beginObject();
+    w.key("units").beginArray();
+    for (const auto &u : units) {
+        w.beginObject();
+        w.member("name", u.name);
+        w.key("kernels").beginArray();
+        for (const auto &k : u.kernels) {
+            w.beginObject();
+            w.member("name", k.name);
+            w.member("line", k.line);
+            w.key("registers").beginObject();
+            w.member("pred", k.regs[0]);
+            w.member("b16", k.regs[1]);
+            w.member("b32", k.regs[2]);
+            w.member("b64", k.regs[3]);
+            w.member("b128", k.regs[4]);
+            w.member("equiv32", k.regs32());
+            w.endObject();
+            w.member("local_bytes", k.localBytes);
+            w.member("shared_bytes", k.sharedBytes);
+            w.member("dynamic_shared", k.dynamicShared);
+            w.key("instructions").beginObject();
+            w.member("total", k.instructions);
+            w.key("memory").beginObject();
+            for (const auto &m : k.memory)
+                w.member(m.first, m.second);
+            w.endObject();
+            w.member("alu", k.alu);
+            w.member("control", k.control);
+            w.endObject();
+            w.key("loops").beginArray();
+            for (const auto &l : k.loops) {
+                w.beginObject();
+                w.member("line", l.line);
+                w.member("depth", l.depth);
+                w.member("body", l.body);
+                w.member("memory", l.memory);
+                if (l.trips < 0)
+                    w.key("trips").null();
+                else
+                    w.member("trips", l.trips);
+                w.endObject();
+            }
+            w.endArray();
+            w.member("estimated_instructions", k.estimate);
+            w.member("bounded", k.bounded);
+            w.endObject();
+        }
+        w.endArray();
+        w.endObject();
+    }
+    w.endArray();
+    w.endObject();
+}
+
+// compares with an earlier --analyze=json report; the growth of registers
+// or local memory (a sign of spills) is fatal, and with --analyze-exact
+// any change is
+static void compareBaseline(const Opts &opts, FILE *out, const std::vector<PtxUnit> &units)
+{
+    std::string text = readTextFile(opts.analyzeBaseline);
+    JsonValue base;
+    std::string err;
+    if (!parseJson(text, base, err)) {
+        fatal("%s: %s", opts.analyzeBaseline.c_str(), err.c_str());
+    }
+    std::stringstream regressions;
+    bool printed = false;
+    for (const auto &u : units) {
+        const JsonValue *bu = nullptr;
+        const auto &bus = base["units"];
+        for (size_t i = 0; i < bus.size(); i++) {
+            // a lone unit matches whatever it was called (a file vs. a device)
+            if (bus[i]["name"].str() == u.name || (bus.size() == 1 && units.size() == 1))
+                bu = &bus[i];
+        }
+        if (bu == nullptr) {
+            warning("%s: no %s in the baseline\n", opts.analyzeBaseline.c_str(),
+                u.name.c_str());
+            if (opts.analyzeExact)
+                regressions << "  " << u.name << ": not in the baseline\n";
+            continue;
+        }
+        const auto &bks = (*bu)["kernels"];
+        for (size_t i = 0; i < bks.size(); i++) {
+            auto name = bks[i]["name"].str();
+            auto same = [&](const PtxKernel &k) { return k.name == name; };
+            if (std::none_of(u.kernels.begin(), u.kernels.end(), same)) {
+                fprintf(out, "  %s: removed kernel\n", name.c_str());
+                printed = true;
+                if (opts.analyzeExact)
+                    regressions << "  " << name << ": removed\n";
+            }
+        }
+        for (const auto &k : u.kernels) {
+            const JsonValue *bk = nullptr;
+            for (size_t i = 0; i < bks.size(); i++) {
+                if (bks[i]["name"].str() == k.name)
+                    bk = &bks[i];
+            }
+            if (bk == nullptr) {
+                fprintf(out, "  %s: new kernel\n", k.name.c_str());
+                printed = true;
+                if (opts.analyzeExact)
+                    regressions << "  " << k.name << ": new\n";
+                continue;
+            }
+            long long memoryOps = 0;
+            const auto &bm = (*bk)["instructions"]["memory"];
+            for (const auto &m : bm.items)
+                memoryOps += (long long)m.uint64();
+            struct { const char *what; long long was, now; bool fatal; } ms[] = {
+                {"registers", (long long)(*bk)["registers"]["equiv32"].uint64(), k.regs32(), true},
+                {"local bytes", (long long)(*bk)["local_bytes"].uint64(),
+                    (long long)k.localBytes, true},
+                {"shared bytes", (long long)(*bk)["shared_bytes"].uint64(),
+                    (long long)k.sharedBytes, false},
+                {"instructions", (long long)(*bk)["instructions"]["total"].uint64(),
+                    k.instructions, false},
+                {"memory ops", memoryOps, k.memoryOps(), false},
+                {"alu", (long long)(*bk)["instructions"]["alu"].uint64(), k.alu, false},
+                {"control", (long long)(*bk)["instructions"]["control"].uint64(),
+                    k.control, false},
+                {"loops", (long long)(*bk)["loops"].size(), (long long)k.loops.size(), false},
+                {"est. instructions", (long long)(*bk)["estimated_instructions"].uint64(),
+                    k.estimate, false},
+            };
+            for (const auto &m : ms) {
+                if (m.was == m.now)
+                    continue;
+                if (!printed)
+                    fprintf(out, "changes from %s:\n", opts.analyzeBaseline.c_str());
+                printed = true;
+                fprintf(out, "  %-24s %-18s %8lld -> %-8lld (%+lld)\n", k.name.c_str(),
+                    m.what, m.was, m.now, m.now - m.was);
+                if (opts.analyzeExact || (m.fatal && m.now > m.was)) {
+                    regressions << "  " << k.name << ": " << m.what << " " << m.was <<
+                        " -> " << m.now << "\n";
+                }
+            }
+        }
+    }
+    if (!printed && opts.verbosity >= 0)
+        fprintf(out, "no changes from %s\n", opts.analyzeBaseline.c_str());
+    if (!regressions.str().empty()) {
+        fflush(out);
+        if (opts.analyzeExact) {
+            fatal("the analysis changed since %s:\n%s",
+                opts.analyzeBaseline.c_str(), regressions.str().c_str());
+        }
+        fatal("register or local memory use grew since %s:\n%s",
+            opts.analyzeBaseline.c_str(), regressions.str().c_str());
+    }
+}
+
+static void report(const Opts &opts, const std::vector<PtxUnit> &units)
+{
+    // the report goes to stderr when the binary goes to stdout
+    FILE *out = opts.output == "--" ? stderr : stdout;
+    if (opts.analyze == "json") {
+        std::stringstream ss;
+        printJson(ss, units);
+        fputs(ss.str().c_str(), out);
+    } else if (opts.verbosity >= 0) {
+        printTable(out, units);
+    }
+    if (!opts.analyzeBaseline.empty())
+        compareBaseline(opts, out, units);
+}
+
+void analyzeBinaries(const Opts &opts, const std::vector<DeviceBinary> &bins)
+{
+    if (opts.analyze.empty())
+        return;
+    std::vector<PtxUnit> units;
+    for (const auto &b : bins) {
+        std::string dev = b.device.getInfo<CL_DEVICE_NAME>().c_str();
+        if (!isPtx(b.bits.data(), b.bits.size())) {
+            verbose("--analyze: %s: the binary is not PTX; skipped\n", dev.c_str());
+            continue;
+        }
+        PtxUnit u;
+        u.name = dev;
+        u.kernels = parsePtx(b.bits.data(), b.bits.size());
+        units.push_back(u);
+    }
+    if (units.empty()) {
+        warning("--analyze: no PTX among the binaries (only NVIDIA devices produce it)\n");
+        return;
+    }
+    report(opts, units);
+}
+
+bool isPtxPath(const std::string &path)
+{
+    return path.size() > 4 && path.compare(path.size() - 4, 4, ".ptx") == 0;
+}
+
+int runAnalyze(const Opts &opts)
+{
+    std::vector<PtxUnit> units;
+    for (const auto &path : opts.args) {
+        auto text = readSource(path);
+        if (!isPtx(text.data(), text.size())) {
+            fatal("%s: not PTX (expected .version and .target directives)", path.c_str());
+        }
+        PtxUnit u;
+        u.name = path;
+        u.kernels = parsePtx(text.data(), text.size());
+        if (u.kernels.empty())
+            warning("%s: no .entry kernels\n", path.c_str());
+        units.push_back(u);
+    }
+    report(opts, units);
+    return 0;
+}
@@ -0,0 +1,264 @@
+#include "clc.hpp"
+#include "json.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <stdint.h>
+#include <stdio.h>
+
+// cl_nv_device_attribute_query and cl_amd_device_attribute_query
+#ifndef CL_DEVICE_COMPUTE_CAPABILITY_MAJOR_NV
+#define CL_DEVICE_COMPUTE_CAPABILITY_MAJOR_NV 0x4000
+#define CL_DEVICE_COMPUTE_CAPABILITY_MINOR_NV 0x4001
+#endif
+#ifndef CL_DEVICE_SIMD_PER_COMPUTE_UNIT_AMD
+#define CL_DEVICE_SIMD_PER_COMPUTE_UNIT_AMD 0x4040
+#define CL_DEVICE_WAVEFRONT_WIDTH_AMD 0x4043
+#endif
+
+struct KernelResources {
+    std::string                 name;
+    size_t                      workGroupSize = 0; // CL_KERNEL_WORK_GROUP_SIZE
+    size_t                      preferredMultiple = 0;
+    cl_ulong                    localMem = 0;
+    cl_ulong                    privateMem = 0;
+    size_t                      compileSize[3] = {0, 0, 0}; // reqd_work_group_size
+    size_t                      localSize = 0; // recommended
+    double                      occupancy = 0.0;
+    const char                 *limiter = "-";
+    std::vector<std::string>    violations;
+};
+
+struct DeviceResources {
+    std::string                 device;
+    cl_uint                     computeUnits = 0;
+    cl_ulong                    localMemSize = 0;
+    size_t                      maxWorkGroupSize = 0;
+    size_t                      residentItems = 0; // per compute unit
+    std::vector<KernelResources> kernels;
+};
+
+// the work-items a compute unit keeps resident at once; portable OpenCL
+// does not say, so it comes from the vendor queries where there are some
+static size_t residentItems(const cl::Device &dev, size_t maxWorkGroupSize)
+{
+    cl_uint major = 0, minor = 0;
+    if (clGetDeviceInfo(dev(), CL_DEVICE_COMPUTE_CAPABILITY_MAJOR_NV, sizeof(major),
+            &major, nullptr) == CL_SUCCESS && major > 0)
+    {
+        clGetDeviceInfo(dev(), CL_DEVICE_COMPUTE_CAPABILITY_MINOR_NV, sizeof(minor),
+            &minor, nullptr);
+        cl_uint cc = major * 10 + minor;
+        if (cc == 75)
+            return 1024;
+        if (cc == 86 || cc == 89 || cc >= 120)
+            return 1536;
+        return 2048;
+    }
+    cl_uint simds = 0, wave = 0;
+    if (clGetDeviceInfo(dev(), CL_DEVICE_SIMD_PER_COMPUTE_UNIT_AMD, sizeof(simds),
+            &simds, nullptr) == CL_SUCCESS && simds > 0 &&
+        clGetDeviceInfo(dev(), CL_DEVICE_WAVEFRONT_WIDTH_AMD, sizeof(wave),
+            &wave, nullptr) == CL_SUCCESS && wave > 0)
+    {
+        // GCN keeps 10 wave64s per SIMD, RDNA 16 wave32s
+        return (size_t)simds * wave * (wave >= 64 ? 10 : 16);
+    }
+    // e.g. a CPU core, which runs one work-group at a time
+    return maxWorkGroupSize;
+}
+
+// An estimate without vendor tools: the fraction of a compute unit's
+// resident work-items (residentItems) that the work-groups fitting on it
+// at once occupy.  Whole work-groups fit; CL_DEVICE_LOCAL_MEM_SIZE is
+// taken as the compute unit's local memory and shared by its groups; and
+// drivers lower a kernel's CL_KERNEL_WORK_GROUP_SIZE below the device's
+// when its registers do not fit, which scales the resident work-items
+// down in proportion.
+static void estimateOccupancy(KernelResources &k, const DeviceResources &d)
+{
+    size_t mult = std::max<size_t>(1, k.preferredMultiple);
+    if (k.compileSize[0] != 0) {
+        k.localSize = k.compileSize[0] * std::max<size_t>(1, k.compileSize[1]) *
+            std::max<size_t>(1, k.compileSize[2]);
+    } else {
+        // the largest multiple of the preferred size the kernel allows
+        k.localSize = k.workGroupSize >= mult ? k.workGroupSize / mult * mult : k.workGroupSize;
+    }
+    if (k.localSize == 0 || d.maxWorkGroupSize == 0 || d.residentItems == 0)
+        return;
+
+    size_t resident = std::max(d.residentItems, k.localSize);
+    size_t bySlots = resident / k.localSize;
+    size_t regItems = k.workGroupSize < d.maxWorkGroupSize ?
+        (size_t)((double)resident * k.workGroupSize / d.maxWorkGroupSize) : resident;
+    size_t byRegisters = std::max<size_t>(1, regItems / k.localSize);
+    size_t byLocalMem = k.localMem > 0 ?
+        std::max<size_t>(1, (size_t)(d.localMemSize / k.localMem)) : SIZE_MAX;
+    size_t groups = std::min(bySlots, std::min(byRegisters, byLocalMem));
+    k.occupancy = std::min(1.0, (double)(groups * k.localSize) / resident);
+    if (k.occupancy >= 1.0) {
+        k.limiter = "-";
+    } else if (byLocalMem == groups && byLocalMem < bySlots) {
+        k.limiter = "local memory";
+    } else if (byRegisters == groups && byRegisters < bySlots) {
+        k.limiter = "registers";
+    } else {
+        k.limiter = "work-group size";
+    }
+}
+
+static DeviceResources deviceResources(const Opts &opts, const DeviceBinary &bin)
+{
+    TRACE_SCOPE("kernel resources");
+    const auto &dev = bin.device;
+    DeviceResources d;
+    d.device = dev.getInfo<CL_DEVICE_NAME>().c_str();
+    d.computeUnits = dev.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
+    d.localMemSize = dev.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+    d.maxWorkGroupSize = dev.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
+    d.residentItems = residentItems(dev, d.maxWorkGroupSize);
+
+    cl::Context ctx(dev);
+    cl::Program prog(ctx, {dev},
+        {std::make_pair((const void *)bin.bits.data(), bin.bits.size())});
+    prog.build({dev});
+    std::vector<cl::Kernel> ks;
+    prog.createKernels(&ks);
+    for (auto &kern : ks) {
+        KernelResources k;
+        k.name = kern.getInfo<CL_KERNEL_FUNCTION_NAME>().c_str();
+        k.workGroupSize = kern.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(dev);
+        k.preferredMultiple =
+            kern.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(dev);
+        k.localMem = kern.getWorkGroupInfo<CL_KERNEL_LOCAL_MEM_SIZE>(dev);
+        k.privateMem = kern.getWorkGroupInfo<CL_KERNEL_PRIVATE_MEM_SIZE>(dev);
+        // (cl.hpp lacks the traits for this one; not every driver answers
+        // it for kernels without the attribute)
+        if (clGetKernelWorkGroupInfo(kern(), dev(), CL_KERNEL_COMPILE_WORK_GROUP_SIZE,
+            sizeof(k.compileSize), k.compileSize, nullptr) != CL_SUCCESS)
+        {
+            k.compileSize[0] = k.compileSize[1] = k.compileSize[2] = 0;
+        }
+        estimateOccupancy(k, d);
+
+        std::stringstream ss;
+        if (opts.maxPrivateBytes > 0 && k.privateMem > opts.maxPrivateBytes) {
+            ss << "private memory " << k.privateMem << " B exceeds -max-private=" <<
+                opts.maxPrivateBytes << " (registers spilled?)";
+            k.violations.push_back(ss.str());
+            ss.str("");
+        }
+        if (opts.maxLocalBytes > 0 && k.localMem > opts.maxLocalBytes) {
+            ss << "local memory " << k.localMem << " B exceeds -max-local=" << opts.maxLocalBytes;
+            k.violations.push_back(ss.str());
+            ss.str("");
+        }
+        if (opts.minOccupancy > 0.0 && k.occupancy * 100.0 < opts.minOccupancy) {
+            ss << "estimated occupancy " << (int)(k.occupancy * 100.0 + 0.5) <<
+                "% is below -min-occupancy=" << opts.minOccupancy << "% (limited by " <<
+                k.limiter << ")";
+            k.violations.push_back(ss.str());
+        }
+        d.kernels.push_back(k);
+    }
+    std::sort(d.kernels.begin(), d.kernels.end(),
+        [](const KernelResources &a, const KernelResources &b) { return a.name < b.name; });
+    return d;
+}
+
+static void printTable(FILE *out, const std::vector<DeviceResources> &ds)
+{
+    for (const auto &d : ds) {
+        fprintf(out, "resources on %s: %u compute units, %llu KB local memory, "
+            "work-groups up to %d, %d resident work-items per unit\n", d.device.c_str(),
+            d.computeUnits, (unsigned long long)(d.localMemSize / 1024),
+            (int)d.maxWorkGroupSize, (int)d.residentItems);
+        fprintf(out, "%-24s %7s %8s %9s %9s %10s %9s  %s\n", "kernel", "max wg",
+            "multiple", "local B", "private B", "local size", "occupancy", "limited by");
+        for (const auto &k : d.kernels) {
+            fprintf(out, "%-24s %7d %8d %9llu %9llu %10d %8d%%  %s\n", k.name.c_str(),
+                (int)k.workGroupSize, (int)k.preferredMultiple,
+                (unsigned long long)k.localMem, (unsigned long long)k.privateMem,
+                (int)k.localSize, (int)(k.occupancy * 100.0 + 0.5), k.limiter);
+        }
+    }
+}
+
+static void printJson(std::ostream &os, const std::vector<DeviceResources> &ds)
+{
+    JsonWriter w(os);
+    w.beginObject();
+    w.key("devices").beginArray();
+    for (const auto &d : ds) {
+        w.beginObject();
+        w.member("device", d.device);
+        w.member("compute_units", d.computeUnits);
+        w.member("local_mem_size", d.localMemSize);
+        w.member("max_work_group_size", d.maxWorkGroupSize);
+        w.member("resident_work_items", d.residentItems);
+        w.key("kernels").beginArray();
+        for (const auto &k : d.kernels) {
+            w.beginObject();
+            w.member("name", k.name);
+            w.member("work_group_size", k.workGroupSize);
+            w.member("preferred_work_group_size_multiple", k.preferredMultiple);
+            w.member("local_mem_size", k.localMem);
+            w.member("private_mem_size", k.privateMem);
+            w.key("compile_work_group_size").beginArray();
+            for (auto s : k.compileSize)
+                w.value(s);
+            w.endArray();
+            w.member("recommended_local_size", k.localSize);
+            w.member("occupancy", k.occupancy);
+            w.member("limited_by", k.limiter);
+            w.key("violations").beginArray();
+            for (const auto &v : k.violations)
+                w.value(v);
+            w.endArray();
+            w.endObject();
+        }
+        w.endArray();
+        w.endObject();
+    }
+    w.endArray();
+    w.endObject();
+}
+
+void checkResources(const Opts &opts, const std::vector<DeviceBinary> &bins)
+{
+    if (opts.resources.empty() && opts.maxPrivateBytes == 0 &&
+        opts.maxLocalBytes == 0 && opts.minOccupancy <= 0.0)
+    {
+        return;
+    }
+    std::vector<DeviceResources> ds;
+    for (const auto &b : bins)
+        ds.push_back(deviceResources(opts, b));
+
+    // the report goes to stderr when the binary goes to stdout
+    if (opts.resources == "json") {
+        std::stringstream ss;
+        printJson(ss, ds);
+        fputs(ss.str().c_str(), opts.output == "--" ? stderr : stdout);
+    } else if (!opts.resources.empty() && opts.verbosity >= 0) {
+        printTable(opts.output == "--" ? stderr : stdout, ds);
+    }
+
+    std::stringstream ss;
+    for (const auto &d : ds) {
+        for (const auto &k : d.kernels) {
+            for (const auto &v : k.violations) {
+                ss << "  " << k.name;
+                if (ds.size() > 1)
+                    ss << " on " << d.device;
+                ss << ": " << v << "\n";
+            }
+        }
+    }
+    if (!ss.str().empty()) {
+        fatal("kernels exceed the resource limits:\n%s", ss.str().c_str());
+    }
+}
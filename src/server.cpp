@@ -0,0 +1,619 @@
+#include "clc.hpp"
+#include "cache.hpp"
+#include "clerrs.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+
+int runServer(const Opts &opts)
+{
+    fatal("--serve: the compile server requires Unix domain sockets");
+    return EXIT_FAILURE;
+}
+
+bool runClient(const Opts &, int, const char **, int &)
+{
+    return false;
+}
+
+#else
+
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+
+// Wire format: a message is a u32 field count followed by that many
+// (u64 length, bytes) fields; integers are little endian.
+//
+//   client -> server   "clc-hello", VERSION_STRING, build identity
+//   server -> client   "ok" or "version mismatch"
+//   client -> server   cwd, verbosity, argc, argv..., source texts...
+//   server -> client   status ("0" or "1"), diagnostics, error,
+//                      output count, (output path, binary)...
+//
+// The client reads the sources itself (including stdin) and sends
+// inputs as absolute paths; the server adds -I<client cwd> to the build
+// options since the front end resolves includes against the working
+// directory.  Outputs are written by the client, and only to the paths
+// it expects for its own options.
+//
+// The build identity tells a server left running across an upgrade from
+// the new client: the options (and their meaning) may differ even when
+// VERSION_STRING does not, so such a client compiles in-process.
+static const char *HELLO = "clc-hello";
+
+// the size and mtime of the executable (the server keeps the ones it
+// started with, even once the file is replaced)
+static const std::string &buildIdentity()
+{
+    static const std::string id = [] {
+        uint64_t size = 0;
+        int64_t mtime = 0;
+        if (!fileStat("/proc/self/exe", size, mtime))
+            return std::string(__DATE__ " " __TIME__);
+        return std::to_string(size) + "-" + std::to_string(mtime);
+    }();
+    return id;
+}
+
+// $XDG_RUNTIME_DIR is private to the user; /tmp is not, so there the
+// socket lives in a directory (privateSocketDirectory) only the user can
+// enter, or another user could bind the name first
+static std::string defaultSocketPath(const Opts &opts)
+{
+    if (!opts.serverSocket.empty())
+        return opts.serverSocket;
+    const char *run = getenv("XDG_RUNTIME_DIR");
+    if (run && *run)
+        return std::string(run) + "/clc.sock";
+    std::stringstream ss;
+    ss << "/tmp/clc-" << getuid() << "/server.sock";
+    return ss.str();
+}
+
+// the directory of the /tmp default ("" for any other socket path)
+static std::string privateSocketDirectory(const Opts &opts)
+{
+    auto path = defaultSocketPath(opts);
+    std::stringstream ss;
+    ss << "/tmp/clc-" << getuid() << "/";
+    if (path.compare(0, ss.str().size(), ss.str()) != 0)
+        return "";
+    return ss.str().substr(0, ss.str().size() - 1);
+}
+
+// path is of the type, owned by this user, and (a directory) closed to
+// everyone else; lstat, so a planted symbolic link fails
+static bool ownedByUser(const std::string &path, mode_t type)
+{
+    struct stat st;
+    return lstat(path.c_str(), &st) == 0 && (st.st_mode & S_IFMT) == type &&
+        st.st_uid == getuid() && (type != S_IFDIR || (st.st_mode & 077) == 0);
+}
+
+// the process at the other end of the socket runs as this user
+static bool peerIsUser(int fd)
+{
+#ifdef SO_PEERCRED
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 &&
+        cred.uid == getuid();
+#else
+    uid_t uid;
+    gid_t gid;
+    return getpeereid(fd, &uid, &gid) == 0 && uid == getuid();
+#endif
+}
+
+static bool writeAll(int fd, const void *bits, size_t len)
+{
+    const char *p = (const char *)bits;
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+static bool readAll(int fd, void *bits, size_t len)
+{
+    char *p = (char *)bits;
+    while (len > 0) {
+        ssize_t n = recv(fd, p, len, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+static bool sendMessage(int fd, const std::vector<std::string> &fields)
+{
+    std::string buf;
+    auto putInt = [&](uint64_t x, int bytes) {
+        for (int i = 0; i < bytes; i++)
+            buf += (char)(x >> (8*i));
+    };
+    putInt(fields.size(), 4);
+    for (const auto &f : fields) {
+        putInt(f.size(), 8);
+        buf += f;
+    }
+    return writeAll(fd, buf.data(), buf.size());
+}
+
+static bool recvMessage(int fd, std::vector<std::string> &fields)
+{
+    auto getInt = [&](int bytes, uint64_t &x) {
+        uint8_t b[8];
+        if (!readAll(fd, b, bytes))
+            return false;
+        x = 0;
+        for (int i = 0; i < bytes; i++)
+            x |= (uint64_t)b[i] << (8*i);
+        return true;
+    };
+    uint64_t n;
+    if (!getInt(4, n))
+        return false;
+    fields.clear();
+    for (uint64_t i = 0; i < n; i++) {
+        uint64_t len;
+        if (!getInt(8, len))
+            return false;
+        std::string f(len, '\0');
+        if (len > 0 && !readAll(fd, &f[0], len))
+            return false;
+        fields.push_back(f);
+    }
+    return true;
+}
+
+static std::string currentDirectory()
+{
+    std::vector<char> buf(4096);
+    if (getcwd(buf.data(), buf.size()) == nullptr) {
+        fatal("getcwd: %s", strerror(errno));
+    }
+    return buf.data();
+}
+
+static std::string absolutePath(const std::string &cwd, const std::string &path)
+{
+    if (path.empty() || path[0] == '/')
+        return path;
+    return cwd + "/" + path;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// server
+
+// recently built binaries keyed by binaryCacheKey()
+class MemoryCache {
+    std::list<std::pair<std::string,std::vector<char>>> lru; // front = newest
+    std::map<std::string,decltype(lru)::iterator> index;
+    size_t bytes = 0, maxBytes;
+public:
+    MemoryCache(size_t _maxBytes) : maxBytes(_maxBytes) { }
+
+    bool lookup(const std::string &key, std::vector<char> &bits) {
+        auto itr = index.find(key);
+        if (itr == index.end())
+            return false;
+        lru.splice(lru.begin(), lru, itr->second);
+        bits = itr->second->second;
+        return true;
+    }
+    void store(const std::string &key, const std::vector<char> &bits) {
+        if (index.find(key) != index.end())
+            return;
+        lru.emplace_front(key, bits);
+        index[key] = lru.begin();
+        bytes += bits.size();
+        while (bytes > maxBytes && lru.size() > 1) {
+            bytes -= lru.back().second.size();
+            index.erase(lru.back().first);
+            lru.pop_back();
+        }
+    }
+};
+
+struct ServerState {
+    const BinaryCache                          *cache = nullptr;
+    std::mutex                                  mutex;
+    // warm state: device selections and a context per platform (holding
+    // all its devices) survive across requests
+    std::map<std::string,std::vector<cl::Device>> devices;
+    std::map<cl_platform_id,cl::Context>        contexts;
+    MemoryCache                                 recent{256u * 1024u * 1024u};
+    // connections being served; runServer stops accepting at the limit
+    int                                         active = 0;
+    std::condition_variable                     idle;
+};
+
+static const int MAX_CONNECTIONS = 64;
+
+static std::vector<DeviceBinary> serveBuild(
+    ServerState &st,
+    const Opts &opts,
+    const std::vector<SourceText> &sourceStrs)
+{
+    std::vector<cl::Device> devs;
+    {
+        std::lock_guard<std::mutex> lock(st.mutex);
+        std::stringstream key;
+        key << opts.device << "|" << opts.deviceType << "|" << opts.vendorId << "|" << opts.multiDevice;
+        auto itr = st.devices.find(key.str());
+        if (itr == st.devices.end()) {
+            std::vector<cl::Device> ds;
+            if (opts.multiDevice)
+                ds = findDevices(opts);
+            else
+                ds.push_back(findDevice(opts));
+            itr = st.devices.emplace(key.str(), ds).first;
+        }
+        devs = itr->second;
+    }
+
+    std::vector<DeviceBinary> bins(devs.size());
+    std::vector<std::string> keys(devs.size());
+    std::map<cl_platform_id,std::vector<cl::Device>> misses;
+    for (size_t i = 0; i < devs.size(); i++) {
+        bins[i].device = devs[i];
+        keys[i] = binaryCacheKey(devs[i], opts.args, sourceStrs, opts.buildOpts);
+        std::lock_guard<std::mutex> lock(st.mutex);
+        if (st.recent.lookup(keys[i], bins[i].bits)) {
+            verbose("server: reusing recent build of %s\n",
+                devs[i].getInfo<CL_DEVICE_NAME>().c_str());
+        } else {
+            misses[devs[i].getInfo<CL_DEVICE_PLATFORM>()].push_back(devs[i]);
+        }
+    }
+
+    for (auto &m : misses) {
+        cl::Context ctx;
+        {
+            std::lock_guard<std::mutex> lock(st.mutex);
+            auto itr = st.contexts.find(m.first);
+            if (itr == st.contexts.end()) {
+                std::vector<cl::Device> all;
+                cl::Platform(m.first).getDevices(CL_DEVICE_TYPE_ALL, &all);
+                itr = st.contexts.emplace(m.first, cl::Context(all)).first;
+            }
+            ctx = itr->second;
+        }
+        auto built = buildProgram(opts, sourceStrs, m.second, ctx, st.cache);
+        std::lock_guard<std::mutex> lock(st.mutex);
+        for (auto &b : built) {
+            for (size_t i = 0; i < devs.size(); i++) {
+                if (devs[i]() == b.device()) {
+                    bins[i].bits = b.bits;
+                    st.recent.store(keys[i], b.bits);
+                }
+            }
+        }
+    }
+    return bins;
+}
+
+static void serveConnection(int fd, ServerState &st)
+{
+    std::vector<std::string> req;
+    if (!peerIsUser(fd) || !recvMessage(fd, req) || req.size() < 2 || req[0] != HELLO) {
+        close(fd);
+        return;
+    }
+    if (req.size() != 3 || req[1] != VERSION_STRING || req[2] != buildIdentity()) {
+        sendMessage(fd, {"version mismatch"});
+        close(fd);
+        return;
+    }
+    if (!sendMessage(fd, {"ok"}) || !recvMessage(fd, req) || req.size() < 3) {
+        close(fd);
+        return;
+    }
+
+    const std::string &cwd = req[0];
+    int argc = atoi(req[2].c_str());
+    if (argc < 0 || req.size() < 3 + (size_t)argc) {
+        close(fd);
+        return;
+    }
+    std::vector<const char *> argv;
+    for (int i = 0; i < argc; i++)
+        argv.push_back(req[3 + i].c_str());
+    std::vector<SourceText> sourceStrs;
+    for (size_t i = 3 + argc; i < req.size(); i++)
+        sourceStrs.emplace_back(std::move(req[i]));
+
+    DiagnosticSink sink;
+    sink.verbosity = atoi(req[1].c_str());
+    setDiagnosticSink(&sink);
+
+    std::vector<std::string> resp;
+    try {
+        // the client validated these already; still, a bad option must
+        // fail the request, not exit the server
+        Opts opts = parseOpts((int)argv.size(), argv.data(), false);
+        if (sourceStrs.size() != opts.args.size()) {
+            fatal("server: malformed request");
+        }
+        Opts userOpts = opts; // what an archive records
+        opts.buildOpts.push_back("-I \"" + cwd + "\"");
+        verbose("server: building %s\n", opts.args[0].c_str());
+
+        auto bins = serveBuild(st, opts, sourceStrs);
+
+        std::vector<cl::Device> devs;
+        for (const auto &b : bins)
+            devs.push_back(b.device);
+        auto outputs = outputPaths(opts, devs);
+
+        resp.push_back("0");
+        resp.push_back("");
+        resp.push_back("");
+        if (opts.format == "archive") {
+            auto image = archiveImage(userOpts, bins, sourceStrs);
+            resp.push_back("1");
+            resp.push_back(outputs[0]);
+            resp.emplace_back(image.begin(), image.end());
+        } else if (opts.format == "cpp") {
+            auto files = embeddedSources(userOpts, bins, outputs[0]);
+            resp.push_back(std::to_string(files.size()));
+            for (const auto &f : files) {
+                resp.push_back(f.first);
+                resp.push_back(f.second);
+            }
+        } else {
+            resp.push_back(std::to_string(bins.size()));
+            for (size_t i = 0; i < bins.size(); i++) {
+                resp.push_back(outputs[i]);
+                resp.emplace_back(bins[i].bits.begin(), bins[i].bits.end());
+            }
+        }
+    } catch (const FatalError &err) {
+        resp = {"1", "", err.what(), "0"};
+    } catch (const cl::Error &err) {
+        resp = {"1", "", std::string(err.what()) + " (" + clErrStr(err.err()) + ")", "0"};
+    }
+    setDiagnosticSink(nullptr);
+    resp[1] = sink.text;
+
+    sendMessage(fd, resp);
+    close(fd);
+}
+
+int runServer(const Opts &opts)
+{
+    auto path = defaultSocketPath(opts);
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        fatal("%s: socket path too long", path.c_str());
+    }
+    strcpy(addr.sun_path, path.c_str());
+    auto dir = privateSocketDirectory(opts);
+    if (!dir.empty()) {
+        if (mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST) {
+            fatal("%s: %s", dir.c_str(), strerror(errno));
+        }
+        if (!ownedByUser(dir, S_IFDIR)) {
+            fatal("%s: not a directory private to this user", dir.c_str());
+        }
+    }
+
+    int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (lfd < 0) {
+        fatal("socket: %s", strerror(errno));
+    }
+    // clear a stale socket, but never steal one from a live server
+    if (connect(lfd, (sockaddr *)&addr, sizeof(addr)) == 0) {
+        close(lfd);
+        fatal("%s: a server is already listening", path.c_str());
+    }
+    close(lfd);
+    unlink(path.c_str());
+
+    lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    mode_t um = umask(077); // only this user may connect
+    int br = bind(lfd, (sockaddr *)&addr, sizeof(addr));
+    umask(um);
+    if (br != 0 || listen(lfd, 64) != 0) {
+        fatal("%s: %s", path.c_str(), strerror(errno));
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    ServerState st;
+    std::unique_ptr<BinaryCache> cache;
+    if (!opts.cacheDir.empty()) {
+        cache.reset(new BinaryCache(
+            absolutePath(currentDirectory(), opts.cacheDir), opts.cacheMaxBytes));
+        st.cache = cache.get();
+    }
+    // requests carry absolute inputs and -I<client cwd>; leave our own
+    // directory so it can never satisfy a client's relative #include
+    if (chdir("/") != 0) {
+        fatal("chdir: %s", strerror(errno));
+    }
+
+    // pay platform and device discovery once up front
+    std::vector<cl::Platform> ps;
+    cl::Platform::get(&ps);
+    verbose("server: listening on %s (%d platforms)\n", path.c_str(), (int)ps.size());
+
+    for (;;) {
+        // further clients wait in the listen backlog
+        {
+            std::unique_lock<std::mutex> lock(st.mutex);
+            st.idle.wait(lock, [&] { return st.active < MAX_CONNECTIONS; });
+        }
+        int fd = accept(lfd, nullptr, nullptr);
+        if (fd < 0) {
+            if (errno == EINTR)
+                continue;
+            fatal("accept: %s", strerror(errno));
+        }
+        {
+            std::lock_guard<std::mutex> lock(st.mutex);
+            st.active++;
+        }
+        std::thread([fd, &st] {
+            serveConnection(fd, st);
+            std::lock_guard<std::mutex> lock(st.mutex);
+            st.active--;
+            st.idle.notify_one();
+        }).detach();
+    }
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// client
+
+// the files a reply may write; only the device-named binaries of a
+// multi-device or -o-less build need the devices
+static std::vector<std::string> expectedOutputs(const Opts &opts)
+{
+    if (opts.format == "archive" || opts.format == "cpp" ||
+        (!opts.multiDevice && !opts.output.empty()))
+    {
+        auto path = outputPaths(opts, {cl::Device()})[0];
+        if (opts.format == "cpp")
+            return {path, embedHeaderPath(path)};
+        return {path};
+    }
+    if (opts.multiDevice)
+        return outputPaths(opts, findDevices(opts));
+    return outputPaths(opts, {findDevice(opts)});
+}
+
+bool runClient(const Opts &opts, int argc, const char **argv, int &exitCode)
+{
+    if (opts.noServer || opts.listDevices || opts.cacheStats ||
+        !opts.batchFile.empty() || !opts.sweeps.empty() ||
+        !opts.bench.empty() || opts.depsOnly || opts.time ||
+        !opts.traceFile.empty() || opts.refreshDevices || !opts.resources.empty() ||
+        opts.maxPrivateBytes > 0 || opts.maxLocalBytes > 0 || opts.minOccupancy > 0.0 ||
+        opts.watch || opts.format == "spv" || !opts.stubs.empty() || !opts.analyze.empty() ||
+        !opts.perfLint.empty() || opts.args.empty())
+    {
+        return false;
+    }
+    auto path = defaultSocketPath(opts);
+    if (path.size() >= sizeof(sockaddr_un::sun_path) || access(path.c_str(), F_OK) != 0)
+        return false;
+    auto dir = privateSocketDirectory(opts);
+    if (!ownedByUser(path, S_IFSOCK) || (!dir.empty() && !ownedByUser(dir, S_IFDIR))) {
+        warning("%s: not a socket of this user; compiling in-process\n", path.c_str());
+        return false;
+    }
+
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path.c_str());
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return false;
+    if (connect(fd, (sockaddr *)&addr, sizeof(addr)) != 0) {
+        debug("%s: no server (%s); compiling in-process\n", path.c_str(), strerror(errno));
+        close(fd);
+        return false;
+    }
+    if (!peerIsUser(fd)) {
+        warning("%s: server runs as another user; compiling in-process\n", path.c_str());
+        close(fd);
+        return false;
+    }
+
+    // nothing has been consumed yet (e.g. stdin), so we can still fall back
+    std::vector<std::string> resp;
+    if (!sendMessage(fd, {HELLO, VERSION_STRING, buildIdentity()}) ||
+        !recvMessage(fd, resp) || resp.size() != 1 || resp[0] != "ok")
+    {
+        debug("%s: server declined (%s); compiling in-process\n",
+            path.c_str(), resp.empty() ? "no reply" : resp[0].c_str());
+        close(fd);
+        return false;
+    }
+    verbose("forwarding to compile server at %s\n", path.c_str());
+
+    auto cwd = currentDirectory();
+    std::vector<std::string> req;
+    req.push_back(cwd);
+    req.push_back(std::to_string(opts.verbosity));
+    req.push_back(std::to_string(argc));
+    for (int i = 0; i < argc; i++) {
+        std::string a = argv[i];
+        bool isInput = a != "-" && std::find(opts.args.begin(), opts.args.end(), a) != opts.args.end();
+        req.push_back(isInput ? absolutePath(cwd, a) : a);
+    }
+    auto sourceStrs = readSources(opts);
+    for (const auto &s : sourceStrs)
+        req.push_back(s.str());
+
+    if (!sendMessage(fd, req) || !recvMessage(fd, resp) || resp.size() < 4) {
+        close(fd);
+        fatal("%s: lost connection to compile server", path.c_str());
+    }
+    close(fd);
+
+    // diagnostics were captured at the client's verbosity
+    fputs(resp[1].c_str(), stderr);
+    if (resp[0] != "0") {
+        fatal(resp[2]);
+    }
+    size_t n = (size_t)atoi(resp[3].c_str());
+    if (resp.size() != 4 + 2*n) {
+        fatal("%s: malformed reply from compile server", path.c_str());
+    }
+    // only the binaries come from the server; where they go is decided here
+    auto expected = expectedOutputs(opts);
+    for (size_t i = 0; i < n; i++) {
+        const auto &out = resp[4 + 2*i];
+        if (std::find(expected.begin(), expected.end(), out) == expected.end()) {
+            fatal("%s: compile server replied with unexpected output %s",
+                path.c_str(), out.c_str());
+        }
+    }
+    std::vector<std::string> outputs;
+    for (size_t i = 0; i < n; i++) {
+        const auto &out = resp[4 + 2*i];
+        const auto &bits = resp[5 + 2*i];
+        writeBinary(out == "--" ? "" : out, bits.data(), bits.size());
+        outputs.push_back(out);
+    }
+    if (opts.depfile) {
+        // the includes are scanned here, relative to the client's directory
+        writeDependencies(opts, outputs, sourceStrs);
+    }
+    exitCode = EXIT_SUCCESS;
+    return true;
+}
+
+#endif
@@ -0,0 +1,207 @@
+#include "clc.hpp"
+#include "clparse.hpp"
+
+#include <sstream>
+#include <string.h>
+
+struct SpecArg {
+    std::string     name;
+    std::string     value;
+};
+
+struct SpecRequest {
+    std::string             text; // as given (for messages)
+    std::string             kernel;
+    std::string             variant; // the specialized kernel's name
+    std::vector<SpecArg>    args;
+    bool                    found = false;
+};
+
+// 0.5 -> 0_5, -1 -> m1, (float2)(1,2) -> float2_1_2
+static std::string nameFragment(const std::string &value)
+{
+    std::string s;
+    for (char c : value) {
+        if (isalnum((unsigned char)c)) {
+            s += c;
+        } else if (c == '-' && s.empty()) {
+            s += 'm';
+        } else if (!s.empty() && s.back() != '_') {
+            s += '_';
+        }
+    }
+    while (!s.empty() && s.back() == '_')
+        s.pop_back();
+    return s;
+}
+
+// [VARIANT=]KERNEL:ARG=VALUE[,ARG=VALUE...]; commas inside parentheses
+// (vector literals) do not separate arguments
+static SpecRequest parseSpec(const std::string &text)
+{
+    SpecRequest r;
+    r.text = text;
+    auto colon = text.find(':');
+    if (colon == std::string::npos) {
+        fatal("-spec=%s: expected KERNEL:ARG=VALUE", text.c_str());
+    }
+    std::string head = text.substr(0, colon);
+    auto eq = head.find('=');
+    if (eq != std::string::npos) {
+        r.variant = head.substr(0, eq);
+        r.kernel = head.substr(eq + 1);
+    } else {
+        r.kernel = head;
+    }
+    if (!isIdentifier(r.kernel) || (!r.variant.empty() && !isIdentifier(r.variant))) {
+        fatal("-spec=%s: malformed kernel name", text.c_str());
+    }
+
+    std::string rest = text.substr(colon + 1);
+    int depth = 0;
+    size_t start = 0;
+    for (size_t i = 0; i <= rest.size(); i++) {
+        char c = i < rest.size() ? rest[i] : ',';
+        if (c == '(') {
+            depth++;
+        } else if (c == ')') {
+            depth--;
+        } else if (c == ',' && depth == 0) {
+            std::string a = rest.substr(start, i - start);
+            start = i + 1;
+            auto aeq = a.find('=');
+            SpecArg sa;
+            if (aeq != std::string::npos) {
+                sa.name = a.substr(0, aeq);
+                sa.value = a.substr(aeq + 1);
+            }
+            if (!isIdentifier(sa.name) || sa.value.empty() ||
+                sa.value.find_first_of(";{}") != std::string::npos)
+            {
+                fatal("-spec=%s: expected ARG=VALUE, not '%s'", text.c_str(), a.c_str());
+            }
+            r.args.push_back(sa);
+        }
+    }
+    if (r.variant.empty()) {
+        r.variant = r.kernel;
+        for (const auto &a : r.args)
+            r.variant += "_" + a.name + "_" + nameFragment(a.value);
+    }
+    return r;
+}
+
+// the kernel with the requested arguments removed from the signature and
+// declared as locals holding the values; #line keeps the build log's line
+// numbers pointing at the original body
+static std::string specializedKernel(
+    const char *src, const KernelDecl &k, const SpecRequest &r, const std::string &path)
+{
+    std::stringstream ss;
+    ss << "\n// -spec=" << r.text << "\n";
+    ss << std::string(src + k.begin, k.nameBegin - k.begin) << r.variant << "(";
+    bool first = true;
+    std::vector<std::string> decls;
+    for (const auto &p : k.params) {
+        const SpecArg *sa = nullptr;
+        for (const auto &a : r.args) {
+            if (a.name == p.name)
+                sa = &a;
+        }
+        if (sa == nullptr) {
+            ss << (first ? "\n    " : ",\n    ") << p.text;
+            first = false;
+            continue;
+        }
+        if (p.isPointer() || p.type.find("image") != std::string::npos ||
+            p.type.find("sampler_t") != std::string::npos)
+        {
+            fatal("-spec=%s: %s: only scalar and vector arguments can be specialized",
+                r.text.c_str(), p.text.c_str());
+        }
+        // the argument stays assignable, as a parameter is
+        std::string type = p.type;
+        for (const char *q : {"const ", "__private ", "private "}) {
+            auto ix = type.find(q);
+            if (ix != std::string::npos)
+                type.erase(ix, strlen(q));
+        }
+        decls.push_back(type + " " + p.name + " = " + sa->value + ";");
+    }
+    ss << ")\n{\n";
+    for (const auto &d : decls)
+        ss << "    " << d << "\n";
+    // the body may come from an earlier rewrite (e.g. a template instance)
+    auto where = sourceLocation(src, k.bodyBegin, path);
+    ss << lineDirective(where.second, where.first);
+    ss << std::string(src + k.bodyBegin + 1, k.bodyEnd - k.bodyBegin - 1) << "\n";
+    return ss.str();
+}
+
+void applySpecializations(const Opts &opts, std::vector<SourceText> &sourceStrs)
+{
+    if (opts.specs.empty())
+        return;
+    std::vector<SpecRequest> reqs;
+    for (const auto &s : opts.specs)
+        reqs.push_back(parseSpec(s));
+
+    for (size_t u = 0; u < sourceStrs.size(); u++) {
+        const char *src = sourceStrs[u].data();
+        size_t n = sourceStrs[u].size();
+        auto kernels = parseKernels(src, n);
+
+        // each variant goes right after its kernel so that it lands in
+        // the same #if branch; a later #line restores the numbering
+        std::string out;
+        size_t copied = 0;
+        for (const auto &k : kernels) {
+            std::string variants;
+            for (auto &r : reqs) {
+                if (r.kernel != k.name)
+                    continue;
+                for (const auto &a : r.args) {
+                    bool known = false;
+                    for (const auto &p : k.params)
+                        known |= p.name == a.name;
+                    if (!known) {
+                        std::string names;
+                        for (const auto &p : k.params)
+                            names += (names.empty() ? "" : ", ") + p.name;
+                        fatal("-spec=%s: %s has no argument %s (it has %s)", r.text.c_str(),
+                            k.name.c_str(), a.name.c_str(), names.c_str());
+                    }
+                }
+                for (const auto &other : kernels) {
+                    if (other.name == r.variant) {
+                        fatal("-spec=%s: kernel %s already exists; name the variant "
+                            "(-spec=NAME=%s:...)", r.text.c_str(), r.variant.c_str(),
+                            r.kernel.c_str());
+                    }
+                }
+                variants += specializedKernel(src, k, r, opts.args[u]);
+                r.found = true;
+                verbose("%s: specialized %s as %s\n", opts.args[u].c_str(),
+                    k.name.c_str(), r.variant.c_str());
+            }
+            if (variants.empty())
+                continue;
+            if (out.empty())
+                out.reserve(n + variants.size());
+            out.append(src + copied, k.bodyEnd - copied);
+            out += variants;
+            auto where = sourceLocation(src, k.bodyEnd, opts.args[u]);
+            out += lineDirective(where.second, where.first);
+            copied = k.bodyEnd;
+        }
+        if (copied > 0) {
+            out.append(src + copied, n - copied);
+            sourceStrs[u] = SourceText(std::move(out));
+        }
+    }
+    for (const auto &r : reqs) {
+        if (!r.found) {
+            fatal("-spec=%s: no kernel %s in the inputs", r.text.c_str(), r.kernel.c_str());
+        }
+    }
+}
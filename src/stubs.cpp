@@ -0,0 +1,307 @@
+#include "clc.hpp"
+#include "clerrs.h"
+#include "includes.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <ctype.h>
+#include <set>
+#include <sstream>
+
+// One argument of a kernel as the host passes it.
+struct StubArg {
+    std::string     name;     // C++ parameter name
+    std::string     decl;     // as the kernel declares it (for the comment)
+    std::string     hostType; // e.g. cl_mem or cl_float4; "" for opaque
+    bool            isLocal = false; // passes a byte count
+};
+
+struct StubKernel {
+    std::string             name;
+    std::vector<StubArg>    args;
+};
+
+// the parameters of the launch functions and C++ keywords a kernel
+// argument may be named after
+static bool isReservedName(const std::string &s)
+{
+    static const std::set<std::string> names = {
+        "queue", "dims", "global", "local", "numEvents", "waitList", "event",
+        "err", "kernel_", "program",
+        "alignas", "alignof", "and", "asm", "auto", "bitand", "bitor", "bool",
+        "catch", "char16_t", "char32_t", "class", "compl", "constexpr",
+        "const_cast", "decltype", "delete", "dynamic_cast", "explicit", "export",
+        "false", "friend", "mutable", "namespace", "new", "noexcept", "not",
+        "nullptr", "operator", "or", "private", "protected", "public",
+        "reinterpret_cast", "static_assert", "static_cast", "template", "this",
+        "thread_local", "throw", "true", "try", "typeid", "typename", "using",
+        "virtual", "wchar_t", "xor",
+    };
+    return names.count(s) > 0;
+}
+
+std::string identifierFrom(const std::string &path)
+{
+    auto ix = path.find_last_of("/\\");
+    std::string base = ix == std::string::npos ? path : path.substr(ix + 1);
+    base = base.substr(0, base.find('.'));
+    std::string id;
+    for (char c : base)
+        id += isalnum((unsigned char)c) ? c : '_';
+    if (id.empty() || isdigit((unsigned char)id[0]))
+        id = "k" + id;
+    return id;
+}
+
+// the cl_platform.h type of an OpenCL C scalar or vector ("" if none)
+static std::string hostTypeOf(std::string type)
+{
+    if (type.compare(0, 9, "unsigned ") == 0)
+        type = "u" + type.substr(9);
+    size_t e = type.size();
+    while (e > 0 && isdigit((unsigned char)type[e - 1]))
+        e--;
+    std::string scalar = type.substr(0, e), lanes = type.substr(e);
+    static const char *scalars[] = {
+        "char", "uchar", "short", "ushort", "int", "uint", "long", "ulong",
+        "half", "float", "double",
+    };
+    for (const char *s : scalars) {
+        if (scalar == s) {
+            if (!lanes.empty() && lanes != "2" && lanes != "3" && lanes != "4" &&
+                lanes != "8" && lanes != "16")
+            {
+                return "";
+            }
+            return "cl_" + type;
+        }
+    }
+    return "";
+}
+
+static StubKernel describeKernel(const cl::Kernel &kern)
+{
+    StubKernel k;
+    k.name = kern.getInfo<CL_KERNEL_FUNCTION_NAME>().c_str();
+    cl_uint numArgs = kern.getInfo<CL_KERNEL_NUM_ARGS>();
+    for (cl_uint i = 0; i < numArgs; i++) {
+        cl_kernel_arg_address_qualifier aq = CL_KERNEL_ARG_ADDRESS_PRIVATE;
+        cl_kernel_arg_type_qualifier tq = 0;
+        std::string type, name;
+        try {
+            aq = kern.getArgInfo<CL_KERNEL_ARG_ADDRESS_QUALIFIER>(i);
+            tq = kern.getArgInfo<CL_KERNEL_ARG_TYPE_QUALIFIER>(i);
+            type = kern.getArgInfo<CL_KERNEL_ARG_TYPE_NAME>(i).c_str();
+            name = kern.getArgInfo<CL_KERNEL_ARG_NAME>(i).c_str();
+        } catch (const cl::Error &err) {
+            fatal("--stubs: %s: argument info unavailable (%s)",
+                k.name.c_str(), clErrStr(err.err()).c_str());
+        }
+
+        StubArg a;
+        a.name = name.empty() ? "arg" + std::to_string(i) : name;
+        if (isReservedName(a.name))
+            a.name += "_";
+        std::string space =
+            aq == CL_KERNEL_ARG_ADDRESS_GLOBAL ? "global " :
+            aq == CL_KERNEL_ARG_ADDRESS_CONSTANT ? "constant " :
+            aq == CL_KERNEL_ARG_ADDRESS_LOCAL ? "local " : "";
+        bool isPointer = !type.empty() && type.back() == '*';
+        a.decl = std::string(tq & CL_KERNEL_ARG_TYPE_CONST ? "const " : "") + space +
+            (isPointer ? type.substr(0, type.size() - 1) + " *" : type + " ") + name;
+
+        if (aq == CL_KERNEL_ARG_ADDRESS_LOCAL) {
+            a.isLocal = true;
+            a.hostType = "size_t";
+        } else if (isPointer || type.compare(0, 5, "image") == 0 ||
+            type.compare(0, 4, "pipe") == 0)
+        {
+            a.hostType = "cl_mem";
+        } else if (type == "sampler_t") {
+            a.hostType = "cl_sampler";
+        } else {
+            a.hostType = hostTypeOf(type);
+            if (a.hostType.empty()) {
+                // e.g. a struct: its host layout is the caller's business
+                warning("--stubs: %s: %s: no host type; passed as bytes\n",
+                    k.name.c_str(), a.decl.c_str());
+            }
+        }
+        k.args.push_back(a);
+    }
+    return k;
+}
+
+// items joined with commas, continuing on lines indented by 8 past col 80
+static std::string wrapList(const std::vector<std::string> &items, size_t column)
+{
+    std::string s;
+    for (size_t i = 0; i < items.size(); i++) {
+        if (i > 0) {
+            s += ",";
+            if (column + items[i].size() + 3 > 80) {
+                s += "\n        ";
+                column = 8;
+            } else {
+                s += " ";
+                column += 2;
+            }
+        }
+        s += items[i];
+        column += items[i].size();
+    }
+    return s;
+}
+
+static void emitKernelClass(std::ostream &os, const StubKernel &k)
+{
+    std::string cls = isReservedName(k.name) ? k.name + "_" : k.name;
+    os << "// kernel void " << k.name << "(";
+    for (size_t i = 0; i < k.args.size(); i++)
+        os << (i ? ", " : "") << k.args[i].decl;
+    os << ")\n";
+    os << "class " << cls << " {\n";
+    os << "    cl_kernel kernel_ = nullptr;\n";
+    os << "    " << cls << "(const " << cls << " &) = delete;\n";
+    os << "    " << cls << " &operator=(const " << cls << " &) = delete;\n";
+    os << "public:\n";
+    os << "    static const cl_uint NUM_ARGS = " << k.args.size() << ";\n\n";
+    os << "    " << cls << "() { }\n";
+    os << "    ~" << cls << "() { if (kernel_) clReleaseKernel(kernel_); }\n\n";
+    os << "    cl_int create(cl_program program) {\n";
+    os << "        cl_int err = CL_SUCCESS;\n";
+    os << "        cl_kernel k = clCreateKernel(program, \"" << k.name << "\", &err);\n";
+    os << "        if (err != CL_SUCCESS)\n";
+    os << "            return err;\n";
+    os << "        cl_uint n = 0;\n";
+    os << "        err = clGetKernelInfo(k, CL_KERNEL_NUM_ARGS, sizeof(n), &n, nullptr);\n";
+    os << "        if (err == CL_SUCCESS && n != NUM_ARGS)\n";
+    os << "            err = CL_INVALID_KERNEL_ARGS;\n";
+    os << "        if (err != CL_SUCCESS) {\n";
+    os << "            clReleaseKernel(k);\n";
+    os << "            return err;\n";
+    os << "        }\n";
+    os << "        if (kernel_)\n";
+    os << "            clReleaseKernel(kernel_);\n";
+    os << "        kernel_ = k;\n";
+    os << "        return CL_SUCCESS;\n";
+    os << "    }\n";
+    os << "    cl_kernel kernel() const { return kernel_; }\n\n";
+
+    std::vector<std::string> params, names;
+    for (const auto &a : k.args) {
+        if (a.hostType.empty()) {
+            params.push_back("const void *" + a.name);
+            params.push_back("size_t " + a.name + "Bytes");
+            names.push_back(a.name);
+            names.push_back(a.name + "Bytes");
+        } else {
+            params.push_back(a.hostType + " " + a.name + (a.isLocal ? "Bytes" : ""));
+            names.push_back(a.name + (a.isLocal ? "Bytes" : ""));
+        }
+    }
+
+    os << "    cl_int setArgs(" << wrapList(params, 19) << ")\n";
+    os << "    {\n";
+    os << "        cl_int err = CL_SUCCESS;\n";
+    for (size_t i = 0; i < k.args.size(); i++) {
+        const auto &a = k.args[i];
+        os << "        if (err == CL_SUCCESS)\n";
+        os << "            err = clSetKernelArg(kernel_, " << i << ", ";
+        if (a.isLocal) {
+            os << a.name << "Bytes, nullptr);\n";
+        } else if (a.hostType.empty()) {
+            os << a.name << "Bytes, " << a.name << ");\n";
+        } else {
+            os << "sizeof(" << a.hostType << "), &" << a.name << ");\n";
+        }
+    }
+    os << "        return err;\n";
+    os << "    }\n";
+    os << "    cl_int enqueue(cl_command_queue queue, cl_uint dims, const size_t *global,\n";
+    os << "        const size_t *local, cl_uint numEvents = 0, const cl_event *waitList = nullptr,\n";
+    os << "        cl_event *event = nullptr) const\n";
+    os << "    {\n";
+    os << "        return clEnqueueNDRangeKernel(queue, kernel_, dims, nullptr, global, local,\n";
+    os << "            numEvents, waitList, event);\n";
+    os << "    }\n";
+    os << "    cl_int operator()(cl_command_queue queue, cl_uint dims, const size_t *global,\n";
+    params.insert(params.begin(), "const size_t *local");
+    os << "        " << wrapList(params, 8) << ")\n";
+    os << "    {\n";
+    os << "        cl_int err = setArgs(" << wrapList(names, 29) << ");\n";
+    os << "        return err != CL_SUCCESS ? err : enqueue(queue, dims, global, local);\n";
+    os << "    }\n";
+    os << "};\n\n";
+}
+
+void writeLaunchStubs(
+    const Opts &opts,
+    const std::vector<SourceText> &sourceStrs,
+    const cl::Device &dev)
+{
+    TRACE_SCOPE("launch stubs");
+    // the binaries are built without argument info; build once more with it
+    cl::Context ctx(dev);
+    cl::Program prog = createProgram(ctx, sourceStrs, {dev});
+    // the same -DCLC_FLOATN=... as the binaries, or floatN arguments would
+    // be described as float
+    std::string buildOpts = deviceBuildOptions(opts, sourceStrs, dev);
+    buildOpts += (buildOpts.empty() ? "" : " ") + std::string("-cl-kernel-arg-info");
+    try {
+        prog.build({dev}, buildOpts.c_str());
+    } catch (const cl::Error &err) {
+        fatal("--stubs: during build: %s (%s):\n%s", err.what(), clErrStr(err.err()).c_str(),
+            prog.getBuildInfo<CL_PROGRAM_BUILD_LOG>(dev).c_str());
+    }
+    std::vector<cl::Kernel> kernels;
+    prog.createKernels(&kernels);
+
+    std::vector<StubKernel> stubs;
+    for (const auto &kern : kernels)
+        stubs.push_back(describeKernel(kern));
+    // CL_PROGRAM_KERNEL_NAMES order is unspecified; keep the header stable
+    std::sort(stubs.begin(), stubs.end(), [](const StubKernel &a, const StubKernel &b) {
+        return a.name < b.name;
+    });
+
+    std::string ns = identifierFrom(opts.stubs);
+    std::string guard = ns;
+    for (auto &c : guard)
+        c = (char)toupper((unsigned char)c);
+    std::string inputs;
+    for (const auto &a : opts.args)
+        inputs += (inputs.empty() ? "" : " ") + (a == "-" ? std::string("stdin") : a);
+
+    std::stringstream os;
+    os << "// generated by clc --stubs from " << inputs << "; do not edit\n";
+    os << "//\n";
+    os << "// One class per kernel holds its cl_kernel and sets the arguments by index\n";
+    os << "// with their sizes fixed here; create() checks that the program's kernel\n";
+    os << "// takes as many arguments as when this was generated.  Not thread-safe:\n";
+    os << "// like the cl_kernel, an instance is set and enqueued by one thread.\n";
+    os << "//\n";
+    os << "//   " << ns << "::" << (stubs.empty() ? "kernel" : stubs[0].name) << " k;\n";
+    os << "//   k.create(program);                          // once\n";
+    os << "//   k(queue, 1, global, local, ...arguments);   // per launch\n";
+    os << "#ifndef " << guard << "_HPP\n";
+    os << "#define " << guard << "_HPP\n\n";
+    os << "#include <stddef.h>\n\n";
+    os << "#ifdef __APPLE__\n#include <OpenCL/cl.h>\n#else\n#include <CL/cl.h>\n#endif\n\n";
+    os << "namespace " << ns << " {\n\n";
+    for (size_t i = 0; i < stubs.size(); i++) {
+        if (i > 0 && stubs[i].name == stubs[i - 1].name)
+            continue;
+        emitKernelClass(os, stubs[i]);
+    }
+    os << "} // namespace " << ns << "\n\n";
+    os << "#endif\n";
+
+    auto text = os.str();
+    verbose("saving launch stubs for %d kernels to %s\n", (int)stubs.size(),
+        opts.stubs.c_str());
+    // unchanged stubs keep their timestamp so make does not rebuild the host
+    if (isRegularFile(opts.stubs) && readTextFile(opts.stubs) == text)
+        return;
+    writeBinary(opts.stubs, text.data(), text.size());
+}
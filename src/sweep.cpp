@@ -0,0 +1,285 @@
+#include "clc.hpp"
+#include "clerrs.h"
+#include "includes.hpp"
+#include "launch.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <sstream>
+#include <stdio.h>
+#include <thread>
+
+struct SweepVariant {
+    std::vector<std::string>  extraOpts; // e.g. {"-DTILE=16", "-DVW=4"}
+    std::vector<char>         bits;
+    std::string               error;
+};
+
+struct SweepResult {
+    size_t      variant = 0;
+    WorkSize    local;
+    double      medianNs = 0.0;
+    double      minNs = 0.0;
+    std::string error;
+};
+
+// -sweep=TILE:8,16,32 -> {-DTILE=8, -DTILE=16, -DTILE=32};
+// -sweep=-cl-std:CL1.2,CL2.0 -> {-cl-std=CL1.2, -cl-std=CL2.0};
+// without values the option is toggled: -sweep=-cl-fast-relaxed-math ->
+// {(nothing), -cl-fast-relaxed-math} and -sweep=USE_LOCAL -> {(nothing), -DUSE_LOCAL}
+static std::vector<std::string> sweepAxis(const std::string &spec)
+{
+    auto colon = spec.find(':');
+    std::string name = spec.substr(0, colon);
+    if (name.empty()) {
+        fatal("-sweep=%s: expected NAME or NAME:V1,V2,...", spec.c_str());
+    }
+    std::string opt = name[0] == '-' ? name : "-D" + name;
+
+    std::vector<std::string> values;
+    if (colon == std::string::npos) {
+        values.push_back("");
+        values.push_back(opt);
+        return values;
+    }
+    std::stringstream ss(spec.substr(colon + 1));
+    std::string v;
+    while (std::getline(ss, v, ','))
+        values.push_back(opt + "=" + v);
+    if (values.empty()) {
+        fatal("-sweep=%s: expected values after :", spec.c_str());
+    }
+    return values;
+}
+
+static std::string joinOpts(const std::vector<std::string> &opts)
+{
+    std::string s;
+    for (const auto &o : opts) {
+        if (o.empty())
+            continue;
+        if (!s.empty())
+            s += " ";
+        s += o;
+    }
+    return s;
+}
+
+// the cartesian product of every -sweep= axis
+static std::vector<SweepVariant> sweepVariants(const Opts &opts)
+{
+    std::vector<SweepVariant> vs(1);
+    for (const auto &spec : opts.sweeps) {
+        auto axis = sweepAxis(spec);
+        std::vector<SweepVariant> next;
+        for (const auto &v : vs) {
+            for (const auto &val : axis) {
+                SweepVariant nv = v;
+                if (!val.empty())
+                    nv.extraOpts.push_back(val);
+                next.push_back(nv);
+            }
+        }
+        vs.swap(next);
+    }
+    return vs;
+}
+
+int runSweep(const Opts &opts, const BinaryCache *cache)
+{
+    if (opts.kernel.empty()) {
+        fatal("-sweep: expected -kernel=... to name the kernel to time");
+    }
+    if (opts.multiDevice) {
+        fatal("-sweep: tunes for a single device (drop -m)");
+    }
+    auto variants = sweepVariants(opts);
+    auto globals = parseWorkSizes(opts.globalSize.empty() ? "1M" : opts.globalSize);
+    if (globals.size() != 1 || globals[0].dims == 0) {
+        fatal("-global=%s: expected a single work size", opts.globalSize.c_str());
+    }
+    auto global = globals[0];
+    auto locals = parseWorkSizes(opts.localSize);
+    auto argSpec = parseArgSpec(opts.kernelArgs);
+
+    auto sourceStrs = readSources(opts);
+    cl::Device dev = findDevice(opts);
+    cl::Context ctx(dev);
+    std::string devName = dev.getInfo<CL_DEVICE_NAME>();
+
+    // build every variant concurrently in the shared context
+    int workers = opts.jobs;
+    if (workers <= 0)
+        workers = (int)std::max(1u, std::thread::hardware_concurrency());
+    workers = std::min(workers, (int)variants.size());
+    verbose("sweep: building %d variants on %d workers\n", (int)variants.size(), workers);
+
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+        for (size_t i = next++; i < variants.size(); i = next++) {
+            auto &v = variants[i];
+            Opts vopts = opts;
+            vopts.buildOpts.insert(vopts.buildOpts.end(),
+                v.extraOpts.begin(), v.extraOpts.end());
+            try {
+                auto bins = buildProgram(vopts, sourceStrs, {dev}, ctx, cache);
+                v.bits.swap(bins[0].bits);
+            } catch (const FatalError &err) {
+                v.error = err.what();
+            } catch (const cl::Error &err) {
+                v.error = std::string(err.what()) + " (" + clErrStr(err.err()) + ")";
+            }
+        }
+    };
+    std::vector<std::thread> threads;
+    for (int i = 1; i < workers; i++)
+        threads.emplace_back(worker);
+    worker();
+    for (auto &t : threads)
+        t.join();
+
+    size_t firstOk = variants.size();
+    for (size_t i = 0; i < variants.size(); i++) {
+        if (variants[i].error.empty()) {
+            firstOk = i;
+            break;
+        }
+    }
+    if (firstOk == variants.size()) {
+        fatal("-sweep: every variant failed to build; first error:\n%s",
+            variants[0].error.c_str());
+    }
+
+    // argument types come from a build of the first good variant with
+    // -cl-kernel-arg-info (the timed binaries are built without it)
+    // (with the vector widths buildProgram added for the device)
+    auto variantOpts = [&](const SweepVariant &v) {
+        Opts vopts = opts;
+        vopts.buildOpts.insert(vopts.buildOpts.end(), v.extraOpts.begin(), v.extraOpts.end());
+        return deviceBuildOptions(vopts, sourceStrs, dev);
+    };
+    std::string firstOpts = variantOpts(variants[firstOk]);
+    {
+        cl::Program prog(ctx, {dev},
+            {std::make_pair((const void *)variants[firstOk].bits.data(),
+                variants[firstOk].bits.size())});
+        prog.build({dev});
+        cl::Kernel kern;
+        try {
+            kern = cl::Kernel(prog, opts.kernel.c_str());
+        } catch (const cl::Error &err) {
+            fatal("-kernel=%s: no such kernel in the program", opts.kernel.c_str());
+        }
+        if (!argSpecComplete(argSpec, kern)) {
+            auto ik = introspectKernel(ctx, dev, sourceStrs, firstOpts, opts.kernel);
+            synthesizeArgs(argSpec, ik, dev, global);
+        }
+    }
+    KernelArgs args(ctx, dev, argSpec, global, locals[0]);
+    std::stringstream argDesc;
+    for (size_t i = 0; i < args.list().size(); i++)
+        argDesc << (i > 0 ? ", " : "") << args.list()[i].str();
+    verbose("sweep: arguments %s\n", argDesc.str().c_str());
+
+    // time the variants one at a time so they do not contend
+    cl::CommandQueue queue(ctx, dev, CL_QUEUE_PROFILING_ENABLE);
+    std::vector<SweepResult> results;
+    for (size_t i = 0; i < variants.size(); i++) {
+        const auto &v = variants[i];
+        SweepResult r;
+        r.variant = i;
+        if (!v.error.empty()) {
+            r.error = v.error;
+            results.push_back(r);
+            continue;
+        }
+        cl::Kernel kern;
+        try {
+            cl::Program prog(ctx, {dev},
+                {std::make_pair((const void *)v.bits.data(), v.bits.size())});
+            prog.build({dev});
+            kern = cl::Kernel(prog, opts.kernel.c_str());
+            args.bind(kern);
+        } catch (const cl::Error &err) {
+            r.error = std::string(err.what()) + " (" + clErrStr(err.err()) + ")";
+            results.push_back(r);
+            continue;
+        }
+        for (const auto &local : locals) {
+            r.local = local;
+            r.error.clear();
+            try {
+                args.bindLocals(kern, local);
+                auto ns = timeKernel(queue, kern, global, local, 1, opts.iterations);
+                r.medianNs = percentile(ns, 0.5);
+                r.minNs = *std::min_element(ns.begin(), ns.end());
+            } catch (const cl::Error &err) {
+                r.error = std::string(err.what()) + " (" + clErrStr(err.err()) + ")";
+            }
+            debug("sweep: %s local %s: %s\n", joinOpts(v.extraOpts).c_str(),
+                local.str().c_str(), r.error.empty() ? "ok" : r.error.c_str());
+            results.push_back(r);
+        }
+    }
+
+    std::stable_sort(results.begin(), results.end(),
+        [](const SweepResult &a, const SweepResult &b) {
+            if (a.error.empty() != b.error.empty())
+                return a.error.empty();
+            return a.medianNs < b.medianNs;
+        });
+    if (!results[0].error.empty()) {
+        fatal("-sweep: no variant ran; first error:\n%s", results[0].error.c_str());
+    }
+
+    // the report goes to stderr when the binary goes to stdout
+    FILE *out = opts.output == "--" ? stderr : stdout;
+    if (opts.verbosity >= 0) {
+        fprintf(out, "sweep: %d variants of %s on %s, global %s, %d iterations\n",
+            (int)variants.size(), opts.kernel.c_str(), devName.c_str(),
+            global.str().c_str(), opts.iterations);
+        fprintf(out, "%5s %12s %12s %10s  %s\n", "rank", "median us", "min us", "local", "options");
+        int rank = 0;
+        for (const auto &r : results) {
+            std::string vopts = joinOpts(variants[r.variant].extraOpts);
+            if (vopts.empty())
+                vopts = "(none)";
+            if (r.error.empty()) {
+                fprintf(out, "%5d %12.3f %12.3f %10s  %s\n", ++rank,
+                    r.medianNs / 1000.0, r.minNs / 1000.0,
+                    r.local.str().c_str(), vopts.c_str());
+            } else {
+                auto nl = r.error.find('\n');
+                fprintf(out, "%5s %12s %12s %10s  %s: %s\n", "-", "FAILED", "",
+                    r.local.str().c_str(), vopts.c_str(), r.error.substr(0, nl).c_str());
+            }
+        }
+    }
+
+    // the winner's binary goes where a plain build would have put it and
+    // its complete build options next to it
+    const auto &best = results[0];
+    const auto &bv = variants[best.variant];
+    std::string bestOpts = variantOpts(bv);
+    DeviceBinary db;
+    db.device = dev;
+    db.bits = bv.bits;
+    // an archive records the winning options
+    Opts bestBuild = opts;
+    bestBuild.buildOpts.insert(bestBuild.buildOpts.end(), bv.extraOpts.begin(), bv.extraOpts.end());
+    saveBinaries(bestBuild, {db}, sourceStrs);
+    auto path = outputPaths(opts, {dev})[0];
+    if (path != "--") {
+        std::string optsText = bestOpts + "\n";
+        writeBinary(path + ".opts", optsText.data(), optsText.size());
+    }
+    if (opts.verbosity >= 0) {
+        fprintf(out, "best: %s (local %s)", bestOpts.empty() ? "(none)" : bestOpts.c_str(),
+            best.local.str().c_str());
+        if (path != "--")
+            fprintf(out, " saved to %s and %s.opts", path.c_str(), path.c_str());
+        fprintf(out, "\n");
+    }
+    return EXIT_SUCCESS;
+}
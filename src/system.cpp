@@ -0,0 +1,337 @@
+#include "system.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <sstream>
+#include <stdio.h>
+#include <stdlib.h>
+#ifdef _WIN32
+#include <Windows.h>
+#include <sys/stat.h>
+#include <sys/utime.h>
+#include <direct.h>
+#include <process.h>
+#include <psapi.h>
+#define stat _stat64
+#define getpid _getpid
+#else
+#ifdef __APPLE__
+#include <mach-o/dyld.h>
+#else
+#include <link.h>
+#endif
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <utime.h>
+extern char **environ;
+#endif
+
+bool makeDirectories(const std::string &path)
+{
+    if (path.empty() || isDirectory(path))
+        return true;
+    auto ix = path.find_last_of("/\\");
+    if (ix != std::string::npos && ix > 0) {
+        if (!makeDirectories(path.substr(0, ix)))
+            return false;
+    }
+#ifdef _WIN32
+    int r = _mkdir(path.c_str());
+#else
+    int r = mkdir(path.c_str(), 0777);
+#endif
+    // another process may have raced us to it
+    return r == 0 || isDirectory(path);
+}
+
+std::vector<std::string> listDirectory(const std::string &path)
+{
+    std::vector<std::string> names;
+#ifdef _WIN32
+    WIN32_FIND_DATAA fd;
+    HANDLE h = FindFirstFileA((path + "\\*").c_str(), &fd);
+    if (h == INVALID_HANDLE_VALUE)
+        return names;
+    do {
+        std::string n = fd.cFileName;
+        if (n != "." && n != "..")
+            names.push_back(n);
+    } while (FindNextFileA(h, &fd));
+    FindClose(h);
+#else
+    DIR *d = opendir(path.c_str());
+    if (d == nullptr)
+        return names;
+    while (struct dirent *e = readdir(d)) {
+        std::string n = e->d_name;
+        if (n != "." && n != "..")
+            names.push_back(n);
+    }
+    closedir(d);
+#endif
+    return names;
+}
+
+bool isDirectory(const std::string &path)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+        return false;
+    return (st.st_mode & S_IFMT) == S_IFDIR;
+}
+
+bool isRegularFile(const std::string &path)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+        return false;
+    return (st.st_mode & S_IFMT) == S_IFREG;
+}
+
+bool fileStat(const std::string &path, uint64_t &size, int64_t &mtime)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+        return false;
+    size = (uint64_t)st.st_size;
+    mtime = (int64_t)st.st_mtime;
+    return true;
+}
+
+void touchFile(const std::string &path)
+{
+#ifdef _WIN32
+    _utime(path.c_str(), nullptr);
+#else
+    utime(path.c_str(), nullptr);
+#endif
+}
+
+bool removeFile(const std::string &path)
+{
+    return remove(path.c_str()) == 0;
+}
+
+bool removeDirectory(const std::string &path)
+{
+    for (const auto &n : listDirectory(path)) {
+        std::string p = path + "/" + n;
+#ifdef _WIN32
+        bool dir = isDirectory(p);
+#else
+        struct stat st;
+        bool dir = lstat(p.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+#endif
+        if (dir ? !removeDirectory(p) : !removeFile(p))
+            return false;
+    }
+#ifdef _WIN32
+    return _rmdir(path.c_str()) == 0;
+#else
+    return rmdir(path.c_str()) == 0;
+#endif
+}
+
+bool renameReplace(const std::string &src, const std::string &dst)
+{
+#ifdef _WIN32
+    return MoveFileExA(src.c_str(), dst.c_str(),
+        MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+    return rename(src.c_str(), dst.c_str()) == 0;
+#endif
+}
+
+std::string uniqueTempPath(const std::string &path)
+{
+    static std::atomic<unsigned> seq(0);
+    auto now = std::chrono::high_resolution_clock::now().time_since_epoch().count();
+    std::stringstream ss;
+    ss << path << ".tmp." << getpid() << "." << seq++ << "." <<
+        std::hex << (unsigned long long)now;
+    return ss.str();
+}
+
+bool writeFileAtomic(const std::string &path, const void *bits, size_t bitsLen)
+{
+    auto tmp = uniqueTempPath(path);
+    FILE *f = fopen(tmp.c_str(), "wb");
+    if (f == nullptr)
+        return false;
+    bool ok = fwrite(bits, 1, bitsLen, f) == bitsLen;
+    ok = fclose(f) == 0 && ok;
+    if (ok)
+        ok = renameReplace(tmp, path);
+    if (!ok)
+        removeFile(tmp);
+    return ok;
+}
+
+bool MappedFile::open(const std::string &path)
+{
+    close();
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ,
+        nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+    LARGE_INTEGER size;
+    bool ok = GetFileType(file) == FILE_TYPE_DISK && GetFileSizeEx(file, &size);
+    if (ok && size.QuadPart > 0) {
+        // the view keeps the mapping object and the file alive
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mapping)
+            base = (const char *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        ok = base != nullptr;
+        if (ok)
+            length = (size_t)size.QuadPart;
+    }
+    CloseHandle(file);
+#else
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    bool ok = fstat(fd, &st) == 0 && (st.st_mode & S_IFMT) == S_IFREG;
+    // an empty file cannot be mapped, but it is still an empty text
+    if (ok && st.st_size > 0) {
+        void *p = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ok = p != MAP_FAILED;
+        if (ok) {
+            base = (const char *)p;
+            length = (size_t)st.st_size;
+        }
+    }
+    ::close(fd);
+#endif
+    if (!ok)
+        close();
+    return ok;
+}
+
+void MappedFile::close()
+{
+#ifdef _WIN32
+    if (base)
+        UnmapViewOfFile(base);
+    if (mapping)
+        CloseHandle((HANDLE)mapping);
+    mapping = nullptr;
+#else
+    if (base)
+        munmap((void *)base, length);
+#endif
+    base = nullptr;
+    length = 0;
+}
+
+int runCommand(const std::vector<std::string> &args)
+{
+#ifdef _WIN32
+    // _spawnvp joins the arguments with spaces; quote the ones with spaces
+    std::vector<std::string> quoted;
+    for (const auto &a : args) {
+        if (a.find_first_of(" \t\"") == std::string::npos) {
+            quoted.push_back(a);
+            continue;
+        }
+        std::string q = "\"";
+        for (char c : a)
+            q += std::string(c == '"' ? "\\" : "") + c;
+        quoted.push_back(q + "\"");
+    }
+    std::vector<const char *> argv;
+    for (const auto &a : quoted)
+        argv.push_back(a.c_str());
+    argv.push_back(nullptr);
+    intptr_t r = _spawnvp(_P_WAIT, argv[0], argv.data());
+    return r < 0 ? -1 : (int)r;
+#else
+    std::vector<char *> argv;
+    for (const auto &a : args)
+        argv.push_back((char *)a.c_str());
+    argv.push_back(nullptr);
+    pid_t pid;
+    if (posix_spawnp(&pid, argv[0], nullptr, nullptr, argv.data(), environ) != 0)
+        return -1;
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR)
+            return -1;
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+#endif
+}
+
+uint64_t peakResidentBytes()
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS pmc;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)))
+        return 0;
+    return pmc.PeakWorkingSetSize;
+#else
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) != 0)
+        return 0;
+#ifdef __APPLE__
+    return (uint64_t)ru.ru_maxrss; // bytes
+#else
+    return (uint64_t)ru.ru_maxrss * 1024; // kilobytes
+#endif
+#endif
+}
+
+std::vector<std::string> loadedLibraries()
+{
+    std::vector<std::string> libs;
+#ifdef _WIN32
+    HMODULE mods[1024];
+    DWORD needed = 0;
+    if (EnumProcessModules(GetCurrentProcess(), mods, sizeof(mods), &needed)) {
+        for (DWORD i = 0; i < needed / sizeof(HMODULE) && i < 1024; i++) {
+            char path[MAX_PATH];
+            if (GetModuleFileNameA(mods[i], path, sizeof(path)))
+                libs.push_back(path);
+        }
+    }
+#elif defined(__APPLE__)
+    for (uint32_t i = 0, n = _dyld_image_count(); i < n; i++) {
+        if (const char *path = _dyld_get_image_name(i))
+            libs.push_back(path);
+    }
+#else
+    dl_iterate_phdr([](struct dl_phdr_info *info, size_t, void *arg) {
+        if (info->dlpi_name && *info->dlpi_name)
+            ((std::vector<std::string> *)arg)->push_back(info->dlpi_name);
+        return 0;
+    }, &libs);
+#endif
+    return libs;
+}
+
+std::string userCacheDirectory()
+{
+#ifdef _WIN32
+    const char *base = getenv("LOCALAPPDATA");
+    return base && *base ? std::string(base) + "\\clc" : std::string();
+#else
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    if (xdg && *xdg)
+        return std::string(xdg) + "/clc";
+    const char *home = getenv("HOME");
+#ifdef __APPLE__
+    return home && *home ? std::string(home) + "/Library/Caches/clc" : std::string();
+#else
+    return home && *home ? std::string(home) + "/.cache/clc" : std::string();
+#endif
+#endif
+}
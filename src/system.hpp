@@ -0,0 +1,69 @@
+#ifndef SYSTEM_HPP
+#define SYSTEM_HPP
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// thin portability layer over the few file system calls clc needs
+
+// creates the directory and any missing parents
+bool makeDirectories(const std::string &path);
+// file names (not paths) in a directory excluding . and ..
+std::vector<std::string> listDirectory(const std::string &path);
+bool isDirectory(const std::string &path);
+// false for directories, devices, pipes, and missing files
+bool isRegularFile(const std::string &path);
+// size and last modification time (seconds); false if missing
+bool fileStat(const std::string &path, uint64_t &size, int64_t &mtime);
+// sets the modification time to now
+void touchFile(const std::string &path);
+bool removeFile(const std::string &path);
+// removes a directory and everything in it (symbolic links are not followed)
+bool removeDirectory(const std::string &path);
+// atomically replaces dst with src (both on the same volume)
+bool renameReplace(const std::string &src, const std::string &dst);
+// a file name next to path that no other process or thread will pick
+std::string uniqueTempPath(const std::string &path);
+
+// writes a file via a temporary and rename; readers see either the old
+// contents or the complete new contents
+bool writeFileAtomic(const std::string &path, const void *bits, size_t bitsLen);
+
+// A read-only mapping of a whole regular file.  The pages are read on
+// first touch and shared with the page cache, so mapping a large input
+// costs neither a copy nor its size in private memory.
+class MappedFile {
+    const char     *base = nullptr;
+    size_t          length = 0;
+#ifdef _WIN32
+    void           *mapping = nullptr;
+#endif
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+public:
+    MappedFile() { }
+    ~MappedFile() { close(); }
+
+    // false if path is not a regular file or cannot be mapped
+    bool open(const std::string &path);
+    void close();
+
+    const char *data() const { return base ? base : ""; }
+    size_t size() const { return length; }
+};
+
+// runs a program (found on the PATH) and waits for it; its exit status,
+// or -1 if it could not be started or did not exit normally
+int runCommand(const std::vector<std::string> &args);
+
+// peak resident set size of this process so far (0 if unknown)
+uint64_t peakResidentBytes();
+
+// paths of the shared libraries mapped into this process
+std::vector<std::string> loadedLibraries();
+// the per-user directory for clc's caches ("" if there is none)
+std::string userCacheDirectory();
+
+#endif
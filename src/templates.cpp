@@ -0,0 +1,344 @@
+#include "clc.hpp"
+#include "clparse.hpp"
+#include "includes.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <string.h>
+
+// Kernel templates: a kernel preceded by
+//
+//   template <typename T = floatN, int W = 4>
+//
+// is expanded into a kernel per -inst=NAME<ARG,...> (named NAME_ARG_...)
+// and, if every parameter has a default, into NAME itself.  The
+// parameters are replaced textually.  A vector type written with N
+// (floatN, ucharN, ...) becomes a macro that buildProgram defines per
+// device from CL_DEVICE_PREFERRED_VECTOR_WIDTH_*.
+
+struct TemplateParam {
+    std::string     name;
+    std::string     deflt; // "" if none
+};
+
+struct KernelTemplate {
+    KernelDecl                  k;
+    size_t                      begin = 0; // the template keyword
+    std::vector<TemplateParam>  params;
+};
+
+struct VectorType {
+    const char          *scalar;
+    cl_device_info      preferred;
+};
+
+static const VectorType vectorTypes[] = {
+    {"char", CL_DEVICE_PREFERRED_VECTOR_WIDTH_CHAR},
+    {"uchar", CL_DEVICE_PREFERRED_VECTOR_WIDTH_CHAR},
+    {"short", CL_DEVICE_PREFERRED_VECTOR_WIDTH_SHORT},
+    {"ushort", CL_DEVICE_PREFERRED_VECTOR_WIDTH_SHORT},
+    {"int", CL_DEVICE_PREFERRED_VECTOR_WIDTH_INT},
+    {"uint", CL_DEVICE_PREFERRED_VECTOR_WIDTH_INT},
+    {"long", CL_DEVICE_PREFERRED_VECTOR_WIDTH_LONG},
+    {"ulong", CL_DEVICE_PREFERRED_VECTOR_WIDTH_LONG},
+    {"float", CL_DEVICE_PREFERRED_VECTOR_WIDTH_FLOAT},
+    {"double", CL_DEVICE_PREFERRED_VECTOR_WIDTH_DOUBLE},
+    {"half", CL_DEVICE_PREFERRED_VECTOR_WIDTH_HALF},
+};
+
+// the preferred width as a vector size OpenCL C has (2, 3, 4, 8, or 16):
+// wide-SIMD drivers report 32 or 64 for char
+static cl_uint vectorSize(cl_uint width)
+{
+    if (width >= 16)
+        return 16;
+    if (width >= 8)
+        return 8;
+    if (width >= 4)
+        return 4;
+    return width;
+}
+
+// floatN -> CLC_FLOATN; "" if type is not a scalar type followed by N
+static std::string widthMacro(const std::string &type)
+{
+    for (const auto &v : vectorTypes) {
+        if (type == std::string(v.scalar) + "N") {
+            std::string m = "CLC_";
+            for (char c : type)
+                m += (char)toupper((unsigned char)c);
+            return m;
+        }
+    }
+    return "";
+}
+
+static std::string trim(const std::string &s)
+{
+    size_t b = s.find_first_not_of(" \t\r\n");
+    if (b == std::string::npos)
+        return "";
+    return s.substr(b, s.find_last_not_of(" \t\r\n") - b + 1);
+}
+
+// splits at commas outside <...> and (...)
+static std::vector<std::string> splitList(const std::string &s)
+{
+    std::vector<std::string> items;
+    int depth = 0;
+    size_t start = 0;
+    for (size_t i = 0; i <= s.size(); i++) {
+        char c = i < s.size() ? s[i] : ',';
+        if (c == '<' || c == '(') {
+            depth++;
+        } else if (c == '>' || c == ')') {
+            depth--;
+        } else if (c == ',' && depth == 0) {
+            items.push_back(trim(s.substr(start, i - start)));
+            start = i + 1;
+        }
+    }
+    return items;
+}
+
+// the template <...> header right before the kernel, if any
+static bool parseTemplate(const char *src, const KernelDecl &k, const std::string &path,
+    KernelTemplate &t)
+{
+    size_t e = k.begin;
+    while (e > 0 && isspace((unsigned char)src[e - 1]))
+        e--;
+    if (e == 0 || src[e - 1] != '>')
+        return false;
+    size_t lt = e - 1;
+    while (lt > 0 && src[lt] != '<' && src[lt] != ';' && src[lt] != '}')
+        lt--;
+    if (src[lt] != '<')
+        return false;
+    size_t kw = lt;
+    while (kw > 0 && isspace((unsigned char)src[kw - 1]))
+        kw--;
+    if (kw < 8 || strncmp(src + kw - 8, "template", 8) != 0 ||
+        (kw > 8 && (isalnum((unsigned char)src[kw - 9]) || src[kw - 9] == '_')))
+    {
+        return false;
+    }
+    t.k = k;
+    t.begin = kw - 8;
+    for (const auto &p : splitList(std::string(src + lt + 1, e - 2 - lt))) {
+        TemplateParam tp;
+        auto eq = p.find('=');
+        std::string decl = trim(p.substr(0, eq));
+        if (eq != std::string::npos)
+            tp.deflt = trim(p.substr(eq + 1));
+        auto sp = decl.find_last_of(" \t");
+        std::string kind = sp == std::string::npos ? "" : trim(decl.substr(0, sp));
+        tp.name = trim(decl.substr(sp == std::string::npos ? 0 : sp + 1));
+        if (!isIdentifier(tp.name) || (kind != "typename" && kind != "class" &&
+            kind != "int" && kind != "uint" && kind != "size_t"))
+        {
+            fatal("%s:%d: template parameter '%s': expected typename NAME [= TYPE] or "
+                "int NAME [= VALUE]", path.c_str(), (int)lineOf(src, t.begin), p.c_str());
+        }
+        t.params.push_back(tp);
+    }
+    return true;
+}
+
+// blend<uchar4> -> blend_uchar4
+static std::string instanceName(const std::string &kernel, const std::vector<std::string> &args)
+{
+    std::string n = kernel;
+    for (const auto &a : args) {
+        n += '_';
+        for (char c : a) {
+            if (isalnum((unsigned char)c) || c == '_')
+                n += c;
+            else if (c == '-')
+                n += 'm';
+            else if (n.back() != '_')
+                n += '_';
+        }
+        while (n.back() == '_')
+            n.pop_back();
+    }
+    return n;
+}
+
+// the kernel with the parameters replaced by args and renamed
+static std::string instantiate(const char *src, const KernelTemplate &t,
+    const std::vector<std::string> &args, const std::string &name, const std::string &path)
+{
+    struct Edit {
+        size_t          at, len;
+        std::string     text;
+    };
+    std::vector<Edit> edits;
+    edits.push_back({t.k.nameBegin, t.k.nameEnd - t.k.nameBegin, name});
+    std::string guards;
+    for (size_t p = 0; p < t.params.size(); p++) {
+        std::string arg = args[p];
+        auto macro = widthMacro(arg);
+        if (!macro.empty()) {
+            // buildProgram defines it for the device; scalar elsewhere
+            guards += "#ifndef " + macro + "\n#define " + macro + " " +
+                arg.substr(0, arg.size() - 1) + "\n#endif\n";
+            arg = macro;
+        }
+        for (size_t at : identifierUses(src, t.k.nameEnd, t.k.bodyEnd, t.params[p].name))
+            edits.push_back({at, t.params[p].name.size(), arg});
+    }
+    std::sort(edits.begin(), edits.end(), [](const Edit &a, const Edit &b) {
+        return a.at < b.at;
+    });
+
+    std::string out = guards + lineDirective(lineOf(src, t.k.begin), path);
+    size_t copied = t.k.begin;
+    for (const auto &e : edits) {
+        out.append(src + copied, e.at - copied);
+        out += e.text;
+        copied = e.at + e.len;
+    }
+    out.append(src + copied, t.k.bodyEnd - copied);
+    return out + "\n";
+}
+
+struct InstRequest {
+    std::string                 text;
+    std::string                 kernel;
+    std::vector<std::string>    args;
+    bool                        found = false;
+};
+
+void applyTemplates(const Opts &opts, std::vector<SourceText> &sourceStrs)
+{
+    std::vector<InstRequest> reqs;
+    for (const auto &list : opts.instantiations) {
+        for (const auto &item : splitList(list)) {
+            InstRequest r;
+            r.text = item;
+            auto lt = item.find('<');
+            r.kernel = trim(item.substr(0, lt));
+            if (lt != std::string::npos) {
+                if (item.back() != '>') {
+                    fatal("-inst=%s: expected KERNEL<ARG,...>", item.c_str());
+                }
+                r.args = splitList(item.substr(lt + 1, item.size() - lt - 2));
+            }
+            if (!isIdentifier(r.kernel)) {
+                fatal("-inst=%s: malformed kernel name", item.c_str());
+            }
+            reqs.push_back(r);
+        }
+    }
+
+    for (size_t u = 0; u < sourceStrs.size(); u++) {
+        if (isSpirv(sourceStrs[u]))
+            continue;
+        const char *src = sourceStrs[u].data();
+        size_t n = sourceStrs[u].size();
+        // cheap test first: most inputs have no templates
+        if (std::search(src, src + n, "template", "template" + 8) == src + n)
+            continue;
+        TRACE_SCOPE("instantiate templates");
+        const auto &path = opts.args[u];
+        std::string out;
+        size_t copied = 0;
+        for (const auto &k : parseKernels(src, n)) {
+            KernelTemplate t;
+            if (!parseTemplate(src, k, path, t))
+                continue;
+            // the instantiations replace the template in place
+            std::string insts;
+            bool defaults = true;
+            for (const auto &p : t.params)
+                defaults &= !p.deflt.empty();
+            if (defaults) {
+                std::vector<std::string> args;
+                for (const auto &p : t.params)
+                    args.push_back(p.deflt);
+                insts += instantiate(src, t, args, k.name, path);
+            }
+            for (auto &r : reqs) {
+                if (r.kernel != k.name)
+                    continue;
+                if (r.args.size() > t.params.size()) {
+                    fatal("-inst=%s: %s takes %d template arguments", r.text.c_str(),
+                        k.name.c_str(), (int)t.params.size());
+                }
+                std::vector<std::string> args = r.args;
+                for (size_t p = args.size(); p < t.params.size(); p++) {
+                    if (t.params[p].deflt.empty()) {
+                        fatal("-inst=%s: no argument for %s (and no default)",
+                            r.text.c_str(), t.params[p].name.c_str());
+                    }
+                    args.push_back(t.params[p].deflt);
+                }
+                r.found = true;
+                auto name = instanceName(k.name, r.args);
+                if (name == k.name && defaults)
+                    continue; // the defaults, already there
+                insts += instantiate(src, t, args, name, path);
+                verbose("%s: instantiated %s as %s\n", path.c_str(), r.text.c_str(),
+                    name.c_str());
+            }
+            if (insts.empty()) {
+                warning("%s:%d: template kernel %s is never instantiated (-inst=%s<...>)\n",
+                    path.c_str(), (int)lineOf(src, t.begin), k.name.c_str(),
+                    k.name.c_str());
+            }
+            out.append(src + copied, t.begin - copied);
+            out += insts;
+            out += lineDirective(lineOf(src, k.bodyEnd), path);
+            copied = k.bodyEnd;
+        }
+        if (copied > 0) {
+            out.append(src + copied, n - copied);
+            sourceStrs[u] = SourceText(std::move(out));
+        }
+    }
+    for (const auto &r : reqs) {
+        if (!r.found) {
+            fatal("-inst=%s: no template kernel %s in the inputs", r.text.c_str(),
+                r.kernel.c_str());
+        }
+    }
+}
+
+std::string vectorWidthOptions(
+    const Opts &opts, const std::vector<SourceText> &sourceStrs, const cl::Device &dev)
+{
+    std::string defs;
+    for (const auto &v : vectorTypes) {
+        auto macro = widthMacro(std::string(v.scalar) + "N");
+        // -b=-DCLC_FLOATN=... overrides the device's preference
+        bool given = false;
+        for (const auto &b : opts.buildOpts)
+            given |= b.find("-D" + macro) != std::string::npos;
+        bool used = false;
+        for (const auto &s : sourceStrs) {
+            used |= !isSpirv(s) &&
+                std::search(s.data(), s.data() + s.size(), macro.begin(), macro.end()) !=
+                    s.data() + s.size();
+        }
+        if (given || !used)
+            continue;
+        cl_uint width = 1;
+        dev.getInfo(v.preferred, &width);
+        width = vectorSize(width);
+        defs += (defs.empty() ? "-D" : " -D") + macro + "=" + v.scalar;
+        if (width > 1)
+            defs += std::to_string(width);
+    }
+    return defs;
+}
+
+std::string deviceBuildOptions(
+    const Opts &opts, const std::vector<SourceText> &sourceStrs, const cl::Device &dev)
+{
+    auto buildOpts = opts.buildOpts;
+    auto widths = vectorWidthOptions(opts, sourceStrs, dev);
+    if (!widths.empty())
+        buildOpts.push_back(widths);
+    return normalizeBuildOptions(buildOpts);
+}
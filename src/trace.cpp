@@ -0,0 +1,149 @@
+#include "trace.hpp"
+#include "clc.hpp"
+#include "json.hpp"
+#include "system.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <stdio.h>
+#include <vector>
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+bool g_tracing = false;
+
+struct TraceEvent {
+    std::string   name;
+    std::string   detail;
+    int64_t       startUs;
+    int64_t       endUs;
+    int           tid;
+};
+
+static std::mutex s_mutex;
+static std::vector<TraceEvent> s_events;
+static const auto s_epoch = std::chrono::steady_clock::now();
+
+int64_t traceNowUs()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - s_epoch).count();
+}
+
+// small stable thread numbers read better in a trace viewer than native ids
+static int threadNumber()
+{
+    static std::atomic<int> next(0);
+    static thread_local int tid = next++;
+    return tid;
+}
+
+void traceRecord(const char *name, const char *detail, int64_t startUs, int64_t endUs)
+{
+    TraceEvent e;
+    e.name = name;
+    if (detail)
+        e.detail = detail;
+    e.startUs = startUs;
+    e.endUs = endUs;
+    e.tid = threadNumber();
+    std::lock_guard<std::mutex> lock(s_mutex);
+    s_events.push_back(e);
+}
+
+void printTimeReport(FILE *stream)
+{
+    struct Phase {
+        int       count = 0;
+        int64_t   totalUs = 0;
+        int64_t   maxUs = 0;
+        int64_t   firstUs = 0;
+    };
+    std::map<std::string,Phase> phases;
+    std::vector<std::string> order;
+    {
+        std::lock_guard<std::mutex> lock(s_mutex);
+        for (const auto &e : s_events) {
+            auto itr = phases.find(e.name);
+            if (itr == phases.end()) {
+                itr = phases.emplace(e.name, Phase()).first;
+                itr->second.firstUs = e.startUs;
+                order.push_back(e.name);
+            }
+            auto &p = itr->second;
+            int64_t us = e.endUs - e.startUs;
+            p.count++;
+            p.totalUs += us;
+            p.maxUs = std::max(p.maxUs, us);
+            p.firstUs = std::min(p.firstUs, e.startUs);
+        }
+    }
+    // in order of first appearance (roughly pipeline order)
+    std::sort(order.begin(), order.end(), [&](const std::string &a, const std::string &b) {
+        return phases[a].firstUs < phases[b].firstUs;
+    });
+
+    fprintf(stream, "%-24s %7s %12s %12s\n", "phase", "count", "total ms", "max ms");
+    for (const auto &n : order) {
+        const auto &p = phases[n];
+        fprintf(stream, "%-24s %7d %12.3f %12.3f\n", n.c_str(), p.count,
+            p.totalUs / 1000.0, p.maxUs / 1000.0);
+    }
+    fprintf(stream, "(phases nest, so totals overlap; concurrent phases sum across threads)\n");
+    fprintf(stream, "wall time: %.3f ms   peak RSS: %.1f MB\n",
+        traceNowUs() / 1000.0, peakResidentBytes() / (1024.0 * 1024.0));
+}
+
+void writeTrace(const std::string &path)
+{
+    std::stringstream ss;
+    JsonWriter w(ss);
+    int pid = (int)getpid();
+    w.beginObject();
+    w.member("displayTimeUnit", "ms");
+    w.key("traceEvents").beginArray();
+    {
+        std::lock_guard<std::mutex> lock(s_mutex);
+        for (const auto &e : s_events) {
+            w.beginObject();
+            w.member("name", e.name);
+            w.member("cat", "clc");
+            w.member("ph", "X");
+            w.member("ts", e.startUs);
+            w.member("dur", e.endUs - e.startUs);
+            w.member("pid", pid);
+            w.member("tid", e.tid);
+            if (!e.detail.empty()) {
+                w.key("args").beginObject();
+                w.member("detail", e.detail);
+                w.endObject();
+            }
+            w.endObject();
+        }
+    }
+    // the peak RSS as a counter sample at the end of the run
+    w.beginObject();
+    w.member("name", "peak RSS (MB)");
+    w.member("ph", "C");
+    w.member("ts", traceNowUs());
+    w.member("pid", pid);
+    w.key("args").beginObject();
+    w.member("MB", peakResidentBytes() / (1024.0 * 1024.0));
+    w.endObject();
+    w.endObject();
+    w.endArray();
+    w.endObject();
+
+    auto text = ss.str();
+    if (!writeFileAtomic(path, text.data(), text.size())) {
+        fatal("%s: failed to write trace", path.c_str());
+    }
+}
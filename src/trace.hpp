@@ -0,0 +1,40 @@
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+
+// Phase timing for --time and --trace=FILE.
+//
+// Each phase of the pipeline is wrapped in a TRACE_SCOPE.  When neither
+// flag is given g_tracing is false and a scope costs one branch at entry
+// and exit: no clock reads, allocation, or locking.
+extern bool g_tracing;
+
+void traceRecord(const char *name, const char *detail, int64_t startUs, int64_t endUs);
+int64_t traceNowUs();
+
+class TraceScope {
+    const char *name;
+    const char *detail;
+    int64_t     startUs;
+public:
+    // detail (e.g. a file name) must outlive the scope
+    TraceScope(const char *name, const char *detail = nullptr)
+        : name(name), detail(detail), startUs(g_tracing ? traceNowUs() : 0) { }
+    ~TraceScope() {
+        if (g_tracing)
+            traceRecord(name, detail, startUs, traceNowUs());
+    }
+};
+#define TRACE_CONCAT2(A,B) A##B
+#define TRACE_CONCAT(A,B) TRACE_CONCAT2(A,B)
+#define TRACE_SCOPE(...) TraceScope TRACE_CONCAT(_traceScope, __LINE__)(__VA_ARGS__)
+
+// --time: per-phase totals, wall time, and peak RSS
+void printTimeReport(FILE *stream);
+// --trace=FILE: Chrome trace-event JSON (chrome://tracing, Perfetto)
+void writeTrace(const std::string &path);
+
+#endif
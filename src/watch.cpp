@@ -0,0 +1,282 @@
+#include "clc.hpp"
+#include "clerrs.h"
+#include "hash.hpp"
+#include "includes.hpp"
+#include "system.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <set>
+#include <stdarg.h>
+#include <stdio.h>
+#include <thread>
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+// editors save in bursts (write, rename, chmod) and a checkout may touch
+// several headers; a rebuild waits for this long without another change
+static const int DEBOUNCE_MS = 100;
+// the interval at which files are checked where there is no inotify
+static const int POLL_MS = 250;
+
+typedef std::chrono::steady_clock Clock;
+
+static double millisSince(Clock::time_point t0)
+{
+    return std::chrono::duration<double,std::milli>(Clock::now() - t0).count();
+}
+
+// foo.cl -> ./foo.cl so that every path names its directory
+static std::string watchPath(const std::string &path)
+{
+    if (path.find_first_of("/\\") == std::string::npos)
+        return "./" + path;
+    return path;
+}
+
+static std::string directoryOf(const std::string &path)
+{
+    return path.substr(0, path.find_last_of("/\\"));
+}
+
+// Reports changes to a set of files.  On Linux the files' directories
+// are watched with inotify (many editors save by renaming a new file
+// over the old one, which a watch on the file itself would lose track
+// of); elsewhere the files' sizes and modification times are polled.
+class FileWatcher {
+    std::set<std::string>                           files;
+    std::map<std::string,std::pair<uint64_t,int64_t>> stamps; // polling
+#ifdef __linux__
+    int                                             fd = -1;
+    std::map<int,std::string>                       dirs; // by watch descriptor
+
+    void readEvents(std::set<std::string> &changed) {
+        alignas(struct inotify_event) char buf[16 * 1024];
+        ssize_t n = read(fd, buf, sizeof(buf));
+        for (ssize_t off = 0; off < n; ) {
+            const auto *e = (const struct inotify_event *)(buf + off);
+            off += sizeof(*e) + e->len;
+            auto itr = dirs.find(e->wd);
+            if (itr == dirs.end() || e->len == 0)
+                continue;
+            auto path = itr->second + "/" + e->name;
+            if (files.count(path))
+                changed.insert(path);
+        }
+    }
+#endif
+
+    std::pair<uint64_t,int64_t> stamp(const std::string &path) const {
+        uint64_t size = 0;
+        int64_t mtime = -1; // missing
+        fileStat(path, size, mtime);
+        return std::make_pair(size, mtime);
+    }
+    void pollChanges(std::set<std::string> &changed) {
+        for (auto &s : stamps) {
+            auto now = stamp(s.first);
+            if (now != s.second) {
+                s.second = now;
+                changed.insert(s.first);
+            }
+        }
+    }
+public:
+    FileWatcher() {
+#ifdef __linux__
+        fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (fd < 0)
+            warning("--watch: inotify unavailable; polling every %d ms\n", POLL_MS);
+#endif
+    }
+    ~FileWatcher() {
+#ifdef __linux__
+        if (fd >= 0)
+            close(fd);
+#endif
+    }
+
+    // replaces the watched set
+    void watch(const std::vector<std::string> &paths) {
+        files.clear();
+        stamps.clear();
+        for (const auto &p : paths) {
+            auto wp = watchPath(p);
+            files.insert(wp);
+            stamps[wp] = stamp(wp);
+#ifdef __linux__
+            if (fd < 0)
+                continue;
+            auto dir = directoryOf(wp);
+            int wd = inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO |
+                IN_MOVED_FROM | IN_CREATE | IN_DELETE | IN_ATTRIB);
+            if (wd < 0) {
+                warning("--watch: %s: cannot watch directory\n", dir.c_str());
+            } else {
+                dirs[wd] = dir;
+            }
+#endif
+        }
+    }
+
+    // blocks until a watched file changes and then until DEBOUNCE_MS pass
+    // without another change; returns the files that changed
+    std::vector<std::string> wait() {
+        std::set<std::string> changed;
+        Clock::time_point quietSince;
+        for (;;) {
+            size_t before = changed.size();
+#ifdef __linux__
+            if (fd >= 0) {
+                int timeout = -1;
+                if (!changed.empty())
+                    timeout = std::max(0, DEBOUNCE_MS - (int)millisSince(quietSince));
+                struct pollfd pfd = {fd, POLLIN, 0};
+                if (poll(&pfd, 1, timeout) > 0)
+                    readEvents(changed);
+            } else
+#endif
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(POLL_MS));
+                pollChanges(changed);
+            }
+            if (changed.size() != before) {
+                quietSince = Clock::now();
+            } else if (!changed.empty() && millisSince(quietSince) >= DEBOUNCE_MS) {
+                break;
+            }
+        }
+        return std::vector<std::string>(changed.begin(), changed.end());
+    }
+};
+
+static void status(const Opts &opts, const char *pat, ...)
+{
+    if (opts.verbosity < 0)
+        return;
+    va_list ap;
+    va_start(ap, pat);
+    vfprintf(stderr, pat, ap);
+    va_end(ap);
+    fflush(stderr);
+}
+
+int runWatch(const Opts &opts, const BinaryCache *cache)
+{
+    if (std::find(opts.args.begin(), opts.args.end(), "-") != opts.args.end()) {
+        fatal("--watch: cannot watch stdin");
+    }
+    if (opts.output == "--") {
+        fatal("--watch: output cannot be stdout");
+    }
+
+    // the devices and their contexts are set up once for every rebuild
+    std::vector<cl::Device> devs;
+    if (opts.multiDevice) {
+        devs = findDevices(opts);
+    } else {
+        devs.push_back(findDevice(opts));
+    }
+    auto outputs = outputPaths(opts, devs);
+    auto incDirs = includeDirectories(splitBuildOptions(opts.buildOpts));
+    std::map<cl_platform_id,cl::Context> contexts;
+
+    FileWatcher watcher;
+    std::string builtInputs; // digest of the texts last built
+    std::vector<std::string> builtBits(devs.size()); // digest per output
+    auto t0 = Clock::now();
+    for (;;) {
+        std::vector<std::string> files = opts.args;
+        bool watching = false;
+        try {
+            // copied, not mapped: an editor that truncates the file in
+            // place while the build reads it would otherwise fault
+            auto sourceStrs = readSources(opts, false);
+            for (const auto &inc : scanIncludes(opts.args, sourceStrs, incDirs)) {
+                if (!inc.path.empty())
+                    files.push_back(inc.path);
+            }
+            // watch before building so that edits during the build count
+            watcher.watch(files);
+            watching = true;
+
+            // a save that changes nothing (or a touch) does not rebuild
+            Sha256 h;
+            for (const auto &s : sourceStrs)
+                h.updateField(s.data(), s.size());
+            for (size_t i = opts.args.size(); i < files.size(); i++) {
+                auto text = readTextFile(files[i]);
+                h.updateField(text.data(), text.size());
+            }
+            auto inputs = h.hexDigest();
+            if (inputs == builtInputs) {
+                status(opts, "no changes\n");
+            } else {
+                auto bins = buildProgramOnDevices(opts, sourceStrs, devs, cache, &contexts);
+                checkResources(opts, bins);
+
+                // only outputs whose binary changed are rewritten, so make
+                // does not relink what depends on the others
+                std::vector<std::string> written;
+                bool anyChanged = false;
+                std::vector<std::string> bits(bins.size());
+                for (size_t i = 0; i < bins.size(); i++) {
+                    bits[i] = sha256Hex(bins[i].bits.data(), bins[i].bits.size());
+                    anyChanged |= bits[i] != builtBits[i];
+                }
+                if (opts.format == "archive" || opts.format == "cpp") {
+                    if (anyChanged) {
+                        saveBinaries(opts, bins, sourceStrs);
+                        written.push_back(outputs[0]);
+                    }
+                } else {
+                    for (size_t i = 0; i < bins.size(); i++) {
+                        if (bits[i] == builtBits[i])
+                            continue;
+                        verbose("saving binary to %s\n", outputs[i].c_str());
+                        writeBinary(outputs[i], bins[i].bits.data(), bins[i].bits.size());
+                        written.push_back(outputs[i]);
+                    }
+                }
+                if (!opts.stubs.empty()) {
+                    writeLaunchStubs(opts, sourceStrs, devs[0]);
+                }
+                if (opts.depfile) {
+                    writeDependencies(opts, outputTargets(opts, devs), sourceStrs);
+                }
+                builtBits = bits;
+                builtInputs = inputs;
+
+                std::string names;
+                for (const auto &w : written)
+                    names += (names.empty() ? "" : ", ") + w;
+                if (written.empty()) {
+                    status(opts, "rebuilt in %.0f ms; binaries unchanged\n", millisSince(t0));
+                } else {
+                    status(opts, "rebuilt %s in %.0f ms\n", names.c_str(), millisSince(t0));
+                }
+            }
+        } catch (const FatalError &err) {
+            fatalMessage(err.what());
+            builtInputs.clear();
+        } catch (const cl::Error &err) {
+            fatalMessage(std::string(err.what()) + ": " + clErrStr(err.err()));
+            builtInputs.clear();
+        }
+        if (!watching) {
+            // reading failed (e.g. an input is mid-rename); watch the inputs
+            watcher.watch(files);
+        }
+
+        status(opts, "watching %d files...\n", (int)files.size());
+        auto changed = watcher.wait();
+        t0 = Clock::now();
+        for (const auto &c : changed)
+            verbose("changed: %s\n", c.c_str());
+    }
+    return 0;
+}